@@ -9,16 +9,85 @@
 
 // Определения команд протокола
 typedef enum {
-    CMD_CREATE_SEGMENT = 1,
+    CMD_CREATE_SEGMENT = 1, // Поиск или создание сегмента по ключу (поле shmid - ключ, flags - shmflg;
+                            // результат - shmid, в ответе - размер сегмента)
     CMD_ATTACH_SEGMENT,
     CMD_DETACH_SEGMENT,
     CMD_REMOVE_SEGMENT,
     CMD_READ_DATA,
     CMD_WRITE_DATA,
     CMD_GET_STATUS,
-    CMD_SHMCTL
+    CMD_SHMCTL,
+    CMD_CLUSTER_MAP,        // Получение карты кластера
+    CMD_SET_CLUSTER_MAP,    // Установка новой карты кластера (запускает миграцию)
+    CMD_MIGRATE_IN,         // Прием сегмента от другого узла
+    CMD_MIGRATE_OUT,        // Передача сегмента другому узлу по его запросу
+    CMD_HELLO,              // Согласование возможностей протокола (flags - возможности клиента)
+    CMD_PUNCH_HOLE,         // Освобождение страниц диапазона (offset, size) с обнулением
+    CMD_SNAPSHOT,           // Снимок сегмента: новый shmid только для чтения (в ответе - размер)
+    CMD_GET_CHANGES,        // Записи журнала изменений сегмента (запрос - shm_changes_req_t)
+    CMD_CHECKSUM,           // Свертка CRC32C диапазона (offset, size), в ответе - uint32 в сетевом порядке
+    CMD_REPLICA_UPDATE,     // Изменения сегментов от их владельца для копий на этом узле (shm_replica_batch_t)
+    CMD_SUBSCRIBE,          // Подписка на изменения диапазона (offset, size; 0 - до конца сегмента)
+    CMD_FILL,               // Заполнение диапазона (offset, size) байтом flags
+    CMD_COPY,               // Копирование в диапазон, начинающийся с offset (запрос - shm_copy_t)
+    CMD_RESIZE,             // Изменение размера сегмента (запрос и ответ - размер: два uint32
+                            // в сетевом порядке, старшая половина первой)
+    CMD_AUTH                // Подтверждение общего ключа (запрос - shm_auth_t, ответ -
+                            // подтверждение сервера, DSHM_AUTH_MAC байт)
 } shm_command_t;
 
+// После успешного ответа на CMD_SUBSCRIBE соединение только получает рассылку:
+// на каждое изменение, задевающее диапазон, сервер сам присылает ответ в формате
+// CMD_GET_CHANGES (shm_changes_t и одна запись; с данными, если в flags подписки
+// был DSHM_CHANGES_DATA). Данные записи охватывают весь измененный диапазон, а
+// не только его пересечение с подпиской. Если подписчик не успевает принимать,
+// накопленные для него изменения отбрасываются и приходит одно сообщение с lost = 1:
+// диапазон нужно перечитать целиком.
+
+// Источник CMD_COPY (поля в сетевом порядке байт). Источник и приемник могут
+// быть одним сегментом, в том числе с перекрытием диапазонов (как memmove).
+// Если источника нет на узле приемника, сервер отвечает SHM_EXDEV.
+typedef struct {
+    int32_t src_shmid;
+    uint32_t src_offset;
+    uint32_t len;
+} shm_copy_t;
+
+// Копия сегмента на узле, который им не владеет, обслуживает CMD_READ_DATA и
+// CMD_CHECKSUM. Поле flags этих запросов - допустимое отставание копии от
+// владельца в миллисекундах (0 - любое); более отстающая копия отвечает SHM_EAGAIN.
+
+// Возможности протокола, согласуемые командой CMD_HELLO
+#define DSHM_CAP_COMPRESS 0x1   // Сжатие полезной нагрузки
+#define DSHM_CAP_CRC 0x2        // За каждым сообщением - CRC32C заголовка и данных
+                                // в том виде, в каком они переданы (uint32, сетевой порядок)
+#define DSHM_CAP_AUTH 0x4       // Сервер требует CMD_AUTH; ответ на CMD_HELLO несет его
+                                // вызов (DSHM_AUTH_NONCE случайных байт)
+
+// Проверка подлинности соединения общим ключом (сервер запущен с -k). До
+// успешного CMD_AUTH сервер выполняет только CMD_HELLO и CMD_AUTH. Клиент
+// сообщает uid и доказывает знание ключа этого uid (для uid 0 - ключа узлов);
+// права доступа к сегментам проверяются от имени этого uid и gid из файла
+// ключей сервера. Сервер в ответ доказывает знание ключа клиенту.
+// Подтверждения - HMAC-SHA256 по ключу от строки: сторона ('C' - клиент,
+// 'S' - сервер), вызов сервера, вызов клиента, uid и gid (как в shm_auth_t).
+// Сами запросы после этого не подписываются и не шифруются.
+#define DSHM_AUTH_NONCE 16
+#define DSHM_AUTH_MAC 32
+
+typedef struct {
+    uint32_t uid;                       // Сетевой порядок байт
+    uint32_t gid;
+    uint8_t nonce[DSHM_AUTH_NONCE];     // Вызов клиента
+    uint8_t mac[DSHM_AUTH_MAC];         // Подтверждение клиента
+} shm_auth_t;
+
+// Кодирование полезной нагрузки сообщения
+#define DSHM_ENC_NONE 0         // Данные передаются как есть
+#define DSHM_ENC_COMPRESSED 1   // Сжатые данные, впереди - исходный размер (uint32, сетевой порядок)
+#define DSHM_ENC_ZERO 2         // Данных нет: весь запрошенный диапазон состоит из нулей
+
 // Структура заголовка сообщения
 typedef struct {
     uint32_t command;      // Команда
@@ -26,6 +95,7 @@ typedef struct {
     int32_t shmid;         // ID сегмента разделяемой памяти
     int32_t flags;         // Флаги (для shmget)
     uint32_t offset;       // Смещение для чтения/записи
+    uint32_t encoding;     // Кодирование полезной нагрузки (DSHM_ENC_*)
 } shm_header_t;
 
 // Структура для ответа
@@ -33,22 +103,153 @@ typedef struct {
     int32_t result;        // Результат выполнения команды
     int32_t error_code;    // Код ошибки (если есть)
     uint32_t data_size;    // Размер возвращаемых данных
+    uint32_t encoding;     // Кодирование возвращаемых данных (DSHM_ENC_*)
 } shm_response_t;
 
-// Структура для хранения информации о сегменте
+// Журнал изменений (CMD_GET_CHANGES). Все поля в сетевом порядке байт,
+// 64-битные номера записей передаются двумя половинами.
+#define DSHM_CHANGES_DATA 0x1   // Флаг запроса: вместе с записями передать данные диапазонов
+
+#define DSHM_CHANGE_WRITE 0     // Запись данных
+#define DSHM_CHANGE_PUNCH 1     // Обнуление диапазона
+#define DSHM_CHANGE_REMOVE 2    // Сегмент удален (IPC_RMID)
+#define DSHM_CHANGE_COPY 3      // Полная копия сегмента (только в CMD_REPLICA_UPDATE):
+                                // данные - shm_migrate_t и начало содержимого сегмента
+#define DSHM_CHANGE_RESIZE 4    // Размер сегмента изменен: offset - новый размер, len - 0
+#define DSHM_CHANGE_COPY_PART 5 // Продолжение полной копии (только в CMD_REPLICA_UPDATE): данные
+                                // диапазона; копия полна, когда диапазон доходит до конца сегмента
+
+// Запрос записей журнала начиная с номера from
+typedef struct {
+    uint32_t from_hi;
+    uint32_t from_lo;       // 0 - только новые записи
+    uint32_t max_records;   // Не более записей в ответе
+    uint32_t wait_ms;       // Сколько ждать, если новых записей еще нет
+} shm_changes_req_t;
+
+// Заголовок ответа, за ним count записей shm_change_t (каждая - с данными,
+// если запрошен DSHM_CHANGES_DATA)
 typedef struct {
+    uint32_t log_id;        // Идентификатор журнала (меняется при перезапуске узла)
+    uint32_t next_hi;
+    uint32_t next_lo;       // Номер, с которого продолжать
+    uint32_t lost;          // Записи с номера from вытеснены: сегмент нужно перечитать целиком
+    uint32_t count;         // Число записей в ответе
+} shm_changes_t;
+
+// Запись журнала изменений
+typedef struct {
+    uint32_t seq_hi;
+    uint32_t seq_lo;
+    int32_t shmid;
+    uint32_t type;          // DSHM_CHANGE_*
+    uint32_t offset;
+    uint32_t len;
+    uint32_t data_len;      // Размер следующих за записью данных (текущее содержимое диапазона)
+} shm_change_t;
+
+// Пакет изменений для копий сегментов (CMD_REPLICA_UPDATE, поля в сетевом
+// порядке байт). За заголовком следуют count записей shm_change_t, каждая со
+// своими данными; в записях DSHM_CHANGE_WRITE - текущее содержимое диапазона.
+#define DSHM_REPLICA_CURRENT 0x1    // В пакет вошли все изменения владельца на момент отправки
+
+typedef struct {
+    uint32_t epoch;         // Эпоха карты кластера отправителя
+    uint32_t owner;         // Индекс отправителя в карте
+    uint32_t flags;         // DSHM_REPLICA_*
+    uint32_t count;
+} shm_replica_batch_t;
+
+// Размер строки кэша
+#define DSHM_CACHE_LINE 64
+
+// Структура для хранения информации о сегменте.
+// Описатели выровнены по строке кэша, а счетчики присоединений вынесены в
+// отдельную строку, чтобы их изменение не вытесняло редко меняющиеся поля.
+typedef struct shm_segment {
     int shmid;              // ID сегмента
+    int key;                // Ключ IPC (IPC_PRIVATE - сегмент без ключа)
     void *addr;             // Адрес в памяти сервера
     size_t size;            // Размер сегмента
     int shmflg;             // Флаги
+    int migrating;          // Сегмент передается другому узлу кластера
+    int retired;            // Сегмент удален: память и описатель освобождаются, когда
+                            // закончат читатели без блокировки
+    unsigned char *touched; // Битовая карта страниц, в которые когда-либо писали
+    int snapshot;           // Сегмент - снимок другого сегмента (только чтение)
+    struct shm_segment *snapshots;  // Снимки, разделяющие страницы с этим сегментом
+    struct shm_segment *cow_source; // Сегмент, страницы которого снимок еще разделяет
+    struct shm_segment *next_snapshot; // Следующий снимок того же cow_source
+    unsigned char *cow_copied;      // Страницы снимка, уже скопированные из cow_source
+    void *creator;          // Учетная запись квоты создателя (NULL - не учитывается)
+    int pooled;             // Память выделена в общей области малых сегментов
+    int memfd;              // Файл памяти отдельного отображения (-1 - анонимная память);
+                            // передается новому процессу сервера при перезапуске
+    uint32_t *page_crc;     // Суммы CRC32C страниц для CMD_CHECKSUM (выделяются при первом запросе)
+    unsigned char *crc_valid; // Страницы, сумма которых в page_crc действительна
+    int replica;            // Копия для чтения сегмента другого узла (изменяется только его владельцем)
+    uint32_t replica_epoch; // Эпоха карты, в которой копия получена (у владельца - отправлена)
+    int replica_copying;    // Полная копия передана не целиком (у копии - чтение недоступно)
+    size_t replica_copied;  // У владельца: сколько байт полной копии уже отправлено
+    uint32_t uid;           // Владелец (shm_perm.uid, меняется IPC_SET); права - младшие 9 бит shmflg
+    uint32_t gid;
+    uint32_t cuid;          // Создатель
+    uint32_t cgid;
+
+    // Изменяются атомарно, без блокировки таблицы сегментов
+    uint64_t attach_state __attribute__((aligned(DSHM_CACHE_LINE)));
+                            // Поколение описателя (старшие 32 бита), признаки
+                            // и число присоединенных клиентов (младшие 32 бита)
+    uint32_t write_seq;     // Счетчик изменений данных для чтения без блокировки
+                            // (нечетный, пока данные меняются)
+    uint32_t perm_seq;      // Счетчик смен прав (IPC_SET): по нему устаревает кэш прав соединений
     int ref_count;          // Счетчик ссылок
-    int attached_clients;   // Количество подключенных клиентов
-} shm_segment_t;
+} __attribute__((aligned(DSHM_CACHE_LINE))) shm_segment_t;
+
+// Флаги CMD_MIGRATE_OUT: без флагов - получить сегмент (он замораживается у
+// прежнего владельца), затем подтвердить установку или сообщить об ошибке
+#define DSHM_MIGRATE_COMMIT 0x1 // Сегмент установлен, прежний владелец его удаляет
+#define DSHM_MIGRATE_ABORT 0x2  // Установить не удалось, сегмент снова доступен у владельца
+// Флаг CMD_MIGRATE_IN: часть сегмента по смещению offset (первой части с нулевым
+// смещением предшествует описание). Части идут по порядку в одном соединении;
+// без флага сообщение содержит описание и все данные сегмента.
+#define DSHM_MIGRATE_PART 0x4
+
+// Описание сегмента, передаваемого между узлами при миграции
+// (все поля в сетевом порядке байт, за описанием следуют данные сегмента)
+typedef struct {
+    uint32_t size_hi;       // Старшие 32 бита размера
+    uint32_t size_lo;       // Младшие 32 бита размера
+    int32_t shmflg;         // Флаги сегмента
+    int32_t ref_count;      // Счетчик ссылок
+    int32_t attached_clients; // Количество подключенных клиентов
+    int32_t snapshot;       // Сегмент - снимок (только чтение)
+    int32_t key;            // Ключ IPC сегмента
+    uint32_t uid;           // Владелец и создатель (shm_perm)
+    uint32_t gid;
+    uint32_t cuid;
+    uint32_t cgid;
+} shm_migrate_t;
+
+// Сведения о сегменте в ответе на CMD_SHMCTL IPC_STAT и новые значения в запросе
+// IPC_SET (все поля в сетевом порядке байт; IPC_SET использует uid, gid и mode)
+typedef struct {
+    uint32_t size_hi;       // Старшие 32 бита размера
+    uint32_t size_lo;       // Младшие 32 бита размера
+    uint32_t nattch;        // Количество подключенных клиентов
+    uint32_t mode;          // Флаги сегмента (права - младшие 9 бит)
+    int32_t key;            // Ключ IPC сегмента
+    uint32_t uid;           // Владелец и создатель (shm_perm)
+    uint32_t gid;
+    uint32_t cuid;
+    uint32_t cgid;
+} shm_stat_t;
 
 // Определения размеров
-#define MAX_SEGMENTS 1024
+#define DEFAULT_SEGMENTS (1 << 18)  // Сегментов на сервер по умолчанию (-S)
 #define MAX_CLIENTS 100
 #define MAX_BUFFER_SIZE 65536
+#define DSHM_PAGE_SIZE 4096     // Гранулярность учета записанных страниц
 
 // Определения ошибок
 #define SHM_SUCCESS 0
@@ -57,5 +258,12 @@ typedef struct {
 #define SHM_ENOMEM -3
 #define SHM_EACCES -4
 #define SHM_ENOENT -5
+#define SHM_EMOVED -6       // Сегмент принадлежит другому узлу кластера
+#define SHM_EAGAIN -7       // Сегмент временно недоступен (идет миграция)
+#define SHM_EBADMSG -8      // Контрольная сумма сообщения не совпала
+#define SHM_EEXIST -9       // Сегмент с ключом уже есть (IPC_CREAT | IPC_EXCL)
+#define SHM_ESHUTDOWN -10   // Сервер останавливается: запрос не выполнен, его нужно повторить
+                            // через новое соединение (его примет сервер, сменивший этот)
+#define SHM_EXDEV -11       // Сегменты команды находятся на разных узлах кластера
 
 #endif // DISTRIBUTED_SHM_H
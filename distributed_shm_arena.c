@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "distributed_shm.h"
+#include "distributed_shm_arena.h"
+
+// Область уплотняется, когда в ней занято не больше четверти слотов
+#define COMPACT_DIVISOR 4
+
+static int size_class(size_t size) {
+    int c = 0;
+    size_t slot = DSHM_ARENA_MIN_SLOT;
+    while (slot < size) {
+        slot <<= 1;
+        c++;
+    }
+    return c;
+}
+
+// Разделяемое отображение (как у отдельных сегментов, чтобы работал MADV_REMOVE):
+// сначала на явных huge pages, иначе выровненное с просьбой собрать его из прозрачных
+static char *map_region(void) {
+    void *mem = mmap(NULL, DSHM_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) {
+        return mem;
+    }
+
+    size_t span = 2 * DSHM_ARENA_SIZE;
+    char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char*)(((uintptr_t)raw + DSHM_ARENA_SIZE - 1) & ~((uintptr_t)DSHM_ARENA_SIZE - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (raw + span > aligned + DSHM_ARENA_SIZE) {
+        munmap(aligned + DSHM_ARENA_SIZE, raw + span - (aligned + DSHM_ARENA_SIZE));
+    }
+    madvise(aligned, DSHM_ARENA_SIZE, MADV_HUGEPAGE);
+    return aligned;
+}
+
+static dshm_arena_t *arena_create(dshm_arenas_t *arenas, int c) {
+    dshm_arena_t *arena = calloc(1, sizeof(dshm_arena_t));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->slot_size = (size_t)DSHM_ARENA_MIN_SLOT << c;
+    arena->slots = DSHM_ARENA_SIZE / arena->slot_size;
+    arena->free_slots = malloc(arena->slots * sizeof(unsigned));
+    arena->owners = calloc(arena->slots, sizeof(void*));
+    arena->base = map_region();
+    if (arena->free_slots == NULL || arena->owners == NULL || arena->base == NULL) {
+        free(arena->free_slots);
+        free(arena->owners);
+        free(arena);
+        return NULL;
+    }
+
+    arena->next = arenas->classes[c];
+    arenas->classes[c] = arena;
+    arenas->mapped += DSHM_ARENA_SIZE;
+    return arena;
+}
+
+static void arena_destroy(dshm_arenas_t *arenas, int c, dshm_arena_t *arena) {
+    dshm_arena_t **link = &arenas->classes[c];
+    while (*link != arena) {
+        link = &(*link)->next;
+    }
+    *link = arena->next;
+
+    if (arenas->quiesce != NULL) {
+        arenas->quiesce();
+    }
+    munmap(arena->base, DSHM_ARENA_SIZE);
+    arenas->mapped -= DSHM_ARENA_SIZE;
+    free(arena->free_slots);
+    free(arena->owners);
+    free(arena);
+}
+
+// Выдача слота области (в ней должно быть свободное место).
+// Свободные слоты всегда обнулены: новые - ядром, возвращенные - при освобождении
+static void *arena_take(dshm_arena_t *arena, void *owner) {
+    unsigned slot = (arena->free_top > 0) ? arena->free_slots[--arena->free_top] : arena->fresh++;
+    arena->owners[slot] = owner;
+    arena->used++;
+    return arena->base + (size_t)slot * arena->slot_size;
+}
+
+static void arena_release(dshm_arena_t *arena, unsigned slot) {
+    char *ptr = arena->base + (size_t)slot * arena->slot_size;
+    // Слоты от страницы и больше возвращаются системе, меньшие просто обнуляются
+    if (arena->slot_size < DSHM_PAGE_SIZE || madvise(ptr, arena->slot_size, MADV_REMOVE) == -1) {
+        memset(ptr, 0, arena->slot_size);
+    }
+    arena->owners[slot] = NULL;
+    arena->free_slots[arena->free_top++] = slot;
+    arena->used--;
+}
+
+int dshm_arena_fits(size_t size) {
+    return size > 0 && size <= DSHM_ARENA_MAX_SLOT;
+}
+
+void dshm_arenas_init(dshm_arenas_t *arenas, dshm_arena_relocate_fn relocate, dshm_arena_quiesce_fn quiesce) {
+    memset(arenas, 0, sizeof(*arenas));
+    arenas->relocate = relocate;
+    arenas->quiesce = quiesce;
+}
+
+void *dshm_arena_alloc(dshm_arenas_t *arenas, size_t size, void *owner) {
+    int c = size_class(size);
+    dshm_arena_t *arena = arenas->classes[c];
+    while (arena != NULL && arena->used == arena->slots) {
+        arena = arena->next;
+    }
+    if (arena == NULL) {
+        arena = arena_create(arenas, c);
+        if (arena == NULL) {
+            return NULL;
+        }
+    }
+    return arena_take(arena, owner);
+}
+
+// Перенос всех блоков почти пустой области в другие области класса.
+// После переноса у класса должен остаться запас свободных слотов, иначе
+// следующее выделение снова отобразило бы область, освобожденную только что.
+static void arena_compact(dshm_arenas_t *arenas, int c, dshm_arena_t *victim) {
+    size_t room = 0;
+    for (dshm_arena_t *a = arenas->classes[c]; a != NULL; a = a->next) {
+        if (a != victim) {
+            room += a->slots - a->used;
+        }
+    }
+    if (room < victim->used + victim->slots / COMPACT_DIVISOR) {
+        return;
+    }
+
+    dshm_arena_t *target = arenas->classes[c];
+    for (unsigned slot = 0; slot < victim->fresh && victim->used > 0; slot++) {
+        void *owner = victim->owners[slot];
+        if (owner == NULL) {
+            continue;
+        }
+        while (target == victim || target->used == target->slots) {
+            target = target->next;
+        }
+        void *to = arena_take(target, owner);
+        memcpy(to, victim->base + (size_t)slot * victim->slot_size, victim->slot_size);
+        victim->owners[slot] = NULL;
+        victim->used--;
+        arenas->relocate(owner, to);
+    }
+    arena_destroy(arenas, c, victim);
+}
+
+// Область класса c, которой принадлежит блок ptr (NULL - ни одной)
+static dshm_arena_t *arena_of(dshm_arenas_t *arenas, int c, void *ptr) {
+    dshm_arena_t *arena = arenas->classes[c];
+    while (arena != NULL &&
+           ((char*)ptr < arena->base || (char*)ptr >= arena->base + DSHM_ARENA_SIZE)) {
+        arena = arena->next;
+    }
+    return arena;
+}
+
+void dshm_arena_set_owner(dshm_arenas_t *arenas, void *ptr, size_t size, void *owner) {
+    dshm_arena_t *arena = arena_of(arenas, size_class(size), ptr);
+    if (arena != NULL) {
+        arena->owners[((char*)ptr - arena->base) / arena->slot_size] = owner;
+    }
+}
+
+void dshm_arena_free(dshm_arenas_t *arenas, void *ptr, size_t size) {
+    int c = size_class(size);
+    dshm_arena_t *arena = arena_of(arenas, c, ptr);
+    if (arena == NULL) {
+        return;
+    }
+
+    arena_release(arena, (unsigned)(((char*)ptr - arena->base) / arena->slot_size));
+    if (arena->used <= arena->slots / COMPACT_DIVISOR) {
+        arena_compact(arenas, c, arena);
+    }
+}
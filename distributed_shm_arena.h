@@ -0,0 +1,56 @@
+#ifndef DISTRIBUTED_SHM_ARENA_H
+#define DISTRIBUTED_SHM_ARENA_H
+
+#include <stddef.h>
+
+// Малые сегменты (до DSHM_ARENA_MAX_SLOT байт) размещаются в общих областях
+// по 2 МБ, более крупные получают собственное отображение
+#define DSHM_ARENA_MIN_SLOT 128
+#define DSHM_ARENA_MAX_SLOT 4096
+#define DSHM_ARENA_CLASSES 6                // 128, 256, ..., 4096
+#define DSHM_ARENA_SIZE (2u << 20)
+
+// Перенос блока при уплотнении: владелец должен запомнить новый адрес
+typedef void (*dshm_arena_relocate_fn)(void *owner, void *new_addr);
+
+// Вызывается перед возвратом опустевшей области системе: ее еще могут читать без блокировки
+typedef void (*dshm_arena_quiesce_fn)(void);
+
+// Область одного размерного класса
+typedef struct dshm_arena {
+    char *base;
+    size_t slot_size;
+    unsigned slots;
+    unsigned used;
+    unsigned *free_slots;       // Стек номеров свободных слотов
+    unsigned free_top;
+    unsigned fresh;             // Слоты с этого номера еще ни разу не выдавались
+    void **owners;              // Владелец каждого занятого слота (NULL - свободен)
+    struct dshm_arena *next;
+} dshm_arena_t;
+
+// Распределитель малых сегментов. Не содержит собственной блокировки:
+// все вызовы выполняются под блокировкой таблицы сегментов.
+typedef struct {
+    dshm_arena_t *classes[DSHM_ARENA_CLASSES];
+    dshm_arena_relocate_fn relocate;
+    dshm_arena_quiesce_fn quiesce;  // NULL - области освобождаются сразу
+    size_t mapped;              // Байт в отображенных областях
+} dshm_arenas_t;
+
+void dshm_arenas_init(dshm_arenas_t *arenas, dshm_arena_relocate_fn relocate, dshm_arena_quiesce_fn quiesce);
+
+// Размещается ли сегмент такого размера в общей области
+int dshm_arena_fits(size_t size);
+
+// Обнуленный блок не меньше size байт для владельца owner, NULL при нехватке памяти
+void *dshm_arena_alloc(dshm_arenas_t *arenas, size_t size, void *owner);
+
+// Освобождение блока. Почти пустая область уплотняется: ее блоки переносятся
+// в другие области того же класса (с вызовом relocate), а сама она освобождается
+void dshm_arena_free(dshm_arenas_t *arenas, void *ptr, size_t size);
+
+// Смена владельца занятого блока: relocate при уплотнении получит нового владельца
+void dshm_arena_set_owner(dshm_arenas_t *arenas, void *ptr, size_t size, void *owner);
+
+#endif // DISTRIBUTED_SHM_ARENA_H
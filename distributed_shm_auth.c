@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#include "distributed_shm_auth.h"
+
+// SHA-256 (FIPS 180-4)
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;           // Обработано байт
+    uint8_t block[64];
+    size_t used;            // Байт в неполном блоке
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(sha256_t *ctx, const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3];
+    uint32_t e = ctx->h[4], f = ctx->h[5], g = ctx->h[6], h = ctx->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+    ctx->h[5] += f;
+    ctx->h[6] += g;
+    ctx->h[7] += h;
+}
+
+static void sha256_init(sha256_t *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->h, initial, sizeof(initial));
+    ctx->len = 0;
+    ctx->used = 0;
+}
+
+static void sha256_update(sha256_t *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    ctx->len += len;
+    while (len > 0) {
+        size_t chunk = sizeof(ctx->block) - ctx->used;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(ctx->block + ctx->used, p, chunk);
+        ctx->used += chunk;
+        p += chunk;
+        len -= chunk;
+        if (ctx->used == sizeof(ctx->block)) {
+            sha256_block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha256_final(sha256_t *ctx, uint8_t digest[32]) {
+    uint64_t bits = ctx->len * 8;
+    static const uint8_t pad[64] = { 0x80 };
+    sha256_update(ctx, pad, (ctx->used < 56) ? 56 - ctx->used : 120 - ctx->used);
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++) {
+        length[i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, length, sizeof(length));
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(ctx->h[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(ctx->h[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(ctx->h[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)ctx->h[i];
+    }
+}
+
+void dshm_hmac_sha256(const uint8_t *key, size_t key_len, const void *msg, size_t msg_len,
+                      uint8_t mac[DSHM_AUTH_MAC]) {
+    // Ключ длиннее блока заменяется своим хешем
+    uint8_t block_key[64] = { 0 };
+    sha256_t ctx;
+    if (key_len > sizeof(block_key)) {
+        sha256_init(&ctx);
+        sha256_update(&ctx, key, key_len);
+        sha256_final(&ctx, block_key);
+    } else {
+        memcpy(block_key, key, key_len);
+    }
+
+    uint8_t pad[64];
+    uint8_t inner[32];
+    for (size_t i = 0; i < sizeof(pad); i++) {
+        pad[i] = block_key[i] ^ 0x36;
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, pad, sizeof(pad));
+    sha256_update(&ctx, msg, msg_len);
+    sha256_final(&ctx, inner);
+
+    for (size_t i = 0; i < sizeof(pad); i++) {
+        pad[i] = block_key[i] ^ 0x5c;
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, pad, sizeof(pad));
+    sha256_update(&ctx, inner, sizeof(inner));
+    sha256_final(&ctx, mac);
+}
+
+void dshm_auth_proof(const uint8_t *key, size_t key_len, char side, const uint8_t server_nonce[DSHM_AUTH_NONCE],
+                     const shm_auth_t *auth, uint8_t mac[DSHM_AUTH_MAC]) {
+    uint8_t msg[1 + 2 * DSHM_AUTH_NONCE + 2 * sizeof(uint32_t)];
+    msg[0] = (uint8_t)side;
+    memcpy(msg + 1, server_nonce, DSHM_AUTH_NONCE);
+    memcpy(msg + 1 + DSHM_AUTH_NONCE, auth->nonce, DSHM_AUTH_NONCE);
+    memcpy(msg + 1 + 2 * DSHM_AUTH_NONCE, &auth->uid, sizeof(uint32_t));
+    memcpy(msg + 1 + 2 * DSHM_AUTH_NONCE + sizeof(uint32_t), &auth->gid, sizeof(uint32_t));
+    dshm_hmac_sha256(key, key_len, msg, sizeof(msg), mac);
+}
+
+int dshm_auth_equal(const uint8_t a[DSHM_AUTH_MAC], const uint8_t b[DSHM_AUTH_MAC]) {
+    uint8_t diff = 0;
+    for (int i = 0; i < DSHM_AUTH_MAC; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+int dshm_auth_nonce(uint8_t nonce[DSHM_AUTH_NONCE]) {
+    size_t got = 0;
+    while (got < DSHM_AUTH_NONCE) {
+        ssize_t n = getrandom(nonce + got, DSHM_AUTH_NONCE - got, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+int dshm_auth_load_key(const char *path, uint8_t key[DSHM_AUTH_KEY_MAX]) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    // Байт сверх наибольшей длины нужен, чтобы заметить слишком длинный ключ
+    uint8_t buf[DSHM_AUTH_KEY_MAX + 2];
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(buf) && (n = read(fd, buf + len, sizeof(buf) - len)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        len += (size_t)n;
+    }
+    close(fd);
+
+    if (len > 0 && buf[len - 1] == '\n') {
+        len--;
+        if (len > 0 && buf[len - 1] == '\r') {
+            len--;
+        }
+    }
+    if (len < DSHM_AUTH_KEY_MIN || len > DSHM_AUTH_KEY_MAX) {
+        memset(buf, 0, sizeof(buf));
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(key, buf, len);
+    memset(buf, 0, sizeof(buf));
+    return (int)len;
+}
+
+// Похожа ли строка на строку файла ключей (иначе файл - один ключ)
+static int key_line_format(const char *line, size_t len) {
+    if (len > 0 && line[0] == '#') {
+        return 1;
+    }
+    if (len >= 5 && memcmp(line, "node ", 5) == 0) {
+        return 1;
+    }
+    size_t pos = 0;
+    while (pos < len && line[pos] >= '0' && line[pos] <= '9') {
+        pos++;
+    }
+    return pos > 0 && pos < len && line[pos] == ':';
+}
+
+// Разбор строки "node ключ" или "uid:gid ключ". -1 - строка неверна
+static int parse_key_line(const char *line, size_t len, dshm_auth_entry_t *entry) {
+    size_t pos = 0;
+    if (len >= 5 && memcmp(line, "node ", 5) == 0) {
+        entry->kind = DSHM_KEY_NODE;
+        entry->uid = 0;
+        entry->gid = 0;
+        pos = 5;
+    } else {
+        uint64_t ids[2] = { 0, 0 };
+        for (int part = 0; part < 2; part++) {
+            size_t start = pos;
+            while (pos < len && line[pos] >= '0' && line[pos] <= '9' && ids[part] <= UINT32_MAX) {
+                ids[part] = ids[part] * 10 + (uint64_t)(line[pos] - '0');
+                pos++;
+            }
+            if (pos == start || ids[part] > UINT32_MAX || pos == len || line[pos] != (part == 0 ? ':' : ' ')) {
+                return -1;
+            }
+            pos++;
+        }
+        // uid 0 получают только узлы кластера
+        if (ids[0] == 0) {
+            return -1;
+        }
+        entry->kind = DSHM_KEY_USER;
+        entry->uid = (uint32_t)ids[0];
+        entry->gid = (uint32_t)ids[1];
+    }
+
+    size_t key_len = len - pos;
+    if (key_len < DSHM_AUTH_KEY_MIN || key_len > DSHM_AUTH_KEY_MAX) {
+        return -1;
+    }
+    memcpy(entry->key, line + pos, key_len);
+    entry->len = (int)key_len;
+    return 0;
+}
+
+int dshm_auth_load_keys(const char *path, dshm_auth_entry_t *entries, int max) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    // Байт сверх наибольшего размера нужен, чтобы заметить слишком длинный файл
+    size_t cap = (size_t)DSHM_AUTH_KEYS_MAX * (DSHM_AUTH_KEY_MAX + 24) + 1;
+    char *buf = malloc(cap);
+    if (buf == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t len = 0;
+    ssize_t n;
+    while (len < cap && (n = read(fd, buf + len, cap - len)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int saved = errno;
+            close(fd);
+            free(buf);
+            errno = saved;
+            return -1;
+        }
+        len += (size_t)n;
+    }
+    close(fd);
+
+    // Прежний формат: весь файл - один ключ
+    const char *first_end = memchr(buf, '\n', len);
+    size_t first_len = (first_end != NULL) ? (size_t)(first_end - buf) : len;
+    if (!key_line_format(buf, first_len)) {
+        memset(buf, 0, len);
+        free(buf);
+        if (max < 1) {
+            errno = EINVAL;
+            return -1;
+        }
+        int key_len = dshm_auth_load_key(path, entries[0].key);
+        if (key_len == -1) {
+            return -1;
+        }
+        entries[0].kind = DSHM_KEY_ANY;
+        entries[0].uid = 0;
+        entries[0].gid = 0;
+        entries[0].len = key_len;
+        return 1;
+    }
+
+    int count = 0;
+    int status = 0;
+    for (size_t pos = 0; pos < len && status == 0; ) {
+        const char *end = memchr(buf + pos, '\n', len - pos);
+        size_t line_len = (end != NULL) ? (size_t)(end - (buf + pos)) : len - pos;
+        size_t next = pos + line_len + 1;
+        if (line_len > 0 && buf[pos + line_len - 1] == '\r') {
+            line_len--;
+        }
+        if (line_len > 0 && buf[pos] != '#') {
+            if (count == max || len == cap || parse_key_line(buf + pos, line_len, &entries[count]) == -1) {
+                status = -1;
+            } else {
+                count++;
+            }
+        }
+        pos = next;
+    }
+    memset(buf, 0, len);
+    free(buf);
+    if (status == -1 || count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return count;
+}
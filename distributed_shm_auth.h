@@ -0,0 +1,55 @@
+#ifndef DISTRIBUTED_SHM_AUTH_H
+#define DISTRIBUTED_SHM_AUTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "distributed_shm.h"
+
+// Проверка подлинности соединений общим ключом (CMD_AUTH): HMAC-SHA256 один
+// раз при подключении, без шифрования последующих запросов.
+
+#define DSHM_AUTH_KEY_MIN 16    // Ключ короче этого считается ошибкой
+#define DSHM_AUTH_KEY_MAX 256
+#define DSHM_AUTH_KEYS_MAX 1024 // Ключей в файле ключей
+
+// Виды ключей файла ключей
+#define DSHM_KEY_ANY 0          // Файл из одного ключа: у сервера - ключ узлов, клиент
+                                // сообщает свои uid и gid
+#define DSHM_KEY_NODE 1         // Строка "node ключ": узлы кластера и администратор (uid 0)
+#define DSHM_KEY_USER 2         // Строка "uid:gid ключ": ключ одного пользователя (uid не 0)
+
+typedef struct {
+    int kind;               // DSHM_KEY_*
+    uint32_t uid;           // Для DSHM_KEY_USER
+    uint32_t gid;
+    int len;
+    uint8_t key[DSHM_AUTH_KEY_MAX];
+} dshm_auth_entry_t;
+
+// Общий ключ из файла. Перевод строки в конце файла в ключ не входит.
+// Возвращает длину ключа или -1 (errno - причина, EINVAL - неверная длина)
+int dshm_auth_load_key(const char *path, uint8_t key[DSHM_AUTH_KEY_MAX]);
+
+// Ключи из файла ключей: строки "node ключ" и "uid:gid ключ" (пустые строки и
+// строки с # пропускаются). Файл, первая строка которого не такая, целиком -
+// один ключ DSHM_KEY_ANY, как у dshm_auth_load_key. Возвращает число ключей
+// или -1 (errno - причина, EINVAL - неверная строка, длина ключа или ключей больше max)
+int dshm_auth_load_keys(const char *path, dshm_auth_entry_t *entries, int max);
+
+// Случайный вызов. Возвращает -1, если источник случайных чисел недоступен
+int dshm_auth_nonce(uint8_t nonce[DSHM_AUTH_NONCE]);
+
+// Подтверждение стороны side ('C' или 'S') для вызова сервера и полей auth
+// (uid, gid и вызов клиента; поле mac не используется)
+void dshm_auth_proof(const uint8_t *key, size_t key_len, char side, const uint8_t server_nonce[DSHM_AUTH_NONCE],
+                     const shm_auth_t *auth, uint8_t mac[DSHM_AUTH_MAC]);
+
+// Сравнение подтверждений за время, не зависящее от содержимого
+int dshm_auth_equal(const uint8_t a[DSHM_AUTH_MAC], const uint8_t b[DSHM_AUTH_MAC]);
+
+// HMAC-SHA256 сообщения
+void dshm_hmac_sha256(const uint8_t *key, size_t key_len, const void *msg, size_t msg_len,
+                      uint8_t mac[DSHM_AUTH_MAC]);
+
+#endif // DISTRIBUTED_SHM_AUTH_H
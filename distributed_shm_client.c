@@ -11,34 +11,148 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
 
 #include "distributed_shm.h"
 #include "distributed_shm_client.h"
+#include "distributed_shm_cluster.h"
+#include "distributed_shm_compress.h"
+#include "distributed_shm_diff.h"
+#include "distributed_shm_crc.h"
+#include "distributed_shm_frame.h"
+#include "distributed_shm_trace.h"
+#include "distributed_shm_auth.h"
 
 // Global variables for client state
 static client_shm_segment_t client_segments[MAX_CLIENT_SEGMENTS];
 static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int server_socket_fd = -1;
-static char server_host[256] = DEFAULT_SERVER_HOST;
-static int server_port = DEFAULT_SERVER_PORT;
+static dshm_cluster_t cluster;              // Current cluster map (seed list until fetched)
+static dshm_reader_t *node_conns[DSHM_MAX_NODES];  // One connection per cluster node
+static uint32_t node_caps[DSHM_MAX_NODES];  // Protocol capabilities negotiated with each node
+static unsigned cluster_generation = 0;     // Bumped whenever the map (and node indices) change
+static unsigned node_rtt_us[DSHM_MAX_NODES]; // Connection setup time per node (0 - not measured,
+                                             // UINT_MAX - unreachable); picks the nearest replica
+static int replica_staleness_ms = -1;       // Lag allowed for replica reads (-1 - read from the owner)
 static int client_initialized = 0;
 
-// Function to connect to the server
-int connect_to_server(void) {
-    if (server_socket_fd != -1) {
-        close(server_socket_fd);
+// Background prefetch: a queue served by one worker thread over its own
+// connections, so pipelined reads never interleave with foreground requests.
+// The queue and the per-segment page bitmaps are protected by client_mutex.
+typedef struct {
+    int segment_idx;        // Index in client_segments
+    int shmid;              // Segment the request was queued for
+    size_t offset;          // Page-aligned start of the range
+    size_t len;             // Length of the range
+} prefetch_request_t;
+
+#define DSHM_PREFETCH_QUEUE 64
+#define DSHM_PREFETCH_DEPTH 8           // Read requests kept in flight by the worker
+#define DSHM_READAHEAD_MAX (8u << 20)   // Upper bound of the sequential read-ahead window
+
+static prefetch_request_t prefetch_queue[DSHM_PREFETCH_QUEUE];
+static int prefetch_head = 0;
+static int prefetch_count = 0;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;    // Work was queued
+static pthread_cond_t prefetch_done = PTHREAD_COND_INITIALIZER;    // Pages arrived or were dropped
+static pthread_t prefetch_thread;
+static int prefetch_started = 0;
+static int prefetch_stop = 0;
+static dshm_reader_t *prefetch_conns[DSHM_MAX_NODES];  // Worker-owned connections
+static uint32_t prefetch_caps[DSHM_MAX_NODES];
+static unsigned prefetch_generation = 0;
+
+static void stop_prefetch(void);
+
+// How many times a request is re-routed after a map change or a busy segment
+#define DSHM_ROUTE_RETRIES 8
+
+// Protocol capabilities offered by the client
+#define CLIENT_CAPS (DSHM_CAP_COMPRESS | DSHM_CAP_CRC)
+
+// Key proven to servers that require it (0 - none configured). The kind
+// decides which uid the client claims: its own, 0 for a node key, or the
+// uid:gid named next to the key in DSHM_KEY_FILE.
+static uint8_t auth_key[DSHM_AUTH_KEY_MAX];
+static int auth_key_len = 0;
+static int auth_kind = DSHM_KEY_ANY;
+static uint32_t auth_uid = 0;
+static uint32_t auth_gid = 0;
+
+// Ranges from this size up are compared by digest before being read again
+#define DSHM_CHECKSUM_MIN (16u << 10)
+static int checksum_supported = 1;      // Cleared once a server rejects CMD_CHECKSUM
+
+static int send_request(int fd, uint32_t caps, uint32_t command, int shmid, int flags, uint32_t offset,
+                        void *data, size_t data_size);
+static int recv_response(dshm_reader_t *conn, uint32_t caps, size_t requested, void **response_data, size_t *response_size,
+                         int *result);
+
+// Close a connection and release its read buffer
+static void close_connection(dshm_reader_t **conn) {
+    if (*conn != NULL) {
+        close((*conn)->fd);
+        free(*conn);
+        *conn = NULL;
     }
+}
 
-    server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket_fd == -1) {
-        perror("socket");
+// Close the connection to a cluster node
+static void close_node(int node) {
+    close_connection(&node_conns[node]);
+}
+
+// Prove the shared key to a server that asked for it (the HELLO reply carried
+// its nonce) and check the server's proof in return. caps are the features
+// just negotiated: they already apply to this exchange.
+static int authenticate(dshm_reader_t *conn, uint32_t caps, const void *nonce, size_t nonce_size) {
+    if (auth_key_len == 0) {
+        fprintf(stderr, "distributed_shm: the server requires a shared key (DSHM_KEY_FILE)\n");
+        return -1;
+    }
+    if (nonce == NULL || nonce_size != DSHM_AUTH_NONCE) {
+        return -1;
+    }
+
+    uint32_t uid = (auth_kind == DSHM_KEY_ANY) ? (uint32_t)geteuid() : auth_uid;
+    uint32_t gid = (auth_kind == DSHM_KEY_ANY) ? (uint32_t)getegid() : auth_gid;
+    shm_auth_t auth = { .uid = htonl(uid), .gid = htonl(gid) };
+    if (dshm_auth_nonce(auth.nonce) == -1) {
         return -1;
     }
+    uint8_t expected[DSHM_AUTH_MAC];
+    dshm_auth_proof(auth_key, (size_t)auth_key_len, 'C', nonce, &auth, auth.mac);
+    dshm_auth_proof(auth_key, (size_t)auth_key_len, 'S', nonce, &auth, expected);
+
+    void *proof = NULL;
+    size_t proof_size = 0;
+    int result = -1;
+    int status = -1;
+    if (send_request(conn->fd, caps, CMD_AUTH, 0, 0, 0, &auth, sizeof(auth)) == 0 &&
+        recv_response(conn, caps, 0, &proof, &proof_size, &result) == 0 && result == SHM_SUCCESS &&
+        proof_size == DSHM_AUTH_MAC && dshm_auth_equal(expected, proof)) {
+        status = 0;
+    } else {
+        fprintf(stderr, "distributed_shm: shared key authentication failed\n");
+    }
+    free(proof);
+    return status;
+}
+
+// Open a connection to a node and negotiate optional protocol features
+static dshm_reader_t *open_connection(const dshm_node_t *node, uint32_t *caps) {
+    const char *server_host = node->host;
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        perror("socket");
+        return NULL;
+    }
 
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
+    server_addr.sin_port = htons(node->port);
     
     // Try to convert the hostname to an IP address
     if (inet_pton(AF_INET, server_host, &server_addr.sin_addr) <= 0) {
@@ -47,38 +161,86 @@ int connect_to_server(void) {
         host_entry = gethostbyname(server_host);
         if (host_entry == NULL) {
             fprintf(stderr, "Cannot resolve hostname: %s\n", server_host);
-            close(server_socket_fd);
-            server_socket_fd = -1;
-            return -1;
+            close(server_fd);
+            return NULL;
         }
         
         // Copy the resolved IP address
         memcpy(&server_addr.sin_addr, host_entry->h_addr_list[0], host_entry->h_length);
     }
 
-    if (connect(server_socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+    if (connect(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
         perror("connect");
-        close(server_socket_fd);
-        server_socket_fd = -1;
-        return -1;
+        close(server_fd);
+        return NULL;
+    }
+    dshm_socket_setup(server_fd);
+
+    dshm_reader_t *conn = malloc(sizeof(dshm_reader_t));
+    if (conn == NULL) {
+        close(server_fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    dshm_reader_init(conn, server_fd);
+
+    // An older server rejects the command and gets no optional features
+    int result = -1;
+    void *nonce = NULL;
+    size_t nonce_size = 0;
+    if (send_request(server_fd, 0, CMD_HELLO, 0, CLIENT_CAPS, 0, NULL, 0) == -1 ||
+        recv_response(conn, 0, 0, &nonce, &nonce_size, &result) == -1) {
+        close_connection(&conn);
+        return NULL;
+    }
+    *caps = (result > 0) ? (uint32_t)result & CLIENT_CAPS : 0;
+    if (result > 0 && (result & DSHM_CAP_AUTH) && authenticate(conn, *caps, nonce, nonce_size) == -1) {
+        free(nonce);
+        close_connection(&conn);
+        errno = EACCES;
+        return NULL;
     }
+    free(nonce);
 
-    return server_socket_fd;
+    return conn;
 }
 
-// Function to send a request to the server and receive a response
-int send_request_to_server(uint32_t command, int shmid, int flags, uint32_t offset,
-                          void *data, size_t data_size, void **response_data, size_t *response_size) {
-    if (!client_initialized) {
+// Function to connect to a cluster node
+int connect_to_server(int node) {
+    if (node < 0 || node >= cluster.node_count) {
         errno = EINVAL;
         return -1;
     }
+    close_node(node);
 
-    // Connect to server if not already connected
-    if (server_socket_fd == -1) {
-        if (connect_to_server() == -1) {
-            errno = ECONNREFUSED;
-            return -1;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    node_conns[node] = open_connection(&cluster.nodes[node], &node_caps[node]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (node_conns[node] == NULL) {
+        node_rtt_us[node] = UINT_MAX;
+        return -1;
+    }
+
+    // Connect and CMD_HELLO take two round trips
+    long us = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+    node_rtt_us[node] = (us > 0) ? (unsigned)us : 1;
+    return node_conns[node]->fd;
+}
+
+// Send one request (header and payload) without waiting for the response
+static int send_request(int fd, uint32_t caps, uint32_t command, int shmid, int flags, uint32_t offset,
+                        void *data, size_t data_size) {
+    // Compress bulk writes if the node supports it
+    uint32_t encoding = DSHM_ENC_NONE;
+    void *encoded = NULL;
+    if (command == CMD_WRITE_DATA && data != NULL && (caps & DSHM_CAP_COMPRESS)) {
+        size_t encoded_size = 0;
+        encoded = dshm_encode_payload(data, data_size, &encoded_size);
+        if (encoded != NULL) {
+            data = encoded;
+            data_size = encoded_size;
+            encoding = DSHM_ENC_COMPRESSED;
         }
     }
 
@@ -89,67 +251,127 @@ int send_request_to_server(uint32_t command, int shmid, int flags, uint32_t offs
     request_header.shmid = htonl(shmid);
     request_header.flags = htonl(flags);
     request_header.offset = htonl(offset);
+    request_header.encoding = htonl(encoding);
+
+    // The checksum covers the header and the payload exactly as sent
+    int has_data = (data != NULL && data_size > 0);
+    uint32_t trailer = 0;
+    if (caps & DSHM_CAP_CRC) {
+        uint32_t crc = dshm_crc32c(0, &request_header, sizeof(request_header));
+        trailer = htonl(has_data ? dshm_crc32c(crc, data, data_size) : crc);
+    }
 
-    // Send the header
-    if (send(server_socket_fd, &request_header, sizeof(request_header), 0) != sizeof(request_header)) {
-        perror("send header");
-        close(server_socket_fd);
-        server_socket_fd = -1;
+    // Header, data and checksum leave in a single system call
+    struct iovec iov[3] = {
+        { &request_header, sizeof(request_header) },
+        { data, has_data ? data_size : 0 },
+        { &trailer, (caps & DSHM_CAP_CRC) ? sizeof(trailer) : 0 },
+    };
+    int rc = dshm_write_full(fd, iov, 3);
+    if (rc == -1) {
+        perror("send request");
         errno = ECONNRESET;
-        return -1;
     }
+    free(encoded);
+    return rc;
+}
 
-    // Send the data if there is any
-    if (data && data_size > 0) {
-        if (send(server_socket_fd, data, data_size, 0) != (ssize_t)data_size) {
-            perror("send data");
-            close(server_socket_fd);
-            server_socket_fd = -1;
-            errno = ECONNRESET;
-            return -1;
-        }
+// Receive one response. `requested` is the length asked for by a read, which a
+// zero-range reply stands for: *response_data is then NULL and *response_size
+// is that length. Returns -1 only when the connection is no longer usable
+// (including a checksum mismatch: errno is then EBADMSG; a connection the server
+// closed before answering gives ENOTCONN, and the request was not executed).
+static int recv_response(dshm_reader_t *conn, uint32_t caps, size_t requested, void **response_data, size_t *response_size,
+                         int *result) {
+    if (response_data != NULL) {
+        *response_data = NULL;
+        *response_size = 0;
     }
 
     // Receive the response header
     shm_response_t response_header;
-    if (recv(server_socket_fd, &response_header, sizeof(response_header), MSG_WAITALL) != sizeof(response_header)) {
+    ssize_t received = dshm_read_full(conn, &response_header, sizeof(response_header));
+    if (received == 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (received != sizeof(response_header)) {
         perror("recv response header");
-        close(server_socket_fd);
-        server_socket_fd = -1;
         errno = ECONNRESET;
         return -1;
     }
+    uint32_t crc = dshm_crc32c(0, &response_header, sizeof(response_header));
 
     // Convert from network to host byte order
     response_header.result = ntohl(response_header.result);
     response_header.error_code = ntohl(response_header.error_code);
     response_header.data_size = ntohl(response_header.data_size);
+    response_header.encoding = ntohl(response_header.encoding);
+    *result = response_header.result;
+
+    // A zero-range reply carries no bytes: the whole requested range reads as zeros
+    if (response_header.encoding == DSHM_ENC_ZERO && response_header.result >= 0 && response_data != NULL) {
+        *response_size = requested;
+    }
 
-    // If command is read data, receive the data as well
-    if (command == CMD_READ_DATA && response_header.data_size > 0) {
-        *response_size = response_header.data_size;
-        *response_data = malloc(response_header.data_size);
-        if (*response_data == NULL) {
+    // Receive the response payload, if the server sent one
+    void *payload = NULL;
+    if (response_header.data_size > 0) {
+        payload = malloc(response_header.data_size);
+        if (payload == NULL) {
             errno = ENOMEM;
             return -1;
         }
 
-        if (recv(server_socket_fd, *response_data, response_header.data_size, MSG_WAITALL) != (ssize_t)response_header.data_size) {
+        if (dshm_read_full(conn, payload, response_header.data_size) != (ssize_t)response_header.data_size) {
             perror("recv response data");
-            free(*response_data);
-            *response_data = NULL;
-            close(server_socket_fd);
-            server_socket_fd = -1;
+            free(payload);
             errno = ECONNRESET;
             return -1;
         }
-    } else {
-        *response_size = 0;
-        *response_data = NULL;
+        crc = dshm_crc32c(crc, payload, response_header.data_size);
+    }
+
+    // Nothing in a corrupted response can be trusted, not even the message boundaries
+    if (caps & DSHM_CAP_CRC) {
+        uint32_t trailer;
+        if (dshm_read_full(conn, &trailer, sizeof(trailer)) != sizeof(trailer)) {
+            perror("recv response checksum");
+            free(payload);
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (ntohl(trailer) != crc) {
+            free(payload);
+            errno = EBADMSG;
+            return -1;
+        }
+    }
+
+    if (payload != NULL) {
+        size_t payload_size = response_header.data_size;
+        if (response_header.encoding == DSHM_ENC_COMPRESSED) {
+            void *raw = dshm_decode_payload(payload, payload_size, &payload_size);
+            free(payload);
+            if (raw == NULL) {
+                // The stream is intact but the payload is unusable
+                *result = SHM_ERROR;
+                errno = EIO;
+                return 0;
+            }
+            payload = raw;
+        }
+
+        if (response_data != NULL) {
+            *response_data = payload;
+            *response_size = payload_size;
+        } else {
+            free(payload);
+        }
     }
 
     // Map server error codes to POSIX errno values
-    switch (response_header.error_code) {
+    switch (response_header.result) {
         case SHM_EINVAL:
             errno = EINVAL;
             break;
@@ -162,6 +384,22 @@ int send_request_to_server(uint32_t command, int shmid, int flags, uint32_t offs
         case SHM_ENOENT:
             errno = ENOENT;
             break;
+        case SHM_EMOVED:
+        case SHM_EAGAIN:
+            errno = EAGAIN;
+            break;
+        case SHM_EBADMSG:
+            errno = EBADMSG;
+            break;
+        case SHM_EEXIST:
+            errno = EEXIST;
+            break;
+        case SHM_ESHUTDOWN:
+            errno = ESHUTDOWN;
+            break;
+        case SHM_EXDEV:
+            errno = EXDEV;
+            break;
         default:
             if (response_header.result < 0) {
                 errno = EINVAL; // Default error
@@ -169,257 +407,1962 @@ int send_request_to_server(uint32_t command, int shmid, int flags, uint32_t offs
             break;
     }
 
-    return response_header.result;
+    return 0;
 }
 
-// Initialize the client library
-int distributed_shm_init(const char *server_host_param, int server_port_param) {
-    if (server_host_param) {
-        strncpy(server_host, server_host_param, sizeof(server_host) - 1);
-        server_host[sizeof(server_host) - 1] = '\0';
-    }
-    
-    if (server_port_param > 0 && server_port_param <= 65535) {
-        server_port = server_port_param;
+// Send a request to one cluster node and receive its response
+static int send_request_to_node(int node, uint32_t command, int shmid, int flags, uint32_t offset,
+                                void *data, size_t data_size, void **response_data, size_t *response_size) {
+    if (response_data != NULL) {
+        *response_data = NULL;
+        *response_size = 0;
     }
 
-    // Initialize the client segments array
-    memset(client_segments, 0, sizeof(client_segments));
-    
-    client_initialized = 1;
-    return 0;
-}
+    // A stopping server refuses new requests and closes idle connections; when it
+    // hands its socket over to a new process, a fresh connection reaches that one
+    int result = -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        // Connect to the node if not already connected
+        int reused = (node_conns[node] != NULL);
+        if (!reused && connect_to_server(node) == -1) {
+            errno = ECONNREFUSED;
+            return -1;
+        }
 
-// Cleanup the client library
-void distributed_shm_cleanup(void) {
-    // Detach from all attached segments
-    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
-        if (client_segments[i].attached && client_segments[i].local_addr) {
-            // We don't call shmdt here as it would try to lock the mutex again
-            // Instead, we just mark as detached and free local memory
-            if (client_segments[i].local_addr) {
-                munmap(client_segments[i].local_addr, client_segments[i].size);
-                client_segments[i].local_addr = NULL;
+        DSHM_TRACE_BEGIN(DSHM_TRACE_CLIENT_SEND, command, shmid);
+        int sent = send_request(node_conns[node]->fd, node_caps[node], command, shmid, flags, offset, data, data_size);
+        DSHM_TRACE_END(DSHM_TRACE_CLIENT_SEND, command, shmid);
+        int received = -1;
+        if (sent == 0) {
+            DSHM_TRACE_BEGIN(DSHM_TRACE_CLIENT_WAIT, command, shmid);
+            received = recv_response(node_conns[node], node_caps[node], data_size, response_data, response_size, &result);
+            DSHM_TRACE_END(DSHM_TRACE_CLIENT_WAIT, command, shmid);
+        }
+        if (received == -1) {
+            int saved_errno = errno;
+            close_node(node);
+            // Nothing was executed if the request or its answer never got through
+            if (reused && (sent == -1 || saved_errno == ENOTCONN)) {
+                continue;
             }
+            errno = saved_errno;
+            return -1;
+        }
+        if (result == SHM_EBADMSG) {
+            // The node could not trust our request and drops the connection
+            close_node(node);
+        } else if (result == SHM_ESHUTDOWN) {
+            close_node(node);
+            continue;
         }
+        break;
     }
 
-    // Close the server connection
-    if (server_socket_fd != -1) {
-        close(server_socket_fd);
-        server_socket_fd = -1;
-    }
-    
-    client_initialized = 0;
+    return result;
 }
 
-// POSIX-compatible shmget function
-int distributed_shmget(key_t key, size_t size, int shmflg) {
-    if (!client_initialized) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    pthread_mutex_lock(&client_mutex);
-
-    // Find an existing segment with this key or create a new one
-    // For distributed SHM, we'll use the key as the shmid
-    int shmid = (int)key;
-    
-    void *data = &size;
-    size_t data_size = sizeof(size_t);
-    void *response_data = NULL;
-    size_t response_size = 0;
-
-    int result = send_request_to_server(CMD_CREATE_SEGMENT, shmid, shmflg, 0, 
-                                       data, data_size, &response_data, &response_size);
-
-    if (response_data) {
-        free(response_data);
+// Switch to a new cluster map, dropping connections made under the old one
+static void adopt_cluster_map(const dshm_cluster_t *map) {
+    for (int i = 0; i < cluster.node_count; i++) {
+        close_node(i);
+        node_rtt_us[i] = 0;
     }
+    cluster = *map;
+    cluster_generation++;
+}
 
-    if (result < 0) {
-        pthread_mutex_unlock(&client_mutex);
-        return -1;
-    }
+// Fetch the cluster map from the first reachable node.
+// A standalone server returns an empty map, in which case the seed list stays in use.
+static int fetch_cluster_map(void) {
+    for (int i = 0; i < cluster.node_count; i++) {
+        void *response_data = NULL;
+        size_t response_size = 0;
+        int result = send_request_to_node(i, CMD_CLUSTER_MAP, 0, 0, 0, NULL, 0,
+                                          &response_data, &response_size);
+        if (result < 0) {
+            free(response_data);
+            continue;
+        }
 
-    // Store the segment info locally
-    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
-        if (client_segments[i].shmid == 0 || client_segments[i].shmid == shmid) {
-            client_segments[i].shmid = shmid;
-            client_segments[i].size = size;
-            client_segments[i].shmflg = shmflg;
-            if (client_segments[i].local_addr == NULL) {
-                // Create a local mapping area (though for distributed SHM, 
-                // we'll handle data transfer differently)
-                client_segments[i].local_addr = NULL; // We'll allocate on attach
+        if (response_size > 0) {
+            dshm_cluster_t *map = malloc(sizeof(dshm_cluster_t));
+            if (map != NULL && dshm_cluster_decode(map, response_data, response_size) == 0 &&
+                map->node_count > 0 && map->epoch >= cluster.epoch) {
+                adopt_cluster_map(map);
             }
-            break;
+            free(map);
         }
+        free(response_data);
+        return 0;
     }
-
-    pthread_mutex_unlock(&client_mutex);
-    return shmid;
+    return -1;
 }
 
-// POSIX-compatible shmat function
-void *distributed_shmat(int shmid, const void *shmaddr, int shmflg) {
-    if (!client_initialized || shmid < 0) {
+// Function to send a request to the node owning the segment and receive a response
+int send_request_to_server(uint32_t command, int shmid, int flags, uint32_t offset,
+                          void *data, size_t data_size, void **response_data, size_t *response_size) {
+    if (!client_initialized) {
         errno = EINVAL;
-        return (void*)-1;
+        return -1;
     }
 
-    pthread_mutex_lock(&client_mutex);
+    int result = -1;
+    DSHM_TRACE_BEGIN(DSHM_TRACE_CLIENT_REQUEST, command, shmid);
+    for (int attempt = 0; attempt < DSHM_ROUTE_RETRIES; attempt++) {
+        int node = dshm_cluster_owner(&cluster, shmid);
+        if (node < 0) {
+            errno = ECONNREFUSED;
+            result = -1;
+            break;
+        }
 
-    // Find the segment
-    int segment_idx = -1;
-    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
-        if (client_segments[i].shmid == shmid) {
-            segment_idx = i;
+        result = send_request_to_node(node, command, shmid, flags, offset,
+                                      data, data_size, response_data, response_size);
+        if (result == SHM_EMOVED) {
+            // Our map is stale: the segment now lives on another node
+            fetch_cluster_map();
+        } else if (result == SHM_EAGAIN) {
+            // The segment is being migrated right now, back off briefly
+            usleep(1000u << attempt);
+        } else {
             break;
         }
     }
 
-    if (segment_idx == -1) {
-        pthread_mutex_unlock(&client_mutex);
-        errno = EINVAL;
-        return (void*)-1;
-    }
+    DSHM_TRACE_END(DSHM_TRACE_CLIENT_REQUEST, command, shmid);
+    return result;
+}
 
-    // Send attach command to server
-    void *response_data = NULL;
-    size_t response_size = 0;
-    int result = send_request_to_server(CMD_ATTACH_SEGMENT, shmid, shmflg, 0, 
-                                       NULL, 0, &response_data, &response_size);
+// The nearest node holding a read replica of the segment, -1 if replica reads
+// are off or there is none (called with client_mutex held)
+static int replica_node(int shmid) {
+    if (replica_staleness_ms < 0 || cluster.replicas == 0) {
+        return -1;
+    }
 
-    if (response_data) {
-        free(response_data);
+    int nodes[DSHM_MAX_NODES];
+    int count = dshm_cluster_replicas(&cluster, shmid, nodes, DSHM_MAX_NODES);
+    int best = -1;
+    for (int i = 0; i < count; i++) {
+        int node = nodes[i];
+        // Nodes are measured when first connected to
+        if (node_rtt_us[node] == 0 && connect_to_server(node) == -1) {
+            continue;
+        }
+        if (node_rtt_us[node] != UINT_MAX && (best == -1 || node_rtt_us[node] < node_rtt_us[best])) {
+            best = node;
+        }
     }
+    return best;
+}
 
-    if (result < 0) {
-        pthread_mutex_unlock(&client_mutex);
-        return (void*)-1;
+// Send a read request (CMD_READ_DATA or CMD_CHECKSUM; len is the range length).
+// Read-only attachments are served by the nearest replica; if it lags too far
+// behind, lacks the segment or is unreachable, the owner answers instead.
+static int send_read_request(int shmid, int readonly, uint32_t command, uint32_t offset, size_t len,
+                             void **response_data, size_t *response_size) {
+    int node = readonly ? replica_node(shmid) : -1;
+    if (node >= 0) {
+        int result = send_request_to_node(node, command, shmid, replica_staleness_ms, offset,
+                                          NULL, len, response_data, response_size);
+        if (result >= 0) {
+            return result;
+        }
+        free(*response_data);
+        *response_data = NULL;
+        *response_size = 0;
     }
+    return send_request_to_server(command, shmid, 0, offset, NULL, len, response_data, response_size);
+}
 
-    // Update local segment state
-    client_segments[segment_idx].attached = 1;
-    client_segments[segment_idx].shmflg = shmflg;
+// Initialize the client library with a single server
+int distributed_shm_init(const char *server_host_param, int server_port_param) {
+    char seed[DSHM_NODE_HOST_MAX + 16];
 
-    // Allocate local memory for this segment if not already done
-    if (client_segments[segment_idx].local_addr == NULL) {
-        client_segments[segment_idx].local_addr = mmap(NULL, client_segments[segment_idx].size,
-                                                      PROT_READ | PROT_WRITE,
-                                                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-        if (client_segments[segment_idx].local_addr == MAP_FAILED) {
-            client_segments[segment_idx].local_addr = NULL;
-            // Detach from server since we couldn't allocate local memory
-            send_request_to_server(CMD_DETACH_SEGMENT, shmid, 0, 0, NULL, 0, NULL, NULL);
-            pthread_mutex_unlock(&client_mutex);
-            errno = ENOMEM;
-            return (void*)-1;
-        }
+    if (server_port_param <= 0 || server_port_param > 65535) {
+        server_port_param = DEFAULT_SERVER_PORT;
     }
+    snprintf(seed, sizeof(seed), "%s:%d",
+             server_host_param ? server_host_param : DEFAULT_SERVER_HOST, server_port_param);
 
-    pthread_mutex_unlock(&client_mutex);
-    
-    // Return the local address where data will be stored/expected
-    return client_segments[segment_idx].local_addr;
+    return distributed_shm_init_cluster(seed);
 }
 
-// POSIX-compatible shmdt function
-int distributed_shmdt(const void *shmaddr) {
-    if (!client_initialized || shmaddr == NULL) {
+// Set the shared key proven to servers started with -k
+int distributed_shm_set_key(const void *key, size_t len) {
+    if (key == NULL || len < DSHM_AUTH_KEY_MIN || len > DSHM_AUTH_KEY_MAX) {
         errno = EINVAL;
         return -1;
     }
-
     pthread_mutex_lock(&client_mutex);
+    memcpy(auth_key, key, len);
+    auth_key_len = (int)len;
+    auth_kind = DSHM_KEY_ANY;
+    pthread_mutex_unlock(&client_mutex);
+    return 0;
+}
 
-    // Find the segment associated with this address
-    int shmid = -1;
-    int segment_idx = -1;
-    
-    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
-        if (client_segments[i].local_addr == shmaddr && client_segments[i].attached) {
-            shmid = client_segments[i].shmid;
-            segment_idx = i;
-            break;
-        }
+// Initialize the client library with a list of cluster nodes ("host1:port1,host2:port2")
+int distributed_shm_init_cluster(const char *servers) {
+    dshm_cluster_t *seeds = malloc(sizeof(dshm_cluster_t));
+    if (seeds == NULL) {
+        errno = ENOMEM;
+        return -1;
     }
-
-    if (shmid == -1 || segment_idx == -1) {
-        pthread_mutex_unlock(&client_mutex);
+    if (servers == NULL || dshm_cluster_parse(seeds, servers, 0) == -1 || seeds->node_count == 0) {
+        free(seeds);
         errno = EINVAL;
         return -1;
     }
 
-    // Send detach command to server
-    void *response_data = NULL;
-    size_t response_size = 0;
-    int result = send_request_to_server(CMD_DETACH_SEGMENT, shmid, 0, 0, 
-                                       NULL, 0, &response_data, &response_size);
-
-    if (response_data) {
-        free(response_data);
+    // A key set by distributed_shm_set_key takes precedence over DSHM_KEY_FILE
+    const char *key_file = getenv("DSHM_KEY_FILE");
+    if (auth_key_len == 0 && key_file != NULL && key_file[0] != '\0') {
+        dshm_auth_entry_t entry;
+        if (dshm_auth_load_keys(key_file, &entry, 1) == -1) {
+            perror("distributed_shm: DSHM_KEY_FILE");
+            free(seeds);
+            return -1;
+        }
+        memcpy(auth_key, entry.key, (size_t)entry.len);
+        auth_key_len = entry.len;
+        auth_kind = entry.kind;
+        auth_uid = entry.uid;
+        auth_gid = entry.gid;
+        memset(&entry, 0, sizeof(entry));
     }
 
-    if (result < 0) {
-        pthread_mutex_unlock(&client_mutex);
-        return -1;
+    pthread_mutex_lock(&client_mutex);
+
+    for (int i = 0; i < DSHM_MAX_NODES; i++) {
+        node_conns[i] = NULL;
     }
+    cluster = *seeds;
+    free(seeds);
+
+    // Initialize the client segments array
+    memset(client_segments, 0, sizeof(client_segments));
+    
+    client_initialized = 1;
 
-    // Update local segment state
-    client_segments[segment_idx].attached = 0;
+    // Best effort: if no node answers, the seed list is used as the map
+    fetch_cluster_map();
 
     pthread_mutex_unlock(&client_mutex);
     return 0;
 }
 
-// POSIX-compatible shmctl function
-int distributed_shmctl(int shmid, int cmd, struct shmid_ds *buf) {
-    if (!client_initialized || shmid < 0) {
+// Publish a new cluster node list; the servers migrate segments to their new owners
+int distributed_shm_set_cluster(const char *servers) {
+    if (!client_initialized || servers == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    pthread_mutex_lock(&client_mutex);
-
-    // Prepare data for certain commands
-    void *data = NULL;
-    size_t data_size = 0;
-    
-    if (cmd == IPC_SET && buf != NULL) {
-        data = buf;
-        data_size = sizeof(struct shmid_ds);
-    } else if (cmd == IPC_STAT && buf != NULL) {
-        // We'll fill the buffer after getting response from server
-        data = buf;
-        data_size = sizeof(struct shmid_ds);
+    char *encoded = malloc(DSHM_CLUSTER_MAP_MAX);
+    dshm_cluster_t *map = malloc(sizeof(dshm_cluster_t));
+    if (encoded == NULL || map == NULL) {
+        free(encoded);
+        free(map);
+        errno = ENOMEM;
+        return -1;
     }
 
-    void *response_data = NULL;
-    size_t response_size = 0;
-    int result = send_request_to_server(CMD_SHMCTL, shmid, cmd, 0, 
-                                       data, data_size, &response_data, &response_size);
+    pthread_mutex_lock(&client_mutex);
+
+    // Start from the latest map so the new epoch supersedes it
+    fetch_cluster_map();
 
-    // For IPC_STAT, copy the returned data to the user buffer
-    if (cmd == IPC_STAT && buf != NULL && response_data != NULL && response_size >= sizeof(struct shmid_ds)) {
-        memcpy(buf, response_data, sizeof(struct shmid_ds));
+    int result = -1;
+    int len = -1;
+    if (dshm_cluster_parse(map, servers, cluster.epoch + 1) == 0 && map->node_count > 0) {
+        map->replicas = cluster.replicas;
+        len = dshm_cluster_encode(map, encoded, DSHM_CLUSTER_MAP_MAX);
     }
 
+    if (len > 0) {
+        // Nodes leaving the cluster must learn the map too, to hand their segments over
+        result = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < cluster.node_count; i++) {
+                if (send_request_to_node(i, CMD_SET_CLUSTER_MAP, 0, 0, 0, encoded, len, NULL, NULL) < 0) {
+                    result = -1;
+                }
+            }
+            if (pass == 0) {
+                adopt_cluster_map(map);
+            }
+        }
+    } else {
+        errno = EINVAL;
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    free(encoded);
+    free(map);
+    return result;
+}
+
+// Route reads of read-only attachments to replicas lagging at most max_staleness_ms
+int distributed_shm_set_replica_reads(int max_staleness_ms) {
+    pthread_mutex_lock(&client_mutex);
+    replica_staleness_ms = (max_staleness_ms < 0) ? -1 : max_staleness_ms;
+    pthread_mutex_unlock(&client_mutex);
+    return 0;
+}
+
+// Write the request trace of all threads (library built with -DDSHM_TRACE)
+int distributed_shm_trace_dump(const char *path) {
+    return dshm_trace_dump(path);
+}
+
+// Cleanup the client library
+void distributed_shm_cleanup(void) {
+    // Stop background reads before the mappings go away
+    stop_prefetch();
+
+    // Detach from all attached segments
+    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
+        free(client_segments[i].prefetch_pending);
+        free(client_segments[i].prefetch_ready);
+        client_segments[i].prefetch_pending = NULL;
+        client_segments[i].prefetch_ready = NULL;
+        if (client_segments[i].shadow) {
+            munmap(client_segments[i].shadow, client_segments[i].size);
+            client_segments[i].shadow = NULL;
+        }
+
+        if (client_segments[i].attached && client_segments[i].local_addr) {
+            // We don't call shmdt here as it would try to lock the mutex again
+            // Instead, we just mark as detached and free local memory
+            if (client_segments[i].local_addr) {
+                munmap(client_segments[i].local_addr, client_segments[i].size);
+                client_segments[i].local_addr = NULL;
+            }
+        }
+    }
+
+    // Close the connections to all cluster nodes
+    for (int i = 0; i < cluster.node_count; i++) {
+        close_node(i);
+    }
+
+    const char *trace_file = getenv("DSHM_TRACE_FILE");
+    if (trace_file != NULL && trace_file[0] != '\0' && dshm_trace_dump(trace_file) == -1) {
+        perror("distributed_shm: DSHM_TRACE_FILE");
+    }
+    
+    client_initialized = 0;
+}
+
+// Decode a segment size reply (two 32-bit words in network byte order)
+static int parse_size_reply(const void *data, size_t data_size, size_t *size) {
+    if (data == NULL || data_size != 2 * sizeof(uint32_t)) {
+        errno = EPROTO;
+        return -1;
+    }
+    uint32_t size_words[2];
+    memcpy(size_words, data, sizeof(size_words));
+    *size = (size_t)(((uint64_t)ntohl(size_words[0]) << 32) | ntohl(size_words[1]));
+    return 0;
+}
+
+// Decode an IPC_STAT reply (shm_stat_t, network byte order) into a shmid_ds
+static int parse_stat_reply(const void *data, size_t data_size, struct shmid_ds *buf) {
+    if (data == NULL || data_size != sizeof(shm_stat_t)) {
+        errno = EPROTO;
+        return -1;
+    }
+    shm_stat_t stat;
+    memcpy(&stat, data, sizeof(stat));
+    memset(buf, 0, sizeof(*buf));
+    buf->shm_segsz = (size_t)(((uint64_t)ntohl(stat.size_hi) << 32) | ntohl(stat.size_lo));
+    buf->shm_nattch = ntohl(stat.nattch);
+    buf->shm_perm.mode = (unsigned short)ntohl(stat.mode);
+    buf->shm_perm.__key = (key_t)(int32_t)ntohl((uint32_t)stat.key);
+    buf->shm_perm.uid = ntohl(stat.uid);
+    buf->shm_perm.gid = ntohl(stat.gid);
+    buf->shm_perm.cuid = ntohl(stat.cuid);
+    buf->shm_perm.cgid = ntohl(stat.cgid);
+    return 0;
+}
+
+// Drop the local copy of a detached segment
+static void release_local_copy(client_shm_segment_t *segment) {
+    if (segment->local_addr != NULL) {
+        munmap(segment->local_addr, segment->size);
+        segment->local_addr = NULL;
+    }
+    if (segment->shadow != NULL) {
+        munmap(segment->shadow, segment->size);
+        segment->shadow = NULL;
+    }
+    free(segment->prefetch_pending);
+    free(segment->prefetch_ready);
+    segment->prefetch_pending = NULL;
+    segment->prefetch_ready = NULL;
+}
+
+// Record a server segment in the local table (called with client_mutex held).
+// Returns the entry, or NULL when the table is full.
+static client_shm_segment_t *register_segment(int shmid, size_t size, int shmflg) {
+    client_shm_segment_t *free_entry = NULL;
+    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
+        client_shm_segment_t *segment = &client_segments[i];
+        if (segment->shmid == shmid) {
+            // A detached entry may be left over from a removed segment whose shmid was reused
+            if (!segment->attached && segment->size != size) {
+                release_local_copy(segment);
+                segment->size = size;
+                segment->shmflg = shmflg;
+            }
+            return segment;
+        }
+        if (segment->shmid == 0 && free_entry == NULL) {
+            free_entry = segment;
+        }
+    }
+    if (free_entry == NULL) {
+        errno = ENOSPC;
+        return NULL;
+    }
+    free_entry->shmid = shmid;
+    free_entry->size = size;
+    free_entry->shmflg = shmflg;
+    return free_entry;
+}
+
+// POSIX-compatible shmget function
+int distributed_shmget(key_t key, size_t size, int shmflg) {
+    if (!client_initialized) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    // One round trip: the node owning the key looks it up and, with IPC_CREAT
+    // (or for IPC_PRIVATE), creates the segment under a server-generated shmid
+    void *response_data = NULL;
+    size_t response_size = 0;
+    int shmid = send_request_to_server(CMD_CREATE_SEGMENT, (int)key, shmflg, 0,
+                                       &size, sizeof(size_t), &response_data, &response_size);
+
+    size_t segment_size = 0;
+    if (shmid < 0 || parse_size_reply(response_data, response_size, &segment_size) == -1 ||
+        register_segment(shmid, segment_size, shmflg) == NULL) {
+        free(response_data);
+        pthread_mutex_unlock(&client_mutex);
+        return -1;
+    }
+    free(response_data);
+
+    pthread_mutex_unlock(&client_mutex);
+    return shmid;
+}
+
+// Zero a range of a mapping, returning whole pages to the kernel
+// (the mappings are private and anonymous, so dropped pages read back as zeros)
+static void zero_mapping_range(char *base, size_t offset, size_t len) {
+    size_t first = (offset + DSHM_PAGE_SIZE - 1) / DSHM_PAGE_SIZE * DSHM_PAGE_SIZE;
+    size_t last = (offset + len) / DSHM_PAGE_SIZE * DSHM_PAGE_SIZE;
+
+    if (first < last && madvise(base + first, last - first, MADV_DONTNEED) == 0) {
+        memset(base + offset, 0, first - offset);
+        memset(base + last, 0, offset + len - last);
+    } else {
+        memset(base + offset, 0, len);
+    }
+}
+
+// Zero a range the server is known to hold as zeros
+static void zero_local_range(client_shm_segment_t *segment, size_t offset, size_t len) {
+    zero_mapping_range(segment->local_addr, offset, len);
+    if (segment->shadow != NULL) {
+        zero_mapping_range(segment->shadow, offset, len);
+    }
+}
+
+// Record data received from the server in the local mapping and its shadow copy
+static void store_range(client_shm_segment_t *segment, size_t offset, const void *data, size_t len) {
+    memcpy((char*)segment->local_addr + offset, data, len);
+    if (segment->shadow != NULL) {
+        memcpy((char*)segment->shadow + offset, data, len);
+    }
+}
+
+// Forget the shadow copy once it may disagree with the server; pushes then
+// send whole ranges until the next attach brings a fresh copy
+static void drop_shadow(client_shm_segment_t *segment) {
+    if (segment->shadow != NULL) {
+        munmap(segment->shadow, segment->size);
+        segment->shadow = NULL;
+    }
+}
+
+// Ask the server for the digest of a range (see dshm_range_digest())
+static int query_checksum(int shmid, int readonly, size_t offset, size_t len, uint32_t *digest) {
+    void *response_data = NULL;
+    size_t response_size = 0;
+
+    // The size field carries the range length, there is no payload
+    int result = send_read_request(shmid, readonly, CMD_CHECKSUM, (uint32_t)offset, len,
+                                   &response_data, &response_size);
+    if (result >= 0) {
+        if (response_data == NULL || response_size != sizeof(uint32_t)) {
+            result = -1;
+            errno = EPROTO;
+        } else {
+            uint32_t net;
+            memcpy(&net, response_data, sizeof(net));
+            *digest = ntohl(net);
+        }
+    }
+    free(response_data);
+    return result;
+}
+
+// Whether the server still holds what the shadow copy recorded for a range,
+// so that it need not be transferred again
+static int range_unchanged(client_shm_segment_t *segment, size_t offset, size_t len) {
+    if (segment->shadow == NULL || !checksum_supported || len < DSHM_CHECKSUM_MIN) {
+        return 0;
+    }
+
+    uint32_t digest = 0;
+    int result = query_checksum(segment->shmid, (segment->shmflg & SHM_RDONLY) != 0, offset, len, &digest);
+    if (result == SHM_EINVAL) {
+        // An older server without CMD_CHECKSUM
+        checksum_supported = 0;
+    }
+    return result >= 0 && digest == dshm_range_digest(segment->shadow, offset, len);
+}
+
+// Pull a byte range of a segment from the server into its local mapping.
+// Ranges the shadow copy still matches are restored from it instead.
+static int pull_range(client_shm_segment_t *segment, size_t offset, size_t len) {
+    // Unchanged data then costs a single small request however long the range
+    if (len > MAX_BUFFER_SIZE && range_unchanged(segment, offset, len)) {
+        memcpy((char*)segment->local_addr + offset, (char*)segment->shadow + offset, len);
+        return 0;
+    }
+
+    while (len > 0) {
+        size_t chunk = (len > MAX_BUFFER_SIZE) ? MAX_BUFFER_SIZE : len;
+        if (range_unchanged(segment, offset, chunk)) {
+            memcpy((char*)segment->local_addr + offset, (char*)segment->shadow + offset, chunk);
+            offset += chunk;
+            len -= chunk;
+            continue;
+        }
+
+        void *response_data = NULL;
+        size_t response_size = 0;
+
+        // For reads the size field carries the requested length, no payload is sent
+        int result = send_read_request(segment->shmid, (segment->shmflg & SHM_RDONLY) != 0, CMD_READ_DATA,
+                                       (uint32_t)offset, chunk, &response_data, &response_size);
+        if (result < 0 || response_size != chunk) {
+            free(response_data);
+            if (result >= 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+
+        if (response_data == NULL) {
+            // The server never wrote this range
+            zero_local_range(segment, offset, chunk);
+        } else {
+            store_range(segment, offset, response_data, chunk);
+            free(response_data);
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Changed runs looked up per MAX_BUFFER_SIZE window at a time
+#define DSHM_DIFF_MAX_RUNS 16
+
+// Send a byte range of a buffer to the server as is
+static int write_range(client_shm_segment_t *segment, const char *base, size_t offset, size_t len) {
+    while (len > 0) {
+        size_t chunk = (len > MAX_BUFFER_SIZE) ? MAX_BUFFER_SIZE : len;
+        int result = send_request_to_server(CMD_WRITE_DATA, segment->shmid, 0, (uint32_t)offset,
+                                            (char*)base + offset, chunk, NULL, NULL);
+        if (result < 0) {
+            return -1;
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Send a changed run from the shadow copy: whole pages of zeros are released
+// on the server instead of being written
+static int push_run(client_shm_segment_t *segment, size_t offset, size_t len) {
+    const char *shadow = segment->shadow;
+    size_t end = offset + len;
+
+    while (offset < end) {
+        size_t hole = end;
+        for (size_t page = (offset + DSHM_PAGE_SIZE - 1) / DSHM_PAGE_SIZE * DSHM_PAGE_SIZE;
+             page + DSHM_PAGE_SIZE <= end; page += DSHM_PAGE_SIZE) {
+            if (dshm_is_zero(shadow + page, DSHM_PAGE_SIZE)) {
+                hole = page;
+                break;
+            }
+        }
+        if (hole > offset) {
+            if (write_range(segment, shadow, offset, hole - offset) == -1) {
+                return -1;
+            }
+            offset = hole;
+            continue;
+        }
+
+        size_t hole_end = offset + DSHM_PAGE_SIZE;
+        while (hole_end + DSHM_PAGE_SIZE <= end && dshm_is_zero(shadow + hole_end, DSHM_PAGE_SIZE)) {
+            hole_end += DSHM_PAGE_SIZE;
+        }
+        // The size field carries the range length, there is no payload
+        if (send_request_to_server(CMD_PUNCH_HOLE, segment->shmid, 0, (uint32_t)offset,
+                                   NULL, hole_end - offset, NULL, NULL) < 0) {
+            return -1;
+        }
+        offset = hole_end;
+    }
+    return 0;
+}
+
+// Push the changes in a byte range of the local mapping to the server.
+// Only the bytes that differ from the shadow copy are sent; they are copied
+// into the shadow before sending, so writes made meanwhile stay pending.
+// Equal bytes between changes are never sent: the shadow may be behind the
+// server (other writers, server-side fill and copy), and they would undo that.
+static int push_range(client_shm_segment_t *segment, size_t offset, size_t len) {
+    if (segment->shadow == NULL) {
+        return write_range(segment, segment->local_addr, offset, len);
+    }
+
+    const char *local = segment->local_addr;
+    char *shadow = segment->shadow;
+    dshm_run_t runs[DSHM_DIFF_MAX_RUNS];
+    while (len > 0) {
+        size_t window = (len > MAX_BUFFER_SIZE) ? MAX_BUFFER_SIZE : len;
+        int count = dshm_diff_runs(local + offset, shadow + offset, window, 0,
+                                   runs, DSHM_DIFF_MAX_RUNS);
+        // The last run of a full list absorbed the remaining changes together with
+        // the equal bytes between them: the search resumes at its start instead
+        size_t done = window;
+        if (count == DSHM_DIFF_MAX_RUNS) {
+            count--;
+            done = runs[count].offset;
+        }
+        for (int i = 0; i < count; i++) {
+            size_t run_offset = offset + runs[i].offset;
+            memcpy(shadow + run_offset, local + run_offset, runs[i].len);
+            if (push_run(segment, run_offset, runs[i].len) == -1) {
+                drop_shadow(segment);
+                return -1;
+            }
+        }
+        offset += done;
+        len -= done;
+    }
+    return 0;
+}
+
+// Find the attached segment whose local mapping contains [addr, addr + len)
+static client_shm_segment_t *find_segment_by_addr(const void *addr, size_t len, size_t *offset) {
+    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
+        client_shm_segment_t *segment = &client_segments[i];
+        if (!segment->attached || segment->local_addr == NULL) {
+            continue;
+        }
+
+        const char *base = segment->local_addr;
+        if ((const char*)addr >= base && (const char*)addr < base + segment->size &&
+            len <= segment->size - (size_t)((const char*)addr - base)) {
+            *offset = (const char*)addr - base;
+            return segment;
+        }
+    }
+    return NULL;
+}
+
+// Page bitmap helpers
+static int test_page(const unsigned char *map, size_t page) {
+    return (map[page / 8] >> (page % 8)) & 1;
+}
+
+static void set_page(unsigned char *map, size_t page) {
+    map[page / 8] |= (unsigned char)(1u << (page % 8));
+}
+
+static void clear_page(unsigned char *map, size_t page) {
+    map[page / 8] &= (unsigned char)~(1u << (page % 8));
+}
+
+// Drop prefetch state for the pages overlapping a range, so that data still
+// in flight will not overwrite it and stale prefetched pages are not used
+static void forget_prefetch(client_shm_segment_t *segment, size_t offset, size_t len) {
+    if (segment->prefetch_pending == NULL || len == 0) {
+        return;
+    }
+    for (size_t page = offset / DSHM_PAGE_SIZE; page <= (offset + len - 1) / DSHM_PAGE_SIZE; page++) {
+        clear_page(segment->prefetch_pending, page);
+        clear_page(segment->prefetch_ready, page);
+    }
+    pthread_cond_broadcast(&prefetch_done);
+}
+
+// Copy prefetched data into the local mapping (called with client_mutex held).
+// Only pages still marked pending are written: anything synced or refreshed
+// since the request was queued keeps its newer contents.
+static void apply_prefetched(const prefetch_request_t *req, size_t offset, const void *data, size_t len) {
+    client_shm_segment_t *segment = &client_segments[req->segment_idx];
+    if (segment->shmid != req->shmid || !segment->attached || segment->prefetch_pending == NULL ||
+        offset + len > segment->size) {
+        return;
+    }
+
+    for (size_t pos = offset; pos < offset + len; ) {
+        size_t page = pos / DSHM_PAGE_SIZE;
+        size_t page_end = (page + 1) * DSHM_PAGE_SIZE;
+        size_t chunk = ((page_end < offset + len) ? page_end : offset + len) - pos;
+
+        if (test_page(segment->prefetch_pending, page)) {
+            if (data != NULL) {
+                store_range(segment, pos, (const char*)data + (pos - offset), chunk);
+            } else {
+                zero_local_range(segment, pos, chunk);
+            }
+            if (pos + chunk == page_end || pos + chunk == segment->size) {
+                clear_page(segment->prefetch_pending, page);
+                set_page(segment->prefetch_ready, page);
+            }
+        }
+        pos += chunk;
+    }
+    pthread_cond_broadcast(&prefetch_done);
+}
+
+// Fetch one queued range over the worker's connection, keeping up to
+// DSHM_PREFETCH_DEPTH reads in flight (called without client_mutex)
+static int prefetch_range(int node, const dshm_node_t *target, int flags, const prefetch_request_t *req) {
+    if (prefetch_conns[node] == NULL) {
+        prefetch_conns[node] = open_connection(target, &prefetch_caps[node]);
+        if (prefetch_conns[node] == NULL) {
+            return -1;
+        }
+    }
+    dshm_reader_t *conn = prefetch_conns[node];
+
+    size_t end = req->offset + req->len;
+    size_t next_send = req->offset;
+    size_t next_recv = req->offset;
+    int in_flight = 0;
+    int failed = 0;
+
+    while (next_recv < end) {
+        // Keep the pipeline full: requests are small, responses are read in order
+        while (in_flight < DSHM_PREFETCH_DEPTH && next_send < end && !failed) {
+            size_t chunk = (end - next_send > MAX_BUFFER_SIZE) ? MAX_BUFFER_SIZE : end - next_send;
+            if (send_request(conn->fd, prefetch_caps[node], CMD_READ_DATA, req->shmid, flags,
+                             (uint32_t)next_send, NULL, chunk) == -1) {
+                goto broken;
+            }
+            next_send += chunk;
+            in_flight++;
+        }
+        if (in_flight == 0) {
+            break;
+        }
+
+        size_t chunk = (end - next_recv > MAX_BUFFER_SIZE) ? MAX_BUFFER_SIZE : end - next_recv;
+        void *data = NULL;
+        size_t size = 0;
+        int result = -1;
+        if (recv_response(conn, prefetch_caps[node], chunk, &data, &size, &result) == -1) {
+            goto broken;
+        }
+        in_flight--;
+
+        if (result < 0 || size != chunk) {
+            failed = 1; // Drain the remaining responses but apply nothing more
+        } else {
+            pthread_mutex_lock(&client_mutex);
+            apply_prefetched(req, next_recv, data, chunk);
+            pthread_mutex_unlock(&client_mutex);
+        }
+        free(data);
+        next_recv += chunk;
+    }
+    return failed ? -1 : 0;
+
+broken:
+    close_connection(&prefetch_conns[node]);
+    return -1;
+}
+
+// Background prefetch worker
+static void *prefetch_worker(void *arg __attribute__((unused))) {
+    pthread_mutex_lock(&client_mutex);
+    while (!prefetch_stop) {
+        if (prefetch_count == 0) {
+            pthread_cond_wait(&prefetch_cond, &client_mutex);
+            continue;
+        }
+
+        prefetch_request_t req = prefetch_queue[prefetch_head];
+        prefetch_head = (prefetch_head + 1) % DSHM_PREFETCH_QUEUE;
+        prefetch_count--;
+
+        // Node indices are only meaningful for the map the sockets were opened under
+        if (prefetch_generation != cluster_generation) {
+            for (int i = 0; i < DSHM_MAX_NODES; i++) {
+                close_connection(&prefetch_conns[i]);
+            }
+            prefetch_generation = cluster_generation;
+        }
+
+        // Read-only attachments prefetch from a replica; what it cannot serve is read by refresh
+        client_shm_segment_t *segment = &client_segments[req.segment_idx];
+        int readonly = (segment->shmid == req.shmid && (segment->shmflg & SHM_RDONLY));
+        int node = readonly ? replica_node(req.shmid) : -1;
+        int flags = (node >= 0) ? replica_staleness_ms : 0;
+        if (node < 0) {
+            node = dshm_cluster_owner(&cluster, req.shmid);
+        }
+        dshm_node_t target;
+        if (node >= 0) {
+            target = cluster.nodes[node];
+        }
+        pthread_mutex_unlock(&client_mutex);
+
+        int result = (node >= 0) ? prefetch_range(node, &target, flags, &req) : -1;
+
+        pthread_mutex_lock(&client_mutex);
+        if (result == -1) {
+            // Whatever did not arrive will be read synchronously by refresh
+            client_shm_segment_t *segment = &client_segments[req.segment_idx];
+            if (segment->shmid == req.shmid && segment->prefetch_pending != NULL) {
+                for (size_t page = req.offset / DSHM_PAGE_SIZE;
+                     page <= (req.offset + req.len - 1) / DSHM_PAGE_SIZE; page++) {
+                    clear_page(segment->prefetch_pending, page);
+                }
+            }
+            pthread_cond_broadcast(&prefetch_done);
+        }
+    }
+    pthread_mutex_unlock(&client_mutex);
+    return NULL;
+}
+
+// Queue a background read of a range (called with client_mutex held)
+static int queue_prefetch(client_shm_segment_t *segment, size_t offset, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (prefetch_count == DSHM_PREFETCH_QUEUE) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t pages = (segment->size + DSHM_PAGE_SIZE - 1) / DSHM_PAGE_SIZE;
+    if (segment->prefetch_pending == NULL) {
+        segment->prefetch_pending = calloc((pages + 7) / 8, 1);
+        segment->prefetch_ready = calloc((pages + 7) / 8, 1);
+        if (segment->prefetch_pending == NULL || segment->prefetch_ready == NULL) {
+            free(segment->prefetch_pending);
+            free(segment->prefetch_ready);
+            segment->prefetch_pending = NULL;
+            segment->prefetch_ready = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    if (!prefetch_started) {
+        for (int i = 0; i < DSHM_MAX_NODES; i++) {
+            prefetch_conns[i] = NULL;
+        }
+        prefetch_generation = cluster_generation;
+        prefetch_stop = 0;
+        if (pthread_create(&prefetch_thread, NULL, prefetch_worker, NULL) != 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        prefetch_started = 1;
+    }
+
+    // Whole pages only; skip a leading run that is already in flight or prefetched
+    size_t first = offset / DSHM_PAGE_SIZE;
+    size_t last = (offset + len - 1) / DSHM_PAGE_SIZE;
+    while (first <= last && (test_page(segment->prefetch_pending, first) ||
+                             test_page(segment->prefetch_ready, first))) {
+        first++;
+    }
+    if (first > last) {
+        return 0;
+    }
+    for (size_t page = first; page <= last; page++) {
+        set_page(segment->prefetch_pending, page);
+    }
+
+    size_t start = first * DSHM_PAGE_SIZE;
+    size_t end = (last + 1) * DSHM_PAGE_SIZE;
+    if (end > segment->size) {
+        end = segment->size;
+    }
+
+    prefetch_request_t *req = &prefetch_queue[(prefetch_head + prefetch_count) % DSHM_PREFETCH_QUEUE];
+    req->segment_idx = (int)(segment - client_segments);
+    req->shmid = segment->shmid;
+    req->offset = start;
+    req->len = end - start;
+    prefetch_count++;
+    pthread_cond_signal(&prefetch_cond);
+    return 0;
+}
+
+// Sequential access detector: a refresh that continues where the previous one
+// ended grows a read-ahead window (doubling up to DSHM_READAHEAD_MAX). Only
+// read-only attachments read ahead: prefetched pages overwrite the mapping and
+// the shadow, which would lose unsynced writes of a writable attachment.
+static void note_refresh(client_shm_segment_t *segment, size_t offset, size_t len) {
+    size_t end = offset + len;
+
+    if (len > 0 && offset == segment->seq_next && (segment->shmflg & SHM_RDONLY)) {
+        size_t window = segment->seq_window ? segment->seq_window * 2 : 2 * len;
+        if (window > DSHM_READAHEAD_MAX) {
+            window = DSHM_READAHEAD_MAX;
+        }
+        segment->seq_window = window;
+
+        size_t start = (segment->seq_ahead > end) ? segment->seq_ahead : end;
+        size_t stop = (end + window < segment->size) ? end + window : segment->size;
+        if (start < stop && queue_prefetch(segment, start, stop - start) == 0) {
+            segment->seq_ahead = stop;
+        }
+    } else {
+        segment->seq_window = 0;
+        segment->seq_ahead = 0;
+    }
+    segment->seq_next = end;
+}
+
+// Pull the pages of a range that were not prefetched, consuming the ones that were
+static int pull_unprefetched(client_shm_segment_t *segment, size_t offset, size_t len) {
+    if (segment->prefetch_ready == NULL || len == 0) {
+        return pull_range(segment, offset, len);
+    }
+
+    size_t end = offset + len;
+    size_t run_start = offset;
+    size_t pos = offset;
+    while (pos < end) {
+        size_t page = pos / DSHM_PAGE_SIZE;
+        size_t page_end = (page + 1) * DSHM_PAGE_SIZE;
+        size_t next = (page_end < end) ? page_end : end;
+
+        if (test_page(segment->prefetch_ready, page)) {
+            clear_page(segment->prefetch_ready, page);
+            if (run_start < pos && pull_range(segment, run_start, pos - run_start) == -1) {
+                return -1;
+            }
+            run_start = next;
+        }
+        pos = next;
+    }
+    return (run_start < end) ? pull_range(segment, run_start, end - run_start) : 0;
+}
+
+// Wait until no page of the range has a background read in flight
+static int wait_prefetched(client_shm_segment_t *segment, size_t offset, size_t len) {
+    int shmid = segment->shmid;
+    for (;;) {
+        if (!segment->attached || segment->shmid != shmid) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (segment->prefetch_pending == NULL || len == 0) {
+            return 0;
+        }
+
+        int pending = 0;
+        for (size_t page = offset / DSHM_PAGE_SIZE; page <= (offset + len - 1) / DSHM_PAGE_SIZE; page++) {
+            if (test_page(segment->prefetch_pending, page)) {
+                pending = 1;
+                break;
+            }
+        }
+        if (!pending) {
+            return 0;
+        }
+        pthread_cond_wait(&prefetch_done, &client_mutex);
+    }
+}
+
+// Stop the prefetch worker and close its connections
+static void stop_prefetch(void) {
+    pthread_mutex_lock(&client_mutex);
+    if (!prefetch_started) {
+        pthread_mutex_unlock(&client_mutex);
+        return;
+    }
+    prefetch_stop = 1;
+    pthread_cond_broadcast(&prefetch_cond);
+    pthread_mutex_unlock(&client_mutex);
+
+    pthread_join(prefetch_thread, NULL);
+
+    pthread_mutex_lock(&client_mutex);
+    for (int i = 0; i < DSHM_MAX_NODES; i++) {
+        close_connection(&prefetch_conns[i]);
+    }
+    prefetch_head = 0;
+    prefetch_count = 0;
+    prefetch_started = 0;
+    pthread_mutex_unlock(&client_mutex);
+}
+
+// POSIX-compatible shmat function
+void *distributed_shmat(int shmid, const void *shmaddr, int shmflg) {
+    if (!client_initialized || shmid < 0) {
+        errno = EINVAL;
+        return (void*)-1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    // Find the segment
+    int segment_idx = -1;
+    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
+        if (client_segments[i].shmid == shmid) {
+            segment_idx = i;
+            break;
+        }
+    }
+
+    // A segment this process did not shmget: its size comes from the server
+    if (segment_idx == -1) {
+        struct shmid_ds stat;
+        void *stat_data = NULL;
+        size_t stat_size = 0;
+        int result = send_request_to_server(CMD_SHMCTL, shmid, IPC_STAT, 0, NULL, 0, &stat_data, &stat_size);
+        client_shm_segment_t *segment = NULL;
+        if (result >= 0 && parse_stat_reply(stat_data, stat_size, &stat) == 0) {
+            segment = register_segment(shmid, stat.shm_segsz, 0);
+        } else if (result < 0 && errno == ENOENT) {
+            errno = EINVAL;     // As shmat reports an unknown shmid
+        }
+        free(stat_data);
+        if (segment == NULL) {
+            pthread_mutex_unlock(&client_mutex);
+            return (void*)-1;
+        }
+        segment_idx = (int)(segment - client_segments);
+    }
+
+    // Send attach command to server
+    void *response_data = NULL;
+    size_t response_size = 0;
+    int result = send_request_to_server(CMD_ATTACH_SEGMENT, shmid, shmflg, 0, 
+                                       NULL, 0, &response_data, &response_size);
+
     if (response_data) {
         free(response_data);
     }
 
+    if (result < 0) {
+        pthread_mutex_unlock(&client_mutex);
+        return (void*)-1;
+    }
+
+    // Another shmat of a mapped segment shares the mapping: pulling it again would
+    // overwrite writes not synced yet. Only a writable attachment of a read-only
+    // mapping pulls it, to start the shadow copy.
+    client_shm_segment_t *attached = &client_segments[segment_idx];
+    int prev_attached = attached->attached;
+    int prev_shmflg = attached->shmflg;
+    attached->attached++;
+    if (prev_attached > 0 && !((prev_shmflg & SHM_RDONLY) && !(shmflg & SHM_RDONLY))) {
+        pthread_mutex_unlock(&client_mutex);
+        return attached->local_addr;
+    }
+    attached->shmflg = shmflg;
+
+    // Allocate local memory for this segment if not already done
+    if (client_segments[segment_idx].local_addr == NULL) {
+        client_segments[segment_idx].local_addr = mmap(NULL, client_segments[segment_idx].size,
+                                                      PROT_READ | PROT_WRITE,
+                                                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (client_segments[segment_idx].local_addr == MAP_FAILED) {
+            client_segments[segment_idx].local_addr = NULL;
+            client_segments[segment_idx].attached = 0;
+            // Detach from server since we couldn't allocate local memory
+            send_request_to_server(CMD_DETACH_SEGMENT, shmid, 0, 0, NULL, 0, NULL, NULL);
+            pthread_mutex_unlock(&client_mutex);
+            errno = ENOMEM;
+            return (void*)-1;
+        }
+    }
+
+    // Writable attachments keep a shadow copy to find local changes against
+    if (!(shmflg & SHM_RDONLY) && client_segments[segment_idx].shadow == NULL) {
+        void *shadow = mmap(NULL, client_segments[segment_idx].size, PROT_READ | PROT_WRITE,
+                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (shadow != MAP_FAILED) {
+            client_segments[segment_idx].shadow = shadow;
+        }
+    }
+
+    // Bring the local copy up to date with the server
+    forget_prefetch(&client_segments[segment_idx], 0, client_segments[segment_idx].size);
+    if (pull_range(&client_segments[segment_idx], 0, client_segments[segment_idx].size) == -1) {
+        int saved_errno = errno;
+        client_segments[segment_idx].attached = prev_attached;
+        client_segments[segment_idx].shmflg = prev_shmflg;
+        send_request_to_server(CMD_DETACH_SEGMENT, shmid, 0, 0, NULL, 0, NULL, NULL);
+        pthread_mutex_unlock(&client_mutex);
+        errno = saved_errno;
+        return (void*)-1;
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    
+    // Return the local address where data will be stored/expected
+    return client_segments[segment_idx].local_addr;
+}
+
+// POSIX-compatible shmdt function
+int distributed_shmdt(const void *shmaddr) {
+    if (!client_initialized || shmaddr == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    // Find the segment associated with this address
+    int shmid = -1;
+    int segment_idx = -1;
+    
+    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
+        if (client_segments[i].local_addr == shmaddr && client_segments[i].attached) {
+            shmid = client_segments[i].shmid;
+            segment_idx = i;
+            break;
+        }
+    }
+
+    if (shmid == -1 || segment_idx == -1) {
+        pthread_mutex_unlock(&client_mutex);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Write local changes back before detaching
+    if (!(client_segments[segment_idx].shmflg & SHM_RDONLY) &&
+        push_range(&client_segments[segment_idx], 0, client_segments[segment_idx].size) == -1) {
+        pthread_mutex_unlock(&client_mutex);
+        return -1;
+    }
+
+    // Send detach command to server
+    void *response_data = NULL;
+    size_t response_size = 0;
+    int result = send_request_to_server(CMD_DETACH_SEGMENT, shmid, 0, 0, 
+                                       NULL, 0, &response_data, &response_size);
+
+    if (response_data) {
+        free(response_data);
+    }
+
+    if (result < 0) {
+        pthread_mutex_unlock(&client_mutex);
+        return -1;
+    }
+
+    // The mapping stays until the last attachment is detached
+    if (--client_segments[segment_idx].attached == 0) {
+        forget_prefetch(&client_segments[segment_idx], 0, client_segments[segment_idx].size);
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    return 0;
+}
+
+// POSIX-compatible shmctl function
+int distributed_shmctl(int shmid, int cmd, struct shmid_ds *buf) {
+    if (!client_initialized || shmid < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    // Prepare data for certain commands
+    void *data = NULL;
+    size_t data_size = 0;
+    shm_stat_t set;
+    
+    if (cmd == IPC_SET && buf != NULL) {
+        // Only the owner and the permission bits are sent, in network byte order
+        memset(&set, 0, sizeof(set));
+        set.mode = htonl(buf->shm_perm.mode);
+        set.uid = htonl(buf->shm_perm.uid);
+        set.gid = htonl(buf->shm_perm.gid);
+        data = &set;
+        data_size = sizeof(set);
+    }
+
+    void *response_data = NULL;
+    size_t response_size = 0;
+    int result = send_request_to_server(CMD_SHMCTL, shmid, cmd, 0, 
+                                       data, data_size, &response_data, &response_size);
+
+    // For IPC_STAT, decode the returned data into the user buffer
+    if (cmd == IPC_STAT && buf != NULL && result >= 0 && parse_stat_reply(response_data, response_size, buf) == -1) {
+        result = -1;
+    }
+
+    if (response_data) {
+        free(response_data);
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    if (result < 0) {
+        return -1;
+    }
+    
+    return result;
+}
+
+// Write a range of an attached segment's local mapping back to the server
+int distributed_shm_sync(const void *addr, size_t len) {
+    if (!client_initialized || addr == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    size_t offset = 0;
+    client_shm_segment_t *segment = find_segment_by_addr(addr, len, &offset);
+    int result = -1;
+    if (segment == NULL) {
+        errno = EINVAL;
+    } else if (segment->shmflg & SHM_RDONLY) {
+        errno = EACCES;
+    } else {
+        forget_prefetch(segment, offset, len);
+        result = push_range(segment, offset, len);
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    return result;
+}
+
+// Re-read a range of an attached segment from the server into the local mapping
+int distributed_shm_refresh(const void *addr, size_t len) {
+    if (!client_initialized || addr == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    size_t offset = 0;
+    client_shm_segment_t *segment = find_segment_by_addr(addr, len, &offset);
+    int result = -1;
+    if (segment == NULL) {
+        errno = EINVAL;
+    } else if (wait_prefetched(segment, offset, len) == 0) {
+        // Reads already in flight are awaited rather than issued again
+        result = pull_unprefetched(segment, offset, len);
+        if (result == 0) {
+            note_refresh(segment, offset, len);
+        }
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    return result;
+}
+
+// Fetch a range of an attached segment in the background
+int distributed_shm_prefetch(const void *addr, size_t len) {
+    if (!client_initialized || addr == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    size_t offset = 0;
+    client_shm_segment_t *segment = find_segment_by_addr(addr, len, &offset);
+    int result = -1;
+    if (segment == NULL) {
+        errno = EINVAL;
+    } else {
+        result = queue_prefetch(segment, offset, len);
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    return result;
+}
+
+// Zero a range of an attached segment and release its pages on the server
+int distributed_shm_punch_hole(const void *addr, size_t len) {
+    if (!client_initialized || addr == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    size_t offset = 0;
+    client_shm_segment_t *segment = find_segment_by_addr(addr, len, &offset);
+    int result = -1;
+    if (segment == NULL) {
+        errno = EINVAL;
+    } else if (segment->shmflg & SHM_RDONLY) {
+        errno = EACCES;
+    } else {
+        // The size field carries the range length, there is no payload
+        result = send_request_to_server(CMD_PUNCH_HOLE, segment->shmid, 0, (uint32_t)offset,
+                                        NULL, len, NULL, NULL);
+        if (result >= 0) {
+            forget_prefetch(segment, offset, len);
+            zero_local_range(segment, offset, len);
+            result = 0;
+        } else {
+            result = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    return result;
+}
+
+// Bytes per fill or copy request: bounds how long the server holds its
+// segment table lock for one request
+#define DSHM_RANGE_OP_CHUNK (16u * 1024 * 1024)
+
+// Drop prefetched pages of attached mappings over a range the server changed
+// by itself, so that a later refresh fetches the new contents
+static void forget_server_change(int shmid, size_t offset, size_t len) {
+    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
+        client_shm_segment_t *segment = &client_segments[i];
+        if (segment->attached && segment->shmid == shmid && offset + len <= segment->size) {
+            forget_prefetch(segment, offset, len);
+        }
+    }
+}
+
+// Set a range of a segment to a byte value on the server
+int distributed_shm_fill(int shmid, size_t offset, int value, size_t len) {
+    if (!client_initialized || shmid < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    int result = 0;
+    for (size_t done = 0; done < len && result == 0; ) {
+        size_t chunk = (len - done > DSHM_RANGE_OP_CHUNK) ? DSHM_RANGE_OP_CHUNK : len - done;
+        // The size field carries the range length, there is no payload
+        if (send_request_to_server(CMD_FILL, shmid, (unsigned char)value, (uint32_t)(offset + done),
+                                   NULL, chunk, NULL, NULL) < 0) {
+            result = -1;
+        }
+        forget_server_change(shmid, offset + done, chunk);
+        done += chunk;
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    return result;
+}
+
+// Copy a range between segments on different nodes through this process
+static int copy_through_client(int dst_shmid, size_t dst_offset, int src_shmid, size_t src_offset, size_t len) {
+    while (len > 0) {
+        size_t chunk = (len > MAX_BUFFER_SIZE) ? MAX_BUFFER_SIZE : len;
+        void *response_data = NULL;
+        size_t response_size = 0;
+        int result = send_request_to_server(CMD_READ_DATA, src_shmid, 0, (uint32_t)src_offset,
+                                            NULL, chunk, &response_data, &response_size);
+        if (result < 0 || response_size != chunk) {
+            free(response_data);
+            if (result >= 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+
+        // A never-written source range stays unallocated at the destination too
+        if (response_data == NULL) {
+            result = send_request_to_server(CMD_PUNCH_HOLE, dst_shmid, 0, (uint32_t)dst_offset,
+                                            NULL, chunk, NULL, NULL);
+        } else {
+            result = send_request_to_server(CMD_WRITE_DATA, dst_shmid, 0, (uint32_t)dst_offset,
+                                            response_data, chunk, NULL, NULL);
+            free(response_data);
+        }
+        if (result < 0) {
+            return -1;
+        }
+        dst_offset += chunk;
+        src_offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Copy a range from one segment to another (or within one) on the server
+int distributed_shm_copy(int dst_shmid, size_t dst_offset, int src_shmid, size_t src_offset, size_t len) {
+    if (!client_initialized || dst_shmid < 0 || src_shmid < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    // Requests are split like memmove splits its work: a destination that
+    // overlaps the source from above is copied from the end
+    int backward = (dst_shmid == src_shmid && dst_offset > src_offset && dst_offset < src_offset + len);
+    int result = 0;
+    for (size_t done = 0; done < len && result == 0; ) {
+        size_t chunk = (len - done > DSHM_RANGE_OP_CHUNK) ? DSHM_RANGE_OP_CHUNK : len - done;
+        size_t skip = backward ? len - done - chunk : done;
+        shm_copy_t req;
+        req.src_shmid = (int32_t)htonl((uint32_t)src_shmid);
+        req.src_offset = htonl((uint32_t)(src_offset + skip));
+        req.len = htonl((uint32_t)chunk);
+
+        result = send_request_to_server(CMD_COPY, dst_shmid, 0, (uint32_t)(dst_offset + skip),
+                                        &req, sizeof(req), NULL, NULL);
+        if (result < 0 && errno == EXDEV) {
+            // The source lives on another node: the data has to pass through here
+            result = copy_through_client(dst_shmid, dst_offset + skip, src_shmid, src_offset + skip, chunk);
+        }
+        result = (result < 0) ? -1 : 0;
+        forget_server_change(dst_shmid, dst_offset + skip, chunk);
+        done += chunk;
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    return result;
+}
+
+// Attachment whose local mapping starts at shmaddr
+static client_shm_segment_t *find_attachment(const void *shmaddr) {
+    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
+        if (client_segments[i].attached && client_segments[i].local_addr == shmaddr) {
+            return &client_segments[i];
+        }
+    }
+    return NULL;
+}
+
+// Follow a new server-side size with the local mapping and its shadow copy
+// (called with client_mutex held). Both are private anonymous mappings, so
+// pages added by growing read as zeros, just as they do on the server.
+static int remap_local(client_shm_segment_t *segment, size_t size) {
+    size_t old_size = segment->size;
+    if (size == old_size) {
+        return 0;
+    }
+
+    // Background reads in flight may target pages that no longer exist
+    forget_prefetch(segment, 0, old_size);
+    free(segment->prefetch_pending);
+    free(segment->prefetch_ready);
+    segment->prefetch_pending = NULL;
+    segment->prefetch_ready = NULL;
+    segment->seq_next = 0;
+    segment->seq_window = 0;
+    segment->seq_ahead = 0;
+
+    void *local = mremap(segment->local_addr, old_size, size, MREMAP_MAYMOVE);
+    if (local == MAP_FAILED) {
+        errno = ENOMEM;
+        return -1;
+    }
+    segment->local_addr = local;
+    if (segment->shadow != NULL) {
+        void *shadow = mremap(segment->shadow, old_size, size, MREMAP_MAYMOVE);
+        if (shadow == MAP_FAILED) {
+            munmap(segment->shadow, old_size);
+            segment->shadow = NULL;
+        } else {
+            segment->shadow = shadow;
+        }
+    }
+    segment->size = size;
+
+    // The rest of the old last page now lies inside the segment
+    if (size > old_size) {
+        size_t page_end = (old_size + DSHM_PAGE_SIZE - 1) / DSHM_PAGE_SIZE * DSHM_PAGE_SIZE;
+        size_t tail = ((page_end < size) ? page_end : size) - old_size;
+        memset((char*)segment->local_addr + old_size, 0, tail);
+        if (segment->shadow != NULL) {
+            memset((char*)segment->shadow + old_size, 0, tail);
+        }
+    }
+    return 0;
+}
+
+// Resize an attached segment on the server and locally
+void *distributed_shm_resize(const void *shmaddr, size_t size) {
+    if (!client_initialized || shmaddr == NULL || size == 0) {
+        errno = EINVAL;
+        return (void*)-1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    client_shm_segment_t *segment = find_attachment(shmaddr);
+    void *result = (void*)-1;
+    if (segment == NULL) {
+        errno = EINVAL;
+    } else if (segment->shmflg & SHM_RDONLY) {
+        errno = EACCES;
+    } else {
+        uint32_t size_req[2] = { htonl((uint32_t)((uint64_t)size >> 32)), htonl((uint32_t)size) };
+        void *response_data = NULL;
+        size_t response_size = 0;
+        size_t new_size = 0;
+        if (send_request_to_server(CMD_RESIZE, segment->shmid, 0, 0, size_req, sizeof(size_req),
+                                   &response_data, &response_size) >= 0 &&
+            parse_size_reply(response_data, response_size, &new_size) == 0 &&
+            remap_local(segment, new_size) == 0) {
+            result = segment->local_addr;
+        }
+        free(response_data);
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    return result;
+}
+
+// Adopt the server's current size of an attached segment
+void *distributed_shm_remap(const void *shmaddr) {
+    if (!client_initialized || shmaddr == NULL) {
+        errno = EINVAL;
+        return (void*)-1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    client_shm_segment_t *segment = find_attachment(shmaddr);
+    void *result = (void*)-1;
+    if (segment == NULL) {
+        errno = EINVAL;
+    } else {
+        struct shmid_ds stat;
+        void *stat_data = NULL;
+        size_t stat_size = 0;
+        int status = send_request_to_server(CMD_SHMCTL, segment->shmid, IPC_STAT, 0, NULL, 0,
+                                            &stat_data, &stat_size);
+        if (status >= 0 && parse_stat_reply(stat_data, stat_size, &stat) == 0 &&
+            remap_local(segment, stat.shm_segsz) == 0) {
+            result = segment->local_addr;
+        }
+        free(stat_data);
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    return result;
+}
+
+// Digest of a range of a segment as stored on the server
+int distributed_shm_checksum(int shmid, size_t offset, size_t len, uint32_t *digest) {
+    if (!client_initialized || shmid < 0 || digest == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+    int result = query_checksum(shmid, 0, offset, len, digest);
+    pthread_mutex_unlock(&client_mutex);
+    return (result < 0) ? -1 : 0;
+}
+
+// Create a read-only, copy-on-write snapshot of a segment on the server
+int distributed_shm_snapshot(int shmid) {
+    if (!client_initialized || shmid < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+
+    void *response_data = NULL;
+    size_t response_size = 0;
+    int snapshot = send_request_to_server(CMD_SNAPSHOT, shmid, 0, 0, NULL, 0,
+                                          &response_data, &response_size);
+    size_t size = 0;
+    if (snapshot < 0 || parse_size_reply(response_data, response_size, &size) == -1) {
+        free(response_data);
+        pthread_mutex_unlock(&client_mutex);
+        return -1;
+    }
+    free(response_data);
+
+    // Register the snapshot so it can be attached like any other segment
+    if (register_segment(snapshot, size, SHM_RDONLY) == NULL) {
+        send_request_to_server(CMD_REMOVE_SEGMENT, snapshot, 0, 0, NULL, 0, NULL, NULL);
+        pthread_mutex_unlock(&client_mutex);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    pthread_mutex_unlock(&client_mutex);
+    return snapshot;
+}
+
+// Change feed subscription
+struct dshm_subscription {
+    int shmid;
+    int flags;
+    uint64_t next_seq;      // Next record to ask for
+    uint32_t log_id;        // Log the sequence numbers belong to (0 - not known yet)
+    dshm_reader_t *conn;    // Dedicated connection to the owning node
+    uint32_t caps;
+    int push;               // The server pushes changes of [offset, offset + len)
+    uint32_t offset;
+    uint32_t len;           // 0 - to the end of the segment
+    void **replies;         // Replies of the last batch, referenced by changes[].data
+    int reply_count;
+    dshm_change_t *changes;
+};
+
+#define DSHM_CHANGES_BATCH 256
+
+// Free the replies the previous batch of changes pointed into
+static void release_replies(dshm_subscription_t *sub) {
+    for (int i = 0; i < sub->reply_count; i++) {
+        free(sub->replies[i]);
+    }
+    sub->reply_count = 0;
+}
+
+static dshm_subscription_t *new_subscription(int shmid, int flags) {
+    if (!client_initialized || shmid < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    dshm_subscription_t *sub = calloc(1, sizeof(dshm_subscription_t));
+    if (sub == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    sub->changes = calloc(DSHM_CHANGES_BATCH, sizeof(dshm_change_t));
+    sub->replies = calloc(DSHM_CHANGES_BATCH, sizeof(void*));
+    if (sub->changes == NULL || sub->replies == NULL) {
+        free(sub->changes);
+        free(sub->replies);
+        free(sub);
+        errno = ENOMEM;
+        return NULL;
+    }
+    sub->shmid = shmid;
+    sub->flags = flags & DSHM_CHANGES_DATA;
+    sub->conn = NULL;
+    return sub;
+}
+
+// Subscribe to the change log of a segment
+dshm_subscription_t *distributed_shm_subscribe(int shmid, uint64_t from_seq, int flags) {
+    dshm_subscription_t *sub = new_subscription(shmid, flags);
+    if (sub == NULL) {
+        return NULL;
+    }
+    sub->next_seq = from_seq;
+
+    // "Only new changes" starts at the log position as of now, not at the first poll
+    if (from_seq == 0) {
+        const dshm_change_t *changes;
+        int lost;
+        if (distributed_shm_next_changes(sub, 0, &changes, &lost) == -1) {
+            int saved_errno = errno;
+            distributed_shm_unsubscribe(sub);
+            errno = saved_errno;
+            return NULL;
+        }
+    }
+    return sub;
+}
+
+// Open the subscription's connection to the node currently owning the segment
+static int subscription_connect(dshm_subscription_t *sub) {
+    pthread_mutex_lock(&client_mutex);
+    int node = dshm_cluster_owner(&cluster, sub->shmid);
+    dshm_node_t target;
+    if (node >= 0) {
+        target = cluster.nodes[node];
+    }
     pthread_mutex_unlock(&client_mutex);
+
+    if (node < 0) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    sub->conn = open_connection(&target, &sub->caps);
+    return (sub->conn != NULL) ? 0 : -1;
+}
+
+// Open the push connection and subscribe to the range on the owning node
+static int push_connect(dshm_subscription_t *sub) {
+    for (int attempt = 0; attempt < DSHM_ROUTE_RETRIES; attempt++) {
+        if (subscription_connect(sub) == -1) {
+            return -1;
+        }
+
+        int result = SHM_ERROR;
+        if (send_request(sub->conn->fd, sub->caps, CMD_SUBSCRIBE, sub->shmid, sub->flags, sub->offset,
+                         NULL, sub->len) == -1 ||
+            recv_response(sub->conn, sub->caps, 0, NULL, NULL, &result) == -1) {
+            int saved_errno = errno;
+            close_connection(&sub->conn);
+            errno = saved_errno;
+            return -1;
+        }
+        if (result == SHM_SUCCESS) {
+            return 0;
+        }
+
+        int saved_errno = errno;
+        close_connection(&sub->conn);
+        if (result == SHM_EMOVED) {
+            pthread_mutex_lock(&client_mutex);
+            fetch_cluster_map();
+            pthread_mutex_unlock(&client_mutex);
+        } else if (result == SHM_EAGAIN) {
+            usleep(1000u << attempt);
+        } else {
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+// Push subscription to a range of a segment
+dshm_subscription_t *distributed_shm_subscribe_range(int shmid, size_t offset, size_t len, int flags) {
+    if (offset > UINT32_MAX || len > UINT32_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    dshm_subscription_t *sub = new_subscription(shmid, flags);
+    if (sub == NULL) {
+        return NULL;
+    }
+    sub->push = 1;
+    sub->offset = (uint32_t)offset;
+    sub->len = (uint32_t)len;
+
+    if (push_connect(sub) == -1) {
+        int saved_errno = errno;
+        distributed_shm_unsubscribe(sub);
+        errno = saved_errno;
+        return NULL;
+    }
+    return sub;
+}
+
+// Decode the records of a CMD_GET_CHANGES-style reply into sub->changes[first...].
+// Returns the number of records or -1 (errno = EPROTO).
+static int parse_changes(dshm_subscription_t *sub, const void *reply, size_t reply_size, int first, int *lost) {
+    shm_changes_t head;
+    if (reply == NULL || reply_size < sizeof(head)) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(&head, reply, sizeof(head));
+    uint32_t count = ntohl(head.count);
+    uint32_t log_id = ntohl(head.log_id);
+    if (count > (uint32_t)(DSHM_CHANGES_BATCH - first)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    // Sequence numbers of another log (node restart or migration) mean nothing here
+    if (ntohl(head.lost) != 0 || (sub->log_id != 0 && sub->log_id != log_id)) {
+        *lost = 1;
+    }
+    sub->log_id = log_id;
+    sub->next_seq = ((uint64_t)ntohl(head.next_hi) << 32) | ntohl(head.next_lo);
+
+    const char *p = (const char*)reply + sizeof(head);
+    const char *end = (const char*)reply + reply_size;
+    for (uint32_t i = 0; i < count; i++) {
+        shm_change_t change;
+        if ((size_t)(end - p) < sizeof(change)) {
+            errno = EPROTO;
+            return -1;
+        }
+        memcpy(&change, p, sizeof(change));
+        p += sizeof(change);
+
+        uint32_t data_len = ntohl(change.data_len);
+        if ((size_t)(end - p) < data_len) {
+            errno = EPROTO;
+            return -1;
+        }
+        dshm_change_t *out = &sub->changes[first + i];
+        out->seq = ((uint64_t)ntohl(change.seq_hi) << 32) | ntohl(change.seq_lo);
+        out->shmid = (int32_t)ntohl(change.shmid);
+        out->type = (int)ntohl(change.type);
+        out->offset = ntohl(change.offset);
+        out->len = ntohl(change.len);
+        out->data = (data_len > 0) ? p : NULL;
+        p += data_len;
+    }
+    return (int)count;
+}
+
+// Collect pushed changes: wait up to timeout_ms for the first message, then
+// take the messages that have already arrived, up to one batch
+static int next_pushed(dshm_subscription_t *sub, int timeout_ms, int *lost) {
+    int count = 0;
+    while (count < DSHM_CHANGES_BATCH && sub->reply_count < DSHM_CHANGES_BATCH) {
+        if (sub->conn == NULL) {
+            // The stream broke or the segment moved: changes in between are unknown
+            if (push_connect(sub) == -1) {
+                return (count > 0) ? count : -1;
+            }
+            *lost = 1;
+        }
+
+        if (sub->conn->head == sub->conn->tail) {
+            if (count > 0 || *lost) {
+                break;
+            }
+            struct pollfd pfd = { .fd = sub->conn->fd, .events = POLLIN };
+            int ready = poll(&pfd, 1, timeout_ms);
+            if (ready == 0 || (ready == -1 && errno == EINTR)) {
+                break;
+            }
+            if (ready == -1) {
+                return -1;
+            }
+        }
+
+        void *reply = NULL;
+        size_t reply_size = 0;
+        int result = SHM_ERROR;
+        if (recv_response(sub->conn, sub->caps, 0, &reply, &reply_size, &result) == -1 || result < 0) {
+            free(reply);
+            close_connection(&sub->conn);
+            continue;
+        }
+        sub->replies[sub->reply_count++] = reply;
+        int n = parse_changes(sub, reply, reply_size, count, lost);
+        if (n == -1) {
+            close_connection(&sub->conn);
+            return -1;
+        }
+        count += n;
+    }
+    return count;
+}
+
+// Wait for the next batch of changes
+int distributed_shm_next_changes(dshm_subscription_t *sub, int timeout_ms,
+                                 const dshm_change_t **changes, int *lost) {
+    if (sub == NULL || changes == NULL || lost == NULL || timeout_ms < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    *changes = sub->changes;
+    *lost = 0;
+    release_replies(sub);
+    if (sub->push) {
+        return next_pushed(sub, timeout_ms, lost);
+    }
+
+    shm_changes_req_t req = {
+        .max_records = htonl(DSHM_CHANGES_BATCH),
+        .wait_ms = htonl((uint32_t)timeout_ms)
+    };
+    void *reply = NULL;
+    size_t reply_size = 0;
+    int result = -1;
+
+    for (int attempt = 0; attempt < DSHM_ROUTE_RETRIES; attempt++) {
+        if (sub->conn == NULL && subscription_connect(sub) == -1) {
+            return -1;
+        }
+
+        req.from_hi = htonl((uint32_t)(sub->next_seq >> 32));
+        req.from_lo = htonl((uint32_t)sub->next_seq);
+        if (send_request(sub->conn->fd, sub->caps, CMD_GET_CHANGES, sub->shmid, sub->flags, 0,
+                         &req, sizeof(req)) == -1 ||
+            recv_response(sub->conn, sub->caps, 0, &reply, &reply_size, &result) == -1) {
+            int saved_errno = errno;
+            close_connection(&sub->conn);
+            errno = saved_errno;
+            return -1;
+        }
+
+        if (result == SHM_EMOVED) {
+            // The segment now lives on another node with its own log
+            free(reply);
+            reply = NULL;
+            close_connection(&sub->conn);
+            pthread_mutex_lock(&client_mutex);
+            fetch_cluster_map();
+            pthread_mutex_unlock(&client_mutex);
+        } else if (result == SHM_EAGAIN) {
+            free(reply);
+            reply = NULL;
+            usleep(1000u << attempt);
+        } else {
+            break;
+        }
+    }
     if (result < 0) {
+        free(reply);
         return -1;
     }
-    
-    return result;
+
+    int count = parse_changes(sub, reply, reply_size, 0, lost);
+    if (count == -1) {
+        free(reply);
+        return -1;
+    }
+    sub->replies[sub->reply_count++] = reply;
+    return count;
+}
+
+uint64_t distributed_shm_subscription_seq(const dshm_subscription_t *sub) {
+    return sub->next_seq;
+}
+
+void distributed_shm_unsubscribe(dshm_subscription_t *sub) {
+    if (sub == NULL) {
+        return;
+    }
+    close_connection(&sub->conn);
+    release_replies(sub);
+    free(sub->replies);
+    free(sub->changes);
+    free(sub);
 }
 
 // Wrapper functions that match the standard POSIX names
+// (the preload library defines its own, routing by key)
+#ifndef DSHM_NO_POSIX_WRAPPERS
 int shmget(key_t key, size_t size, int shmflg) {
     return distributed_shmget(key, size, shmflg);
 }
@@ -435,3 +2378,4 @@ int shmdt(const void *shmaddr) {
 int shmctl(int shmid, int cmd, struct shmid_ds *buf) {
     return distributed_shmctl(shmid, cmd, buf);
 }
+#endif // DSHM_NO_POSIX_WRAPPERS
@@ -7,6 +7,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "distributed_shm.h"
+
 // Configuration for the client
 #define DEFAULT_SERVER_HOST "localhost"
 #define DEFAULT_SERVER_PORT 8080
@@ -16,8 +18,14 @@ typedef struct {
     int shmid;              // Shared memory ID from server
     void *local_addr;       // Local address where data is cached/stored
     size_t size;            // Size of the shared memory segment
-    int attached;           // Flag indicating if currently attached
+    int attached;           // shmat calls not yet matched by shmdt (they share the mapping)
     int shmflg;             // Flags used when creating/attaching
+    void *shadow;           // Contents last exchanged with the server (changes are found by diff)
+    unsigned char *prefetch_pending;  // Pages with a background read in flight
+    unsigned char *prefetch_ready;    // Prefetched pages not yet consumed by a refresh
+    size_t seq_next;        // Offset where a sequential reader is expected to continue
+    size_t seq_window;      // Current read-ahead window
+    size_t seq_ahead;       // End of the range already scheduled for read-ahead
 } client_shm_segment_t;
 
 // Maximum number of segments a client can handle
@@ -29,12 +37,128 @@ extern void *distributed_shmat(int shmid, const void *shmaddr, int shmflg);
 extern int distributed_shmdt(const void *shmaddr);
 extern int distributed_shmctl(int shmid, int cmd, struct shmid_ds *buf);
 
+// Data transfer between an attached segment's local mapping and the server.
+// shmat() fetches the segment and shmdt() writes it back; these move a
+// sub-range in between (bulk transfers are compressed when the server agrees).
+extern int distributed_shm_sync(const void *addr, size_t len);
+extern int distributed_shm_refresh(const void *addr, size_t len);
+
+// Zero a range of an attached segment; whole pages are released on the server
+// and later reads of never-written ranges transfer no data at all.
+extern int distributed_shm_punch_hole(const void *addr, size_t len);
+
+// Range operations executed by the server, so the data never crosses the
+// network: fill a range with a byte value (zero releases whole pages), or copy
+// a range between segments or within one (overlapping ranges are handled like
+// memmove). Copies between segments owned by different cluster nodes fall back
+// to moving the data through this process. Attached mappings keep their old
+// contents until distributed_shm_refresh() of the range.
+extern int distributed_shm_fill(int shmid, size_t offset, int value, size_t len);
+extern int distributed_shm_copy(int dst_shmid, size_t dst_offset, int src_shmid, size_t src_offset, size_t len);
+
+// Grow or shrink the segment attached at shmaddr (up to 4 GB). The server
+// resizes its memory without copying it, and the local mapping follows; it
+// moves only if it cannot be extended in place, so the returned address
+// replaces shmaddr. Returns (void*)-1 on error.
+extern void *distributed_shm_resize(const void *shmaddr, size_t size);
+
+// Bring an attachment to the segment's current size after another process
+// resized it (the change feed reports DSHM_CHANGE_RESIZE). Returns the possibly
+// moved address. Added ranges read as zeros until distributed_shm_refresh().
+extern void *distributed_shm_remap(const void *shmaddr);
+
+// Start fetching a range of an attached segment in the background. A later
+// distributed_shm_refresh() of the range uses the prefetched pages (or waits
+// for reads already in flight) instead of issuing blocking requests.
+// Sequential refreshes of read-only attachments trigger read-ahead automatically.
+extern int distributed_shm_prefetch(const void *addr, size_t len);
+
+// Digest of a range of a segment as the server holds it: CRC32C over the
+// CRC32C of each page-sized piece of the range (dshm_range_digest() computes
+// the same over local memory). Equal digests mean the range has not changed
+// and need not be read again; distributed_shm_refresh() and shmat() do this
+// check themselves for data they already hold.
+extern int distributed_shm_checksum(int shmid, size_t offset, size_t len, uint32_t *digest);
+
+// Create a point-in-time snapshot of a segment. Returns the shmid of a new
+// read-only segment that shares pages copy-on-write with the source, so it can
+// be attached with SHM_RDONLY and read while writers continue. Local changes
+// not yet pushed with distributed_shm_sync() are not part of the snapshot.
+extern int distributed_shm_snapshot(int shmid);
+
+// Change feed of a segment. A subscription owns its own connection and
+// long-polls the server's bounded change log, so waiting for changes never
+// blocks other requests of the process.
+typedef struct {
+    uint64_t seq;           // Position of the change in its server's log
+    int shmid;
+    int type;               // DSHM_CHANGE_WRITE, DSHM_CHANGE_PUNCH, DSHM_CHANGE_REMOVE or
+                            // DSHM_CHANGE_RESIZE (offset is then the new size)
+    size_t offset;
+    size_t len;
+    const void *data;       // Current contents of the range (DSHM_CHANGES_DATA), else NULL
+} dshm_change_t;
+
+typedef struct dshm_subscription dshm_subscription_t;
+
+// Subscribe to changes of a segment starting at from_seq (0 - only new changes).
+// flags: DSHM_CHANGES_DATA to receive the data of changed ranges.
+extern dshm_subscription_t *distributed_shm_subscribe(int shmid, uint64_t from_seq, int flags);
+
+// Push subscription to [offset, offset + len) of a segment (len 0 - to the end).
+// The server sends each change overlapping the range once it is made, so many
+// readers of one segment cost a single copy of the data on the server instead of
+// a read request each. Records cover the whole changed range, which may extend
+// past the subscribed one. A reader that falls behind gets *lost instead of the
+// changes it could not take in time. Read with distributed_shm_next_changes().
+extern dshm_subscription_t *distributed_shm_subscribe_range(int shmid, size_t offset, size_t len, int flags);
+
+// Wait up to timeout_ms for changes. Returns the number of records stored in
+// *changes (valid until the next call), 0 on timeout, -1 on error. *lost is set
+// when records were dropped from the log or the segment moved to another server:
+// the caller should then re-read the whole segment.
+extern int distributed_shm_next_changes(dshm_subscription_t *sub, int timeout_ms,
+                                        const dshm_change_t **changes, int *lost);
+
+// Sequence number the subscription continues from (to resume it later)
+extern uint64_t distributed_shm_subscription_seq(const dshm_subscription_t *sub);
+
+extern void distributed_shm_unsubscribe(dshm_subscription_t *sub);
+
 // Client initialization and cleanup functions
 extern int distributed_shm_init(const char *server_host, int server_port);
+extern int distributed_shm_init_cluster(const char *servers);
 extern void distributed_shm_cleanup(void);
 
+// Key for servers started with -k (16 to 256 bytes), set before
+// distributed_shm_init. Without it the key is read from the file named by
+// DSHM_KEY_FILE: a bare key, "uid:gid key" or "node key". Every connection
+// proves the key once when it is opened and checks the server's proof. The
+// server accepts the key only for the uid it was issued to (the process's
+// effective uid for a bare key or this call, 0 for a node key) and enforces
+// segment permissions for that uid and the gid from its key file.
+extern int distributed_shm_set_key(const void *key, size_t len);
+
+// Cluster management: publish a new node list ("host1:port1,host2:port2").
+// Segments are routed to nodes by consistent hashing of the shmid, and
+// servers migrate segments whose owner changed in the background.
+extern int distributed_shm_set_cluster(const char *servers);
+
+// Read replicas: servers started with -r keep read-only copies of each segment
+// on the next nodes of the ring. Reads of read-only attachments (shmat with
+// SHM_RDONLY) go to the nearest replica if it lags at most max_staleness_ms
+// behind the owner (0 - any lag), otherwise to the owner. A negative value
+// sends all reads to the owner, which is also the default.
+extern int distributed_shm_set_replica_reads(int max_staleness_ms);
+
+// Request tracing: a library built with -DDSHM_TRACE (make trace) records the
+// stages of each request in per-thread ring buffers. This writes them to a file
+// for dshm_trace2json; distributed_shm_cleanup does the same when DSHM_TRACE_FILE
+// is set. Returns the number of events, or -1 (errno ENOSYS without tracing).
+extern int distributed_shm_trace_dump(const char *path);
+
 // Internal functions (not part of public API)
-extern int connect_to_server(void);
+extern int connect_to_server(int node);
 extern int send_request_to_server(uint32_t command, int shmid, int flags, uint32_t offset, 
                                   void *data, size_t data_size, void **response_data, size_t *response_size);
 
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "distributed_shm_cluster.h"
+
+// Финализатор MurmurHash3 - хорошо перемешивает последовательные shmid
+static uint32_t mix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+// Обращение mix32: сервер подбирает shmid по нужной позиции на кольце
+static uint32_t unmix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x7ed1b41dU;       // Обратный к 0xc2b2ae35 по модулю 2^32
+    h ^= (h >> 13) ^ (h >> 26);
+    h *= 0xa5cb9243U;       // Обратный к 0x85ebca6b
+    h ^= h >> 16;
+    return h;
+}
+
+// FNV-1a для имени виртуального узла
+static uint32_t hash_string(const char *s) {
+    uint32_t h = 2166136261U;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619U;
+    }
+    return mix32(h);
+}
+
+static int compare_vnodes(const void *a, const void *b) {
+    const dshm_vnode_t *va = a;
+    const dshm_vnode_t *vb = b;
+    if (va->hash != vb->hash) {
+        return (va->hash < vb->hash) ? -1 : 1;
+    }
+    return (va->node < vb->node) ? -1 : (va->node > vb->node);
+}
+
+// Построение кольца по списку узлов
+static void build_ring(dshm_cluster_t *cluster) {
+    char name[DSHM_NODE_HOST_MAX + 32];
+
+    cluster->vnode_count = 0;
+    for (int n = 0; n < cluster->node_count; n++) {
+        for (int v = 0; v < DSHM_VNODES_PER_NODE; v++) {
+            snprintf(name, sizeof(name), "%s:%d#%d",
+                     cluster->nodes[n].host, cluster->nodes[n].port, v);
+            cluster->ring[cluster->vnode_count].hash = hash_string(name);
+            cluster->ring[cluster->vnode_count].node = n;
+            cluster->vnode_count++;
+        }
+    }
+    qsort(cluster->ring, cluster->vnode_count, sizeof(dshm_vnode_t), compare_vnodes);
+}
+
+int dshm_cluster_parse(dshm_cluster_t *cluster, const char *nodes, uint32_t epoch) {
+    memset(cluster, 0, sizeof(*cluster));
+    cluster->epoch = epoch;
+
+    const char *p = nodes;
+    while (p != NULL && *p != '\0') {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        const char *colon = memrchr(p, ':', len);
+
+        if (len > 0) {
+            if (colon == NULL || cluster->node_count >= DSHM_MAX_NODES ||
+                (size_t)(colon - p) >= DSHM_NODE_HOST_MAX) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            dshm_node_t *node = &cluster->nodes[cluster->node_count];
+            memcpy(node->host, p, colon - p);
+            node->host[colon - p] = '\0';
+            node->port = atoi(colon + 1);
+            if (node->host[0] == '\0' || node->port <= 0 || node->port > 65535) {
+                errno = EINVAL;
+                return -1;
+            }
+            cluster->node_count++;
+        }
+
+        p = end ? end + 1 : NULL;
+    }
+
+    build_ring(cluster);
+    return 0;
+}
+
+int dshm_cluster_encode(const dshm_cluster_t *cluster, char *buf, size_t buf_size) {
+    int len = (cluster->replicas > 0)
+              ? snprintf(buf, buf_size, "%u/%d ", cluster->epoch, cluster->replicas)
+              : snprintf(buf, buf_size, "%u ", cluster->epoch);
+    if (len < 0 || (size_t)len >= buf_size) {
+        return -1;
+    }
+
+    for (int i = 0; i < cluster->node_count; i++) {
+        int n = snprintf(buf + len, buf_size - len, "%s%s:%d", (i > 0) ? "," : "",
+                         cluster->nodes[i].host, cluster->nodes[i].port);
+        if (n < 0 || (size_t)(len + n) >= buf_size) {
+            return -1;
+        }
+        len += n;
+    }
+    return len;
+}
+
+int dshm_cluster_decode(dshm_cluster_t *cluster, const char *buf, size_t len) {
+    char text[DSHM_CLUSTER_MAP_MAX];
+    if (len >= sizeof(text)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(text, buf, len);
+    text[len] = '\0';
+
+    char *nodes = NULL;
+    unsigned long epoch = strtoul(text, &nodes, 10);
+    long replicas = 0;
+    if (nodes != text && *nodes == '/') {
+        char *start = nodes + 1;
+        replicas = strtol(start, &nodes, 10);
+        if (nodes == start || replicas < 0 || replicas >= DSHM_MAX_NODES) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (nodes == text || (*nodes != ' ' && *nodes != '\0')) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (*nodes == ' ') {
+        nodes++;
+    }
+    if (dshm_cluster_parse(cluster, nodes, (uint32_t)epoch) == -1) {
+        return -1;
+    }
+    cluster->replicas = (int)replicas;
+    return 0;
+}
+
+// Позиция на кольце первого виртуального узла с хешем >= конца корзины shmid (по кругу)
+static int ring_position(const dshm_cluster_t *cluster, int shmid) {
+    uint32_t h = mix32((uint32_t)shmid) | (DSHM_BUCKET_SLOTS - 1);
+    int lo = 0, hi = cluster->vnode_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cluster->ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo == cluster->vnode_count) ? 0 : lo;
+}
+
+int dshm_cluster_owner(const dshm_cluster_t *cluster, int shmid) {
+    if (cluster->vnode_count == 0) {
+        return -1;
+    }
+    return (int)cluster->ring[ring_position(cluster, shmid)].node;
+}
+
+int dshm_cluster_replicas(const dshm_cluster_t *cluster, int shmid, int *nodes, int max) {
+    if (cluster->vnode_count == 0) {
+        return 0;
+    }
+    if (max > cluster->replicas) {
+        max = cluster->replicas;
+    }
+
+    int pos = ring_position(cluster, shmid);
+    int owner = (int)cluster->ring[pos].node;
+    int count = 0;
+    for (int step = 1; step < cluster->vnode_count && count < max; step++) {
+        int node = (int)cluster->ring[(pos + step) % cluster->vnode_count].node;
+        int seen = (node == owner);
+        for (int i = 0; i < count && !seen; i++) {
+            seen = (nodes[i] == node);
+        }
+        if (!seen) {
+            nodes[count++] = node;
+        }
+    }
+    return count;
+}
+
+int dshm_cluster_bucket_id(uint32_t key, unsigned slot) {
+    uint32_t id = unmix32((mix32(key) & ~(uint32_t)(DSHM_BUCKET_SLOTS - 1)) | slot);
+    return (id > 0 && id <= INT32_MAX) ? (int)id : -1;
+}
+
+int dshm_cluster_find(const dshm_cluster_t *cluster, const char *host, int port) {
+    for (int i = 0; i < cluster->node_count; i++) {
+        if (cluster->nodes[i].port == port && strcmp(cluster->nodes[i].host, host) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
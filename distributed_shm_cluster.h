@@ -0,0 +1,65 @@
+#ifndef DISTRIBUTED_SHM_CLUSTER_H
+#define DISTRIBUTED_SHM_CLUSTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Ограничения карты кластера
+#define DSHM_MAX_NODES 64
+#define DSHM_VNODES_PER_NODE 64
+#define DSHM_NODE_HOST_MAX 256
+#define DSHM_CLUSTER_MAP_MAX (DSHM_MAX_NODES * (DSHM_NODE_HOST_MAX + 8) + 32)
+
+// Узел кластера
+typedef struct {
+    char host[DSHM_NODE_HOST_MAX];  // Имя или адрес узла
+    int port;                       // Порт узла
+} dshm_node_t;
+
+// Виртуальный узел на кольце консистентного хеширования
+typedef struct {
+    uint32_t hash;          // Позиция на кольце
+    uint32_t node;          // Индекс узла в карте
+} dshm_vnode_t;
+
+// Карта кластера: список узлов и кольцо консистентного хеширования
+typedef struct {
+    uint32_t epoch;         // Версия карты (растет при каждом изменении)
+    int replicas;           // Копий каждого сегмента для чтения на других узлах
+    int node_count;         // Количество узлов
+    dshm_node_t nodes[DSHM_MAX_NODES];
+    int vnode_count;        // Количество виртуальных узлов на кольце
+    dshm_vnode_t ring[DSHM_MAX_NODES * DSHM_VNODES_PER_NODE];
+} dshm_cluster_t;
+
+// Разбор списка узлов вида "host1:port1,host2:port2"
+int dshm_cluster_parse(dshm_cluster_t *cluster, const char *nodes, uint32_t epoch);
+
+// Сериализация карты в текст "<epoch> host1:port1,host2:port2"
+// (при наличии копий для чтения - "<epoch>/<replicas> ...")
+int dshm_cluster_encode(const dshm_cluster_t *cluster, char *buf, size_t buf_size);
+
+// Разбор сериализованной карты
+int dshm_cluster_decode(dshm_cluster_t *cluster, const char *buf, size_t len);
+
+// Индекс узла-владельца сегмента или -1, если карта пуста.
+// Владелец определяется корзиной - старшими битами хеша shmid, поэтому все
+// идентификаторы одной корзины при любой карте принадлежат одному узлу.
+int dshm_cluster_owner(const dshm_cluster_t *cluster, int shmid);
+
+// Узлы, хранящие копии сегмента для чтения: следующие за владельцем на кольце
+// различные узлы, не больше cluster->replicas и max. Возвращает их число.
+int dshm_cluster_replicas(const dshm_cluster_t *cluster, int shmid, int *nodes, int max);
+
+// Число идентификаторов в корзине
+#define DSHM_BUCKET_SLOTS 256
+
+// Идентификатор номер slot (0..DSHM_BUCKET_SLOTS-1) из корзины, в которую попадает key.
+// Сегмент с таким shmid живет на том же узле, что и запись его ключа в индексе.
+// Возвращает -1, если идентификатор не является положительным int.
+int dshm_cluster_bucket_id(uint32_t key, unsigned slot);
+
+// Поиск узла в карте по адресу, -1 если не найден
+int dshm_cluster_find(const dshm_cluster_t *cluster, const char *host, int port);
+
+#endif // DISTRIBUTED_SHM_CLUSTER_H
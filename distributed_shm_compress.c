@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "distributed_shm_compress.h"
+
+// Типы токенов сжатого потока
+#define TOK_ZERO    0   // Серия нулевых байт: длина
+#define TOK_RUN     1   // Серия одинаковых байт: длина, байт
+#define TOK_LITERAL 2   // Литералы: длина, байты
+#define TOK_MATCH   3   // Совпадение с предыдущими данными: длина, расстояние
+
+#define HASH_BITS 12
+#define MIN_RUN 8
+#define MIN_MATCH 6
+
+// Буфер записи сжатого потока
+typedef struct {
+    uint8_t *buf;
+    size_t pos;
+    size_t cap;
+    int overflow;
+} writer_t;
+
+static void put_byte(writer_t *w, uint8_t b) {
+    if (w->pos >= w->cap) {
+        w->overflow = 1;
+        return;
+    }
+    w->buf[w->pos++] = b;
+}
+
+static void put_varint(writer_t *w, uint64_t v) {
+    while (v >= 0x80) {
+        put_byte(w, (uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    put_byte(w, (uint8_t)v);
+}
+
+static void put_bytes(writer_t *w, const uint8_t *p, size_t len) {
+    if (w->cap - w->pos < len) {
+        w->overflow = 1;
+        return;
+    }
+    memcpy(w->buf + w->pos, p, len);
+    w->pos += len;
+}
+
+static void flush_literals(writer_t *w, const uint8_t *src, size_t start, size_t end) {
+    if (end > start) {
+        put_byte(w, TOK_LITERAL);
+        put_varint(w, end - start);
+        put_bytes(w, src + start, end - start);
+    }
+}
+
+// Длина серии одинаковых байт, начиная с позиции i (сравнение словами по 8 байт)
+static size_t run_length(const uint8_t *src, size_t i, size_t n) {
+    uint64_t pattern = 0x0101010101010101ULL * src[i];
+    size_t k = i;
+    while (k + 8 <= n) {
+        uint64_t word;
+        memcpy(&word, src + k, sizeof(word));
+        if (word != pattern) {
+            break;
+        }
+        k += 8;
+    }
+    while (k < n && src[k] == src[i]) {
+        k++;
+    }
+    return k - i;
+}
+
+size_t dshm_compress(const void *src_data, size_t src_len, void *dst, size_t dst_cap) {
+    const uint8_t *src = src_data;
+    writer_t w = { dst, 0, dst_cap, 0 };
+    uint32_t table[1 << HASH_BITS];     // Позиции четырехбайтовых последовательностей (+1)
+    size_t literal_start = 0;
+    size_t i = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (i < src_len && !w.overflow) {
+        // Серии нулей и повторяющихся значений
+        size_t run = run_length(src, i, src_len);
+        if (run >= MIN_RUN) {
+            flush_literals(&w, src, literal_start, i);
+            put_byte(&w, src[i] == 0 ? TOK_ZERO : TOK_RUN);
+            put_varint(&w, run);
+            if (src[i] != 0) {
+                put_byte(&w, src[i]);
+            }
+            i += run;
+            literal_start = i;
+            continue;
+        }
+
+        // Поиск совпадения по хешу четырех байт
+        if (i + 4 <= src_len) {
+            uint32_t seq;
+            memcpy(&seq, src + i, sizeof(seq));
+            uint32_t h = (seq * 2654435761U) >> (32 - HASH_BITS);
+            uint32_t candidate = table[h];
+            table[h] = (uint32_t)i + 1;
+
+            if (candidate != 0) {
+                size_t c = candidate - 1;
+                size_t len = 0;
+                while (i + len < src_len && src[c + len] == src[i + len]) {
+                    len++;
+                }
+                if (len >= MIN_MATCH) {
+                    flush_literals(&w, src, literal_start, i);
+                    put_byte(&w, TOK_MATCH);
+                    put_varint(&w, len);
+                    put_varint(&w, i - c);
+                    i += len;
+                    literal_start = i;
+                    continue;
+                }
+            }
+        }
+
+        i++;
+    }
+
+    flush_literals(&w, src, literal_start, src_len);
+    return w.overflow ? 0 : w.pos;
+}
+
+// Чтение varint с проверкой границ
+static int get_varint(const uint8_t *src, size_t len, size_t *pos, uint64_t *value) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*pos >= len) {
+            return -1;
+        }
+        uint8_t b = src[(*pos)++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int dshm_decompress(const void *src_data, size_t src_len, void *dst_data, size_t dst_len) {
+    const uint8_t *src = src_data;
+    uint8_t *dst = dst_data;
+    size_t in = 0, out = 0;
+
+    while (in < src_len) {
+        uint8_t token = src[in++];
+        uint64_t len;
+        if (get_varint(src, src_len, &in, &len) == -1 || len > dst_len - out) {
+            return -1;
+        }
+
+        switch (token) {
+            case TOK_ZERO:
+                memset(dst + out, 0, len);
+                break;
+
+            case TOK_RUN:
+                if (in >= src_len) {
+                    return -1;
+                }
+                memset(dst + out, src[in++], len);
+                break;
+
+            case TOK_LITERAL:
+                if (len > src_len - in) {
+                    return -1;
+                }
+                memcpy(dst + out, src + in, len);
+                in += len;
+                break;
+
+            case TOK_MATCH: {
+                uint64_t dist;
+                if (get_varint(src, src_len, &in, &dist) == -1 || dist == 0 || dist > out) {
+                    return -1;
+                }
+                // Совпадение может перекрываться с копируемым участком
+                const uint8_t *from = dst + out - dist;
+                for (uint64_t k = 0; k < len; k++) {
+                    dst[out + k] = from[k];
+                }
+                break;
+            }
+
+            default:
+                return -1;
+        }
+        out += len;
+    }
+
+    return (out == dst_len) ? 0 : -1;
+}
+
+size_t dshm_encode_payload_into(const void *data, size_t len, void *buf, size_t cap) {
+    if (len < DSHM_COMPRESS_THRESHOLD || len > UINT32_MAX || cap < sizeof(uint32_t)) {
+        return 0;
+    }
+
+    // Сжатие имеет смысл, только если экономит хотя бы восьмую часть
+    size_t limit = len - len / 8;
+    if (cap - sizeof(uint32_t) < limit) {
+        limit = cap - sizeof(uint32_t);
+    }
+    size_t packed = dshm_compress(data, len, (uint8_t*)buf + sizeof(uint32_t), limit);
+    if (packed == 0) {
+        return 0;
+    }
+
+    uint32_t raw_len = htonl((uint32_t)len);
+    memcpy(buf, &raw_len, sizeof(raw_len));
+    return sizeof(uint32_t) + packed;
+}
+
+void *dshm_encode_payload(const void *data, size_t len, size_t *encoded_len) {
+    if (len < DSHM_COMPRESS_THRESHOLD || len > UINT32_MAX) {
+        return NULL;
+    }
+
+    size_t cap = sizeof(uint32_t) + len - len / 8;
+    uint8_t *buf = malloc(cap);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    size_t encoded = dshm_encode_payload_into(data, len, buf, cap);
+    if (encoded == 0) {
+        free(buf);
+        return NULL;
+    }
+    *encoded_len = encoded;
+    return buf;
+}
+
+void *dshm_decode_payload(const void *data, size_t len, size_t *decoded_len) {
+    uint32_t raw_len;
+    if (len < sizeof(raw_len)) {
+        return NULL;
+    }
+    memcpy(&raw_len, data, sizeof(raw_len));
+    raw_len = ntohl(raw_len);
+
+    void *buf = malloc(raw_len > 0 ? raw_len : 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+    if (dshm_decompress((const uint8_t*)data + sizeof(raw_len), len - sizeof(raw_len), buf, raw_len) == -1) {
+        free(buf);
+        return NULL;
+    }
+
+    *decoded_len = raw_len;
+    return buf;
+}
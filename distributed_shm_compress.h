@@ -0,0 +1,32 @@
+#ifndef DISTRIBUTED_SHM_COMPRESS_H
+#define DISTRIBUTED_SHM_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Полезная нагрузка меньше порога передается без сжатия
+#define DSHM_COMPRESS_THRESHOLD 512
+
+// Сжатие блока данных.
+// Формат - последовательность токенов: серия нулей, серия одинаковых байт,
+// литералы и LZ-совпадения с уже закодированными данными. Страница из нулей
+// кодируется одним токеном.
+// Возвращает размер сжатых данных или 0, если результат не помещается в dst.
+size_t dshm_compress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+// Распаковка блока данных ровно в dst_len байт. Возвращает 0 или -1 при ошибке формата.
+int dshm_decompress(const void *src, size_t src_len, void *dst, size_t dst_len);
+
+// Кодирование полезной нагрузки сообщения (DSHM_ENC_COMPRESSED).
+// Возвращает новый буфер "исходный размер + сжатые данные", если сжатие
+// дает заметный выигрыш, иначе NULL (данные передаются как есть).
+void *dshm_encode_payload(const void *data, size_t len, size_t *encoded_len);
+
+// То же в буфер вызывающего размером cap (достаточно 4 + len байт).
+// Возвращает размер закодированных данных или 0, если сжатие не выгодно
+size_t dshm_encode_payload_into(const void *data, size_t len, void *buf, size_t cap);
+
+// Декодирование полезной нагрузки DSHM_ENC_COMPRESSED в новый буфер, NULL при ошибке
+void *dshm_decode_payload(const void *data, size_t len, size_t *decoded_len);
+
+#endif // DISTRIBUTED_SHM_COMPRESS_H
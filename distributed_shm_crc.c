@@ -0,0 +1,110 @@
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "distributed_shm.h"
+#include "distributed_shm_crc.h"
+
+#if defined(__x86_64__)
+#define DSHM_CRC_HW 1
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u     // Отраженный полином Castagnoli
+
+// Таблицы для обработки по 8 байт за шаг (slicing-by-8)
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_update)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t crc_update_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#ifdef DSHM_CRC_HW
+__attribute__((target("sse4.2")))
+static uint32_t crc_update_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = crc_table[0][crc_table[t - 1][i] & 0xff] ^ (crc_table[t - 1][i] >> 8);
+        }
+    }
+
+    crc_update = crc_update_sw;
+#ifdef DSHM_CRC_HW
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_update = crc_update_hw;
+    }
+#endif
+}
+
+uint32_t dshm_crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    return ~crc_update(~crc, data, len);
+}
+
+uint32_t dshm_digest_add(uint32_t digest, uint32_t piece_crc) {
+    uint32_t net = htonl(piece_crc);
+    return dshm_crc32c(digest, &net, sizeof(net));
+}
+
+uint32_t dshm_range_digest(const void *base, size_t offset, size_t len) {
+    uint32_t digest = 0;
+    while (len > 0) {
+        size_t chunk = DSHM_PAGE_SIZE - offset % DSHM_PAGE_SIZE;
+        if (chunk > len) {
+            chunk = len;
+        }
+        digest = dshm_digest_add(digest, dshm_crc32c(0, (const char*)base + offset, chunk));
+        offset += chunk;
+        len -= chunk;
+    }
+    return digest;
+}
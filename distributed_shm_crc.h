@@ -0,0 +1,20 @@
+#ifndef DISTRIBUTED_SHM_CRC_H
+#define DISTRIBUTED_SHM_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (полином Castagnoli) - инструкцией crc32 SSE4.2, если ее поддерживает
+// процессор, иначе таблично. crc - сумма предшествующих данных (0 в начале),
+// так что сообщение можно обрабатывать по частям.
+uint32_t dshm_crc32c(uint32_t crc, const void *data, size_t len);
+
+// Свертка диапазона сегмента (CMD_CHECKSUM): CRC32C от последовательности
+// сумм частей диапазона, попадающих в отдельные страницы сегмента (каждая -
+// 4 байта в сетевом порядке). Сервер хранит суммы целых страниц и не читает их заново.
+uint32_t dshm_digest_add(uint32_t digest, uint32_t piece_crc);
+
+// Свертка диапазона [offset, offset + len) сегмента, данные которого начинаются с base
+uint32_t dshm_range_digest(const void *base, size_t offset, size_t len);
+
+#endif // DISTRIBUTED_SHM_CRC_H
@@ -0,0 +1,251 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "distributed_shm_diff.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DSHM_DIFF_X86 1
+#include <immintrin.h>
+#endif
+
+// Ядра обрабатывают блоки по 64 байта: маска блока - по биту на байт
+#define BLOCK 64
+
+// Реализация ядер для одного набора инструкций
+typedef struct {
+    const char *name;
+    // Пропуск совпадающих блоков начиная с *pos (до end, кратного BLOCK).
+    // Возвращает маску различающихся байт первого несовпавшего блока
+    // (*pos указывает на него) или 0, если различий нет
+    uint64_t (*next_diff)(const unsigned char *a, const unsigned char *b, size_t *pos, size_t end);
+    // Нулевые ли len байт (len кратно BLOCK)
+    int (*zero)(const unsigned char *p, size_t len);
+} diff_impl_t;
+
+static uint64_t next_diff_scalar(const unsigned char *a, const unsigned char *b, size_t *pos, size_t end) {
+    for (size_t p = *pos; p < end; p += BLOCK) {
+        uint64_t diff = 0;
+        for (int w = 0; w < BLOCK / 8; w++) {
+            uint64_t x, y;
+            memcpy(&x, a + p + w * 8, 8);
+            memcpy(&y, b + p + w * 8, 8);
+            if (x == y) {
+                continue;
+            }
+            for (int k = 0; k < 8; k++) {
+                if (a[p + w * 8 + k] != b[p + w * 8 + k]) {
+                    diff |= 1ull << (w * 8 + k);
+                }
+            }
+        }
+        if (diff != 0) {
+            *pos = p;
+            return diff;
+        }
+    }
+    *pos = end;
+    return 0;
+}
+
+static int zero_scalar(const unsigned char *p, size_t len) {
+    for (size_t i = 0; i < len; i += BLOCK) {
+        uint64_t acc = 0;
+        for (int w = 0; w < BLOCK / 8; w++) {
+            uint64_t x;
+            memcpy(&x, p + i + w * 8, 8);
+            acc |= x;
+        }
+        if (acc != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#ifdef DSHM_DIFF_X86
+__attribute__((target("sse2")))
+static uint64_t next_diff_sse2(const unsigned char *a, const unsigned char *b, size_t *pos, size_t end) {
+    for (size_t p = *pos; p < end; p += BLOCK) {
+        uint64_t eq = 0;
+        for (int i = 0; i < 4; i++) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(a + p + i * 16));
+            __m128i y = _mm_loadu_si128((const __m128i*)(b + p + i * 16));
+            eq |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) << (i * 16);
+        }
+        if (eq != ~0ull) {
+            *pos = p;
+            return ~eq;
+        }
+    }
+    *pos = end;
+    return 0;
+}
+
+__attribute__((target("sse2")))
+static int zero_sse2(const unsigned char *p, size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t i = 0; i < len; i += BLOCK) {
+        __m128i acc = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)),
+                         _mm_loadu_si128((const __m128i*)(p + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)),
+                         _mm_loadu_si128((const __m128i*)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+__attribute__((target("avx2")))
+static uint64_t next_diff_avx2(const unsigned char *a, const unsigned char *b, size_t *pos, size_t end) {
+    for (size_t p = *pos; p < end; p += BLOCK) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i*)(a + p));
+        __m256i y0 = _mm256_loadu_si256((const __m256i*)(b + p));
+        __m256i x1 = _mm256_loadu_si256((const __m256i*)(a + p + 32));
+        __m256i y1 = _mm256_loadu_si256((const __m256i*)(b + p + 32));
+        uint64_t eq = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0)) |
+                      (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1)) << 32;
+        if (eq != ~0ull) {
+            *pos = p;
+            return ~eq;
+        }
+    }
+    *pos = end;
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static int zero_avx2(const unsigned char *p, size_t len) {
+    for (size_t i = 0; i < len; i += BLOCK) {
+        __m256i acc = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + i)),
+                                      _mm256_loadu_si256((const __m256i*)(p + i + 32)));
+        if (!_mm256_testz_si256(acc, acc)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
+
+enum { IMPL_AVX2, IMPL_SSE2, IMPL_SCALAR, IMPL_COUNT };
+
+// В порядке предпочтения
+static const diff_impl_t impls[IMPL_COUNT] = {
+#ifdef DSHM_DIFF_X86
+    [IMPL_AVX2] = { "avx2", next_diff_avx2, zero_avx2 },
+    [IMPL_SSE2] = { "sse2", next_diff_sse2, zero_sse2 },
+#endif
+    [IMPL_SCALAR] = { "scalar", next_diff_scalar, zero_scalar },
+};
+
+static const diff_impl_t *current = NULL;
+
+static int impl_supported(int i) {
+    if (impls[i].name == NULL) {
+        return 0;
+    }
+#ifdef DSHM_DIFF_X86
+    if (i == IMPL_AVX2) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (i == IMPL_SSE2) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return 1;
+}
+
+int dshm_diff_select(const char *name) {
+    for (int i = 0; i < IMPL_COUNT; i++) {
+        if (impl_supported(i) && (name == NULL || strcmp(name, impls[i].name) == 0)) {
+            __atomic_store_n(&current, &impls[i], __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static const diff_impl_t *impl(void) {
+    const diff_impl_t *selected = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    if (selected == NULL) {
+        dshm_diff_select(NULL);
+        selected = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    }
+    return selected;
+}
+
+const char *dshm_diff_impl(void) {
+    return impl()->name;
+}
+
+// Накопление списка отрезков
+typedef struct {
+    dshm_run_t *runs;
+    int count;
+    int max;
+    size_t gap;
+} run_list_t;
+
+static void add_diff(run_list_t *list, size_t start, size_t end) {
+    if (list->count > 0) {
+        dshm_run_t *last = &list->runs[list->count - 1];
+        if (start - (last->offset + last->len) <= list->gap || list->count == list->max) {
+            last->len = end - last->offset;
+            return;
+        }
+    }
+    list->runs[list->count].offset = start;
+    list->runs[list->count].len = end - start;
+    list->count++;
+}
+
+int dshm_diff_runs(const void *cur, const void *old, size_t len, size_t gap,
+                   dshm_run_t *runs, int max_runs) {
+    const unsigned char *a = cur;
+    const unsigned char *b = old;
+    const diff_impl_t *kernels = impl();
+    run_list_t list = { runs, 0, max_runs, gap };
+    if (max_runs < 1) {
+        return 0;
+    }
+
+    size_t blocks_end = len - len % BLOCK;
+    size_t pos = 0;
+    while (pos < blocks_end) {
+        uint64_t diff = kernels->next_diff(a, b, &pos, blocks_end);
+        if (diff == 0) {
+            break;
+        }
+        // Серии единиц маски - отрезки различающихся байт блока
+        while (diff != 0) {
+            int bit = __builtin_ctzll(diff);
+            uint64_t rest = ~(diff >> bit);
+            int ones = (rest == 0) ? BLOCK - bit : __builtin_ctzll(rest);
+            add_diff(&list, pos + bit, pos + bit + ones);
+            diff = (bit + ones >= BLOCK) ? 0 : diff & (~0ull << (bit + ones));
+        }
+        pos += BLOCK;
+    }
+
+    for (pos = blocks_end; pos < len; pos++) {
+        if (a[pos] != b[pos]) {
+            add_diff(&list, pos, pos + 1);
+        }
+    }
+    return list.count;
+}
+
+int dshm_is_zero(const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t blocks_end = len - len % BLOCK;
+    if (!impl()->zero(p, blocks_end)) {
+        return 0;
+    }
+    for (size_t i = blocks_end; i < len; i++) {
+        if (p[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,29 @@
+#ifndef DISTRIBUTED_SHM_DIFF_H
+#define DISTRIBUTED_SHM_DIFF_H
+
+#include <stddef.h>
+
+// Отрезок измененных байт
+typedef struct {
+    size_t offset;
+    size_t len;
+} dshm_run_t;
+
+// Поиск байт, которыми cur отличается от old, в виде списка отрезков.
+// Отрезки, между которыми не больше gap совпадающих байт, объединяются.
+// Если отрезков больше max_runs, последний поглощает все оставшиеся отличия.
+// Возвращает число отрезков (0 - блоки совпадают).
+int dshm_diff_runs(const void *cur, const void *old, size_t len, size_t gap,
+                   dshm_run_t *runs, int max_runs);
+
+// Состоит ли блок из одних нулей
+int dshm_is_zero(const void *data, size_t len);
+
+// Выбор реализации: "avx2", "sse2" или "scalar" (NULL - лучшая из доступных).
+// Возвращает -1, если процессор не поддерживает выбранную реализацию
+int dshm_diff_select(const char *name);
+
+// Имя используемой реализации
+const char *dshm_diff_impl(void);
+
+#endif // DISTRIBUTED_SHM_DIFF_H
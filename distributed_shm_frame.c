@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "distributed_shm_frame.h"
+
+// Ожидание готовности сокета посреди сообщения
+static int wait_ready(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    for (;;) {
+        int ready = poll(&pfd, 1, DSHM_STALL_TIMEOUT_MS);
+        if (ready > 0) {
+            return 0;
+        }
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+void dshm_reader_init(dshm_reader_t *reader, int fd) {
+    reader->fd = fd;
+    reader->head = 0;
+    reader->tail = 0;
+}
+
+static ssize_t read_full(dshm_reader_t *reader, void *buf, size_t len, int idle_ok) {
+    char *dst = buf;
+    size_t done = 0;
+
+    while (done < len) {
+        if (reader->head < reader->tail) {
+            size_t n = reader->tail - reader->head;
+            if (n > len - done) {
+                n = len - done;
+            }
+            memcpy(dst + done, reader->buf + reader->head, n);
+            reader->head += n;
+            done += n;
+            continue;
+        }
+
+        // Крупный остаток читается сразу на место, мелкий - через буфер вместе со следующими сообщениями
+        reader->head = 0;
+        reader->tail = 0;
+        int direct = (len - done >= sizeof(reader->buf));
+        ssize_t n = recv(reader->fd, direct ? dst + done : reader->buf,
+                         direct ? len - done : sizeof(reader->buf), 0);
+        if (n > 0) {
+            if (direct) {
+                done += (size_t)n;
+            } else {
+                reader->tail = (size_t)n;
+            }
+            continue;
+        }
+        if (n == 0) {
+            if (done == 0) {
+                return 0;
+            }
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (idle_ok && done == 0) {
+                return -1;
+            }
+            if (wait_ready(reader->fd, POLLIN) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        return -1;
+    }
+    return (ssize_t)done;
+}
+
+ssize_t dshm_read_full(dshm_reader_t *reader, void *buf, size_t len) {
+    return read_full(reader, buf, len, 0);
+}
+
+ssize_t dshm_read_first(dshm_reader_t *reader, void *buf, size_t len) {
+    return read_full(reader, buf, len, 1);
+}
+
+int dshm_write_full(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (iovcnt < IOV_MAX) ? iovcnt : IOV_MAX;
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(fd, POLLOUT) == 0) {
+                continue;
+            }
+            return -1;
+        }
+
+        // Пропуск отправленного: частичная запись продолжается с места остановки
+        size_t left = (size_t)sent;
+        while (left > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (left > 0) {
+            iov->iov_base = (char*)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+void dshm_socket_setup(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
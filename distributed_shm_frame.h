@@ -0,0 +1,43 @@
+#ifndef DISTRIBUTED_SHM_FRAME_H
+#define DISTRIBUTED_SHM_FRAME_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Размер буфера чтения соединения: несколько небольших сообщений
+// (заголовок, данные, контрольная сумма) разбираются за один вызов recv
+#define DSHM_READ_BUFFER 16384
+
+// Сколько ждать продолжения начатого сообщения, прежде чем считать соединение оборванным
+#define DSHM_STALL_TIMEOUT_MS 30000
+
+// Буферизованное чтение сообщений из сокета. Сообщение может прийти любыми
+// частями: чтение собирает их, повторяет прерванные вызовы (EINTR) и дожидается
+// данных после истечения таймаута сокета или на неблокирующем сокете (EAGAIN).
+typedef struct {
+    int fd;
+    size_t head;                // Непрочитанные данные буфера - buf[head, tail)
+    size_t tail;
+    char buf[DSHM_READ_BUFFER];
+} dshm_reader_t;
+
+void dshm_reader_init(dshm_reader_t *reader, int fd);
+
+// Чтение ровно len байт. Возвращает len, 0 - соединение закрыто до первого байта,
+// -1 - ошибка (в том числе обрыв посреди сообщения)
+ssize_t dshm_read_full(dshm_reader_t *reader, void *buf, size_t len);
+
+// То же для начала сообщения: если за время таймаута сокета не пришло ни байта,
+// возвращает -1 с errno = EAGAIN (соединение простаивает, но исправно)
+ssize_t dshm_read_first(dshm_reader_t *reader, void *buf, size_t len);
+
+// Отправка частей сообщения одним вызовом sendmsg (без SIGPIPE), с досылкой
+// после частичной записи. Массив iov изменяется. Возвращает 0 или -1.
+int dshm_write_full(int fd, struct iovec *iov, int iovcnt);
+
+// Настройка сокета соединения: сообщения отправляются целиком, поэтому
+// алгоритм Нейгла только задерживал бы следующие за ними запросы конвейера
+void dshm_socket_setup(int fd);
+
+#endif // DISTRIBUTED_SHM_FRAME_H
@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "distributed_shm.h"
+#include "distributed_shm_pool.h"
+
+// Заголовок блока занимает строку кэша, данные блока тоже выровнены по ней
+#define BLOCK_HEADER 64
+
+static const size_t class_size[DSHM_POOL_CLASSES] = {
+    1024, 4096, 16384, MAX_BUFFER_SIZE + DSHM_PAGE_SIZE
+};
+
+typedef struct {
+    int size_class;
+} block_header_t;
+
+// Участок на huge pages: сначала явные (MAP_HUGETLB), иначе выровненное
+// отображение с просьбой к ядру собрать его из прозрачных huge pages
+static char *map_chunk(void) {
+    void *mem = mmap(NULL, DSHM_POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) {
+        return mem;
+    }
+
+    size_t span = 2 * DSHM_POOL_CHUNK_SIZE;
+    char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char*)(((uintptr_t)raw + DSHM_POOL_CHUNK_SIZE - 1) & ~((uintptr_t)DSHM_POOL_CHUNK_SIZE - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (raw + span > aligned + DSHM_POOL_CHUNK_SIZE) {
+        munmap(aligned + DSHM_POOL_CHUNK_SIZE, raw + span - (aligned + DSHM_POOL_CHUNK_SIZE));
+    }
+    madvise(aligned, DSHM_POOL_CHUNK_SIZE, MADV_HUGEPAGE);
+    return aligned;
+}
+
+void dshm_pool_init(dshm_pool_t *pool) {
+    memset(pool, 0, sizeof(*pool));
+}
+
+void dshm_pool_destroy(dshm_pool_t *pool) {
+    for (int i = 0; i < pool->chunk_count; i++) {
+        munmap(pool->chunks[i], DSHM_POOL_CHUNK_SIZE);
+    }
+    dshm_pool_init(pool);
+}
+
+void *dshm_pool_alloc(dshm_pool_t *pool, size_t size) {
+    int c = 0;
+    while (c < DSHM_POOL_CLASSES && size > class_size[c]) {
+        c++;
+    }
+    if (c == DSHM_POOL_CLASSES) {
+        return malloc(size > 0 ? size : 1);
+    }
+
+    // Свободный блок класса: первое слово данных - ссылка на следующий
+    void *block = pool->free_list[c];
+    if (block != NULL) {
+        memcpy(&pool->free_list[c], block, sizeof(void*));
+        return block;
+    }
+
+    // Нарезка нового блока из последнего участка или из нового
+    size_t need = BLOCK_HEADER + class_size[c];
+    if (pool->chunk_count == 0 || DSHM_POOL_CHUNK_SIZE - pool->chunk_used < need) {
+        char *chunk = (pool->chunk_count < DSHM_POOL_MAX_CHUNKS) ? map_chunk() : NULL;
+        if (chunk == NULL) {
+            return malloc(size > 0 ? size : 1);
+        }
+        pool->chunks[pool->chunk_count++] = chunk;
+        pool->chunk_used = 0;
+    }
+
+    char *base = pool->chunks[pool->chunk_count - 1] + pool->chunk_used;
+    pool->chunk_used += need;
+    ((block_header_t*)base)->size_class = c;
+    return base + BLOCK_HEADER;
+}
+
+void dshm_pool_free(dshm_pool_t *pool, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    for (int i = 0; i < pool->chunk_count; i++) {
+        char *chunk = pool->chunks[i];
+        if ((char*)ptr >= chunk && (char*)ptr < chunk + DSHM_POOL_CHUNK_SIZE) {
+            int c = ((block_header_t*)((char*)ptr - BLOCK_HEADER))->size_class;
+            memcpy(ptr, &pool->free_list[c], sizeof(void*));
+            pool->free_list[c] = ptr;
+            return;
+        }
+    }
+    free(ptr);
+}
@@ -0,0 +1,36 @@
+#ifndef DISTRIBUTED_SHM_POOL_H
+#define DISTRIBUTED_SHM_POOL_H
+
+#include <stddef.h>
+
+// Размерные классы блоков: до MAX_BUFFER_SIZE с запасом под заголовок сжатия
+#define DSHM_POOL_CLASSES 4
+#define DSHM_POOL_CHUNK_SIZE (2u << 20)     // Участок размером с huge page
+#define DSHM_POOL_MAX_CHUNKS 16
+
+// Пул буферов запросов одного потока.
+// Блоки нарезаются из участков по 2 МБ (по возможности на huge pages) и после
+// освобождения попадают в список свободных блоков своего класса, поэтому в
+// установившемся режиме запросы обходятся без malloc. Пул используется одним
+// потоком, синхронизация не нужна.
+typedef struct {
+    void *free_list[DSHM_POOL_CLASSES];     // Свободные блоки по классам
+    char *chunks[DSHM_POOL_MAX_CHUNKS];     // Участки, из которых нарезаны блоки
+    int chunk_count;
+    size_t chunk_used;                      // Занято в последнем участке
+} dshm_pool_t;
+
+// Инициализация пустого пула (память выделяется при первом запросе)
+void dshm_pool_init(dshm_pool_t *pool);
+
+// Освобождение всех участков пула. Выданные блоки становятся недействительными
+void dshm_pool_destroy(dshm_pool_t *pool);
+
+// Буфер не меньше size байт. Запросы больше наибольшего класса и запросы
+// сверх DSHM_POOL_MAX_CHUNKS участков обслуживаются malloc
+void *dshm_pool_alloc(dshm_pool_t *pool, size_t size);
+
+// Возврат буфера. Принимает и блоки пула, и память из malloc (в том числе NULL)
+void dshm_pool_free(dshm_pool_t *pool, void *ptr);
+
+#endif // DISTRIBUTED_SHM_POOL_H
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "distributed_shm_client.h"
+
+// LD_PRELOAD interposer: unmodified System V shared memory programs get
+// cluster segments without being rebuilt. Configuration is read from the
+// environment on the first intercepted call:
+//   DSHM_SERVERS  cluster nodes, "host1:port1,host2:port2" (default localhost:8080)
+//   DSHM_KEYS     keys served by the cluster: comma-separated keys and ranges
+//                 ("0x1000-0x1fff,42"), "private" for IPC_PRIVATE (default - all keys)
+//   DSHM_SYNC_MS  period of the background exchange of attached segments with the
+//                 server (default 0 - writes reach the server on shmdt only)
+// Other keys, and shmids or addresses the cluster did not hand out, go to the
+// real functions found with dlsym(RTLD_NEXT).
+//
+// Attached segments are the client's local mappings, so loads and stores run
+// at memory speed; data moves only on shmat, shmdt and the periodic sync.
+
+#define PRELOAD_DEFAULT_SERVERS "localhost:8080"
+#define PRELOAD_MAX_RANGES 64
+
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} key_range_t;
+
+// A segment attached through the cluster
+typedef struct {
+    void *addr;             // Local mapping returned to the program (NULL - free entry)
+    size_t size;
+    int readonly;
+    int count;              // shmat calls that returned this mapping
+} preload_attach_t;
+
+static int (*real_shmget)(key_t, size_t, int);
+static void *(*real_shmat)(int, const void *, int);
+static int (*real_shmdt)(const void *);
+static int (*real_shmctl)(int, int, struct shmid_ds *);
+
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t preload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int preload_active = 0;          // The cluster client is initialized
+static int all_keys = 1;                // No DSHM_KEYS: every key goes to the cluster
+static int private_keys = 1;
+static key_range_t key_ranges[PRELOAD_MAX_RANGES];
+static int key_range_count = 0;
+static unsigned sync_ms = 0;
+
+// shmids handed out by the cluster (0 - free entry) and cluster attachments,
+// both protected by preload_mutex
+static int cluster_ids[MAX_CLIENT_SEGMENTS];
+static preload_attach_t attachments[MAX_CLIENT_SEGMENTS];
+
+// Parse DSHM_KEYS
+static void parse_keys(const char *spec) {
+    all_keys = 0;
+    private_keys = 0;
+
+    char *copy = strdup(spec);
+    if (copy == NULL) {
+        return;
+    }
+    char *saveptr = NULL;
+    for (char *token = strtok_r(copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(token, "private") == 0) {
+            private_keys = 1;
+            continue;
+        }
+        if (key_range_count == PRELOAD_MAX_RANGES) {
+            fprintf(stderr, "distributed_shm: DSHM_KEYS: too many ranges, '%s' ignored\n", token);
+            continue;
+        }
+        char *end = NULL;
+        key_range_t range;
+        range.first = (uint32_t)strtoul(token, &end, 0);
+        range.last = range.first;
+        if (*end == '-') {
+            range.last = (uint32_t)strtoul(end + 1, &end, 0);
+        }
+        if (*end != '\0' || end == token || range.last < range.first) {
+            fprintf(stderr, "distributed_shm: DSHM_KEYS: cannot parse '%s'\n", token);
+            continue;
+        }
+        key_ranges[key_range_count++] = range;
+    }
+    free(copy);
+}
+
+// Periodically push local changes of writable attachments and re-read
+// read-only ones (a re-read would overwrite unsynced local writes)
+static void *sync_thread(void *arg __attribute__((unused))) {
+    struct timespec period = { sync_ms / 1000, (long)(sync_ms % 1000) * 1000000L };
+    for (;;) {
+        nanosleep(&period, NULL);
+        pthread_mutex_lock(&preload_mutex);
+        for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
+            preload_attach_t *attach = &attachments[i];
+            if (attach->addr == NULL || attach->size == 0) {
+                continue;
+            }
+            if (attach->readonly) {
+                distributed_shm_refresh(attach->addr, attach->size);
+            } else {
+                distributed_shm_sync(attach->addr, attach->size);
+            }
+        }
+        pthread_mutex_unlock(&preload_mutex);
+    }
+    return NULL;
+}
+
+static void preload_init(void) {
+    real_shmget = (int (*)(key_t, size_t, int))dlsym(RTLD_NEXT, "shmget");
+    real_shmat = (void *(*)(int, const void *, int))dlsym(RTLD_NEXT, "shmat");
+    real_shmdt = (int (*)(const void *))dlsym(RTLD_NEXT, "shmdt");
+    real_shmctl = (int (*)(int, int, struct shmid_ds *))dlsym(RTLD_NEXT, "shmctl");
+
+    const char *keys = getenv("DSHM_KEYS");
+    if (keys != NULL && keys[0] != '\0') {
+        parse_keys(keys);
+    }
+    const char *period = getenv("DSHM_SYNC_MS");
+    if (period != NULL) {
+        sync_ms = (unsigned)strtoul(period, NULL, 10);
+    }
+
+    const char *servers = getenv("DSHM_SERVERS");
+    if (distributed_shm_init_cluster(servers != NULL ? servers : PRELOAD_DEFAULT_SERVERS) == -1) {
+        fprintf(stderr, "distributed_shm: bad DSHM_SERVERS, using local System V shared memory\n");
+        return;
+    }
+    preload_active = 1;
+
+    if (sync_ms > 0) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, sync_thread, NULL) == 0) {
+            pthread_detach(thread);
+        }
+    }
+}
+
+// Does the cluster serve this key
+static int key_matches(key_t key) {
+    if (key == IPC_PRIVATE) {
+        return private_keys;
+    }
+    if (all_keys) {
+        return 1;
+    }
+    for (int i = 0; i < key_range_count; i++) {
+        if ((uint32_t)key >= key_ranges[i].first && (uint32_t)key <= key_ranges[i].last) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Position of a cluster shmid in cluster_ids, -1 if unknown (called with preload_mutex held)
+static int find_cluster_id(int shmid) {
+    for (int i = 0; i < MAX_CLIENT_SEGMENTS; i++) {
+        if (cluster_ids[i] == shmid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Remember a cluster shmid (called with preload_mutex held)
+static void remember_cluster_id(int shmid) {
+    if (find_cluster_id(shmid) == -1) {
+        int slot = find_cluster_id(0);
+        if (slot != -1) {
+            cluster_ids[slot] = shmid;
+        }
+    }
+}
+
+static int is_cluster_id(int shmid) {
+    pthread_mutex_lock(&preload_mutex);
+    int known = (shmid > 0 && find_cluster_id(shmid) != -1);
+    pthread_mutex_unlock(&preload_mutex);
+    return known;
+}
+
+// Attach a cluster segment and record the mapping for shmdt and the sync thread
+static void *cluster_attach(int shmid, int shmflg) {
+    void *addr = distributed_shmat(shmid, NULL, shmflg);
+    if (addr == (void*)-1) {
+        return addr;
+    }
+    struct shmid_ds stat;
+    size_t size = (distributed_shmctl(shmid, IPC_STAT, &stat) == 0) ? stat.shm_segsz : 0;
+
+    pthread_mutex_lock(&preload_mutex);
+    remember_cluster_id(shmid);
+    preload_attach_t *free_entry = NULL;
+    preload_attach_t *entry = NULL;
+    for (int i = 0; i < MAX_CLIENT_SEGMENTS && entry == NULL; i++) {
+        if (attachments[i].addr == addr) {
+            entry = &attachments[i];
+        } else if (attachments[i].addr == NULL && free_entry == NULL) {
+            free_entry = &attachments[i];
+        }
+    }
+    if (entry == NULL && free_entry != NULL) {
+        entry = free_entry;
+        entry->addr = addr;
+        entry->size = size;
+        entry->readonly = (shmflg & SHM_RDONLY) != 0;
+        entry->count = 0;
+    }
+    if (entry != NULL) {
+        entry->count++;
+        entry->readonly &= (shmflg & SHM_RDONLY) != 0;
+    }
+    pthread_mutex_unlock(&preload_mutex);
+    return addr;
+}
+
+int shmget(key_t key, size_t size, int shmflg) {
+    pthread_once(&preload_once, preload_init);
+    if (!preload_active || !key_matches(key)) {
+        return real_shmget(key, size, shmflg);
+    }
+
+    int shmid = distributed_shmget(key, size, shmflg);
+    if (shmid != -1) {
+        pthread_mutex_lock(&preload_mutex);
+        remember_cluster_id(shmid);
+        pthread_mutex_unlock(&preload_mutex);
+    }
+    return shmid;
+}
+
+void *shmat(int shmid, const void *shmaddr, int shmflg) {
+    pthread_once(&preload_once, preload_init);
+    if (preload_active && is_cluster_id(shmid)) {
+        return cluster_attach(shmid, shmflg);
+    }
+
+    void *addr = real_shmat(shmid, shmaddr, shmflg);
+    // Not a kernel segment: it may be a cluster shmid another process passed on
+    if (addr == (void*)-1 && errno == EINVAL && preload_active && shmid > 0) {
+        addr = cluster_attach(shmid, shmflg);
+        if (addr == (void*)-1) {
+            errno = EINVAL;
+        }
+    }
+    return addr;
+}
+
+int shmdt(const void *shmaddr) {
+    pthread_once(&preload_once, preload_init);
+
+    pthread_mutex_lock(&preload_mutex);
+    preload_attach_t *entry = NULL;
+    for (int i = 0; i < MAX_CLIENT_SEGMENTS && shmaddr != NULL; i++) {
+        if (attachments[i].addr == shmaddr) {
+            entry = &attachments[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        pthread_mutex_unlock(&preload_mutex);
+        return real_shmdt(shmaddr);
+    }
+
+    // Detaching writes local changes back to the server
+    int result = distributed_shmdt(shmaddr);
+    if (result == 0 && --entry->count == 0) {
+        memset(entry, 0, sizeof(*entry));
+    }
+    pthread_mutex_unlock(&preload_mutex);
+    return result;
+}
+
+int shmctl(int shmid, int cmd, struct shmid_ds *buf) {
+    pthread_once(&preload_once, preload_init);
+    if (!preload_active || !is_cluster_id(shmid)) {
+        return real_shmctl(shmid, cmd, buf);
+    }
+
+    int result = distributed_shmctl(shmid, cmd, buf);
+    if (result == 0 && cmd == IPC_RMID) {
+        pthread_mutex_lock(&preload_mutex);
+        int slot = find_cluster_id(shmid);
+        if (slot != -1) {
+            cluster_ids[slot] = 0;
+        }
+        pthread_mutex_unlock(&preload_mutex);
+    }
+    return result;
+}
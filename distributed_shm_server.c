@@ -15,509 +15,5847 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <time.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <linux/futex.h>
 
 #include "distributed_shm.h"
+#include "distributed_shm_cluster.h"
+#include "distributed_shm_compress.h"
+#include "distributed_shm_crc.h"
+#include "distributed_shm_frame.h"
+#include "distributed_shm_uring.h"
+#include "distributed_shm_pool.h"
+#include "distributed_shm_arena.h"
+#include "distributed_shm_spsc.h"
+#include "distributed_shm_trace.h"
+#include "distributed_shm_stream.h"
+#include "distributed_shm_auth.h"
 
 // Определение MAP_ANONYMOUS для систем, где оно может отсутствовать
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS 0x20
 #endif
 
+// Параметры режима io_uring
+#define URING_ENTRIES 64                // Размер очереди отправки
+#define URING_RECV_BUFFERS 16           // Буферов приема на соединение (степень двойки)
+#define URING_RECV_BUFFER_SIZE 16384
+#define URING_SEND_SLOTS 16             // Ответов в очереди отправки на соединение
+#define URING_UD_RECV 0                 // user_data многократного recv (отправки - номер слота + 1)
+#define URING_UD_STOP 1                 // user_data ожидания остановки в цикле приема (accept - 0)
+
+// Ответ, ожидающий отправки через io_uring
+typedef struct {
+    shm_response_t header;  // Заголовок ответа (должен жить до завершения отправки)
+    void *payload;          // Данные ответа, освобождаются после отправки
+    uint32_t trailer;       // Контрольная сумма ответа (DSHM_CAP_CRC)
+    int sends;              // Незавершенных операций отправки
+} uring_slot_t;
+
+// Состояние соединения в режиме io_uring
+typedef struct {
+    dshm_uring_t ring;
+    int socket;
+    int armed;                                  // Многократный recv активен
+    int broken;                                 // Соединение закрыто или ошибка ввода-вывода
+    uint16_t chunk_bid[URING_RECV_BUFFERS];     // Принятые, но еще не разобранные буферы
+    uint32_t chunk_len[URING_RECV_BUFFERS];
+    int chunk_head;
+    int chunk_count;
+    size_t chunk_pos;                           // Прочитано из первого буфера
+    uring_slot_t slots[URING_SEND_SLOTS];
+    struct io_uring_sqe *last_send;             // Последняя неотправленная запись цепочки
+    int sends_in_flight;                        // Отправки, еще не завершенные ядром
+    dshm_pool_t *pool;                          // Пул, из которого выделены данные ответов
+} uring_conn_t;
+
+// Права соединения на сегмент, проверенные по shm_perm. Запись действительна,
+// пока описатель сегмента в том же поколении и права сегмента не менялись.
+#define GRANT_SLOTS 256         // Ячеек кэша прав соединения (по shmid)
+#define PERM_READ 04            // Биты прав в shm_perm.mode
+#define PERM_WRITE 02
+
+typedef struct {
+    int shmid;              // 0 - ячейка пуста
+    int perms;              // PERM_*
+    const struct shm_segment *segment;  // Описатель, права которого проверены
+    uint64_t generation;    // Его поколение (старшие 32 бита) и perm_seq (младшие)
+} grant_t;
+
+// Учет квоты -q. Память сегментов числится за постоянным владельцем соединений
+// (подтвержденным uid, без проверки подлинности - адресом клиента), поэтому
+// переподключение квоту не обнуляет. Запись живет, пока у владельца есть
+// соединения или сегменты, так что записей хватает на все соединения и сегменты
+// (MAX_CLIENTS + max_segments).
+#define QUOTA_BY_UID (1ull << 32)
+#define QUOTA_BY_ADDR (2ull << 32)
+
+typedef struct {
+    uint64_t id;            // QUOTA_BY_UID | uid или QUOTA_BY_ADDR | адрес IPv4 (0 - запись свободна)
+    size_t segment_bytes;   // Память сегментов владельца
+    int conns;              // Открытых соединений владельца
+} quota_account_t;          // Изменяется под segments_mutex
+
+// Состояние соединения с клиентом
+typedef struct client_conn {
+    int socket;             // Сокет клиента
+    uint32_t caps;          // Согласованные возможности протокола (DSHM_CAP_*)
+    uring_conn_t *uring;    // Ввод-вывод через io_uring (NULL - обычные recv/send)
+    dshm_reader_t *reader;  // Буферизованное чтение запросов без io_uring
+    uint32_t peer_addr;     // Адрес клиента IPv4 (сетевой порядок байт)
+    quota_account_t *account; // Учетная запись квоты (под segments_mutex, NULL - еще не нужна)
+    dshm_pool_t *pool;      // Буферы запросов и ответов потока соединения
+    int worker_slot;        // Номер очереди соединения у обработчиков (-1 - без очереди)
+    struct push_sub *subscription;  // Подписка на рассылку изменений (CMD_SUBSCRIBE)
+    struct client_conn *prev;       // Список открытых соединений (под conns_mutex)
+    struct client_conn *next;
+    uint64_t read_epoch;    // Эпоха, в которой начато чтение без блокировки (0 - не читает)
+    int authenticated;      // Соединение подтвердило ключ (CMD_AUTH)
+    int node_peer;          // Без ключей: клиент - узел кластера или эта машина (-1 - не проверялось)
+    uint32_t uid;           // От чьего имени проверяются права (0 - без проверки)
+    uint32_t gid;
+    uint8_t auth_nonce[DSHM_AUTH_NONCE];    // Вызов, отправленный в ответе на CMD_HELLO
+    grant_t *grants;        // Кэш прав (GRANT_SLOTS ячеек, только поток соединения)
+    struct worker_request *request; // Команда, переданная обработчику (стек потока соединения)
+    shm_segment_t *incoming;        // Сегмент, принимаемый частями (CMD_MIGRATE_IN), под segments_mutex
+    size_t incoming_len;            // Сколько байт его уже получено
+} client_conn_t;
+
+// Возможности протокола, поддерживаемые сервером
+#define SERVER_CAPS (DSHM_CAP_COMPRESS | DSHM_CAP_CRC)
+
 // Глобальные переменные
-static shm_segment_t segments[MAX_SEGMENTS];
+// Описатели сегментов. Место под max_segments (-S) описателей резервируется
+// при запуске, а память занимают только использованные: описатели не
+// перемещаются, поэтому найденный без блокировки остается на месте.
+#define SEGMENTS_LIMIT (1 << 24)        // Наибольшее значение -S
+static shm_segment_t *segments;
+static int max_segments = DEFAULT_SEGMENTS;
+static int segments_high = 0;           // Описатели с этого номера еще не использовались
+static int *free_slots;                 // Стек освобожденных описателей
+static int free_slot_count = 0;
+
+// Индекс shmid: хеш-таблица с линейным пробированием и удалением сдвигом,
+// ячейка - слово ((shmid << 32) | номер описателя + 1), 0 - свободна.
+// Изменяется под segments_mutex, читается и без нее: удаление меняет
+// segment_index_seq, и поиск, не нашедший shmid, повторяется.
+// Индекс ключей (key_index) того же размера.
+static uint64_t *segment_index;
+static uint32_t segment_index_seq = 0;  // Нечетный, пока записи сдвигаются
+static unsigned index_bits;             // Размер индексов - 2^index_bits >= 2 * max_segments
+static unsigned index_size;
+
+// Малые чтения выполняются без segments_mutex: данные копируются оптимистично
+// и перечитываются, если сегмент менялся во время копирования (write_seq).
+// Память сегментов освобождается только после того, как все читатели,
+// начавшие чтение до снятия сегмента с публикации, закончили. Удаление и
+// изменение размера не ждут их под блокировкой: прежняя память и описатель
+// уходят в список освобождения, который разбирает поток освобождения.
+#define OPTIMISTIC_READ_MAX 256         // Наибольшее чтение без блокировки
+#define OPTIMISTIC_READ_RETRIES 8       // Попыток до перехода к чтению под блокировкой
+static uint64_t reclaim_epoch = 1;      // Эпоха освобождения памяти
+static uint64_t replication_read_epoch = 0; // Чтение рассылки копий вне segments_mutex (0 - не читает)
+
+// Память, которую еще могут читать без блокировки читатели, начавшие чтение до эпохи epoch
+typedef struct retired {
+    struct retired *next;
+    uint64_t epoch;
+    shm_segment_t *segment;     // Удаленный сегмент: освобождаются его память и описатель
+    void *addr;                 // Иначе - прежняя память сегмента, сменившего размер
+    size_t size;
+    int pooled;
+    int fd;                     // Закрывается после освобождения (-1 - нет)
+    unsigned char *touched;
+} retired_t;
+static retired_t *retired_list = NULL;  // Под segments_mutex, новые записи в начале
+static int reclaim_running = 0;         // Поток освобождения работает (под segments_mutex)
+
+// Младшие 32 бита attach_state
+#define ATTACH_COUNT 0x3fffffffu        // Число присоединенных клиентов
+#define ATTACH_FROZEN 0x40000000u       // Сегмент передается на другой узел
+#define ATTACH_DEAD 0x80000000u         // Описатель свободен
+
+// Флаг shmflg: IPC_RMID отложен до отсоединения последнего клиента
+// (сам IPC_RMID равен нулю и не может служить флагом)
+#define SEGMENT_REMOVED 0x40000000
+
+// Значения migrating
+#define MIGRATING_PUSH 1                // Поток миграции отправляет сегмент новому владельцу
+#define MIGRATING_PULL 2                // Новый владелец забрал сегмент, ждем подтверждения
+#define MIGRATING_IN 3                  // Сегмент принимается частями и еще не опубликован
 static int segment_count = 0;
 static pthread_mutex_t segments_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int server_socket = -1;
 static int running = 1;
 
-// Функция для поиска сегмента по ID
+// Остановка и перезапуск без простоя
+#define DRAIN_TIMEOUT_MS 30000          // Ожидание завершения запросов в обработке
+static volatile sig_atomic_t stop_requested = 0;   // Получен SIGINT или SIGTERM
+static int stop_pipe[2] = { -1, -1 };   // Пробуждение цикла приема подключений
+static int draining = 0;                // Новые запросы не выполняются (ответ SHM_ESHUTDOWN)
+static int requests_in_flight = 0;      // Запросы, выполняемые сейчас
+static client_conn_t *conn_list = NULL; // Открытые соединения клиентов
+static pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char *handoff_path = NULL; // Управляющий сокет для передачи состояния преемнику (-H)
+static int handoff_socket = -1;
+static int handoff_conn = -1;           // Подключившийся преемник (под conns_mutex)
+static const char *trace_path = NULL;   // Файл трассировки, записываемый по SIGUSR1 (-T)
+static volatile sig_atomic_t trace_requested = 0;
+static int use_uring = 0;               // Сетевой ввод-вывод через io_uring (-u)
+static dshm_arenas_t segment_arenas;    // Общие области малых сегментов (под segments_mutex)
+
+// Режим закрепленных за ядрами обработчиков (-w): каждый сегмент принадлежит
+// одному обработчику, и все команды над ним выполняются только на его ядре.
+// Соединения передают такие команды владельцу через свои очереди SPSC.
+#define WORKER_SPIN 2000                // Проверок очереди перед засыпанием
+#define WORKER_IDLE_MS 100              // Сон простаивающего обработчика
+#define WORKER_TIMEOUT_MS 10000         // Ожидание ответа обработчика
+
+// Команда, переданная обработчику (живет в стеке потока соединения, пока
+// соединение открыто, поэтому переживает и брошенное ожидание)
+typedef struct worker_request {
+    client_conn_t *conn;
+    shm_header_t header;
+    void *data;
+    void *reply;
+    size_t reply_size;
+    uint32_t encoding;
+    int result;
+    uint32_t state;         // REQ_* (слово futex)
+    size_t reserved;        // Допуск буферов брошенной команды (освобождается при закрытии)
+} worker_request_t;
+
+#define REQ_PENDING 0
+#define REQ_DONE 1
+#define REQ_SLEEPING 2      // Поток соединения ждет на futex
+#define REQ_ABANDONED 3     // Ответ не дождались; соединение закрывается после выполнения
+
+typedef struct {
+    pthread_t thread;
+    int cpu;
+    uint32_t wake;                              // Счетчик пробуждений (слово futex)
+    int sleeping;
+    uint64_t pending[(MAX_CLIENTS + 63) / 64];  // Очереди, в которых есть команды
+    dshm_spsc_t queues[MAX_CLIENTS];            // По очереди на соединение
+} worker_t;
+
+static worker_t *workers = NULL;
+static int worker_count = 0;
+static int worker_spin = 0;             // На одном ядре ожидание активным опросом бесполезно
+static pthread_mutex_t worker_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char worker_slot_used[MAX_CLIENTS];
+static __thread int current_worker = -1;        // Номер обработчика в его потоке
+static uint32_t private_worker = 0;             // Обработчик следующего сегмента без ключа
+
+// Обработчик, которому принадлежит сегмент
+static int segment_owner(int shmid) {
+    return (int)(((uint32_t)shmid * 2654435761u) % (uint32_t)worker_count);
+}
+
+// Подходит ли новый shmid выполняющему обработчику (вне обработчиков - любой)
+static int worker_owns(int shmid) {
+    return current_worker < 0 || segment_owner(shmid) == current_worker;
+}
+
+// Ограничения памяти (0 - без ограничения)
+static size_t quota_segments_global = 0;        // Память всех сегментов (-Q)
+static size_t quota_segments_conn = 0;          // Память сегментов одного соединения (-q)
+static size_t limit_buffers_global = 256u << 20; // Буферы всех запросов в обработке (-B)
+static size_t limit_buffers_conn = 64u << 20;   // Буфер одного запроса (-b)
+static size_t segment_bytes = 0;                // Текущая память сегментов (под segments_mutex)
+static quota_account_t *quota_accounts;         // MAX_CLIENTS + max_segments записей
+static int quota_accounts_high = 0;             // Записи с этого номера еще не использовались
+
+// Проверка подлинности соединений (-k). Соединение действует от имени
+// пользователя, чей ключ подтвердило; uid 0 - только с ключом узлов. Без ключей
+// соединения не проверяются и действуют с правами суперпользователя, а команды
+// узлов кластера принимаются только с адресов узлов карты и этой машины.
+static dshm_auth_entry_t *auth_keys;
+static int auth_key_count = 0;
+static const dshm_auth_entry_t *node_key = NULL;   // Ключ, которым узлы подтверждают друг другу
+
+// Допуск буферов запросов: соединения обслуживаются по очереди (FIFO по билетам),
+// а при исчерпании общего лимита поток перестает читать свой сокет
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t admission_cond = PTHREAD_COND_INITIALIZER;
+static size_t buffers_in_use = 0;
+static unsigned long admission_next = 0;        // Следующий выдаваемый билет
+static unsigned long admission_serving = 0;     // Билет, который обслуживается сейчас
+
+// Состояние кластера
+static dshm_cluster_t cluster;          // Текущая карта кластера (пустая - одиночный режим)
+static dshm_cluster_t prev_cluster;     // Предыдущая карта (откуда забирать сегменты)
+static int cluster_self = -1;           // Индекс этого узла в текущей карте
+static int prev_self = -1;              // Индекс этого узла в предыдущей карте
+static char self_host[DSHM_NODE_HOST_MAX] = "";
+static int self_port = 8080;
+static pthread_mutex_t cluster_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t migration_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int migration_running = 0;
+static int migration_pending = 0;
+#define MIGRATE_CHUNK (256 << 10)       // Часть сегмента в одном CMD_MIGRATE_IN потока миграции
+
+// Копии сегментов для чтения на других узлах. Владелец периодически рассылает
+// накопленные изменения из журнала; копии сегментов, созданных или
+// перенесенных по новой карте, передаются целиком.
+#define REPLICA_BATCH_MS 10             // Интервал отправки накопленных изменений
+#define REPLICA_HEARTBEAT_MS 100        // Пустой пакет, подтверждающий актуальность копий
+#define REPLICA_RETRY_MS 1000           // Пауза после неудачной отправки
+#define REPLICA_BATCH_MAX (1 << 20)     // Данных в одном пакете (кроме одной части копии)
+#define REPLICA_COPY_CHUNK (256 << 10)  // Часть полной копии, копируемая за один раз
+static int replication_running = 0;     // Под cluster_mutex
+static uint64_t replica_fresh_ms[DSHM_MAX_NODES];  // Когда владелец (индекс в карте) подтвердил
+                                                   // актуальность своих копий (0 - не подтверждал)
+
+// Идентификаторы снимков выдаются сервером из отдельного диапазона
+#define SNAPSHOT_SHMID_BASE 0x60000000
+#define SNAPSHOT_SHMID_ATTEMPTS 65536
+static unsigned snapshot_seq = 0;
+static unsigned private_seq = 0;        // Идентификаторы сегментов IPC_PRIVATE (ниже диапазона снимков)
+
+// Индекс ключей: хеш-таблица с линейным пробированием и удалением сдвигом
+// (без надгробий). Значение - номер описателя + 1, 0 - свободная ячейка.
+// Изменяется и читается под segments_mutex.
+static int *key_index;
+
+// Журнал изменений: кольцо последних записей и удалений диапазонов
+#define CHANGE_LOG_SIZE 4096
+#define CHANGES_MAX_RECORDS 256         // Не более записей в одном ответе
+#define CHANGES_MAX_WAIT_MS 10000       // Предел ожидания новых записей
+#define CHANGES_MAX_REPLY (1 << 20)     // Предел данных в одном ответе
+
+typedef struct {
+    uint64_t seq;
+    int shmid;
+    uint32_t type;
+    uint32_t offset;
+    uint32_t len;
+} change_record_t;
+
+static change_record_t change_log[CHANGE_LOG_SIZE];
+static uint64_t change_next = 1;        // Номер следующей записи
+static uint32_t change_log_id = 0;      // Выбирается при запуске
+static pthread_mutex_t change_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t change_cond = PTHREAD_COND_INITIALIZER;
+
+// Рассылка изменений подписчикам (CMD_SUBSCRIBE)
+#define PUSH_QUEUE_LEN 256              // Сообщений в очереди подписчика
+#define PUSH_QUEUE_BYTES (8u << 20)     // Данных в очереди подписчика
+#define PUSH_IDLE_MS 1000               // Проверка соединения и сегмента простаивающего подписчика
+
+// Сообщение рассылки: готовый ответ (заголовок в сетевом порядке байт и данные)
+// с контрольной суммой. Один экземпляр разделяют все подписчики, которым он
+// отправляется; освобождается после отправки последнему.
+typedef struct {
+    int refs;               // Атомарный счетчик ссылок
+    size_t size;            // Размер ответа вместе с заголовком
+    uint32_t trailer;       // CRC32C ответа (отправляется при DSHM_CAP_CRC)
+    char data[];            // shm_response_t, shm_changes_t, shm_change_t и данные
+} push_msg_t;
+
+typedef struct push_sub {
+    struct push_sub *next;
+    int shmid;
+    uint32_t offset;        // Диапазон подписки [offset, end)
+    uint64_t end;           // У сегмента в 4 ГБ может быть равен 2^32
+    int with_data;          // DSHM_CHANGES_DATA
+    push_msg_t *queue[PUSH_QUEUE_LEN];
+    int head;
+    int count;
+    size_t bytes;           // Данных в очереди
+    int lost;               // Очередь отброшена: подписчику нужно сообщить об этом
+    pthread_cond_t cond;    // Появилось сообщение для отправки
+} push_sub_t;
+
+static push_sub_t *push_subs = NULL;    // Под push_mutex
+static pthread_mutex_t push_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int push_running = 0;            // Под push_mutex
+static uint64_t push_cursor = 0;        // Первая запись журнала, которую разошлет поток рассылки
+
+// Начальная ячейка shmid или ключа в индексе
+static unsigned index_home(int id) {
+    return ((uint32_t)id * 0x9e3779b1u) >> (32 - index_bits);
+}
+
+// Поиск сегмента по ID без блокировки. Описатель может быть освобожден сразу
+// после поиска: вызывающий проверяет его состояние атомарными операциями.
+static shm_segment_t* lookup_segment(int shmid) {
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&segment_index_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        for (unsigned i = index_home(shmid), n = 0; n < index_size; i = (i + 1) & (index_size - 1), n++) {
+            uint64_t entry = __atomic_load_n(&segment_index[i], __ATOMIC_ACQUIRE);
+            if (entry == 0) {
+                break;
+            }
+            if ((uint32_t)(entry >> 32) == (uint32_t)shmid) {
+                return &segments[(uint32_t)entry - 1];
+            }
+        }
+        // Запись могла сдвигаться мимо поиска: тогда ищем заново
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&segment_index_seq, __ATOMIC_RELAXED) == seq) {
+            return NULL;
+        }
+    }
+}
+
+// Публикация сегмента в индексе shmid (под segments_mutex)
+static void index_segment(shm_segment_t *segment) {
+    unsigned i = index_home(segment->shmid);
+    while (segment_index[i] != 0) {
+        i = (i + 1) & (index_size - 1);
+    }
+    uint64_t entry = ((uint64_t)(uint32_t)segment->shmid << 32) | (uint32_t)(segment - segments + 1);
+    __atomic_store_n(&segment_index[i], entry, __ATOMIC_RELEASE);
+}
+
+// Снятие сегмента с публикации (под segments_mutex). Записи переносятся в
+// дырку копированием до очистки прежней ячейки.
+static void unindex_segment(shm_segment_t *segment) {
+    uint64_t entry = ((uint64_t)(uint32_t)segment->shmid << 32) | (uint32_t)(segment - segments + 1);
+    unsigned hole = index_home(segment->shmid);
+    while (segment_index[hole] != entry) {
+        if (segment_index[hole] == 0) {
+            return; // Сегмент не опубликован
+        }
+        hole = (hole + 1) & (index_size - 1);
+    }
+    
+    __atomic_store_n(&segment_index_seq, segment_index_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&segment_index[hole], 0, __ATOMIC_RELAXED);
+    for (unsigned i = (hole + 1) & (index_size - 1); segment_index[i] != 0; i = (i + 1) & (index_size - 1)) {
+        unsigned home = index_home((int)(segment_index[i] >> 32));
+        if (((i - home) & (index_size - 1)) >= ((i - hole) & (index_size - 1))) {
+            __atomic_store_n(&segment_index[hole], segment_index[i], __ATOMIC_RELAXED);
+            __atomic_store_n(&segment_index[i], 0, __ATOMIC_RELAXED);
+            hole = i;
+        }
+    }
+    __atomic_store_n(&segment_index_seq, segment_index_seq + 1, __ATOMIC_RELEASE);
+}
+
+// Свободный описатель (под segments_mutex). -1 - заняты все max_segments
+static int take_slot(void) {
+    if (free_slot_count > 0) {
+        return free_slots[--free_slot_count];
+    }
+    if (segments_high == max_segments) {
+        return -1;
+    }
+    return segments_high++;
+}
+
+// Резервирование таблиц сегментов на max_segments описателей. Страницы
+// занимаются при первом обращении.
+static void *table_alloc(size_t bytes) {
+    void *table = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (table == MAP_FAILED) ? NULL : table;
+}
+
+static int init_segment_table(void) {
+    for (index_bits = 1; (1u << index_bits) < 2u * (unsigned)max_segments; index_bits++) {
+    }
+    index_size = 1u << index_bits;
+    segments = table_alloc((size_t)max_segments * sizeof(shm_segment_t));
+    free_slots = table_alloc((size_t)max_segments * sizeof(int));
+    segment_index = table_alloc(index_size * sizeof(uint64_t));
+    key_index = table_alloc(index_size * sizeof(int));
+    quota_accounts = table_alloc((size_t)(MAX_CLIENTS + max_segments) * sizeof(quota_account_t));
+    if (segments == NULL || free_slots == NULL || segment_index == NULL || key_index == NULL ||
+        quota_accounts == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+// Функция для поиска сегмента по ID (под segments_mutex)
 static shm_segment_t* find_segment(int shmid) {
-    for (int i = 0; i < MAX_SEGMENTS; i++) {
-        if (segments[i].shmid == shmid && segments[i].addr != NULL) {
-            return &segments[i];
+    return lookup_segment(shmid);
+}
+
+// Поиск сегмента по ключу (под segments_mutex)
+static shm_segment_t* find_key(int key) {
+    for (unsigned i = index_home(key); key_index[i] != 0; i = (i + 1) & (index_size - 1)) {
+        shm_segment_t *segment = &segments[key_index[i] - 1];
+        if (segment->key == key) {
+            return segment;
         }
     }
     return NULL;
 }
 
+// Добавление ключа сегмента в индекс (под segments_mutex). Ключ, уже занятый
+// другим сегментом, не переназначается.
+static void index_key(shm_segment_t *segment) {
+    if (segment->key == IPC_PRIVATE) {
+        return;
+    }
+    unsigned i = index_home(segment->key);
+    for (; key_index[i] != 0; i = (i + 1) & (index_size - 1)) {
+        if (segments[key_index[i] - 1].key == segment->key) {
+            return;
+        }
+    }
+    key_index[i] = (int)(segment - segments) + 1;
+}
+
+// Удаление ключа сегмента из индекса (под segments_mutex). После IPC_RMID ключ
+// свободен, как в System V: shmget с ним создаст новый сегмент.
+static void unindex_key(shm_segment_t *segment) {
+    if (segment->key == IPC_PRIVATE) {
+        return;
+    }
+    int value = (int)(segment - segments) + 1;
+    unsigned hole = index_home(segment->key);
+    while (key_index[hole] != value) {
+        if (key_index[hole] == 0) {
+            return; // Сегмент не проиндексирован
+        }
+        hole = (hole + 1) & (index_size - 1);
+    }
+
+    // Сдвигаем назад записи, начальная ячейка которых не лежит между дыркой и ними
+    key_index[hole] = 0;
+    for (unsigned i = (hole + 1) & (index_size - 1); key_index[i] != 0; i = (i + 1) & (index_size - 1)) {
+        unsigned home = index_home(segments[key_index[i] - 1].key);
+        if (((i - home) & (index_size - 1)) >= ((i - hole) & (index_size - 1))) {
+            key_index[hole] = key_index[i];
+            key_index[i] = 0;
+            hole = i;
+        }
+    }
+}
+
+// Число присоединенных клиентов
+static unsigned segment_attached(const shm_segment_t *segment) {
+    return (uint32_t)__atomic_load_n(&segment->attach_state, __ATOMIC_ACQUIRE) & ATTACH_COUNT;
+}
+
+// Освобождение описателя, если к сегменту никто не присоединен (под segments_mutex).
+// После этого новые присоединения к нему невозможны.
+static int retire_if_unused(shm_segment_t *segment) {
+    uint64_t state = __atomic_load_n(&segment->attach_state, __ATOMIC_ACQUIRE);
+    do {
+        if ((uint32_t)state & (ATTACH_COUNT | ATTACH_DEAD)) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&segment->attach_state, &state, state | ATTACH_DEAD, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+// Запрет присоединений на время передачи сегмента (под segments_mutex)
+static void freeze_attachments(shm_segment_t *segment) {
+    __atomic_fetch_or(&segment->attach_state, (uint64_t)ATTACH_FROZEN, __ATOMIC_SEQ_CST);
+}
+
+static void thaw_attachments(shm_segment_t *segment) {
+    __atomic_fetch_and(&segment->attach_state, ~(uint64_t)ATTACH_FROZEN, __ATOMIC_SEQ_CST);
+}
+
+// Размер битовой карты страниц сегмента
+static size_t page_bitmap_size(size_t size) {
+    size_t pages = (size + DSHM_PAGE_SIZE - 1) / DSHM_PAGE_SIZE;
+    return (pages + 7) / 8 + 1;
+}
+
 // Функция для создания нового сегмента
-static shm_segment_t* create_segment(int shmid, size_t size, int shmflg) {
+// Отображение памяти отдельного сегмента. Память берется из файла memfd, чтобы
+// ее можно было передать новому процессу сервера; memfd >= 0 - уже готовый файл
+// (полученный от прежнего процесса). *fd_out - файл отображения или -1.
+static void *map_segment_memory(size_t size, int shmflg, int memfd, int *fd_out) {
+    int prot = (shmflg & SHM_RDONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+    if (memfd < 0) {
+        memfd = memfd_create("dshm_segment", MFD_CLOEXEC);
+        if (memfd != -1 && ftruncate(memfd, (off_t)size) == -1) {
+            close(memfd);
+            return MAP_FAILED;
+        }
+    }
+    
+    // Без memfd (старое ядро) сегмент живет только в этом процессе
+    void *addr = (memfd != -1) ? mmap(NULL, size, prot, MAP_SHARED, memfd, 0)
+                               : mmap(NULL, size, prot, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (addr == MAP_FAILED && memfd != -1) {
+        close(memfd);
+        memfd = -1;
+    }
+    *fd_out = memfd;
+    return addr;
+}
+
+// Создание сегмента; memfd >= 0 - память сегмента уже есть в этом файле
+static shm_segment_t* create_segment_from(int shmid, size_t size, int shmflg, int memfd) {
     // Проверяем, существует ли уже сегмент с таким ID
     if (find_segment(shmid) != NULL) {
         return NULL; // Сегмент уже существует
     }
 
-    // Ищем свободный слот
-    for (int i = 0; i < MAX_SEGMENTS; i++) {
-        if (segments[i].addr == NULL) {
-            // Создаем сегмент в памяти
-            void *addr = mmap(NULL, size, 
-                             (shmflg & SHM_RDONLY) ? PROT_READ : PROT_READ | PROT_WRITE,
-                             MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-            
-            if (addr == MAP_FAILED) {
-                return NULL; // Ошибка выделения памяти
-            }
+    // Берем свободный описатель
+    int i = take_slot();
+    if (i == -1) {
+        return NULL; // Нет свободных описателей
+    }
+    
+    // Малые сегменты размещаются в общих областях, чтобы не тратить
+    // на каждый отдельное отображение и целую страницу
+    int pooled = (memfd < 0 && dshm_arena_fits(size));
+    int fd = -1;
+    void *addr;
+    if (pooled) {
+        addr = dshm_arena_alloc(&segment_arenas, size, &segments[i]);
+        if (addr == NULL) {
+            free_slots[free_slot_count++] = i;
+            errno = ENOMEM;
+            return NULL;
+        }
+    } else {
+        // Создаем сегмент в памяти
+        addr = map_segment_memory(size, shmflg, memfd, &fd);
+        if (addr == MAP_FAILED) {
+            free_slots[free_slot_count++] = i;
+            return NULL; // Ошибка выделения памяти
+        }
+    }
 
-            segments[i].shmid = shmid;
-            segments[i].addr = addr;
-            segments[i].size = size;
-            segments[i].shmflg = shmflg;
-            segments[i].ref_count = 0;
-            segments[i].attached_clients = 0;
-            
-            segment_count++;
-            return &segments[i];
+    // Страницы выделяются лениво; учитываем, какие из них уже записаны
+    unsigned char *touched = calloc(page_bitmap_size(size), 1);
+    if (touched == NULL) {
+        if (pooled) {
+            dshm_arena_free(&segment_arenas, addr, size);
+        } else {
+            munmap(addr, size);
+            if (fd != -1) {
+                close(fd);
+            }
         }
+        free_slots[free_slot_count++] = i;
+        errno = ENOMEM;
+        return NULL;
     }
+
+    segments[i].shmid = shmid;
+    segments[i].addr = addr;
+    segments[i].size = size;
+    segments[i].shmflg = shmflg;
+    segments[i].migrating = 0;
+    segments[i].touched = touched;
+    segments[i].pooled = pooled;
+    segments[i].memfd = fd;
+    __atomic_store_n(&segments[i].ref_count, 0, __ATOMIC_RELAXED);
+    
+    // Новое поколение описателя без присоединений. В индексе сегмент публикует
+    // вызывающий (index_segment).
+    uint64_t generation = (__atomic_load_n(&segments[i].attach_state, __ATOMIC_RELAXED) >> 32) + 1;
+    __atomic_store_n(&segments[i].attach_state, generation << 32, __ATOMIC_RELEASE);
     
-    return NULL; // Нет свободных слотов
+    segment_count++;
+    segment_bytes += size;
+    return &segments[i];
 }
 
-// Функция для удаления сегмента
-static int remove_segment(int shmid) {
-    shm_segment_t *segment = find_segment(shmid);
-    if (segment == NULL) {
-        return SHM_ENOENT;
+static shm_segment_t* create_segment(int shmid, size_t size, int shmflg) {
+    shm_segment_t *segment = create_segment_from(shmid, size, shmflg, -1);
+    if (segment != NULL) {
+        index_segment(segment);
     }
+    return segment;
+}
 
-    // Проверяем, есть ли присоединенные клиенты
-    if (segment->attached_clients > 0) {
-        // Устанавливаем флаг на удаление после отсоединения всех клиентов
-        segment->shmflg |= IPC_RMID; // Помечаем для удаления
-        return SHM_SUCCESS;
+// Отметка страниц диапазона как записанных
+static void mark_touched(shm_segment_t *segment, size_t offset, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    for (size_t page = offset / DSHM_PAGE_SIZE; page <= (offset + len - 1) / DSHM_PAGE_SIZE; page++) {
+        segment->touched[page / 8] |= (unsigned char)(1u << (page % 8));
+    }
+}
+
+// Сброс сохраненных сумм страниц диапазона при изменении его содержимого
+static void invalidate_checksums(shm_segment_t *segment, size_t offset, size_t len) {
+    if (segment->crc_valid == NULL || len == 0) {
+        return;
+    }
+    for (size_t page = offset / DSHM_PAGE_SIZE; page <= (offset + len - 1) / DSHM_PAGE_SIZE; page++) {
+        segment->crc_valid[page / 8] &= (unsigned char)~(1u << (page % 8));
     }
+}
+
+// Изменение данных опубликованного сегмента (под segments_mutex). Пока счетчик
+// нечетный или отличается от прочитанного до копирования, читатель без блокировки
+// повторяет чтение.
+static void data_write_begin(shm_segment_t *segment) {
+    __atomic_store_n(&segment->write_seq, segment->write_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void data_write_end(shm_segment_t *segment) {
+    __atomic_store_n(&segment->write_seq, segment->write_seq + 1, __ATOMIC_RELEASE);
+}
 
-    // Освобождаем память
-    if (segment->addr != NULL) {
-        munmap(segment->addr, segment->size);
+// Ожидание читателей без блокировки, начавших чтение до эпохи epoch
+static void wait_for_readers_before(uint64_t epoch) {
+    pthread_mutex_lock(&conns_mutex);
+    for (client_conn_t *conn = conn_list; conn != NULL; conn = conn->next) {
+        uint64_t started;
+        while ((started = __atomic_load_n(&conn->read_epoch, __ATOMIC_ACQUIRE)) != 0 && started < epoch) {
+            sched_yield();
+        }
     }
+    pthread_mutex_unlock(&conns_mutex);
+    uint64_t started;
+    while ((started = __atomic_load_n(&replication_read_epoch, __ATOMIC_ACQUIRE)) != 0 && started < epoch) {
+        sched_yield();
+    }
+}
 
-    // Очищаем запись
-    memset(segment, 0, sizeof(shm_segment_t));
-    segment_count--;
-    
-    return SHM_SUCCESS;
+// Ожидание читателей без блокировки, начавших чтение до вызова. Снятые с
+// публикации сегменты и их память после этого можно освобождать.
+static void wait_for_readers(void) {
+    uint64_t epoch = __atomic_add_fetch(&reclaim_epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    wait_for_readers_before(epoch);
 }
 
-// Обработка команды создания сегмента
-static int handle_create_segment(shm_header_t *header, void *data) {
-    size_t size = *(size_t*)data;
-    int shmid = header->shmid;
-    int flags = header->flags;
-    
-    pthread_mutex_lock(&segments_mutex);
-    
-    shm_segment_t *segment = create_segment(shmid, size, flags);
-    if (segment == NULL) {
-        pthread_mutex_unlock(&segments_mutex);
-        return (errno == ENOMEM) ? SHM_ENOMEM : SHM_EINVAL;
+// Освобождение памяти сегмента (под segments_mutex)
+static void release_memory(void *addr, size_t size, int pooled, int fd) {
+    if (pooled) {
+        dshm_arena_free(&segment_arenas, addr, size);
+    } else if (addr != NULL) {
+        munmap(addr, size);
+        if (fd != -1) {
+            close(fd);
+        }
     }
-    
-    pthread_mutex_unlock(&segments_mutex);
-    return SHM_SUCCESS;
 }
 
-// Обработка команды чтения данных
-static int handle_read_data(shm_header_t *header, void *buffer, size_t buffer_size __attribute__((unused))) {
-    pthread_mutex_lock(&segments_mutex);
-    
-    shm_segment_t *segment = find_segment(header->shmid);
+// Освобождение записи списка, которую больше никто не читает (под segments_mutex)
+static void release_retired(retired_t *entry) {
+    shm_segment_t *segment = entry->segment;
     if (segment == NULL) {
-        pthread_mutex_unlock(&segments_mutex);
-        return SHM_ENOENT;
+        release_memory(entry->addr, entry->size, entry->pooled, entry->fd);
+        free(entry->touched);
+        return;
     }
-    
-    // Проверяем, не выходит ли за границы
-    if (header->offset + header->size > segment->size) {
+    release_memory(segment->addr, segment->size, segment->pooled, segment->memfd);
+    free(segment->touched);
+    free(segment->page_crc);
+    free(segment->crc_valid);
+    // Атомарные счетчики не затираются: их могут читать без блокировки
+    memset(segment, 0, offsetof(shm_segment_t, attach_state));
+    free_slots[free_slot_count++] = (int)(segment - segments);
+}
+
+// Поток освобождения: ждет читателей вне segments_mutex и освобождает записи
+// списка, пока он не опустеет
+static void *reclaim_thread(void *arg __attribute__((unused))) {
+    DSHM_TRACE_LOCK(&segments_mutex);
+    while (retired_list != NULL) {
+        retired_t *batch = retired_list;
+        retired_list = NULL;
         pthread_mutex_unlock(&segments_mutex);
-        return SHM_EINVAL;
+        
+        // У первой записи самая поздняя эпоха
+        wait_for_readers_before(batch->epoch);
+        
+        DSHM_TRACE_LOCK(&segments_mutex);
+        while (batch != NULL) {
+            retired_t *next = batch->next;
+            release_retired(batch);
+            free(batch);
+            batch = next;
+        }
     }
-    
-    // Копируем данные из сегмента в буфер
-    memcpy(buffer, (char*)segment->addr + header->offset, header->size);
-    
+    __atomic_store_n(&reclaim_running, 0, __ATOMIC_RELEASE);
     pthread_mutex_unlock(&segments_mutex);
-    return SHM_SUCCESS;
+    return NULL;
 }
 
-// Обработка команды записи данных
-static int handle_write_data(shm_header_t *header, void *data) {
-    pthread_mutex_lock(&segments_mutex);
+// Отложенное освобождение (под segments_mutex; память уже снята с публикации).
+// Без памяти под запись или без потока освобождения читатели ждутся на месте.
+static void retire(retired_t *entry, retired_t *what) {
+    if (entry == NULL) {
+        wait_for_readers();
+        release_retired(what);
+        return;
+    }
+    *entry = *what;
+    entry->epoch = __atomic_add_fetch(&reclaim_epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    entry->next = retired_list;
+    retired_list = entry;
+    if (reclaim_running) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reclaim_thread, NULL) == 0) {
+        __atomic_store_n(&reclaim_running, 1, __ATOMIC_RELEASE);
+        pthread_detach(thread);
+        return;
+    }
+    retired_list = entry->next;
+    wait_for_readers_before(entry->epoch);
+    release_retired(entry);
+    free(entry);
+}
+
+// Была ли страница когда-либо записана
+static int page_touched(const shm_segment_t *segment, size_t page) {
+    return (segment->touched[page / 8] >> (page % 8)) & 1;
+}
+
+// Скопировал ли снимок страницу исходного сегмента
+static int page_copied(const shm_segment_t *snapshot, size_t page) {
+    return (snapshot->cow_copied[page / 8] >> (page % 8)) & 1;
+}
+
+// Копирование страницы в снимок перед ее изменением в исходном сегменте
+static void cow_copy_page(shm_segment_t *snapshot, size_t page) {
+    if (page_copied(snapshot, page)) {
+        return;
+    }
+    // Незаписанная на момент снимка страница читается как нули, копировать нечего
+    if (page_touched(snapshot, page)) {
+        size_t offset = page * DSHM_PAGE_SIZE;
+        size_t chunk = (snapshot->size - offset < DSHM_PAGE_SIZE) ? snapshot->size - offset : DSHM_PAGE_SIZE;
+        memcpy((char*)snapshot->addr + offset, (const char*)snapshot->cow_source->addr + offset, chunk);
+    }
+    snapshot->cow_copied[page / 8] |= (unsigned char)(1u << (page % 8));
+}
+
+// Связывание снимка с исходным сегментом (под segments_mutex)
+static void cow_link(shm_segment_t *snapshot, shm_segment_t *source) {
+    snapshot->cow_source = source;
+    snapshot->next_snapshot = source->snapshots;
+    source->snapshots = snapshot;
+}
+
+// Исключение снимка из списка снимков исходного сегмента (под segments_mutex)
+static void cow_unlink(shm_segment_t *snapshot) {
+    shm_segment_t **link = &snapshot->cow_source->snapshots;
+    while (*link != snapshot) {
+        link = &(*link)->next_snapshot;
+    }
+    *link = snapshot->next_snapshot;
+    snapshot->next_snapshot = NULL;
+    snapshot->cow_source = NULL;
+}
+
+// Копирование при записи: вызывается под segments_mutex перед любым изменением
+// диапазона сегмента. Снимки получают собственную копию страницы только при первом
+// изменении ее в исходном сегменте, поэтому снимок создается за O(размер карты страниц).
+static void cow_before_write(shm_segment_t *segment, size_t offset, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    for (shm_segment_t *snapshot = segment->snapshots; snapshot != NULL; snapshot = snapshot->next_snapshot) {
+        for (size_t page = offset / DSHM_PAGE_SIZE; page <= (offset + len - 1) / DSHM_PAGE_SIZE; page++) {
+            cow_copy_page(snapshot, page);
+        }
+    }
+}
+
+// Отделение снимка от исходного сегмента: копируются все еще общие страницы
+static void cow_detach(shm_segment_t *snapshot) {
+    data_write_begin(snapshot);
+    for (size_t page = 0; page * DSHM_PAGE_SIZE < snapshot->size; page++) {
+        cow_copy_page(snapshot, page);
+    }
+    cow_unlink(snapshot);
+    data_write_end(snapshot);
+    free(snapshot->cow_copied);
+    snapshot->cow_copied = NULL;
+}
+
+// Уплотнение общей области перенесло сегмент (вызывается под segments_mutex)
+static void relocate_segment(void *owner, void *new_addr) {
+    shm_segment_t *segment = owner;
+    if (segment < segments || segment >= segments + max_segments) {
+        // Прежняя память сегмента, сменившего размер, ожидает освобождения
+        ((retired_t*)owner)->addr = new_addr;
+        return;
+    }
+    data_write_begin(segment);
+    segment->addr = new_addr;
+    data_write_end(segment);
+}
+
+// Смена защиты памяти сегмента. Общие области всегда доступны на запись:
+// запрет записи в малые сегменты обеспечивают проверки флагов в обработчиках.
+static void protect_segment(shm_segment_t *segment, int prot) {
+    if (!segment->pooled) {
+        mprotect(segment->addr, segment->size, prot);
+    }
+}
+
+// Освобождение учетной записи квоты, за которой не осталось ни соединений,
+// ни сегментов (под segments_mutex)
+static void account_put(quota_account_t *account) {
+    if (account->conns == 0 && account->segment_bytes == 0) {
+        account->id = 0;
+    }
+}
+
+// Учетная запись квоты владельца соединения (под segments_mutex). Владелец
+// меняется после CMD_AUTH. NULL - свободных записей нет.
+static quota_account_t *conn_account(client_conn_t *conn) {
+    uint64_t id = conn->authenticated ? (QUOTA_BY_UID | conn->uid) : (QUOTA_BY_ADDR | conn->peer_addr);
+    if (conn->account != NULL && conn->account->id == id) {
+        return conn->account;
+    }
     
-    shm_segment_t *segment = find_segment(header->shmid);
-    if (segment == NULL) {
-        pthread_mutex_unlock(&segments_mutex);
-        return SHM_ENOENT;
+    quota_account_t *account = NULL;
+    for (int i = 0; i < quota_accounts_high; i++) {
+        if (quota_accounts[i].id == id) {
+            account = &quota_accounts[i];
+            break;
+        }
+        if (account == NULL && quota_accounts[i].id == 0) {
+            account = &quota_accounts[i];
+        }
+    }
+    if (account == NULL) {
+        if (quota_accounts_high == MAX_CLIENTS + max_segments) {
+            return NULL;
+        }
+        account = &quota_accounts[quota_accounts_high++];
+    }
+    if (account->id != id) {
+        account->id = id;
+        account->segment_bytes = 0;
+        account->conns = 0;
     }
     
-    // Проверяем, что сегмент не только для чтения
-    if (segment->shmflg & SHM_RDONLY) {
-        pthread_mutex_unlock(&segments_mutex);
-        return SHM_EACCES;
+    if (conn->account != NULL) {
+        conn->account->conns--;
+        account_put(conn->account);
+    }
+    account->conns++;
+    conn->account = account;
+    return account;
+}
+
+// Удаление сегмента. Память и запись освобождаются после ожидания читателей
+// без блокировки (retire).
+static void destroy_segment(shm_segment_t *segment) {
+    // Снимки этого сегмента получают собственные копии страниц
+    while (segment->snapshots != NULL) {
+        cow_detach(segment->snapshots);
     }
+    if (segment->cow_source != NULL) {
+        cow_unlink(segment);
+    }
+    free(segment->cow_copied);
+    unindex_key(segment);
     
-    // Проверяем, не выходит ли за границы
-    if (header->offset + header->size > segment->size) {
-        pthread_mutex_unlock(&segments_mutex);
-        return SHM_EINVAL;
+    segment_bytes -= segment->size;
+    if (segment->creator != NULL) {
+        quota_account_t *account = segment->creator;
+        account->segment_bytes -= segment->size;
+        account_put(account);
     }
     
-    // Копируем данные из буфера в сегмент
-    memcpy((char*)segment->addr + header->offset, data, header->size);
+    // Описатель снимается с публикации и переходит в новое поколение, поэтому
+    // запоздавшие присоединения и чтения по старому результату поиска не пройдут.
+    // Память освобождается, когда ее перестанут читать без блокировки.
+    unindex_segment(segment);
+    uint64_t generation = (__atomic_load_n(&segment->attach_state, __ATOMIC_RELAXED) >> 32) + 1;
+    __atomic_store_n(&segment->attach_state, (generation << 32) | ATTACH_DEAD, __ATOMIC_SEQ_CST);
+    segment->retired = 1;
+    segment_count--;
     
-    pthread_mutex_unlock(&segments_mutex);
-    return SHM_SUCCESS;
+    retired_t what = { .segment = segment };
+    retire(malloc(sizeof(retired_t)), &what);
 }
 
-// Обработка команды присоединения к сегменту
-static int handle_attach_segment(shm_header_t *header) {
-    pthread_mutex_lock(&segments_mutex);
+// Копирование диапазона сегмента в буфер без обращения к незаписанным страницам
+// (они заполняются нулями и не отображаются в память сервера).
+// Возвращает 1, если в диапазоне нет ни одной записанной страницы.
+static int copy_out(const shm_segment_t *segment, size_t offset, size_t len, void *buffer) {
+    char *dst = buffer;
+    int all_zero = 1;
+
+    while (len > 0) {
+        size_t page = offset / DSHM_PAGE_SIZE;
+        size_t chunk = DSHM_PAGE_SIZE - offset % DSHM_PAGE_SIZE;
+        if (chunk > len) {
+            chunk = len;
+        }
+
+        if (page_touched(segment, page)) {
+            // Страницы снимка, не измененные с момента его создания, берем из исходного сегмента
+            const shm_segment_t *owner = (segment->cow_source != NULL && !page_copied(segment, page))
+                                         ? segment->cow_source : segment;
+            memcpy(dst, (const char*)owner->addr + offset, chunk);
+            all_zero = 0;
+        } else {
+            memset(dst, 0, chunk);
+        }
+
+        dst += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    return all_zero;
+}
+
+// Копирование диапазона из сегмента src в сегмент dst (под segments_mutex).
+// В одном сегменте диапазоны могут перекрываться, как у memmove. Части не выходят
+// за границы страниц: незаписанные страницы источника не читаются, приемник на
+// их месте обнуляется, а его еще не записанные страницы так и остаются незаписанными.
+static void copy_range(shm_segment_t *dst, size_t dst_offset, const shm_segment_t *src,
+                       size_t src_offset, size_t len) {
+    // Приемник правее перекрывающегося с ним источника: копируем с конца
+    int backward = (dst == src && dst_offset > src_offset && dst_offset < src_offset + len);
+    int stream = (len >= DSHM_STREAM_MIN);
+    size_t done = 0;
+
+    while (done < len) {
+        size_t left = len - done;
+        size_t s, d, chunk;
+        if (backward) {
+            size_t s_end = src_offset + left;
+            size_t d_end = dst_offset + left;
+            chunk = (s_end - 1) % DSHM_PAGE_SIZE + 1;
+            if (chunk > (d_end - 1) % DSHM_PAGE_SIZE + 1) {
+                chunk = (d_end - 1) % DSHM_PAGE_SIZE + 1;
+            }
+            if (chunk > left) {
+                chunk = left;
+            }
+            s = s_end - chunk;
+            d = d_end - chunk;
+        } else {
+            s = src_offset + done;
+            d = dst_offset + done;
+            chunk = DSHM_PAGE_SIZE - s % DSHM_PAGE_SIZE;
+            if (chunk > DSHM_PAGE_SIZE - d % DSHM_PAGE_SIZE) {
+                chunk = DSHM_PAGE_SIZE - d % DSHM_PAGE_SIZE;
+            }
+            if (chunk > left) {
+                chunk = left;
+            }
+        }
+
+        size_t page = s / DSHM_PAGE_SIZE;
+        char *to = (char*)dst->addr + d;
+        if (page_touched(src, page)) {
+            // Страницы снимка, не измененные с момента его создания, берем из исходного сегмента
+            const shm_segment_t *owner = (src->cow_source != NULL && !page_copied(src, page))
+                                         ? src->cow_source : src;
+            const char *from = (const char*)owner->addr + s;
+            if (owner == dst && to < from + chunk && from < to + chunk) {
+                memmove(to, from, chunk);
+            } else if (stream) {
+                dshm_stream_copy(to, from, chunk);
+            } else {
+                memcpy(to, from, chunk);
+            }
+            mark_touched(dst, d, chunk);
+        } else if (page_touched(dst, d / DSHM_PAGE_SIZE)) {
+            memset(to, 0, chunk);
+        }
+        done += chunk;
+    }
+    if (stream) {
+        dshm_stream_fence();
+    }
+}
+
+// Обнуление диапазона [start, end) с возвратом целых страниц системе (под segments_mutex)
+static void punch_range(shm_segment_t *segment, size_t start, size_t end) {
+    cow_before_write(segment, start, end - start);
+    invalidate_checksums(segment, start, end - start);
+    data_write_begin(segment);
     
-    shm_segment_t *segment = find_segment(header->shmid);
+    // Целые страницы возвращаем системе, края диапазона просто обнуляем.
+    // Отображение разделяемое, поэтому нужен MADV_REMOVE: MADV_DONTNEED
+    // не освобождает страницы shmem и не обнуляет их.
+    size_t first = (start + DSHM_PAGE_SIZE - 1) / DSHM_PAGE_SIZE;
+    size_t last = end / DSHM_PAGE_SIZE;   // Не включая
+    if (first < last) {
+        char *hole = (char*)segment->addr + first * DSHM_PAGE_SIZE;
+        size_t hole_len = (last - first) * DSHM_PAGE_SIZE;
+        if (madvise(hole, hole_len, MADV_REMOVE) == -1) {
+            memset(hole, 0, hole_len);
+        }
+        for (size_t page = first; page < last; page++) {
+            segment->touched[page / 8] &= (unsigned char)~(1u << (page % 8));
+        }
+        if (start < first * DSHM_PAGE_SIZE) {
+            memset((char*)segment->addr + start, 0, first * DSHM_PAGE_SIZE - start);
+        }
+        if (end > last * DSHM_PAGE_SIZE) {
+            memset((char*)segment->addr + last * DSHM_PAGE_SIZE, 0, end - last * DSHM_PAGE_SIZE);
+        }
+    } else {
+        memset((char*)segment->addr + start, 0, end - start);
+    }
+    data_write_end(segment);
+}
+
+// Изменение размера сегмента (под segments_mutex). Отдельное отображение файла
+// memfd меняет размер на месте (mremap), а если расти рядом некуда, файл
+// отображается заново по другому адресу - данные при этом не копируются. Малые
+// сегменты и сегменты без memfd переносятся в новую память с копированием
+// записанных страниц. Добавленные страницы читаются как нули.
+static int resize_segment(shm_segment_t *segment, size_t size) {
+    size_t old_size = segment->size;
+    if (size == old_size) {
+        return SHM_SUCCESS;
+    }
+    
+    // Отрезаемые страницы, которые еще разделяют снимки, сначала копируются в снимки
+    if (size < old_size) {
+        cow_before_write(segment, size, old_size - size);
+    }
+    
+    size_t kept = (size < old_size) ? size : old_size;
+    size_t kept_pages = (kept + DSHM_PAGE_SIZE - 1) / DSHM_PAGE_SIZE;
+    unsigned char *touched = calloc(page_bitmap_size(size), 1);
+    if (touched == NULL) {
+        return SHM_ENOMEM;
+    }
+    for (size_t page = 0; page < kept_pages; page++) {
+        if (page_touched(segment, page)) {
+            touched[page / 8] |= (unsigned char)(1u << (page % 8));
+        }
+    }
+    
+    // Прежнюю память еще могут читать без блокировки: она освобождается
+    // после ожидания читателей (retire), запись для этого нужна заранее
+    retired_t *entry = malloc(sizeof(retired_t));
+    if (entry == NULL) {
+        free(touched);
+        return SHM_ENOMEM;
+    }
+    
+    int in_place = (!segment->pooled && segment->memfd != -1);
+    int pooled = segment->pooled;
+    int fd = segment->memfd;
+    void *addr = segment->addr;
+    if (in_place && size > old_size) {
+        // Файл не укорачивается при уменьшении (прежнее отображение еще читают),
+        // поэтому он может быть уже достаточно длинным
+        struct stat st;
+        if (fstat(fd, &st) == -1 || ((size_t)st.st_size < size && ftruncate(fd, (off_t)size) == -1)) {
+            free(entry);
+            free(touched);
+            return SHM_ENOMEM;
+        }
+        addr = mremap(segment->addr, old_size, size, 0);
+        if (addr == MAP_FAILED) {
+            // Новое отображение получает ту же защиту, что и map_segment_memory
+            int prot = (segment->shmflg & SHM_RDONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+            addr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+        }
+        if (addr == MAP_FAILED) {
+            free(entry);
+            free(touched);
+            return SHM_ENOMEM;
+        }
+    } else if (!in_place) {
+        pooled = dshm_arena_fits(size);
+        // Память только для чтения закрывается от записи после копирования данных
+        addr = pooled ? dshm_arena_alloc(&segment_arenas, size, segment)
+                      : map_segment_memory(size, segment->shmflg & ~SHM_RDONLY, -1, &fd);
+        if (addr == NULL || addr == MAP_FAILED) {
+            free(entry);
+            free(touched);
+            return SHM_ENOMEM;
+        }
+        for (size_t page = 0; page < kept_pages; page++) {
+            if (page_touched(segment, page)) {
+                size_t offset = page * DSHM_PAGE_SIZE;
+                size_t chunk = (kept - offset < DSHM_PAGE_SIZE) ? kept - offset : DSHM_PAGE_SIZE;
+                memcpy((char*)addr + offset, (char*)segment->addr + offset, chunk);
+            }
+        }
+        if (!pooled && (segment->shmflg & SHM_RDONLY)) {
+            mprotect(addr, size, PROT_READ);
+        }
+    }
+    
+    // Читатели без блокировки берут адрес, размер и карту страниц вместе
+    // внутри write_seq и перечитывают их, если сегмент менялся
+    data_write_begin(segment);
+    retired_t old = {
+        .addr = segment->addr,
+        .size = old_size,
+        .pooled = segment->pooled,
+        .fd = in_place ? -1 : segment->memfd,
+        .touched = segment->touched,
+    };
+    segment->addr = addr;
+    segment->size = size;
+    segment->touched = touched;
+    segment->pooled = pooled;
+    segment->memfd = fd;
+    
+    if (in_place && size < old_size) {
+        // Отрезанный хвост обнуляется в файле: при новом росте он должен читаться
+        // нулями. Отображение хвоста снимается после ожидания читателей.
+        size_t page_end = kept_pages * DSHM_PAGE_SIZE;
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)size, (off_t)(old_size - size)) == -1) {
+            perror("fallocate");
+        }
+        old.addr = (page_end < old_size) ? (char*)old.addr + page_end : NULL;
+        old.size = (page_end < old_size) ? old_size - page_end : 0;
+    } else if (in_place && addr == old.addr) {
+        old.addr = NULL;
+    } else if (old.pooled) {
+        // Уплотнение общей области переносит блок вместе с записью (relocate_segment)
+        dshm_arena_set_owner(&segment_arenas, old.addr, old_size, entry);
+    }
+    
+    // Суммы страниц посчитаются заново по первому запросу
+    free(segment->page_crc);
+    free(segment->crc_valid);
+    segment->page_crc = NULL;
+    segment->crc_valid = NULL;
+    data_write_end(segment);
+    retire(entry, &old);
+    
+    segment_bytes = segment_bytes - old_size + size;
+    if (segment->creator != NULL) {
+        quota_account_t *account = segment->creator;
+        account->segment_bytes = account->segment_bytes - old_size + size;
+    }
+    return SHM_SUCCESS;
+}
+
+// Функция для удаления сегмента
+static int remove_segment(int shmid) {
+    shm_segment_t *segment = find_segment(shmid);
     if (segment == NULL) {
-        pthread_mutex_unlock(&segments_mutex);
         return SHM_ENOENT;
     }
+    if (segment->migrating) {
+        return SHM_EAGAIN;
+    }
+    unindex_key(segment);
+
+    // Проверяем, есть ли присоединенные клиенты
+    if (!retire_if_unused(segment)) {
+        // Устанавливаем флаг на удаление после отсоединения всех клиентов.
+        // Флаг выставляется до повторной проверки: отсоединение, обнулившее
+        // счетчик между ними, увидит флаг и удалит сегмент само.
+        __atomic_fetch_or(&segment->shmflg, SEGMENT_REMOVED, __ATOMIC_SEQ_CST); // Помечаем для удаления
+        if (!retire_if_unused(segment)) {
+            return SHM_SUCCESS;
+        }
+    }
+
+    // Освобождаем память и очищаем запись
+    destroy_segment(segment);
+    
+    return SHM_SUCCESS;
+}
+
+// Описание сегмента для передачи другому узлу (данные передаются отдельно)
+static void pack_meta(const shm_segment_t *segment, shm_migrate_t *out) {
+    shm_migrate_t meta = {
+        .size_hi = htonl((uint32_t)((uint64_t)segment->size >> 32)),
+        .size_lo = htonl((uint32_t)segment->size),
+        .shmflg = htonl(segment->shmflg),
+        .ref_count = htonl(__atomic_load_n(&segment->ref_count, __ATOMIC_RELAXED)),
+        .attached_clients = htonl(segment_attached(segment)),
+        .snapshot = htonl(segment->snapshot),
+        .key = htonl(segment->key),
+        .uid = htonl(segment->uid),
+        .gid = htonl(segment->gid),
+        .cuid = htonl(segment->cuid),
+        .cgid = htonl(segment->cgid)
+    };
+    memcpy(out, &meta, sizeof(meta));
+}
+
+// Упаковка сегмента для передачи на другой узел (вызывается под segments_mutex)
+static void *pack_segment(const shm_segment_t *segment, size_t *packed_size) {
+    size_t total = sizeof(shm_migrate_t) + segment->size;
+    if (total > UINT32_MAX) {
+        errno = EFBIG;
+        return NULL;
+    }
+
+    char *packed = malloc(total);
+    if (packed == NULL) {
+        return NULL;
+    }
+
+    pack_meta(segment, (shm_migrate_t*)packed);
+    copy_out(segment, 0, segment->size, packed + sizeof(shm_migrate_t));
+
+    *packed_size = total;
+    return packed;
+}
+
+// Заполнение диапазона нового сегмента переданными данными (под segments_mutex).
+// Нулевые страницы не копируем, чтобы сегмент остался разреженным.
+static void fill_segment(shm_segment_t *segment, size_t offset, const char *src, size_t len) {
+    // Сегмент только для чтения временно открываем на запись для заполнения
+    if (segment->shmflg & SHM_RDONLY) {
+        protect_segment(segment, PROT_READ | PROT_WRITE);
+    }
+    data_write_begin(segment);
+    static const char zero_page[DSHM_PAGE_SIZE];
+    size_t end = offset + len;
+    while (offset < end) {
+        size_t chunk = DSHM_PAGE_SIZE - offset % DSHM_PAGE_SIZE;
+        if (chunk > end - offset) {
+            chunk = end - offset;
+        }
+        if (memcmp(src, zero_page, chunk) != 0) {
+            memcpy((char*)segment->addr + offset, src, chunk);
+            mark_touched(segment, offset, chunk);
+        }
+        src += chunk;
+        offset += chunk;
+    }
+    data_write_end(segment);
+    if (segment->shmflg & SHM_RDONLY) {
+        protect_segment(segment, PROT_READ);
+    }
+}
+
+// Создание сегмента из упакованного представления (вызывается под segments_mutex).
+// INSTALL_PARTIAL - данные могут содержать лишь начало сегмента (остальное пока нули),
+// INSTALL_STAGED - сегмент не публикуется, пока его не получат целиком (publish_staged).
+#define INSTALL_PARTIAL 0x1
+#define INSTALL_STAGED 0x2
+
+static int install_segment(int shmid, const void *packed, size_t packed_size, int how,
+                           shm_segment_t **installed) {
+    shm_migrate_t meta;
+    if (packed == NULL || packed_size < sizeof(meta)) {
+        return SHM_EINVAL;
+    }
+    memcpy(&meta, packed, sizeof(meta));
+
+    size_t size = (size_t)(((uint64_t)ntohl(meta.size_hi) << 32) | ntohl(meta.size_lo));
+    size_t len = packed_size - sizeof(meta);
+    if ((how & INSTALL_PARTIAL) ? len > size : len != size) {
+        return SHM_EINVAL;
+    }
+
+    // Сегмент с этим shmid здесь уже есть: принятый не должен считаться установленным
+    if (find_segment(shmid) != NULL) {
+        return SHM_EEXIST;
+    }
+    shm_segment_t *segment = create_segment_from(shmid, size, (int32_t)ntohl(meta.shmflg), -1);
+    if (segment == NULL) {
+        return SHM_ENOMEM;
+    }
+    if (installed != NULL) {
+        *installed = segment;
+    }
+    fill_segment(segment, 0, (const char*)packed + sizeof(meta), len);
+
+    __atomic_store_n(&segment->ref_count, (int32_t)ntohl(meta.ref_count), __ATOMIC_RELAXED);
+    __atomic_fetch_or(&segment->attach_state, (uint64_t)(ntohl(meta.attached_clients) & ATTACH_COUNT), __ATOMIC_RELEASE);
+    segment->snapshot = (int32_t)ntohl(meta.snapshot);
+    segment->key = (int32_t)ntohl(meta.key);
+    segment->uid = ntohl(meta.uid);
+    segment->gid = ntohl(meta.gid);
+    segment->cuid = ntohl(meta.cuid);
+    segment->cgid = ntohl(meta.cgid);
+    if (how & INSTALL_STAGED) {
+        segment->migrating = MIGRATING_IN;
+    } else {
+        index_segment(segment);
+        if (!(segment->shmflg & SEGMENT_REMOVED)) {
+            index_key(segment);
+        }
+    }
+    return SHM_SUCCESS;
+}
+
+// Один запрос в открытом соединении с другим узлом. Ответ (если есть) - в reply.
+// Возвращает результат команды или SHM_ERROR при ошибке соединения
+static int node_call(int sock, dshm_reader_t *reader, uint32_t command, int shmid, int flags, uint32_t offset,
+                     const void *data, size_t data_size, void **reply, size_t *reply_size) {
+    shm_header_t header = {
+        .command = htonl(command),
+        .size = htonl((uint32_t)data_size),
+        .shmid = htonl(shmid),
+        .flags = htonl(flags),
+        .offset = htonl(offset)
+    };
+    struct iovec iov[2] = {
+        { &header, sizeof(header) },
+        { (void*)data, data_size },
+    };
+    if (dshm_write_full(sock, iov, 2) == -1) {
+        return SHM_ERROR;
+    }
+
+    shm_response_t response;
+    if (dshm_read_full(reader, &response, sizeof(response)) != sizeof(response)) {
+        return SHM_ERROR;
+    }
+
+    uint32_t size = ntohl(response.data_size);
+    if (size > 0) {
+        void *buf = malloc(size);
+        if (buf == NULL || dshm_read_full(reader, buf, size) != (ssize_t)size) {
+            free(buf);
+            return SHM_ERROR;
+        }
+        if (reply != NULL) {
+            *reply = buf;
+            *reply_size = size;
+        } else {
+            free(buf);
+        }
+    }
+    return (int32_t)ntohl(response.result);
+}
+
+// Подтверждение общего ключа другому узлу: узлы действуют от имени суперпользователя.
+// Возвращает 0, если обе стороны подтвердили ключ
+static int node_authenticate(int sock, dshm_reader_t *reader) {
+    void *nonce = NULL;
+    size_t nonce_size = 0;
+    int caps = node_call(sock, reader, CMD_HELLO, 0, 0, 0, NULL, 0, &nonce, &nonce_size);
+    int status = -1;
+    shm_auth_t auth = { .uid = htonl(0), .gid = htonl(0) };
+    if (node_key == NULL) {
+        fprintf(stderr, "В файле ключей нет ключа узлов: запросы к узлам кластера не отправляются\n");
+    } else if (caps >= 0 && (caps & DSHM_CAP_AUTH) && nonce_size == DSHM_AUTH_NONCE &&
+        dshm_auth_nonce(auth.nonce) == 0) {
+        dshm_auth_proof(node_key->key, (size_t)node_key->len, 'C', nonce, &auth, auth.mac);
+        void *proof = NULL;
+        size_t proof_size = 0;
+        uint8_t expected[DSHM_AUTH_MAC];
+        dshm_auth_proof(node_key->key, (size_t)node_key->len, 'S', nonce, &auth, expected);
+        if (node_call(sock, reader, CMD_AUTH, 0, 0, 0, &auth, sizeof(auth), &proof, &proof_size) == SHM_SUCCESS &&
+            proof_size == DSHM_AUTH_MAC && dshm_auth_equal(expected, proof)) {
+            status = 0;
+        }
+        free(proof);
+    } else if (caps >= 0 && !(caps & DSHM_CAP_AUTH)) {
+        fprintf(stderr, "Узел кластера не требует общего ключа: запросы к нему не отправляются\n");
+    }
+    free(nonce);
+    return status;
+}
+
+// Соединение с другим узлом кластера для последовательности запросов node_call.
+// Возвращает сокет или -1
+static int node_connect(const dshm_node_t *node, dshm_reader_t *reader) {
+    struct addrinfo hints, *addrs = NULL;
+    char port_str[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", node->port);
+    if (getaddrinfo(node->host, port_str, &hints, &addrs) != 0) {
+        return -1;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock != -1 && connect(sock, addrs->ai_addr, addrs->ai_addrlen) == -1) {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addrs);
+    if (sock == -1) {
+        return -1;
+    }
+    dshm_socket_setup(sock);
+
+    dshm_reader_init(reader, sock);
+    if (auth_key_count > 0 && node_authenticate(sock, reader) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Синхронный запрос к другому узлу кластера (отдельное соединение на запрос)
+static int node_request(const dshm_node_t *node, uint32_t command, int shmid, int flags,
+                        const void *data, size_t data_size, void **reply, size_t *reply_size) {
+    if (reply != NULL) {
+        *reply = NULL;
+        *reply_size = 0;
+    }
+
+    dshm_reader_t reader;
+    int sock = node_connect(node, &reader);
+    if (sock == -1) {
+        return SHM_ERROR;
+    }
+    int result = node_call(sock, &reader, command, shmid, flags, 0, data, data_size, reply, reply_size);
+    close(sock);
+    return result;
+}
+
+// Индекс этого узла в карте (без явного адреса - первый узел с нашим портом)
+static int find_self(const dshm_cluster_t *map) {
+    if (self_host[0] == '\0') {
+        for (int i = 0; i < map->node_count; i++) {
+            if (map->nodes[i].port == self_port) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    return dshm_cluster_find(map, self_host, self_port);
+}
+
+// Принадлежит ли сегмент узлу self по карте map
+static int owns_shmid(const dshm_cluster_t *map, int self, int shmid) {
+    if (map->node_count == 0) {
+        return 1; // Одиночный режим - все сегменты локальные
+    }
+    return self >= 0 && dshm_cluster_owner(map, shmid) == self;
+}
+
+// Забирает сегмент у прежнего владельца, если карта сменилась и сегмента здесь еще нет
+static int pull_segment(int shmid) {
+    dshm_node_t prev_node;
+    int have_prev = 0;
+
+    pthread_mutex_lock(&cluster_mutex);
+    if (prev_cluster.node_count > 0 && !owns_shmid(&prev_cluster, prev_self, shmid)) {
+        prev_node = prev_cluster.nodes[dshm_cluster_owner(&prev_cluster, shmid)];
+        have_prev = 1;
+    }
+    pthread_mutex_unlock(&cluster_mutex);
+
+    if (!have_prev) {
+        return SHM_SUCCESS;
+    }
+
+    // Сериализуем перенос, чтобы параллельные запросы не забрали сегмент дважды
+    pthread_mutex_lock(&migration_mutex);
+
+    // Копия для чтения, оставшаяся с прежней карты, уступает место самому сегменту
+    DSHM_TRACE_LOCK(&segments_mutex);
+    shm_segment_t *segment = find_segment(shmid);
+    if (segment != NULL && segment->replica) {
+        destroy_segment(segment);
+        segment = NULL;
+    }
+    int exists = (segment != NULL);
+    pthread_mutex_unlock(&segments_mutex);
+
+    int result = SHM_SUCCESS;
+    if (!exists) {
+        void *packed = NULL;
+        size_t packed_size = 0;
+        result = node_request(&prev_node, CMD_MIGRATE_OUT, shmid, 0, NULL, 0, &packed, &packed_size);
+        if (result == SHM_SUCCESS) {
+            DSHM_TRACE_LOCK(&segments_mutex);
+            result = install_segment(shmid, packed, packed_size, 0, NULL);
+            pthread_mutex_unlock(&segments_mutex);
+            
+            // Прежний владелец удаляет сегмент только после подтверждения установки.
+            // Если подтверждение потеряно, у него остается замороженная копия, а не
+            // пропадает сам сегмент.
+            int flags = (result == SHM_SUCCESS) ? DSHM_MIGRATE_COMMIT : DSHM_MIGRATE_ABORT;
+            if (node_request(&prev_node, CMD_MIGRATE_OUT, shmid, flags, NULL, 0, NULL, NULL) != SHM_SUCCESS) {
+                fprintf(stderr, "Не удалось подтвердить перенос сегмента %d с узла %s:%d\n",
+                        shmid, prev_node.host, prev_node.port);
+            }
+        } else if (result == SHM_ENOENT) {
+            // У прежнего владельца сегмента нет
+            result = SHM_SUCCESS;
+        } else {
+            // Прежний владелец недоступен или не смог отдать сегмент: его отсутствие
+            // не подтверждено, запрос нужно повторить
+            result = SHM_EAGAIN;
+        }
+        free(packed);
+    }
+
+    pthread_mutex_unlock(&migration_mutex);
+    return result;
+}
+
+// Ищет ключ у прежнего владельца его корзины, если карта сменилась и ключа здесь
+// еще нет, и забирает найденный сегмент. Иначе shmget создал бы второй сегмент
+// с тем же ключом, пока миграция не завершилась.
+static int pull_key(int key) {
+    dshm_node_t prev_node;
+    int have_prev = 0;
+
+    pthread_mutex_lock(&cluster_mutex);
+    if (prev_cluster.node_count > 0 && !owns_shmid(&prev_cluster, prev_self, key)) {
+        prev_node = prev_cluster.nodes[dshm_cluster_owner(&prev_cluster, key)];
+        have_prev = 1;
+    }
+    pthread_mutex_unlock(&cluster_mutex);
+
+    if (!have_prev) {
+        return SHM_SUCCESS;
+    }
+
+    // Поиск без создания: нулевой размер и флаги без IPC_CREAT
+    size_t size = 0;
+    int shmid = node_request(&prev_node, CMD_CREATE_SEGMENT, key, 0, &size, sizeof(size), NULL, NULL);
+    if (shmid > 0) {
+        return pull_segment(shmid);
+    }
+    // Ключа нет только по ответу ENOENT (или EMOVED: прежний владелец уже знает новую
+    // карту, и ключа у него нет). Иначе shmget(IPC_CREAT) создал бы второй сегмент.
+    return (shmid == SHM_ENOENT || shmid == SHM_EMOVED) ? SHM_SUCCESS : SHM_EAGAIN;
+}
+
+// Монотонное время в миллисекундах
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Отстает ли копия сегмента от владельца не больше чем на max_ms (0 - без ограничения).
+// Отставание оценивается по последнему пакету владельца, включившему все его изменения.
+static int replica_fresh(int shmid, uint32_t max_ms) {
+    if (max_ms == 0) {
+        return 1;
+    }
+    pthread_mutex_lock(&cluster_mutex);
+    int owner = dshm_cluster_owner(&cluster, shmid);
+    pthread_mutex_unlock(&cluster_mutex);
+    
+    uint64_t fresh = (owner >= 0) ? __atomic_load_n(&replica_fresh_ms[owner], __ATOMIC_ACQUIRE) : 0;
+    return fresh != 0 && now_ms() - fresh <= max_ms;
+}
+
+// Проверка, что создание сегмента по ключу должно обслуживаться этим узлом.
+// Ключ обслуживает владелец его корзины; сегмент без ключа создается на любом узле.
+static int route_create(shm_header_t *header) {
+    int key = header->shmid;
+    if (key == IPC_PRIVATE) {
+        return SHM_SUCCESS;
+    }
+
+    pthread_mutex_lock(&cluster_mutex);
+    int local = owns_shmid(&cluster, cluster_self, key);
+    pthread_mutex_unlock(&cluster_mutex);
+
+    DSHM_TRACE_LOCK(&segments_mutex);
+    int exists = (find_key(key) != NULL);
+    pthread_mutex_unlock(&segments_mutex);
+
+    if (!local) {
+        // Сегмент, еще не перенесенный новому владельцу, продолжаем обслуживать здесь
+        return exists ? SHM_SUCCESS : SHM_EMOVED;
+    }
+    return exists ? SHM_SUCCESS : pull_key(key);
+}
+
+// Проверка, что запрос к сегменту должен обслуживаться этим узлом
+static int route_request(shm_header_t *header) {
+    switch (header->command) {
+        case CMD_CREATE_SEGMENT:
+            return route_create(header);
+        case CMD_ATTACH_SEGMENT:
+        case CMD_DETACH_SEGMENT:
+        case CMD_REMOVE_SEGMENT:
+        case CMD_READ_DATA:
+        case CMD_WRITE_DATA:
+        case CMD_SHMCTL:
+        case CMD_PUNCH_HOLE:
+        case CMD_SNAPSHOT:
+        case CMD_GET_CHANGES:
+        case CMD_CHECKSUM:
+        case CMD_SUBSCRIBE:
+        case CMD_FILL:
+        case CMD_COPY:
+        case CMD_RESIZE:
+            break;
+        default:
+            return SHM_SUCCESS;
+    }
+
+    pthread_mutex_lock(&cluster_mutex);
+    int local = owns_shmid(&cluster, cluster_self, header->shmid);
+    pthread_mutex_unlock(&cluster_mutex);
+
+    if (!local) {
+        // Сегмент, еще не перенесенный новому владельцу, продолжаем обслуживать здесь
+        DSHM_TRACE_LOCK(&segments_mutex);
+        shm_segment_t *segment = find_segment(header->shmid);
+        int exists = (segment != NULL && !segment->replica);
+        int replica = (segment != NULL && segment->replica);
+        int partial = (replica && segment->replica_copying);
+        pthread_mutex_unlock(&segments_mutex);
+        
+        // Копия для чтения обслуживает только чтение, и лишь когда получена целиком
+        if (replica && (header->command == CMD_READ_DATA || header->command == CMD_CHECKSUM)) {
+            return (!partial && replica_fresh(header->shmid, (uint32_t)header->flags)) ? SHM_SUCCESS : SHM_EAGAIN;
+        }
+        return exists ? SHM_SUCCESS : SHM_EMOVED;
+    }
+
+    return pull_segment(header->shmid);
+}
+
+// Передача замороженного сегмента новому владельцу частями по MIGRATE_CHUNK в
+// одном соединении: большой сегмент не упаковывается в память целиком.
+// Новый владелец публикует сегмент, только получив последнюю часть.
+static int push_segment(const dshm_node_t *target, shm_segment_t *segment) {
+    // Смещение части передается в 32-битном поле заголовка
+    if (segment->size > UINT32_MAX) {
+        return SHM_EINVAL;
+    }
+    char *buf = malloc(sizeof(shm_migrate_t) + MIGRATE_CHUNK);
+    if (buf == NULL) {
+        return SHM_ENOMEM;
+    }
+    dshm_reader_t reader;
+    int sock = node_connect(target, &reader);
+    if (sock == -1) {
+        free(buf);
+        return SHM_ERROR;
+    }
+
+    int result;
+    size_t offset = 0;
+    do {
+        size_t head = (offset == 0) ? sizeof(shm_migrate_t) : 0;
+        size_t part = (segment->size - offset < MIGRATE_CHUNK) ? segment->size - offset : MIGRATE_CHUNK;
+        DSHM_TRACE_LOCK(&segments_mutex);
+        if (head > 0) {
+            pack_meta(segment, (shm_migrate_t*)buf);
+        }
+        copy_out(segment, offset, part, buf + head);
+        pthread_mutex_unlock(&segments_mutex);
+        result = node_call(sock, &reader, CMD_MIGRATE_IN, segment->shmid, DSHM_MIGRATE_PART, (uint32_t)offset,
+                           buf, head + part, NULL, NULL);
+        offset += part;
+    } while (result == SHM_SUCCESS && offset < segment->size);
+
+    // При обрыве новый владелец удаляет принятые части сам
+    close(sock);
+    free(buf);
+    return result;
+}
+
+// Перенос сегментов, которые по новой карте принадлежат другим узлам
+static void *migration_thread(void *arg __attribute__((unused))) {
+    pthread_mutex_lock(&cluster_mutex);
+    while (migration_pending) {
+        migration_pending = 0;
+        uint32_t epoch = cluster.epoch;
+        pthread_mutex_unlock(&cluster_mutex);
+
+        for (int i = 0; i < segments_high && running; i++) {
+            DSHM_TRACE_LOCK(&segments_mutex);
+            shm_segment_t *segment = &segments[i];
+            if (segment->addr == NULL || segment->retired || segment->migrating) {
+                pthread_mutex_unlock(&segments_mutex);
+                continue;
+            }
+            if (segment->replica) {
+                // Копии прежней карты не переносятся: владельцы пришлют копии заново
+                if (segment->replica_epoch < epoch) {
+                    destroy_segment(segment);
+                }
+                pthread_mutex_unlock(&segments_mutex);
+                continue;
+            }
+
+            int shmid = segment->shmid;
+            dshm_node_t target;
+            pthread_mutex_lock(&cluster_mutex);
+            int local = owns_shmid(&cluster, cluster_self, shmid);
+            if (!local) {
+                target = cluster.nodes[dshm_cluster_owner(&cluster, shmid)];
+            }
+            pthread_mutex_unlock(&cluster_mutex);
+
+            if (local) {
+                pthread_mutex_unlock(&segments_mutex);
+                continue;
+            }
+
+            // Пока сегмент передается, изменения в нем и присоединения запрещены
+            segment->migrating = MIGRATING_PUSH;
+            freeze_attachments(segment);
+            pthread_mutex_unlock(&segments_mutex);
+
+            int result = push_segment(&target, segment);
+
+            DSHM_TRACE_LOCK(&segments_mutex);
+            segment->migrating = 0;
+            if (result == SHM_SUCCESS) {
+                destroy_segment(segment);
+            } else {
+                thaw_attachments(segment);
+            }
+            pthread_mutex_unlock(&segments_mutex);
+
+            if (result == SHM_SUCCESS) {
+                printf("Сегмент %d перенесен на узел %s:%d\n", shmid, target.host, target.port);
+            } else {
+                fprintf(stderr, "Не удалось перенести сегмент %d на узел %s:%d\n",
+                        shmid, target.host, target.port);
+            }
+        }
+
+        pthread_mutex_lock(&cluster_mutex);
+    }
+    migration_running = 0;
+    pthread_mutex_unlock(&cluster_mutex);
+    return NULL;
+}
+
+// Запуск фоновой миграции (вызывается под cluster_mutex)
+static void start_migration(void) {
+    migration_pending = 1;
+    if (migration_running) {
+        return; // Текущий поток миграции сделает еще один проход
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, migration_thread, NULL) == 0) {
+        migration_running = 1;
+        pthread_detach(thread);
+    } else {
+        perror("Ошибка создания потока миграции");
+    }
+}
+
+// Пакет изменений, собираемый для одного узла с копиями
+typedef struct {
+    char *buf;              // shm_replica_batch_t, затем записи с данными
+    size_t len;
+    size_t cap;
+    uint32_t count;
+} replica_batch_t;
+
+// Место еще под extra байт пакета (у пустого пакета - и под заголовок)
+static int batch_reserve(replica_batch_t *batch, size_t extra) {
+    size_t need = (batch->len == 0 ? sizeof(shm_replica_batch_t) : batch->len) + extra;
+    if (need > batch->cap) {
+        size_t cap = (batch->cap > 0) ? batch->cap : 65536;
+        while (cap < need) {
+            cap *= 2;
+        }
+        char *buf = realloc(batch->buf, cap);
+        if (buf == NULL) {
+            return -1;
+        }
+        batch->buf = buf;
+        batch->cap = cap;
+    }
+    if (batch->len == 0) {
+        batch->len = sizeof(shm_replica_batch_t);
+    }
+    return 0;
+}
+
+// Место под данные записи (data_len байт) в конце пакета
+static char *batch_append(replica_batch_t *batch, int shmid, uint32_t type, size_t offset, size_t len,
+                          size_t data_len) {
+    if (batch_reserve(batch, sizeof(shm_change_t) + data_len) == -1) {
+        return NULL;
+    }
+    
+    shm_change_t change = {
+        .shmid = htonl(shmid),
+        .type = htonl(type),
+        .offset = htonl((uint32_t)offset),
+        .len = htonl((uint32_t)len),
+        .data_len = htonl((uint32_t)data_len)
+    };
+    char *p = batch->buf + batch->len;
+    memcpy(p, &change, sizeof(change));
+    batch->len += sizeof(change) + data_len;
+    batch->count++;
+    return p + sizeof(change);
+}
+
+// Сброс признака отправленной копии у всех сегментов: копии будут переданы
+// заново (вызывается под segments_mutex)
+static void replicas_resync_locked(void) {
+    for (int i = 0; i < segments_high; i++) {
+        segments[i].replica_epoch = segments[i].replica ? segments[i].replica_epoch : 0;
+    }
+}
+
+static void replicas_resync(void) {
+    DSHM_TRACE_LOCK(&segments_mutex);
+    replicas_resync_locked();
+    pthread_mutex_unlock(&segments_mutex);
+}
+
+// Рассылка изменений своих сегментов узлам, хранящим их копии. Записи журнала
+// читаются по порядку; данные записи берутся из текущего содержимого сегмента,
+// поэтому копия догоняет владельца, даже если промежуточные состояния пропущены.
+static void *replication_thread(void *arg __attribute__((unused))) {
+    static dshm_cluster_t map;                          // Карта, по которой собран пакет
+    static change_record_t records[CHANGE_LOG_SIZE];
+    static replica_batch_t batches[DSHM_MAX_NODES];
+    uint64_t last_heartbeat = 0;
+    uint64_t retry_at = 0;
+    int backlog = 0;
+    
+    pthread_mutex_lock(&change_mutex);
+    uint64_t cursor = change_next;
+    pthread_mutex_unlock(&change_mutex);
+    
+    while (running) {
+        if (!backlog) {
+            struct timespec pause = { 0, REPLICA_BATCH_MS * 1000000L };
+            nanosleep(&pause, NULL);
+        }
+        
+        pthread_mutex_lock(&cluster_mutex);
+        map = cluster;
+        int self = cluster_self;
+        pthread_mutex_unlock(&cluster_mutex);
+        
+        uint64_t now = now_ms();
+        if (map.replicas == 0 || map.node_count < 2 || self < 0 || now < retry_at) {
+            // Изменений, которые некому или пока не удается отправить, не накапливаем:
+            // после паузы копии передаются целиком
+            pthread_mutex_lock(&change_mutex);
+            cursor = change_next;
+            pthread_mutex_unlock(&change_mutex);
+            backlog = 0;
+            continue;
+        }
+        
+        int nodes[DSHM_MAX_NODES];
+        size_t batched = 0;
+        int failed = 0;
+        DSHM_TRACE_LOCK(&segments_mutex);
+        
+        // Новые записи журнала; вытесненные записи восполняются полными копиями.
+        // Записи берутся под segments_mutex, чтобы части копий ниже соответствовали
+        // размерам сегментов, уже известным копиям.
+        pthread_mutex_lock(&change_mutex);
+        uint64_t oldest = (change_next > CHANGE_LOG_SIZE) ? change_next - CHANGE_LOG_SIZE : 1;
+        int lost = (cursor < oldest);
+        if (lost) {
+            cursor = change_next;
+        }
+        uint32_t count = 0;
+        for (uint64_t seq = cursor; seq < change_next; seq++) {
+            records[count++] = change_log[seq % CHANGE_LOG_SIZE];
+        }
+        uint64_t logged = change_next;
+        pthread_mutex_unlock(&change_mutex);
+        if (lost) {
+            replicas_resync_locked();
+        }
+        
+        // Изменения сегментов, копии которых уже отправлены
+        uint32_t done = 0;
+        for (; done < count && batched < REPLICA_BATCH_MAX && !failed; done++) {
+            const change_record_t *record = &records[done];
+            shm_segment_t *segment = find_segment(record->shmid);
+            size_t data_len = 0;
+            if (record->type != DSHM_CHANGE_REMOVE) {
+                if (segment == NULL || segment->replica || segment->replica_epoch != map.epoch ||
+                    (size_t)record->offset + record->len > segment->size) {
+                    continue;
+                }
+                data_len = (record->type == DSHM_CHANGE_WRITE) ? record->len : 0;
+            }
+            int n = dshm_cluster_replicas(&map, record->shmid, nodes, DSHM_MAX_NODES);
+            for (int k = 0; k < n && !failed; k++) {
+                char *dst = batch_append(&batches[nodes[k]], record->shmid, record->type,
+                                         record->offset, record->len, data_len);
+                if (dst == NULL) {
+                    failed = 1;
+                } else if (data_len > 0) {
+                    copy_out(segment, record->offset, data_len, dst);
+                }
+            }
+            batched += data_len;
+        }
+        cursor += done;
+        backlog = (done < count);
+        
+        // Полные копии сегментов, еще не отправленных по текущей карте, частями по
+        // REPLICA_COPY_CHUNK. Они идут после всех изменений: удаление сегмента должно
+        // опередить копию нового с тем же shmid. Часть обычного сегмента копируется
+        // вне segments_mutex: память удерживает объявленная эпоха чтения, а изменения,
+        // сделанные во время копирования, придут записями журнала. Часть снимка
+        // копируется под блокировкой: его страницы переносятся из исходного сегмента.
+        int chunks = 0;
+        int i = 0;
+        for (; i < segments_high && done == count && (chunks == 0 || batched < REPLICA_BATCH_MAX) && !failed; ) {
+            shm_segment_t *segment = &segments[i];
+            int first = (segment->replica_epoch != map.epoch);
+            if (segment->addr == NULL || segment->retired || segment->replica || segment->migrating ||
+                segment->size > UINT32_MAX ||
+                (!first && !segment->replica_copying) || (segment->shmflg & SEGMENT_REMOVED) ||
+                !owns_shmid(&map, self, segment->shmid)) {
+                i++;
+                continue;
+            }
+            // После уменьшения сегмента остается отправить пустую последнюю часть
+            size_t offset = first ? 0 : segment->replica_copied;
+            if (offset > segment->size) {
+                offset = segment->size;
+            }
+            size_t part = segment->size - offset;
+            if (part > REPLICA_COPY_CHUNK) {
+                part = REPLICA_COPY_CHUNK;
+            }
+            size_t head = first ? sizeof(shm_migrate_t) : 0;
+            
+            char *dst[DSHM_MAX_NODES];
+            int n = dshm_cluster_replicas(&map, segment->shmid, nodes, DSHM_MAX_NODES);
+            for (int k = 0; k < n && !failed; k++) {
+                dst[k] = batch_append(&batches[nodes[k]], segment->shmid,
+                                      first ? DSHM_CHANGE_COPY : DSHM_CHANGE_COPY_PART,
+                                      offset, part, head + part);
+                if (dst[k] == NULL) {
+                    failed = 1;
+                } else if (first) {
+                    pack_meta(segment, (shm_migrate_t*)dst[k]);
+                }
+            }
+            if (failed) {
+                break;
+            }
+            segment->replica_epoch = map.epoch;
+            segment->replica_copied = offset + part;
+            segment->replica_copying = (offset + part < segment->size);
+            batched += head + part;
+            chunks++;
+            if (!segment->replica_copying) {
+                i++;
+            }
+            if (n == 0 || part == 0) {
+                continue;
+            }
+            
+            if (segment->cow_source != NULL) {
+                copy_out(segment, offset, part, dst[0] + head);
+            } else {
+                // Без блокировки сегмент может сменить память: читается прежняя,
+                // она не освобождается до replication_read_epoch = 0
+                shm_segment_t view = { .addr = segment->addr, .touched = segment->touched };
+                __atomic_store_n(&replication_read_epoch, __atomic_load_n(&reclaim_epoch, __ATOMIC_RELAXED),
+                                 __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&segments_mutex);
+                copy_out(&view, offset, part, dst[0] + head);
+                __atomic_store_n(&replication_read_epoch, 0, __ATOMIC_RELEASE);
+                DSHM_TRACE_LOCK(&segments_mutex);
+            }
+            for (int k = 1; k < n; k++) {
+                memcpy(dst[k] + head, dst[0] + head, part);
+            }
+            
+            // Изменения, сделанные без блокировки (в том числе размеров), должны
+            // попасть к копиям раньше следующих частей
+            pthread_mutex_lock(&change_mutex);
+            int changed = (change_next != logged);
+            pthread_mutex_unlock(&change_mutex);
+            if (changed) {
+                break;
+            }
+        }
+        if (i < segments_high) {
+            backlog = 1;
+        }
+        
+        pthread_mutex_unlock(&segments_mutex);
+        
+        // Пакеты с изменениями, а время от времени и пустые - для оценки отставания копий
+        int heartbeat = (now - last_heartbeat >= REPLICA_HEARTBEAT_MS);
+        for (int node = 0; node < map.node_count; node++) {
+            replica_batch_t *batch = &batches[node];
+            if (node != self && !failed && (batch->count > 0 || heartbeat)) {
+                shm_replica_batch_t head = {
+                    .epoch = htonl(map.epoch),
+                    .owner = htonl((uint32_t)self),
+                    .flags = htonl(backlog ? 0 : DSHM_REPLICA_CURRENT),
+                    .count = htonl(batch->count)
+                };
+                if (batch_reserve(batch, 0) == -1) {
+                    failed = 1;
+                } else {
+                    memcpy(batch->buf, &head, sizeof(head));
+                    if (node_request(&map.nodes[node], CMD_REPLICA_UPDATE, 0, 0,
+                                     batch->buf, batch->len, NULL, NULL) != SHM_SUCCESS) {
+                        failed = 1;
+                    }
+                }
+            }
+            batch->len = 0;
+            batch->count = 0;
+        }
+        if (heartbeat) {
+            last_heartbeat = now;
+        }
+        
+        if (failed) {
+            // Узел мог потерять часть изменений: после паузы все копии передаются заново
+            fprintf(stderr, "Не удалось отправить изменения копиям сегментов\n");
+            replicas_resync();
+            retry_at = now_ms() + REPLICA_RETRY_MS;
+        }
+    }
+    
+    pthread_mutex_lock(&cluster_mutex);
+    replication_running = 0;
+    pthread_mutex_unlock(&cluster_mutex);
+    return NULL;
+}
+
+// Запуск рассылки изменений копиям (вызывается под cluster_mutex)
+static void start_replication(void) {
+    if (replication_running) {
+        return;
+    }
+    
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, replication_thread, NULL) == 0) {
+        replication_running = 1;
+        pthread_detach(thread);
+    } else {
+        perror("Ошибка создания потока рассылки копий");
+    }
+}
+
+// Обработка команды получения карты кластера
+static int handle_cluster_map(void **reply, size_t *reply_size) {
+    char *buf = malloc(DSHM_CLUSTER_MAP_MAX);
+    if (buf == NULL) {
+        return SHM_ENOMEM;
+    }
+
+    pthread_mutex_lock(&cluster_mutex);
+    int len = (cluster.node_count > 0) ? dshm_cluster_encode(&cluster, buf, DSHM_CLUSTER_MAP_MAX) : 0;
+    pthread_mutex_unlock(&cluster_mutex);
+
+    if (len <= 0) {
+        free(buf);
+        return (len < 0) ? SHM_ERROR : SHM_SUCCESS;
+    }
+    *reply = buf;
+    *reply_size = len;
+    return SHM_SUCCESS;
+}
+
+// Обработка команды установки новой карты кластера
+static int handle_set_cluster_map(shm_header_t *header, void *data) {
+    if (data == NULL) {
+        return SHM_EINVAL;
+    }
+
+    dshm_cluster_t *map = malloc(sizeof(dshm_cluster_t));
+    if (map == NULL) {
+        return SHM_ENOMEM;
+    }
+    if (dshm_cluster_decode(map, data, header->size) == -1 || map->node_count == 0) {
+        free(map);
+        return SHM_EINVAL;
+    }
+
+    pthread_mutex_lock(&cluster_mutex);
+    if (cluster.node_count > 0 && map->epoch <= cluster.epoch) {
+        int result = (map->epoch == cluster.epoch) ? SHM_SUCCESS : SHM_EINVAL;
+        pthread_mutex_unlock(&cluster_mutex);
+        free(map);
+        return result;
+    }
+
+    prev_cluster = cluster;
+    prev_self = cluster_self;
+    cluster = *map;
+    cluster_self = find_self(&cluster);
+    printf("Новая карта кластера, эпоха %u, узлов: %d\n", cluster.epoch, cluster.node_count);
+    // Индексы узлов в новой карте другие: актуальность копий подтверждается заново
+    for (int i = 0; i < DSHM_MAX_NODES; i++) {
+        __atomic_store_n(&replica_fresh_ms[i], 0, __ATOMIC_RELAXED);
+    }
+    start_migration();
+    if (cluster.replicas > 0) {
+        start_replication();
+    }
+    pthread_mutex_unlock(&cluster_mutex);
+
+    free(map);
+    return SHM_SUCCESS;
+}
+
+// Отмена незавершенного приема сегмента частями (под segments_mutex)
+static void drop_incoming(client_conn_t *conn) {
+    if (conn->incoming != NULL) {
+        destroy_segment(conn->incoming);
+        conn->incoming = NULL;
+    }
+}
+
+// Обработка команды приема сегмента от другого узла. Сегмент передается целиком
+// или частями (DSHM_MIGRATE_PART) в одном соединении; принимаемый частями сегмент
+// не виден запросам, пока не получен целиком, и удаляется при обрыве соединения.
+static int handle_migrate_in(client_conn_t *conn, shm_header_t *header, void *data) {
+    DSHM_TRACE_LOCK(&segments_mutex);
+    // Копия для чтения уступает место самому сегменту
+    shm_segment_t *segment = find_segment(header->shmid);
+    if (segment != NULL && segment->replica) {
+        destroy_segment(segment);
+    }
+    
+    int result;
+    if (!(header->flags & DSHM_MIGRATE_PART)) {
+        result = install_segment(header->shmid, data, header->size, 0, NULL);
+    } else if (header->offset == 0) {
+        // Первая часть: описание и начало данных. Прежняя незавершенная передача отменяется.
+        drop_incoming(conn);
+        result = install_segment(header->shmid, data, header->size, INSTALL_PARTIAL | INSTALL_STAGED,
+                                 &conn->incoming);
+        conn->incoming_len = (result == SHM_SUCCESS) ? header->size - sizeof(shm_migrate_t) : 0;
+    } else if (conn->incoming == NULL || conn->incoming->shmid != header->shmid ||
+               header->offset != conn->incoming_len || conn->incoming_len + header->size > conn->incoming->size) {
+        result = SHM_EINVAL;
+    } else {
+        fill_segment(conn->incoming, header->offset, data, header->size);
+        conn->incoming_len += header->size;
+        result = SHM_SUCCESS;
+    }
+    
+    // Получен целиком: сегмент публикуется
+    segment = conn->incoming;
+    if (result == SHM_SUCCESS && segment != NULL && conn->incoming_len == segment->size) {
+        conn->incoming = NULL;
+        shm_segment_t *existing = find_segment(segment->shmid);
+        if (existing != NULL && existing->replica) {
+            destroy_segment(existing);
+            existing = NULL;
+        }
+        if (existing != NULL) {
+            destroy_segment(segment);
+            result = SHM_EEXIST;
+        } else {
+            segment->migrating = 0;
+            index_segment(segment);
+            if (!(segment->shmflg & SEGMENT_REMOVED)) {
+                index_key(segment);
+            }
+        }
+    }
+    pthread_mutex_unlock(&segments_mutex);
+    return result;
+}
+
+// Обработка запроса другого узла на передачу ему сегмента. Переданный сегмент
+// остается замороженным, пока узел не подтвердит установку (DSHM_MIGRATE_COMMIT)
+// или не сообщит об ошибке (DSHM_MIGRATE_ABORT); повторный запрос получает его снова.
+static int handle_migrate_out(shm_header_t *header, void **reply, size_t *reply_size) {
+    DSHM_TRACE_LOCK(&segments_mutex);
+
+    shm_segment_t *segment = find_segment(header->shmid);
+    if (segment == NULL || segment->replica) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_ENOENT;
+    }
+    // Сегмент отправляется другому узлу потоком миграции
+    if (segment->migrating == MIGRATING_PUSH) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EAGAIN;
+    }
+
+    if (header->flags & (DSHM_MIGRATE_COMMIT | DSHM_MIGRATE_ABORT)) {
+        if (segment->migrating == MIGRATING_PULL) {
+            segment->migrating = 0;
+            if (header->flags & DSHM_MIGRATE_COMMIT) {
+                destroy_segment(segment);
+            } else {
+                thaw_attachments(segment);
+            }
+        }
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_SUCCESS;
+    }
+
+    *reply = pack_segment(segment, reply_size);
+    if (*reply == NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_ENOMEM;
+    }
+    segment->migrating = MIGRATING_PULL;
+    freeze_attachments(segment);
+
+    pthread_mutex_unlock(&segments_mutex);
+    return SHM_SUCCESS;
+}
+
+// Применение записи пакета к копии сегмента (вызывается под segments_mutex)
+static int apply_replica_change(const shm_change_t *change, const char *data, uint32_t epoch) {
+    int shmid = (int32_t)ntohl(change->shmid);
+    uint32_t type = ntohl(change->type);
+    size_t offset = ntohl(change->offset);
+    size_t len = ntohl(change->len);
+    size_t data_len = ntohl(change->data_len);
+    
+    shm_segment_t *segment = find_segment(shmid);
+    if (segment != NULL && !segment->replica) {
+        return SHM_SUCCESS; // Сам сегмент еще здесь (его перенос не завершен)
+    }
+    
+    if (type == DSHM_CHANGE_COPY) {
+        if (segment != NULL) {
+            destroy_segment(segment);
+        }
+        int result = install_segment(shmid, data, data_len, INSTALL_PARTIAL, NULL);
+        segment = find_segment(shmid);
+        if (result != SHM_SUCCESS || segment == NULL) {
+            return result;
+        }
+        segment->replica_copying = (data_len - sizeof(shm_migrate_t) < segment->size);
+        // Копия не занимает ключ и не учитывает присоединения владельца
+        unindex_key(segment);
+        __atomic_fetch_and(&segment->attach_state, ~(uint64_t)ATTACH_COUNT, __ATOMIC_RELEASE);
+        __atomic_store_n(&segment->ref_count, 0, __ATOMIC_RELAXED);
+        segment->replica = 1;
+        segment->replica_epoch = epoch;
+        return SHM_SUCCESS;
+    }
+    
+    // Изменения копии, полученной по прежней карте, не применяются: придет новая копия
+    if (segment == NULL || segment->replica_epoch != epoch) {
+        return SHM_SUCCESS;
+    }
+    switch (type) {
+        case DSHM_CHANGE_WRITE:
+            if (offset + len > segment->size || data_len != len || (segment->shmflg & SHM_RDONLY)) {
+                return SHM_EINVAL;
+            }
+            invalidate_checksums(segment, offset, len);
+            data_write_begin(segment);
+            mark_touched(segment, offset, len);
+            memcpy((char*)segment->addr + offset, data, len);
+            data_write_end(segment);
+            break;
+            
+        case DSHM_CHANGE_PUNCH:
+            if (offset + len > segment->size || (segment->shmflg & SHM_RDONLY)) {
+                return SHM_EINVAL;
+            }
+            punch_range(segment, offset, offset + len);
+            break;
+            
+        case DSHM_CHANGE_REMOVE:
+            destroy_segment(segment);
+            break;
+            
+        case DSHM_CHANGE_RESIZE:
+            if (offset == 0) {
+                return SHM_EINVAL;
+            }
+            return resize_segment(segment, offset);
+            
+        case DSHM_CHANGE_COPY_PART:
+            if (!segment->replica_copying || offset + len > segment->size || data_len != len) {
+                return SHM_EINVAL;
+            }
+            invalidate_checksums(segment, offset, len);
+            fill_segment(segment, offset, data, len);
+            segment->replica_copying = (offset + len < segment->size);
+            break;
+            
+        default:
+            return SHM_EINVAL;
+    }
+    return SHM_SUCCESS;
+}
+
+// Обработка пакета изменений от владельца сегментов (CMD_REPLICA_UPDATE)
+static int handle_replica_update(shm_header_t *header, void *data) {
+    shm_replica_batch_t batch;
+    if (data == NULL || header->size < sizeof(batch)) {
+        return SHM_EINVAL;
+    }
+    memcpy(&batch, data, sizeof(batch));
+    uint32_t epoch = ntohl(batch.epoch);
+    uint32_t owner = ntohl(batch.owner);
+    uint32_t count = ntohl(batch.count);
+    
+    // Пакет, собранный по другой карте, отклоняется: владелец передаст копии заново
+    pthread_mutex_lock(&cluster_mutex);
+    int valid = (cluster.node_count > 0 && epoch == cluster.epoch &&
+                 owner < (uint32_t)cluster.node_count && (int)owner != cluster_self);
+    pthread_mutex_unlock(&cluster_mutex);
+    if (!valid) {
+        return SHM_EAGAIN;
+    }
+    
+    const char *p = (const char*)data + sizeof(batch);
+    const char *end = (const char*)data + header->size;
+    int result = SHM_SUCCESS;
+    
+    DSHM_TRACE_LOCK(&segments_mutex);
+    for (uint32_t i = 0; i < count && result == SHM_SUCCESS; i++) {
+        shm_change_t change;
+        if ((size_t)(end - p) < sizeof(change)) {
+            result = SHM_EINVAL;
+            break;
+        }
+        memcpy(&change, p, sizeof(change));
+        size_t data_len = ntohl(change.data_len);
+        if ((size_t)(end - p) - sizeof(change) < data_len) {
+            result = SHM_EINVAL;
+            break;
+        }
+        result = apply_replica_change(&change, p + sizeof(change), epoch);
+        p += sizeof(change) + data_len;
+    }
+    pthread_mutex_unlock(&segments_mutex);
+    
+    if (result == SHM_SUCCESS && (ntohl(batch.flags) & DSHM_REPLICA_CURRENT)) {
+        __atomic_store_n(&replica_fresh_ms[owner], now_ms(), __ATOMIC_RELEASE);
+    }
+    return result;
+}
+
+// Проверка квот памяти сегментов перед созданием (вызывается под segments_mutex).
+// account - за кем числится сегмент (NULL - ни за кем, как принятые при миграции)
+static int segment_quota_ok(const quota_account_t *account, size_t size) {
+    // Сегменты, принятые при миграции, создаются без проверки и могут превысить квоту
+    if (quota_segments_global > 0 &&
+        (segment_bytes > quota_segments_global || size > quota_segments_global - segment_bytes)) {
+        return 0;
+    }
+    if (quota_segments_conn > 0 && account != NULL &&
+        (account->segment_bytes > quota_segments_conn || size > quota_segments_conn - account->segment_bytes)) {
+        return 0;
+    }
+    return 1;
+}
+
+// Проверка квот для сегмента, создаваемого соединением (под segments_mutex);
+// *account - учетная запись, за которой его нужно числить
+static int conn_quota_ok(client_conn_t *conn, size_t size, quota_account_t **account) {
+    *account = conn_account(conn);
+    if (quota_segments_conn > 0 && *account == NULL) {
+        return 0; // Учесть сегмент не за кем
+    }
+    return segment_quota_ok(*account, size);
+}
+
+// Проверка квот для роста сегмента до size байт по запросу соединения (под
+// segments_mutex). Выросший сегмент целиком числится за запросившим: чужой
+// сегмент переходит на его учетную запись (*account).
+static int grow_quota_ok(client_conn_t *conn, const shm_segment_t *segment, size_t size, quota_account_t **account) {
+    *account = conn_account(conn);
+    if (quota_segments_conn > 0 && *account == NULL) {
+        return 0;
+    }
+    if (!segment_quota_ok(NULL, size - segment->size)) {
+        return 0;
+    }
+    if (quota_segments_conn == 0) {
+        return 1;
+    }
+    size_t held = (*account)->segment_bytes - ((*account == segment->creator) ? segment->size : 0);
+    return held <= quota_segments_conn && size <= quota_segments_conn - held;
+}
+
+// Права соединения на сегмент по shm_perm (PERM_*, вызывается под segments_mutex).
+// Как в System V: владелец и создатель получают права владельца, их группы - права группы.
+static int segment_perms(const shm_segment_t *segment, const client_conn_t *conn) {
+    if (conn->uid == 0) {
+        return PERM_READ | PERM_WRITE;
+    }
+    int mode = segment->shmflg & 0777;
+    if (conn->uid == segment->uid || conn->uid == segment->cuid) {
+        mode >>= 6;
+    } else if (conn->gid == segment->gid || conn->gid == segment->cgid) {
+        mode >>= 3;
+    }
+    return mode & (PERM_READ | PERM_WRITE);
+}
+
+// Может ли соединение менять права сегмента и удалять его (под segments_mutex)
+static int segment_owner_conn(const shm_segment_t *segment, const client_conn_t *conn) {
+    return conn->uid == 0 || conn->uid == segment->uid || conn->uid == segment->cuid;
+}
+
+// Соединение закрыто: его сегменты по-прежнему числятся за владельцем
+static void release_conn_account(client_conn_t *conn) {
+    DSHM_TRACE_LOCK(&segments_mutex);
+    if (conn->account != NULL) {
+        conn->account->conns--;
+        account_put(conn->account);
+        conn->account = NULL;
+    }
+    pthread_mutex_unlock(&segments_mutex);
+}
+
+// Подбор свободного shmid для нового сегмента (под segments_mutex). Сегмент с ключом
+// получает shmid из корзины ключа и при любой карте кластера остается на одном узле
+// со своей записью в индексе ключей. Возвращает -1, если свободного shmid нет.
+static int generate_shmid(int key) {
+    if (key != IPC_PRIVATE) {
+        // Создание выполняет владелец первого shmid корзины; другой shmid корзины
+        // выбирается, лишь когда свободных shmid этого обработчика нет
+        int fallback = -1;
+        for (unsigned slot = 0; slot < DSHM_BUCKET_SLOTS; slot++) {
+            int candidate = dshm_cluster_bucket_id((uint32_t)key, slot);
+            if (candidate > 0 && find_segment(candidate) == NULL) {
+                if (worker_owns(candidate)) {
+                    return candidate;
+                }
+                if (fallback == -1) {
+                    fallback = candidate;
+                }
+            }
+        }
+        return fallback;
+    }
+
+    // Сегменту без ключа подходит любой свободный shmid, принадлежащий этому узлу
+    // и выполняющему создание обработчику
+    for (int attempt = 0; attempt < SNAPSHOT_SHMID_ATTEMPTS; attempt++) {
+        pthread_mutex_lock(&cluster_mutex);
+        int candidate = 1 + (int)(private_seq++ % (SNAPSHOT_SHMID_BASE - 1));
+        int local = owns_shmid(&cluster, cluster_self, candidate);
+        pthread_mutex_unlock(&cluster_mutex);
+        
+        if (local && worker_owns(candidate) && find_segment(candidate) == NULL) {
+            return candidate;
+        }
+    }
+    return -1;
+}
+
+// Обработка команды поиска или создания сегмента по ключу.
+// Возвращает shmid, в ответе - размер сегмента.
+static int handle_create_segment(shm_header_t *header, void *data, client_conn_t *conn,
+                                 void **reply, size_t *reply_size) {
+    if (data == NULL || header->size < sizeof(size_t)) {
+        return SHM_EINVAL;
+    }
+    size_t size = *(size_t*)data;
+    int key = header->shmid;
+    int flags = header->flags;
+    
+    uint32_t *size_reply = malloc(2 * sizeof(uint32_t));
+    if (size_reply == NULL) {
+        return SHM_ENOMEM;
+    }
+    
+    DSHM_TRACE_LOCK(&segments_mutex);
+    
+    int result;
+    quota_account_t *account = NULL;
+    shm_segment_t *segment = (key != IPC_PRIVATE) ? find_key(key) : NULL;
+    if (segment != NULL) {
+        // Существующий сегмент: поиск без создания или IPC_CREAT без IPC_EXCL
+        // Права, запрошенные в shmflg (любой из троек), должны быть у соединения
+        int requested = (flags >> 6 | flags >> 3 | flags) & (PERM_READ | PERM_WRITE);
+        if ((flags & IPC_CREAT) && (flags & IPC_EXCL)) {
+            result = SHM_EEXIST;
+        } else if (requested & ~segment_perms(segment, conn)) {
+            result = SHM_EACCES;
+        } else if (size > segment->size) {
+            result = SHM_EINVAL;
+        } else {
+            result = segment->shmid;
+        }
+    } else if (key != IPC_PRIVATE && !(flags & IPC_CREAT)) {
+        result = SHM_ENOENT;
+    } else if (size == 0) {
+        result = SHM_EINVAL;
+    } else if (!conn_quota_ok(conn, size, &account)) {
+        result = SHM_ENOMEM;
+    } else {
+        int shmid = generate_shmid(key);
+        segment = (shmid > 0) ? create_segment(shmid, size, flags) : NULL;
+        if (segment == NULL) {
+            result = (shmid <= 0 || errno == ENOMEM) ? SHM_ENOMEM : SHM_EINVAL;
+        } else {
+            segment->key = key;
+            segment->creator = account;
+            segment->uid = segment->cuid = conn->uid;
+            segment->gid = segment->cgid = conn->gid;
+            if (account != NULL) {
+                account->segment_bytes += size;
+            }
+            index_key(segment);
+            result = shmid;
+        }
+    }
+    
+    if (result > 0) {
+        size_reply[0] = htonl((uint32_t)((uint64_t)segment->size >> 32));
+        size_reply[1] = htonl((uint32_t)segment->size);
+        *reply = size_reply;
+        *reply_size = 2 * sizeof(uint32_t);
+    } else {
+        free(size_reply);
+    }
+    
+    pthread_mutex_unlock(&segments_mutex);
+    return result;
+}
+
+// Добавление записи в журнал изменений (вызывается под segments_mutex)
+static void log_change(int shmid, uint32_t type, size_t offset, size_t len) {
+    pthread_mutex_lock(&change_mutex);
+    change_record_t *record = &change_log[change_next % CHANGE_LOG_SIZE];
+    record->seq = change_next++;
+    record->shmid = shmid;
+    record->type = type;
+    record->offset = (uint32_t)offset;
+    record->len = (uint32_t)len;
+    pthread_cond_broadcast(&change_cond);
+    pthread_mutex_unlock(&change_mutex);
+}
+
+// Обработка запроса журнала изменений сегмента.
+// Ждет появления записей не дольше wait_ms; данные диапазонов берутся из текущего
+// содержимого сегмента, поэтому могут быть новее самой записи.
+// Возвращает число записей в ответе.
+static int handle_get_changes(shm_header_t *header, void *data, void **reply, size_t *reply_size) {
+    shm_changes_req_t req;
+    if (data == NULL || header->size != sizeof(req)) {
+        return SHM_EINVAL;
+    }
+    memcpy(&req, data, sizeof(req));
+    uint64_t from = ((uint64_t)ntohl(req.from_hi) << 32) | ntohl(req.from_lo);
+    uint32_t max_records = ntohl(req.max_records);
+    uint32_t wait_ms = ntohl(req.wait_ms);
+    if (max_records == 0 || max_records > CHANGES_MAX_RECORDS) {
+        max_records = CHANGES_MAX_RECORDS;
+    }
+    if (wait_ms > CHANGES_MAX_WAIT_MS) {
+        wait_ms = CHANGES_MAX_WAIT_MS;
+    }
+    
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    
+    change_record_t found[CHANGES_MAX_RECORDS];
+    uint32_t count = 0;
+    int lost = 0;
+    
+    pthread_mutex_lock(&change_mutex);
+    if (from == 0) {
+        from = change_next;
+    }
+    uint64_t oldest = (change_next > CHANGE_LOG_SIZE) ? change_next - CHANGE_LOG_SIZE : 1;
+    uint64_t next = from;
+    if (from < oldest || from > change_next) {
+        // Записи вытеснены или номер относится к другому журналу
+        lost = 1;
+        next = change_next;
+    } else {
+        for (;;) {
+            while (next < change_next && count < max_records) {
+                const change_record_t *record = &change_log[next % CHANGE_LOG_SIZE];
+                if (record->shmid == header->shmid) {
+                    found[count++] = *record;
+                }
+                next++;
+            }
+            if (count > 0 || wait_ms == 0 || __atomic_load_n(&draining, __ATOMIC_SEQ_CST) ||
+                pthread_cond_timedwait(&change_cond, &change_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+            // Пока ждали, журнал мог обогнать нас больше чем на свой размер
+            if (change_next > CHANGE_LOG_SIZE && next < change_next - CHANGE_LOG_SIZE) {
+                lost = 1;
+                next = change_next;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&change_mutex);
+    
+    // Собираем ответ: заголовок, записи и (по запросу) текущие данные диапазонов
+    int with_data = (header->flags & DSHM_CHANGES_DATA) != 0;
+    size_t total = sizeof(shm_changes_t) + count * sizeof(shm_change_t);
+    if (with_data) {
+        for (uint32_t i = 0; i < count; i++) {
+            total += found[i].len;
+        }
+    }
+    if (total > CHANGES_MAX_REPLY) {
+        // Слишком много данных: ограничиваем ответ, остальное придет следующим запросом
+        size_t kept = sizeof(shm_changes_t);
+        uint32_t i = 0;
+        while (i < count && (i == 0 || kept + sizeof(shm_change_t) + found[i].len <= CHANGES_MAX_REPLY)) {
+            kept += sizeof(shm_change_t) + found[i].len;
+            i++;
+        }
+        next = found[i - 1].seq + 1;
+        count = i;
+        total = kept;
+    }
+    
+    char *buf = malloc(total);
+    if (buf == NULL) {
+        return SHM_ENOMEM;
+    }
+    shm_changes_t head = {
+        .log_id = htonl(change_log_id),
+        .next_hi = htonl((uint32_t)(next >> 32)),
+        .next_lo = htonl((uint32_t)next),
+        .lost = htonl(lost),
+        .count = htonl(count)
+    };
+    memcpy(buf, &head, sizeof(head));
+    
+    DSHM_TRACE_LOCK(&segments_mutex);
+    shm_segment_t *segment = find_segment(header->shmid);
+    char *p = buf + sizeof(head);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t data_len = 0;
+        int have_data = with_data && segment != NULL &&
+                        (size_t)found[i].offset + found[i].len <= segment->size;
+        if (have_data) {
+            data_len = found[i].len;
+            copy_out(segment, found[i].offset, found[i].len, p + sizeof(shm_change_t));
+        }
+        shm_change_t change = {
+            .seq_hi = htonl((uint32_t)(found[i].seq >> 32)),
+            .seq_lo = htonl((uint32_t)found[i].seq),
+            .shmid = htonl(found[i].shmid),
+            .type = htonl(found[i].type),
+            .offset = htonl(found[i].offset),
+            .len = htonl(found[i].len),
+            .data_len = htonl(data_len)
+        };
+        memcpy(p, &change, sizeof(change));
+        p += sizeof(change) + data_len;
+    }
+    pthread_mutex_unlock(&segments_mutex);
+    
+    *reply = buf;
+    *reply_size = (size_t)(p - buf);
+    return (int)count;
+}
+
+// Освобождение ссылки на сообщение рассылки
+static void push_msg_release(push_msg_t *msg) {
+    if (msg != NULL && __atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(msg);
+    }
+}
+
+// Сборка сообщения рассылки с записью журнала (и, если with_data, текущим
+// содержимым ее диапазона). Без записи - сообщение о потере изменений.
+static push_msg_t *push_msg_build(const change_record_t *record, int with_data) {
+    uint64_t next;
+    if (record != NULL) {
+        next = record->seq + 1;
+    } else {
+        pthread_mutex_lock(&change_mutex);
+        next = change_next;
+        pthread_mutex_unlock(&change_mutex);
+    }
+    
+    // Данные копируются под segments_mutex сразу в сообщение
+    shm_segment_t *segment = NULL;
+    size_t data_len = 0;
+    if (with_data && record != NULL) {
+        DSHM_TRACE_LOCK(&segments_mutex);
+        segment = find_segment(record->shmid);
+        if (segment != NULL && (size_t)record->offset + record->len <= segment->size) {
+            data_len = record->len;
+        }
+    }
+    size_t payload = sizeof(shm_changes_t) + (record != NULL ? sizeof(shm_change_t) + data_len : 0);
+    push_msg_t *msg = malloc(sizeof(push_msg_t) + sizeof(shm_response_t) + payload);
+    if (msg != NULL) {
+        shm_response_t response = {
+            .result = htonl(record != NULL ? 1 : 0),
+            .error_code = 0,
+            .data_size = htonl((uint32_t)payload),
+            .encoding = htonl(DSHM_ENC_NONE)
+        };
+        shm_changes_t head = {
+            .log_id = htonl(change_log_id),
+            .next_hi = htonl((uint32_t)(next >> 32)),
+            .next_lo = htonl((uint32_t)next),
+            .lost = htonl(record == NULL),
+            .count = htonl(record != NULL ? 1 : 0)
+        };
+        char *p = msg->data;
+        memcpy(p, &response, sizeof(response));
+        memcpy(p + sizeof(response), &head, sizeof(head));
+        if (record != NULL) {
+            shm_change_t change = {
+                .seq_hi = htonl((uint32_t)(record->seq >> 32)),
+                .seq_lo = htonl((uint32_t)record->seq),
+                .shmid = htonl(record->shmid),
+                .type = htonl(record->type),
+                .offset = htonl(record->offset),
+                .len = htonl(record->len),
+                .data_len = htonl((uint32_t)data_len)
+            };
+            p += sizeof(response) + sizeof(head);
+            memcpy(p, &change, sizeof(change));
+            if (data_len > 0) {
+                copy_out(segment, record->offset, data_len, p + sizeof(change));
+            }
+        }
+        msg->refs = 1;
+        msg->size = sizeof(response) + payload;
+        msg->trailer = htonl(dshm_crc32c(0, msg->data, msg->size));
+    }
+    if (with_data && record != NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+    }
+    return msg;
+}
+
+// Освобождение очереди подписчика (под push_mutex)
+static void push_drop_queue(push_sub_t *sub) {
+    while (sub->count > 0) {
+        push_msg_release(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % PUSH_QUEUE_LEN;
+        sub->count--;
+    }
+    sub->bytes = 0;
+}
+
+// Постановка сообщения в очередь подписчика (под push_mutex). Подписчик, не
+// успевающий принимать, теряет очередь целиком: вместо нее он получит одно
+// сообщение о потере и перечитает диапазон, в котором учтены и отброшенные изменения.
+static void push_enqueue(push_sub_t *sub, push_msg_t *msg) {
+    if (sub->lost) {
+        return; // Изменение войдет в перечитанный диапазон
+    }
+    if (msg == NULL || sub->count == PUSH_QUEUE_LEN ||
+        (sub->count > 0 && sub->bytes + msg->size > PUSH_QUEUE_BYTES)) {
+        push_drop_queue(sub);
+        sub->lost = 1;
+    } else {
+        __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+        sub->queue[(sub->head + sub->count) % PUSH_QUEUE_LEN] = msg;
+        sub->count++;
+        sub->bytes += msg->size;
+    }
+    pthread_cond_signal(&sub->cond);
+}
+
+// Задевает ли запись журнала диапазон подписки
+static int push_matches(const push_sub_t *sub, const change_record_t *record) {
+    if (sub->shmid != record->shmid) {
+        return 0;
+    }
+    return record->type == DSHM_CHANGE_REMOVE || record->type == DSHM_CHANGE_RESIZE ||
+           (record->offset < sub->end && (uint64_t)record->offset + record->len > sub->offset);
+}
+
+// Рассылка записей журнала подписчикам. Сообщение для записи собирается один
+// раз (данные копируются из сегмента однократно) и ставится в очереди всех
+// подписчиков, чей диапазон она задевает.
+static void *push_thread(void *arg __attribute__((unused))) {
+    static change_record_t records[CHANGES_MAX_RECORDS];
+    
+    while (running) {
+        pthread_mutex_lock(&change_mutex);
+        if (push_cursor == change_next) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&change_cond, &change_mutex, &deadline);
+        }
+        uint64_t oldest = (change_next > CHANGE_LOG_SIZE) ? change_next - CHANGE_LOG_SIZE : 1;
+        int lost = (push_cursor < oldest);
+        if (lost) {
+            push_cursor = change_next;
+        }
+        uint32_t count = 0;
+        while (push_cursor < change_next && count < CHANGES_MAX_RECORDS) {
+            records[count++] = change_log[push_cursor++ % CHANGE_LOG_SIZE];
+        }
+        pthread_mutex_unlock(&change_mutex);
+        
+        pthread_mutex_lock(&push_mutex);
+        for (push_sub_t *sub = push_subs; sub != NULL && lost; sub = sub->next) {
+            // Журнал обогнал рассылку: изменения могли пропасть у всех подписчиков
+            push_drop_queue(sub);
+            sub->lost = 1;
+            pthread_cond_signal(&sub->cond);
+        }
+        pthread_mutex_unlock(&push_mutex);
+        
+        for (uint32_t i = 0; i < count; i++) {
+            const change_record_t *record = &records[i];
+            
+            // Какие варианты сообщения нужны (без данных и с данными)
+            int wanted[2] = { 0, 0 };
+            pthread_mutex_lock(&push_mutex);
+            for (push_sub_t *sub = push_subs; sub != NULL; sub = sub->next) {
+                if (!sub->lost && push_matches(sub, record)) {
+                    wanted[sub->with_data] = 1;
+                }
+            }
+            pthread_mutex_unlock(&push_mutex);
+            if (!wanted[0] && !wanted[1]) {
+                continue;
+            }
+            
+            push_msg_t *msgs[2];
+            for (int k = 0; k < 2; k++) {
+                msgs[k] = wanted[k] ? push_msg_build(record, k) : NULL;
+            }
+            pthread_mutex_lock(&push_mutex);
+            for (push_sub_t *sub = push_subs; sub != NULL; sub = sub->next) {
+                // Подписчик, появившийся после выбора вариантов, эту запись пропускает
+                if (wanted[sub->with_data] && push_matches(sub, record)) {
+                    push_enqueue(sub, msgs[sub->with_data]);
+                }
+            }
+            pthread_mutex_unlock(&push_mutex);
+            push_msg_release(msgs[0]);
+            push_msg_release(msgs[1]);
+        }
+    }
+    
+    pthread_mutex_lock(&push_mutex);
+    push_running = 0;
+    pthread_mutex_unlock(&push_mutex);
+    return NULL;
+}
+
+// Регистрация подписчика; первая подписка запускает поток рассылки
+static int push_subscribe(push_sub_t *sub) {
+    pthread_mutex_lock(&push_mutex);
+    if (!push_running) {
+        pthread_mutex_lock(&change_mutex);
+        push_cursor = change_next;
+        pthread_mutex_unlock(&change_mutex);
+        
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, push_thread, NULL) != 0) {
+            pthread_mutex_unlock(&push_mutex);
+            perror("Ошибка создания потока рассылки изменений");
+            return SHM_ENOMEM;
+        }
+        pthread_detach(thread);
+        push_running = 1;
+    }
+    sub->next = push_subs;
+    push_subs = sub;
+    pthread_mutex_unlock(&push_mutex);
+    return SHM_SUCCESS;
+}
+
+// Удаление подписчика вместе с его очередью
+static void push_unsubscribe(push_sub_t *sub) {
+    pthread_mutex_lock(&push_mutex);
+    for (push_sub_t **p = &push_subs; *p != NULL; p = &(*p)->next) {
+        if (*p == sub) {
+            *p = sub->next;
+            break;
+        }
+    }
+    push_drop_queue(sub);
+    pthread_mutex_unlock(&push_mutex);
+    pthread_cond_destroy(&sub->cond);
+    free(sub);
+}
+
+// Обработка подписки на изменения диапазона сегмента. После ответа
+// соединение только отправляет рассылку (serve_subscription).
+static int handle_subscribe(shm_header_t *header, client_conn_t *conn) {
+    if (conn->subscription != NULL) {
+        return SHM_EINVAL;
+    }
+    
+    DSHM_TRACE_LOCK(&segments_mutex);
+    shm_segment_t *segment = find_segment(header->shmid);
+    size_t size = (segment != NULL) ? segment->size : 0;
+    pthread_mutex_unlock(&segments_mutex);
+    if (segment == NULL) {
+        return SHM_ENOENT;
+    }
+    uint64_t end = (header->size == 0) ? size : (uint64_t)header->offset + header->size;
+    if (header->offset >= size || end > size) {
+        return SHM_EINVAL;
+    }
+    
+    push_sub_t *sub = calloc(1, sizeof(push_sub_t));
+    if (sub == NULL) {
+        return SHM_ENOMEM;
+    }
+    sub->shmid = header->shmid;
+    sub->offset = header->offset;
+    sub->end = end;
+    sub->with_data = (header->flags & DSHM_CHANGES_DATA) != 0;
+    pthread_cond_init(&sub->cond, NULL);
+    int result = push_subscribe(sub);
+    if (result != SHM_SUCCESS) {
+        pthread_cond_destroy(&sub->cond);
+        free(sub);
+        return result;
+    }
+    conn->subscription = sub;
+    return SHM_SUCCESS;
+}
+
+// Обработка команды чтения данных
+// Если в диапазоне нет записанных страниц, *zero_range = 1 и буфер заполнен нулями
+// Чтение без блокировки (seqlock). Возвращает -1, если читать нужно под
+// блокировкой: сегмента нет, диапазон неверен, сегмент - снимок с общими
+// страницами или он постоянно изменяется.
+static int read_optimistic(client_conn_t *conn, shm_header_t *header, void *buffer, int *zero_range) {
+    // Читатель объявляется до поиска сегмента: память найденного не освободят до read_epoch = 0
+    __atomic_store_n(&conn->read_epoch, __atomic_load_n(&reclaim_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    int result = -1;
+    for (int attempt = 0; attempt < OPTIMISTIC_READ_RETRIES; attempt++) {
+        shm_segment_t *segment = lookup_segment(header->shmid);
+        if (segment == NULL) {
+            break;
+        }
+        uint32_t seq = __atomic_load_n(&segment->write_seq, __ATOMIC_ACQUIRE);
+        uint64_t state = __atomic_load_n(&segment->attach_state, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        // Адрес, размер и карта страниц берутся вместе: смена размера меняет их
+        // внутри write_seq, а прежняя память живет до read_epoch = 0
+        shm_segment_t view = {
+            .addr = __atomic_load_n(&segment->addr, __ATOMIC_RELAXED),
+            .size = __atomic_load_n(&segment->size, __ATOMIC_RELAXED),
+            .touched = __atomic_load_n(&segment->touched, __ATOMIC_RELAXED),
+            .cow_source = __atomic_load_n(&segment->cow_source, __ATOMIC_RELAXED),
+        };
+        int shmid = __atomic_load_n(&segment->shmid, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&segment->write_seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        // Описатель мог быть освобожден и занят другим сегментом после поиска
+        if ((state & ATTACH_DEAD) || shmid != header->shmid || view.cow_source != NULL ||
+            (uint64_t)header->offset + header->size > view.size) {
+            break;
+        }
+        
+        int all_zero = copy_out(&view, header->offset, header->size, buffer);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&segment->write_seq, __ATOMIC_RELAXED) == seq &&
+            __atomic_load_n(&segment->attach_state, __ATOMIC_RELAXED) >> 32 == state >> 32) {
+            *zero_range = all_zero;
+            result = SHM_SUCCESS;
+            break;
+        }
+    }
+    
+    __atomic_store_n(&conn->read_epoch, 0, __ATOMIC_RELEASE);
+    return result;
+}
+
+static int handle_read_data(client_conn_t *conn, shm_header_t *header, void *buffer, int *zero_range) {
+    // Малые чтения преобладают, и их время уходит на блокировку, а не на копирование
+    if (header->size <= OPTIMISTIC_READ_MAX && read_optimistic(conn, header, buffer, zero_range) == SHM_SUCCESS) {
+        return SHM_SUCCESS;
+    }
+    
+    DSHM_TRACE_LOCK(&segments_mutex);
+    
+    shm_segment_t *segment = find_segment(header->shmid);
+    if (segment == NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_ENOENT;
+    }
+    
+    // Проверяем, не выходит ли за границы
+    if ((uint64_t)header->offset + header->size > segment->size) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EINVAL;
+    }
+    
+    // Копируем данные из сегмента в буфер
+    DSHM_TRACE_BEGIN(DSHM_TRACE_COPY, CMD_READ_DATA, header->shmid);
+    *zero_range = copy_out(segment, header->offset, header->size, buffer);
+    DSHM_TRACE_END(DSHM_TRACE_COPY, CMD_READ_DATA, header->shmid);
+    
+    pthread_mutex_unlock(&segments_mutex);
+    return SHM_SUCCESS;
+}
+
+// Обработка команды записи данных
+static int handle_write_data(shm_header_t *header, void *data) {
+    DSHM_TRACE_LOCK(&segments_mutex);
+    
+    shm_segment_t *segment = find_segment(header->shmid);
+    if (segment == NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_ENOENT;
+    }
+    
+    // Сегмент переносится на другой узел кластера
+    if (segment->migrating) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EAGAIN;
+    }
+    
+    // Проверяем, что сегмент не только для чтения
+    if (segment->shmflg & SHM_RDONLY) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EACCES;
+    }
+    
+    // Проверяем, не выходит ли за границы
+    if ((uint64_t)header->offset + header->size > segment->size) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EINVAL;
+    }
+    
+    // Копируем данные из буфера в сегмент
+    cow_before_write(segment, header->offset, header->size);
+    invalidate_checksums(segment, header->offset, header->size);
+    DSHM_TRACE_BEGIN(DSHM_TRACE_COPY, CMD_WRITE_DATA, header->shmid);
+    data_write_begin(segment);
+    mark_touched(segment, header->offset, header->size);
+    memcpy((char*)segment->addr + header->offset, data, header->size);
+    data_write_end(segment);
+    DSHM_TRACE_END(DSHM_TRACE_COPY, CMD_WRITE_DATA, header->shmid);
+    log_change(segment->shmid, DSHM_CHANGE_WRITE, header->offset, header->size);
+    
+    pthread_mutex_unlock(&segments_mutex);
+    return SHM_SUCCESS;
+}
+
+// Обработка команды освобождения страниц диапазона
+static int handle_punch_hole(shm_header_t *header) {
+    DSHM_TRACE_LOCK(&segments_mutex);
+    
+    shm_segment_t *segment = find_segment(header->shmid);
+    if (segment == NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_ENOENT;
+    }
+    
+    // Сегмент переносится на другой узел кластера
+    if (segment->migrating) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EAGAIN;
+    }
+    
+    if (segment->shmflg & SHM_RDONLY) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EACCES;
+    }
+    
+    size_t start = header->offset;
+    size_t end = start + header->size;
+    if (end > segment->size) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EINVAL;
+    }
+    
+    punch_range(segment, start, end);
+    log_change(segment->shmid, DSHM_CHANGE_PUNCH, start, end - start);
+    
+    pthread_mutex_unlock(&segments_mutex);
+    return SHM_SUCCESS;
+}
+
+// Обработка команды заполнения диапазона байтом (CMD_FILL)
+static int handle_fill(shm_header_t *header) {
+    DSHM_TRACE_LOCK(&segments_mutex);
+    
+    shm_segment_t *segment = find_segment(header->shmid);
+    if (segment == NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_ENOENT;
+    }
+    
+    // Сегмент переносится на другой узел кластера
+    if (segment->migrating) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EAGAIN;
+    }
+    
+    if (segment->shmflg & SHM_RDONLY) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EACCES;
+    }
+    
+    size_t start = header->offset;
+    size_t len = header->size;
+    if (start + len > segment->size) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EINVAL;
+    }
+    if (len == 0) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_SUCCESS;
+    }
+    
+    int value = (unsigned char)header->flags;
+    if (value == 0) {
+        // Нули не хранятся: целые страницы диапазона возвращаются системе
+        punch_range(segment, start, start + len);
+        log_change(segment->shmid, DSHM_CHANGE_PUNCH, start, len);
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_SUCCESS;
+    }
+    
+    cow_before_write(segment, start, len);
+    invalidate_checksums(segment, start, len);
+    DSHM_TRACE_BEGIN(DSHM_TRACE_COPY, CMD_FILL, header->shmid);
+    data_write_begin(segment);
+    mark_touched(segment, start, len);
+    if (len >= DSHM_STREAM_MIN) {
+        dshm_stream_fill((char*)segment->addr + start, value, len);
+        dshm_stream_fence();
+    } else {
+        memset((char*)segment->addr + start, value, len);
+    }
+    data_write_end(segment);
+    DSHM_TRACE_END(DSHM_TRACE_COPY, CMD_FILL, header->shmid);
+    log_change(segment->shmid, DSHM_CHANGE_WRITE, start, len);
+    
+    pthread_mutex_unlock(&segments_mutex);
+    return SHM_SUCCESS;
+}
+
+// Обработка команды копирования диапазона (CMD_COPY). Приемник - shmid и offset
+// заголовка, источник может быть тем же сегментом.
+static int handle_copy(shm_header_t *header, void *data) {
+    shm_copy_t req;
+    if (data == NULL || header->size != sizeof(req)) {
+        return SHM_EINVAL;
+    }
+    memcpy(&req, data, sizeof(req));
+    int src_shmid = (int32_t)ntohl((uint32_t)req.src_shmid);
+    size_t src_offset = ntohl(req.src_offset);
+    size_t len = ntohl(req.len);
+    size_t dst_offset = header->offset;
+    
+    DSHM_TRACE_LOCK(&segments_mutex);
+    
+    shm_segment_t *dst = find_segment(header->shmid);
+    if (dst == NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_ENOENT;
+    }
+    
+    // Источник принадлежит другому узлу (здесь может быть лишь его копия для
+    // чтения, которая отстает от владельца): данные переносит клиент
+    shm_segment_t *src = find_segment(src_shmid);
+    if (src == NULL || src->replica) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EXDEV;
+    }
+    
+    // Один из сегментов переносится на другой узел кластера
+    if (dst->migrating || src->migrating) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EAGAIN;
+    }
+    
+    if (dst->shmflg & SHM_RDONLY) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EACCES;
+    }
+    
+    if (dst_offset + len > dst->size || src_offset + len > src->size) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EINVAL;
+    }
+    if (len == 0 || (dst == src && dst_offset == src_offset)) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_SUCCESS;
+    }
+    
+    cow_before_write(dst, dst_offset, len);
+    invalidate_checksums(dst, dst_offset, len);
+    DSHM_TRACE_BEGIN(DSHM_TRACE_COPY, CMD_COPY, header->shmid);
+    data_write_begin(dst);
+    copy_range(dst, dst_offset, src, src_offset, len);
+    data_write_end(dst);
+    DSHM_TRACE_END(DSHM_TRACE_COPY, CMD_COPY, header->shmid);
+    log_change(dst->shmid, DSHM_CHANGE_WRITE, dst_offset, len);
+    
+    pthread_mutex_unlock(&segments_mutex);
+    return SHM_SUCCESS;
+}
+
+// Обработка команды изменения размера сегмента (CMD_RESIZE). В ответе - новый размер
+static int handle_resize(shm_header_t *header, client_conn_t *conn, void *data, void **reply, size_t *reply_size) {
+    uint32_t size_req[2];
+    if (data == NULL || header->size != sizeof(size_req)) {
+        return SHM_EINVAL;
+    }
+    memcpy(size_req, data, sizeof(size_req));
+    uint64_t size = ((uint64_t)ntohl(size_req[0]) << 32) | ntohl(size_req[1]);
+    // Смещения в запросах 32-битные: данные дальше 4 ГБ недоступны
+    if (size == 0 || size > UINT32_MAX) {
+        return SHM_EINVAL;
+    }
+    
+    uint32_t *size_reply = malloc(2 * sizeof(uint32_t));
+    if (size_reply == NULL) {
+        return SHM_ENOMEM;
+    }
+    
+    DSHM_TRACE_LOCK(&segments_mutex);
+    
+    shm_segment_t *segment = find_segment(header->shmid);
+    quota_account_t *account = NULL;
+    int result = SHM_SUCCESS;
+    if (segment == NULL) {
+        result = SHM_ENOENT;
+    } else if (segment->migrating) {
+        // Сегмент переносится на другой узел кластера
+        result = SHM_EAGAIN;
+    } else if ((segment->shmflg & SHM_RDONLY) || segment->snapshot) {
+        result = SHM_EACCES;
+    } else if (size > segment->size && !grow_quota_ok(conn, segment, size, &account)) {
+        result = SHM_ENOMEM;
+    } else if (size != segment->size) {
+        result = resize_segment(segment, size);
+        if (result == SHM_SUCCESS) {
+            log_change(segment->shmid, DSHM_CHANGE_RESIZE, size, 0);
+        }
+        // Рост числится за запросившим: сегмент переходит на его учетную запись
+        if (result == SHM_SUCCESS && account != NULL && account != segment->creator) {
+            if (segment->creator != NULL) {
+                quota_account_t *previous = segment->creator;
+                previous->segment_bytes -= size;
+                account_put(previous);
+            }
+            account->segment_bytes += size;
+            segment->creator = account;
+        }
+    }
+    
+    if (result == SHM_SUCCESS) {
+        size_reply[0] = htonl((uint32_t)(size >> 32));
+        size_reply[1] = htonl((uint32_t)size);
+        *reply = size_reply;
+        *reply_size = 2 * sizeof(uint32_t);
+    } else {
+        free(size_reply);
+    }
+    
+    pthread_mutex_unlock(&segments_mutex);
+    return result;
+}
+
+// Обработка команды свертки диапазона (CMD_CHECKSUM).
+// Суммы целых страниц сохраняются до их изменения, поэтому повторные запросы
+// по неизмененным данным не читают память сегмента.
+static int handle_checksum(shm_header_t *header, void **reply, size_t *reply_size) {
+    uint32_t *digest_reply = malloc(sizeof(uint32_t));
+    if (digest_reply == NULL) {
+        return SHM_ENOMEM;
+    }
+    
+    DSHM_TRACE_LOCK(&segments_mutex);
+    
+    shm_segment_t *segment = find_segment(header->shmid);
+    if (segment == NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+        free(digest_reply);
+        return SHM_ENOENT;
+    }
+    if ((uint64_t)header->offset + header->size > segment->size) {
+        pthread_mutex_unlock(&segments_mutex);
+        free(digest_reply);
+        return SHM_EINVAL;
+    }
+    if (segment->page_crc == NULL) {
+        size_t pages = (segment->size + DSHM_PAGE_SIZE - 1) / DSHM_PAGE_SIZE;
+        segment->page_crc = malloc(pages * sizeof(uint32_t));
+        segment->crc_valid = calloc(page_bitmap_size(segment->size), 1);
+        if (segment->page_crc == NULL || segment->crc_valid == NULL) {
+            free(segment->page_crc);
+            free(segment->crc_valid);
+            segment->page_crc = NULL;
+            segment->crc_valid = NULL;
+            pthread_mutex_unlock(&segments_mutex);
+            free(digest_reply);
+            return SHM_ENOMEM;
+        }
+    }
+    
+    char buffer[DSHM_PAGE_SIZE];
+    uint32_t digest = 0;
+    size_t offset = header->offset;
+    size_t len = header->size;
+    while (len > 0) {
+        size_t page = offset / DSHM_PAGE_SIZE;
+        size_t page_start = page * DSHM_PAGE_SIZE;
+        size_t page_len = (segment->size - page_start < DSHM_PAGE_SIZE) ? segment->size - page_start : DSHM_PAGE_SIZE;
+        size_t chunk = page_start + page_len - offset;
+        if (chunk > len) {
+            chunk = len;
+        }
+        
+        uint32_t crc;
+        if (chunk == page_len) {
+            // Целая страница - сумма берется из сохраненных
+            if (!((segment->crc_valid[page / 8] >> (page % 8)) & 1)) {
+                copy_out(segment, page_start, page_len, buffer);
+                segment->page_crc[page] = dshm_crc32c(0, buffer, page_len);
+                segment->crc_valid[page / 8] |= (unsigned char)(1u << (page % 8));
+            }
+            crc = segment->page_crc[page];
+        } else {
+            copy_out(segment, offset, chunk, buffer);
+            crc = dshm_crc32c(0, buffer, chunk);
+        }
+        digest = dshm_digest_add(digest, crc);
+        offset += chunk;
+        len -= chunk;
+    }
+    
+    pthread_mutex_unlock(&segments_mutex);
+    
+    *digest_reply = htonl(digest);
+    *reply = digest_reply;
+    *reply_size = sizeof(uint32_t);
+    return SHM_SUCCESS;
+}
+
+// Обработка команды создания снимка сегмента.
+// Снимок получает новый shmid (принадлежащий этому узлу кластера) и разделяет страницы
+// с исходным сегментом до их изменения. Возвращает shmid снимка, в ответе - его размер.
+static int handle_snapshot(shm_header_t *header, client_conn_t *conn, void **reply, size_t *reply_size) {
+    int shmid = -1;
+    
+    // Подбираем свободный shmid, который по карте кластера остается на этом узле,
+    // а среди обработчиков принадлежит тому же, что и исходный сегмент
+    for (int attempt = 0; attempt < SNAPSHOT_SHMID_ATTEMPTS && shmid == -1; attempt++) {
+        pthread_mutex_lock(&cluster_mutex);
+        int candidate = SNAPSHOT_SHMID_BASE + (int)(snapshot_seq++ % SNAPSHOT_SHMID_BASE);
+        int local = owns_shmid(&cluster, cluster_self, candidate);
+        pthread_mutex_unlock(&cluster_mutex);
+        
+        if (local && worker_owns(candidate)) {
+            DSHM_TRACE_LOCK(&segments_mutex);
+            if (find_segment(candidate) == NULL) {
+                shmid = candidate; // segments_mutex остается захваченным
+            } else {
+                pthread_mutex_unlock(&segments_mutex);
+            }
+        }
+    }
+    if (shmid == -1) {
+        return SHM_ENOMEM;
+    }
+    
+    shm_segment_t *source = find_segment(header->shmid);
+    if (source == NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_ENOENT;
+    }
+    if (source->migrating) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EAGAIN;
+    }
+    // Снимок и так неизменяем, его можно читать напрямую
+    if (source->snapshot) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EINVAL;
+    }
+    // Снимок учитывается в квотах полным размером: со временем он может скопировать все страницы
+    quota_account_t *account;
+    if (!conn_quota_ok(conn, source->size, &account)) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_ENOMEM;
+    }
+    
+    uint32_t *size_reply = malloc(2 * sizeof(uint32_t));
+    unsigned char *copied = calloc(page_bitmap_size(source->size), 1);
+    shm_segment_t *snapshot = NULL;
+    if (size_reply != NULL && copied != NULL) {
+        snapshot = create_segment(shmid, source->size, (source->shmflg & ~SEGMENT_REMOVED) | SHM_RDONLY);
+    }
+    if (snapshot == NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+        free(size_reply);
+        free(copied);
+        return SHM_ENOMEM;
+    }
+    
+    // Собственные страницы снимка заполняются сервером при копировании
+    protect_segment(snapshot, PROT_READ | PROT_WRITE);
+    data_write_begin(snapshot);
+    memcpy(snapshot->touched, source->touched, page_bitmap_size(source->size));
+    snapshot->snapshot = 1;
+    cow_link(snapshot, source);
+    snapshot->cow_copied = copied;
+    data_write_end(snapshot);
+    snapshot->creator = account;
+    snapshot->uid = source->uid;
+    snapshot->gid = source->gid;
+    snapshot->cuid = conn->uid;
+    snapshot->cgid = conn->gid;
+    if (account != NULL) {
+        account->segment_bytes += snapshot->size;
+    }
+    
+    size_reply[0] = htonl((uint32_t)((uint64_t)snapshot->size >> 32));
+    size_reply[1] = htonl((uint32_t)snapshot->size);
+    *reply = size_reply;
+    *reply_size = 2 * sizeof(uint32_t);
+    
+    pthread_mutex_unlock(&segments_mutex);
+    return shmid;
+}
+
+// Удаление сегмента, помеченного IPC_RMID, после отсоединения последнего клиента
+static void destroy_if_removed(shm_segment_t *segment, uint64_t state) {
+    if (!(__atomic_load_n(&segment->shmflg, __ATOMIC_SEQ_CST) & SEGMENT_REMOVED)) {
+        return;
+    }
+    DSHM_TRACE_LOCK(&segments_mutex);
+    // Описатель мог смениться, пока блокировка не была взята
+    if ((__atomic_load_n(&segment->attach_state, __ATOMIC_ACQUIRE) >> 32) == (state >> 32) &&
+        (segment->shmflg & SEGMENT_REMOVED) && retire_if_unused(segment)) {
+        destroy_segment(segment);
+    }
+    pthread_mutex_unlock(&segments_mutex);
+}
+
+// Обработка команды присоединения к сегменту.
+// Выполняется без блокировки таблицы: счетчик меняется сравнением с обменом
+// всего слова состояния, поэтому сегмент, удаленный или переданный на другой
+// узел после поиска, присоединение не получит.
+static int handle_attach_segment(shm_header_t *header) {
+    shm_segment_t *segment = lookup_segment(header->shmid);
+    if (segment == NULL) {
+        return SHM_ENOENT;
+    }
+    
+    uint64_t state = __atomic_load_n(&segment->attach_state, __ATOMIC_ACQUIRE);
+    do {
+        if ((uint32_t)state & ATTACH_DEAD ||
+            __atomic_load_n(&segment->shmid, __ATOMIC_RELAXED) != header->shmid) {
+            return SHM_ENOENT;
+        }
+        // Сегмент переносится на другой узел кластера
+        if ((uint32_t)state & ATTACH_FROZEN) {
+            return SHM_EAGAIN;
+        }
+        // Снимок неизменяем
+        if (segment->snapshot && !(header->flags & SHM_RDONLY)) {
+            return SHM_EACCES;
+        }
+        if (((uint32_t)state & ATTACH_COUNT) == ATTACH_COUNT) {
+            return SHM_ENOMEM;
+        }
+    } while (!__atomic_compare_exchange_n(&segment->attach_state, &state, state + 1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE));
+    
+    __atomic_fetch_add(&segment->ref_count, 1, __ATOMIC_RELAXED);
+    return SHM_SUCCESS;
+}
+
+// Обработка команды отсоединения от сегмента (без блокировки таблицы)
+static int handle_detach_segment(shm_header_t *header) {
+    shm_segment_t *segment = lookup_segment(header->shmid);
+    if (segment == NULL) {
+        return SHM_ENOENT;
+    }
+    
+    uint64_t state = __atomic_load_n(&segment->attach_state, __ATOMIC_ACQUIRE);
+    do {
+        if ((uint32_t)state & ATTACH_DEAD ||
+            __atomic_load_n(&segment->shmid, __ATOMIC_RELAXED) != header->shmid) {
+            return SHM_ENOENT;
+        }
+        // Сегмент переносится на другой узел кластера
+        if ((uint32_t)state & ATTACH_FROZEN) {
+            return SHM_EAGAIN;
+        }
+        if (((uint32_t)state & ATTACH_COUNT) == 0) {
+            return SHM_SUCCESS;
+        }
+    } while (!__atomic_compare_exchange_n(&segment->attach_state, &state, state - 1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE));
+    __atomic_fetch_sub(&segment->ref_count, 1, __ATOMIC_RELAXED);
+    
+    // Если сегмент помечен для удаления и больше нет клиентов, удаляем его
+    if (((uint32_t)(state - 1) & ATTACH_COUNT) == 0) {
+        destroy_if_removed(segment, state);
+    }
+    return SHM_SUCCESS;
+}
+
+// Обработка команды удаления сегмента
+static int handle_remove_segment(shm_header_t *header, client_conn_t *conn) {
+    DSHM_TRACE_LOCK(&segments_mutex);
+    shm_segment_t *segment = find_segment(header->shmid);
+    int result = (segment != NULL && !segment_owner_conn(segment, conn)) ? SHM_EACCES : remove_segment(header->shmid);
+    if (result == SHM_SUCCESS) {
+        log_change(header->shmid, DSHM_CHANGE_REMOVE, 0, 0);
+    }
+    pthread_mutex_unlock(&segments_mutex);
+    return result;
+}
+
+// Обработка команды shmctl
+static int handle_shmctl(shm_header_t *header, void *data, client_conn_t *conn, void **reply, size_t *reply_size) {
+    DSHM_TRACE_LOCK(&segments_mutex);
+    
+    shm_segment_t *segment = find_segment(header->shmid);
+    if (segment == NULL) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_ENOENT;
+    }
+    
+    // Сегмент переносится на другой узел кластера
+    if (segment->migrating) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EAGAIN;
+    }
+    
+    // Изменять и удалять сегмент могут только его владелец и создатель,
+    // сведения о нем получает тот, кто может его читать
+    if (((header->flags == IPC_RMID || header->flags == IPC_SET) && !segment_owner_conn(segment, conn)) ||
+        (header->flags == IPC_STAT && !(segment_perms(segment, conn) & PERM_READ))) {
+        pthread_mutex_unlock(&segments_mutex);
+        return SHM_EACCES;
+    }
+    
+    // Обработка различных команд shmctl
+    switch (header->flags) {
+        case IPC_RMID:
+            // Помечаем сегмент для удаления, ключ освобождается сразу
+            __atomic_fetch_or(&segment->shmflg, SEGMENT_REMOVED, __ATOMIC_SEQ_CST);
+            unindex_key(segment);
+            log_change(segment->shmid, DSHM_CHANGE_REMOVE, 0, 0);
+            if (retire_if_unused(segment)) {
+                // Если нет присоединенных клиентов, удаляем сразу
+                destroy_segment(segment);
+            }
+            break;
+            
+        case IPC_STAT: {
+            // Возвращаем статус сегмента (базовую информацию) в ответе
+            shm_stat_t *buf = malloc(sizeof(shm_stat_t));
+            if (buf == NULL) {
+                pthread_mutex_unlock(&segments_mutex);
+                return SHM_ENOMEM;
+            }
+            buf->size_hi = htonl((uint32_t)((uint64_t)segment->size >> 32));
+            buf->size_lo = htonl((uint32_t)segment->size);
+            buf->nattch = htonl(segment_attached(segment));
+            buf->mode = htonl((uint32_t)segment->shmflg);
+            buf->key = (int32_t)htonl((uint32_t)segment->key);
+            buf->uid = htonl(segment->uid);
+            buf->gid = htonl(segment->gid);
+            buf->cuid = htonl(segment->cuid);
+            buf->cgid = htonl(segment->cgid);
+            *reply = buf;
+            *reply_size = sizeof(shm_stat_t);
+            break;
+        }
+            
+        case IPC_SET: {
+            // Как в System V, меняются только владелец и права (младшие 9 бит);
+            // остальные флаги сегмента (SHM_RDONLY снимка, отложенное удаление) сохраняются
+            if (data == NULL || header->size != sizeof(shm_stat_t)) {
+                pthread_mutex_unlock(&segments_mutex);
+                return SHM_EINVAL;
+            }
+            shm_stat_t buf;
+            memcpy(&buf, data, sizeof(buf));
+            int shmflg = (segment->shmflg & ~0777) | (int)(ntohl(buf.mode) & 0777);
+            segment->uid = ntohl(buf.uid);
+            segment->gid = ntohl(buf.gid);
+            __atomic_store_n(&segment->shmflg, shmflg, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&segment->perm_seq, 1, __ATOMIC_RELEASE);
+            // Копии на других узлах получат новые права вместе с полной копией сегмента
+            segment->replica_epoch = 0;
+            break;
+        }
+            
+        default:
+            pthread_mutex_unlock(&segments_mutex);
+            return SHM_EINVAL;
+    }
+    
+    pthread_mutex_unlock(&segments_mutex);
+    return SHM_SUCCESS;
+}
+
+// Обработка готовых завершений io_uring без системных вызовов
+static void uring_reap(uring_conn_t *u) {
+    struct io_uring_cqe *cqe;
+    while ((cqe = dshm_uring_peek(&u->ring)) != NULL) {
+        if (cqe->user_data == URING_UD_RECV) {
+            if (cqe->res > 0) {
+                // Буферы многократного recv приходят в порядке приема
+                int tail = (u->chunk_head + u->chunk_count) % URING_RECV_BUFFERS;
+                u->chunk_bid[tail] = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                u->chunk_len[tail] = (uint32_t)cqe->res;
+                u->chunk_count++;
+            } else {
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    dshm_uring_recycle(&u->ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                // ENOBUFS - все буферы заняты, прием возобновится после их разбора
+                if (cqe->res != -ENOBUFS) {
+                    u->broken = 1;
+                }
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                u->armed = 0;
+            }
+        } else {
+            uring_slot_t *slot = &u->slots[cqe->user_data - 1];
+            if (cqe->res < 0) {
+                u->broken = 1; // Ошибка отправки, следующие в цепочке отменены
+            }
+            u->sends_in_flight--;
+            if (--slot->sends == 0) {
+                dshm_pool_free(u->pool, slot->payload);
+                slot->payload = NULL;
+            }
+        }
+        dshm_uring_seen(&u->ring);
+    }
+}
+
+// Отправка накопленных записей и ожидание хотя бы одного завершения
+static int uring_wait(uring_conn_t *u) {
+    u->last_send = NULL; // Новые ответы начнут следующую цепочку
+    if (dshm_uring_submit(&u->ring, 1) == -1 && errno != EINTR) {
+        u->broken = 1;
+        return -1;
+    }
+    uring_reap(u);
+    return 0;
+}
+
+// Создание кольца соединения с зарегистрированными буферами приема
+static int uring_conn_init(uring_conn_t *u, int socket, dshm_pool_t *pool) {
+    memset(u, 0, sizeof(*u));
+    u->socket = socket;
+    u->pool = pool;
+    if (dshm_uring_init(&u->ring, URING_ENTRIES) == -1) {
+        return -1;
+    }
+    if (dshm_uring_setup_buffers(&u->ring, URING_RECV_BUFFERS, URING_RECV_BUFFER_SIZE) == -1) {
+        dshm_uring_exit(&u->ring);
+        return -1;
+    }
+    return 0;
+}
+
+// Завершение соединения: досылаем ответы и дожидаемся операций, использующих буферы
+static void uring_conn_exit(uring_conn_t *u) {
+    while (u->sends_in_flight > 0 && !u->broken) {
+        uring_wait(u);
+    }
+    shutdown(u->socket, SHUT_RDWR);
+    while ((u->sends_in_flight > 0 || u->armed) && uring_wait(u) == 0) {
+    }
+    for (int i = 0; i < URING_SEND_SLOTS; i++) {
+        dshm_pool_free(u->pool, u->slots[i].payload);
+    }
+    dshm_uring_exit(&u->ring);
+}
+
+// Чтение ровно len байт из принятых буферов.
+// Данные всех запросов, пришедших одним пакетом, разбираются без системных вызовов.
+static ssize_t uring_recv(uring_conn_t *u, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        if (u->chunk_count > 0) {
+            unsigned bid = u->chunk_bid[u->chunk_head];
+            size_t avail = u->chunk_len[u->chunk_head] - u->chunk_pos;
+            size_t n = (avail < len - done) ? avail : len - done;
+            memcpy((char*)buf + done, (char*)dshm_uring_buffer(&u->ring, bid) + u->chunk_pos, n);
+            done += n;
+            u->chunk_pos += n;
+            if (u->chunk_pos == u->chunk_len[u->chunk_head]) {
+                dshm_uring_recycle(&u->ring, bid);
+                u->chunk_head = (u->chunk_head + 1) % URING_RECV_BUFFERS;
+                u->chunk_count--;
+                u->chunk_pos = 0;
+            }
+            continue;
+        }
+
+        if (u->broken) {
+            return done > 0 ? -1 : 0;
+        }
+        if (!u->armed) {
+            struct io_uring_sqe *sqe = dshm_uring_get_sqe(&u->ring);
+            if (sqe == NULL) {
+                uring_wait(u);
+                continue;
+            }
+            dshm_uring_prep_recv_multishot(sqe, u->socket);
+            sqe->user_data = URING_UD_RECV;
+            u->armed = 1;
+        }
+        // Ожидание данных заодно отправляет накопленные ответы
+        if (uring_wait(u) == -1) {
+            return -1;
+        }
+    }
+    return (ssize_t)done;
+}
+
+// Постановка ответа в очередь отправки (данные переходят во владение соединения).
+// Заголовок и данные, а также ответы на подряд идущие запросы связываются в одну
+// цепочку и отправляются одним вызовом io_uring_enter перед ожиданием нового запроса.
+static int uring_send_reply(uring_conn_t *u, const shm_response_t *response, void *payload, size_t size,
+                            const uint32_t *trailer) {
+    // Цепочки не пересекаются: новая начинается после завершения предыдущей,
+    // иначе ответы могли бы уйти в сокет не по порядку
+    while (u->last_send == NULL && u->sends_in_flight > 0 && !u->broken) {
+        uring_wait(u);
+    }
+
+    uring_slot_t *slot = NULL;
+    while (slot == NULL && !u->broken) {
+        for (int i = 0; i < URING_SEND_SLOTS; i++) {
+            if (u->slots[i].sends == 0) {
+                slot = &u->slots[i];
+                break;
+            }
+        }
+        if (slot == NULL || dshm_uring_pending(&u->ring) + 3 > URING_ENTRIES) {
+            slot = NULL;
+            uring_wait(u);
+        }
+    }
+    if (u->broken) {
+        dshm_pool_free(u->pool, payload);
+        return -1;
+    }
+
+    slot->header = *response;
+    slot->payload = payload;
+    slot->trailer = (trailer != NULL) ? *trailer : 0;
+    slot->sends = 0;
+
+    const void *parts[3] = { &slot->header, payload, &slot->trailer };
+    size_t lengths[3] = { sizeof(slot->header), size, (trailer != NULL) ? sizeof(slot->trailer) : 0 };
+    int last = (lengths[2] > 0) ? 2 : (lengths[1] > 0) ? 1 : 0;
+    for (int i = 0; i <= last; i++) {
+        if (lengths[i] == 0) {
+            continue;
+        }
+        // Части одного ответа уходят одним сегментом
+        struct io_uring_sqe *sqe = dshm_uring_get_sqe(&u->ring);
+        dshm_uring_prep_send(sqe, u->socket, parts[i], lengths[i],
+                             MSG_NOSIGNAL | MSG_WAITALL | (i < last ? MSG_MORE : 0));
+        sqe->user_data = (uint64_t)(slot - u->slots) + 1;
+        if (u->last_send != NULL) {
+            u->last_send->flags |= IOSQE_IO_LINK;
+        }
+        u->last_send = sqe;
+        slot->sends++;
+        u->sends_in_flight++;
+    }
+    return 0;
+}
+
+// Проверка поддержки io_uring ядром (многократный recv с кольцом буферов)
+static int uring_available(void) {
+    dshm_uring_t ring;
+    if (dshm_uring_init(&ring, 2) == -1) {
+        return 0;
+    }
+    int ok = (dshm_uring_setup_buffers(&ring, 1, DSHM_PAGE_SIZE) == 0);
+    dshm_uring_exit(&ring);
+    return ok;
+}
+
+// Чтение ровно len байт запроса (0 - соединение закрыто). first - начало запроса:
+// если клиент за время таймаута ничего не прислал, -1 с errno = EAGAIN
+static ssize_t conn_recv(client_conn_t *conn, void *buf, size_t len, int first) {
+    if (conn->uring != NULL) {
+        return uring_recv(conn->uring, buf, len);
+    }
+    return first ? dshm_read_first(conn->reader, buf, len) : dshm_read_full(conn->reader, buf, len);
+}
+
+// Отправка ответа и его данных (с контрольной суммой, если checksum); данные освобождаются
+static int conn_send_reply(client_conn_t *conn, const shm_response_t *response, void *payload, size_t size,
+                           int checksum) {
+    uint32_t trailer = 0;
+    if (checksum) {
+        trailer = htonl(dshm_crc32c(dshm_crc32c(0, response, sizeof(*response)), payload, size));
+    }
+    if (conn->uring != NULL) {
+        return uring_send_reply(conn->uring, response, payload, size, checksum ? &trailer : NULL);
+    }
+    struct iovec iov[3] = {
+        { (void*)response, sizeof(*response) },
+        { payload, size },
+        { &trailer, checksum ? sizeof(trailer) : 0 },
+    };
+    int status = dshm_write_full(conn->socket, iov, 3);
+    dshm_pool_free(conn->pool, payload);
+    return status;
+}
+
+// Ожидание отправки ответов, поставленных в очередь io_uring
+static void conn_flush(client_conn_t *conn) {
+    while (conn->uring != NULL && conn->uring->sends_in_flight > 0 && !conn->uring->broken) {
+        uring_wait(conn->uring);
+    }
+}
+
+// Подписчик на месте: клиент не закрыл соединение, а сегмент остается на этом узле
+static int subscription_alive(const client_conn_t *conn, const push_sub_t *sub) {
+    struct pollfd pfd = { .fd = conn->socket, .events = POLLRDHUP };
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+        return 0;
+    }
+    DSHM_TRACE_LOCK(&segments_mutex);
+    shm_segment_t *segment = find_segment(sub->shmid);
+    int local = (segment != NULL && !segment->replica);
+    pthread_mutex_unlock(&segments_mutex);
+    return local;
+}
+
+// Отправка рассылки подписчику соединения. Когда сегмент уходит с узла,
+// соединение закрывается: клиент подписывается заново у нового владельца.
+static void serve_subscription(client_conn_t *conn) {
+    push_sub_t *sub = conn->subscription;
+    int checksum = (conn->caps & DSHM_CAP_CRC) != 0;
+    
+    // Ответ на подписку мог еще не уйти через io_uring, а рассылка пишется в сокет напрямую
+    conn_flush(conn);
+    
+    while (running && !__atomic_load_n(&draining, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&push_mutex);
+        if (sub->count == 0 && !sub->lost) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += PUSH_IDLE_MS / 1000;
+            deadline.tv_nsec += (long)(PUSH_IDLE_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&sub->cond, &push_mutex, &deadline);
+        }
+        push_msg_t *msg = NULL;
+        int lost = sub->lost;
+        if (lost) {
+            sub->lost = 0;
+        } else if (sub->count > 0) {
+            msg = sub->queue[sub->head];
+            sub->head = (sub->head + 1) % PUSH_QUEUE_LEN;
+            sub->count--;
+            sub->bytes -= msg->size;
+        }
+        pthread_mutex_unlock(&push_mutex);
+        
+        if (lost) {
+            msg = push_msg_build(NULL, 0);
+            if (msg == NULL) {
+                break; // Потерю клиент обнаружит по закрытию соединения
+            }
+        } else if (msg == NULL) {
+            if (!subscription_alive(conn, sub)) {
+                break;
+            }
+            continue;
+        }
+        
+        struct iovec iov[2] = {
+            { msg->data, msg->size },
+            { &msg->trailer, checksum ? sizeof(msg->trailer) : 0 },
+        };
+        int status = dshm_write_full(conn->socket, iov, 2);
+        push_msg_release(msg);
+        if (status == -1) {
+            break;
+        }
+    }
+}
+
+// Резервирование памяти под буфер запроса. Ждет своей очереди и свободного
+// места в общем лимите; запрос, больший лимита, пропускается, когда других нет.
+static void admission_acquire(size_t bytes) {
+    if (bytes == 0) {
+        return;
+    }
+    pthread_mutex_lock(&admission_mutex);
+    unsigned long ticket = admission_next++;
+    while (ticket != admission_serving ||
+           (limit_buffers_global > 0 && buffers_in_use > 0 &&
+            bytes > limit_buffers_global - buffers_in_use)) {
+        pthread_cond_wait(&admission_cond, &admission_mutex);
+    }
+    buffers_in_use += bytes;
+    admission_serving++;
+    pthread_cond_broadcast(&admission_cond);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+// Резервирование без ожидания (для распакованных данных уже принятого запроса)
+static int admission_try(size_t bytes) {
+    pthread_mutex_lock(&admission_mutex);
+    int ok = (limit_buffers_global == 0 ||
+              (buffers_in_use <= limit_buffers_global && bytes <= limit_buffers_global - buffers_in_use));
+    if (ok) {
+        buffers_in_use += bytes;
+    }
+    pthread_mutex_unlock(&admission_mutex);
+    return ok;
+}
+
+static void admission_release(size_t bytes) {
+    if (bytes == 0) {
+        return;
+    }
+    pthread_mutex_lock(&admission_mutex);
+    buffers_in_use -= bytes;
+    pthread_cond_broadcast(&admission_cond);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+// Пропуск полезной нагрузки отклоненного запроса, чтобы не нарушить поток сообщений
+// (контрольная сумма сообщения при этом продолжает считаться)
+static int discard_payload(client_conn_t *conn, size_t size, uint32_t *crc) {
+    char scratch[4096];
+    while (size > 0) {
+        size_t chunk = (size < sizeof(scratch)) ? size : sizeof(scratch);
+        if (conn_recv(conn, scratch, chunk, 0) != (ssize_t)chunk) {
+            return -1;
+        }
+        *crc = dshm_crc32c(*crc, scratch, chunk);
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Чтение и проверка контрольной суммы запроса.
+// Возвращает 1, если сумма совпала (или не согласована), 0 - если нет, -1 при ошибке соединения
+static int check_trailer(client_conn_t *conn, uint32_t caps, uint32_t crc) {
+    if (!(caps & DSHM_CAP_CRC)) {
+        return 1;
+    }
+    uint32_t trailer;
+    if (conn_recv(conn, &trailer, sizeof(trailer), 0) != sizeof(trailer)) {
+        return -1;
+    }
+    return ntohl(trailer) == crc;
+}
+
+// Сопровождается ли запрос полезной нагрузкой размером header.size
+// (для чтения, освобождения страниц, заполнения и свертки поле size задает длину диапазона)
+static int has_payload(uint32_t command) {
+    return command != CMD_READ_DATA && command != CMD_PUNCH_HOLE && command != CMD_CHECKSUM &&
+           command != CMD_SUBSCRIBE && command != CMD_FILL;
+}
+
+// Согласование возможностей; если сервер требует проверки подлинности, в ответе - его вызов
+static int handle_hello(shm_header_t *header, client_conn_t *conn, void **reply, size_t *reply_size) {
+    conn->caps = (uint32_t)header->flags & SERVER_CAPS;
+    if (auth_key_count == 0) {
+        return (int)conn->caps;
+    }
+    uint8_t *nonce = malloc(DSHM_AUTH_NONCE);
+    if (nonce == NULL || dshm_auth_nonce(conn->auth_nonce) == -1) {
+        free(nonce);
+        return SHM_ERROR;
+    }
+    memcpy(nonce, conn->auth_nonce, DSHM_AUTH_NONCE);
+    *reply = nonce;
+    *reply_size = DSHM_AUTH_NONCE;
+    return (int)(conn->caps | DSHM_CAP_AUTH);
+}
+
+// Проверка подтверждения клиента; в ответе - подтверждение сервера. Вызов
+// используется один раз: повтор того же CMD_AUTH не пройдет. Заявленный uid
+// выбирает ключ: 0 - ключ узлов, иначе - ключ этого пользователя, и gid
+// соединения берется из файла ключей, а не от клиента.
+static int handle_auth(shm_header_t *header, void *data, client_conn_t *conn, void **reply, size_t *reply_size) {
+    shm_auth_t auth;
+    if (auth_key_count == 0 || data == NULL || header->size != sizeof(auth)) {
+        return SHM_EINVAL;
+    }
+    memcpy(&auth, data, sizeof(auth));
+    static const uint8_t no_nonce[DSHM_AUTH_NONCE];
+    if (memcmp(conn->auth_nonce, no_nonce, DSHM_AUTH_NONCE) == 0) {
+        return SHM_EACCES; // CMD_HELLO еще не выдал вызов
+    }
+
+    uint32_t uid = ntohl(auth.uid);
+    const dshm_auth_entry_t *entry = NULL;
+    uint8_t expected[DSHM_AUTH_MAC];
+    for (int i = 0; i < auth_key_count && entry == NULL; i++) {
+        const dshm_auth_entry_t *candidate = &auth_keys[i];
+        if ((candidate->kind == DSHM_KEY_USER) ? candidate->uid != uid : uid != 0) {
+            continue;
+        }
+        dshm_auth_proof(candidate->key, (size_t)candidate->len, 'C', conn->auth_nonce, &auth, expected);
+        if (dshm_auth_equal(expected, auth.mac)) {
+            entry = candidate;
+        }
+    }
+    uint8_t *proof = (entry != NULL) ? malloc(DSHM_AUTH_MAC) : NULL;
+    if (proof != NULL) {
+        dshm_auth_proof(entry->key, (size_t)entry->len, 'S', conn->auth_nonce, &auth, proof);
+    }
+    memset(conn->auth_nonce, 0, DSHM_AUTH_NONCE);
+    if (entry == NULL) {
+        fprintf(stderr, "Соединение не подтвердило ключ пользователя %u\n", uid);
+        return SHM_EACCES;
+    }
+    if (proof == NULL) {
+        return SHM_ENOMEM;
+    }
+
+    conn->uid = (entry->kind == DSHM_KEY_USER) ? entry->uid : 0;
+    conn->gid = (entry->kind == DSHM_KEY_USER) ? entry->gid : 0;
+    memset(conn->grants, 0, GRANT_SLOTS * sizeof(grant_t));
+    conn->authenticated = 1;
+    *reply = proof;
+    *reply_size = DSHM_AUTH_MAC;
+    return SHM_SUCCESS;
+}
+
+// Поколение прав сегмента: меняется при его удалении, повторном занятии
+// описателя и смене прав. Читается без блокировки.
+static uint64_t perm_generation(const shm_segment_t *segment) {
+    uint64_t state = __atomic_load_n(&segment->attach_state, __ATOMIC_ACQUIRE);
+    return (state & ~(uint64_t)UINT32_MAX) | __atomic_load_n(&segment->perm_seq, __ATOMIC_ACQUIRE);
+}
+
+// Есть ли у соединения права need на сегмент: SHM_SUCCESS, SHM_EACCES или
+// SHM_ENOENT. Права проверяются по shm_perm под segments_mutex один раз (обычно
+// при присоединении) и дальше берутся из кэша соединения, пока описатель сегмента
+// не сменит поколение. Сегмента нет - отказ: иначе созданный до выполнения
+// команды сегмент с тем же shmid не прошел бы проверку.
+static int conn_may(client_conn_t *conn, int shmid, int need) {
+    grant_t *grant = &conn->grants[(uint32_t)shmid % GRANT_SLOTS];
+    shm_segment_t *segment = lookup_segment(shmid);
+    if (segment == NULL) {
+        return SHM_ENOENT;
+    }
+    if (grant->shmid != shmid || grant->segment != segment || grant->generation != perm_generation(segment)) {
+        DSHM_TRACE_LOCK(&segments_mutex);
+        segment = find_segment(shmid);
+        if (segment == NULL) {
+            pthread_mutex_unlock(&segments_mutex);
+            return SHM_ENOENT;
+        }
+        grant->shmid = shmid;
+        grant->perms = segment_perms(segment, conn);
+        grant->segment = segment;
+        grant->generation = perm_generation(segment);
+        pthread_mutex_unlock(&segments_mutex);
+    }
+    return ((grant->perms & need) == need) ? SHM_SUCCESS : SHM_EACCES;
+}
+
+// Команды, которые отправляют друг другу узлы кластера
+static int node_command(uint32_t command) {
+    return command == CMD_SET_CLUSTER_MAP || command == CMD_MIGRATE_IN || command == CMD_MIGRATE_OUT ||
+           command == CMD_REPLICA_UPDATE;
+}
+
+// Без ключей: подключен ли клиент с этой машины или с адреса узла карты кластера.
+// Адреса узлов разрешаются при первой команде узлов соединения.
+static int conn_node_peer(client_conn_t *conn) {
+    if (conn->node_peer != -1) {
+        return conn->node_peer;
+    }
+    conn->node_peer = ((ntohl(conn->peer_addr) >> 24) == 127);
+    
+    dshm_node_t nodes[DSHM_MAX_NODES];
+    pthread_mutex_lock(&cluster_mutex);
+    int count = cluster.node_count;
+    memcpy(nodes, cluster.nodes, (size_t)count * sizeof(dshm_node_t));
+    pthread_mutex_unlock(&cluster_mutex);
+    
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    for (int i = 0; i < count && !conn->node_peer; i++) {
+        struct addrinfo *addrs = NULL;
+        if (getaddrinfo(nodes[i].host, NULL, &hints, &addrs) != 0) {
+            continue;
+        }
+        for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+            if (((struct sockaddr_in*)a->ai_addr)->sin_addr.s_addr == conn->peer_addr) {
+                conn->node_peer = 1;
+                break;
+            }
+        }
+        freeaddrinfo(addrs);
+    }
+    return conn->node_peer;
+}
+
+// Права, которых требует команда соединения без прав суперпользователя
+static int check_access(client_conn_t *conn, const shm_header_t *header, const void *data) {
+    int need;
+    switch (header->command) {
+        case CMD_ATTACH_SEGMENT:
+            need = (header->flags & SHM_RDONLY) ? PERM_READ : PERM_READ | PERM_WRITE;
+            break;
+            
+        case CMD_READ_DATA:
+        case CMD_CHECKSUM:
+        case CMD_SNAPSHOT:
+        case CMD_GET_CHANGES:
+        case CMD_SUBSCRIBE:
+            need = PERM_READ;
+            break;
+            
+        case CMD_WRITE_DATA:
+        case CMD_PUNCH_HOLE:
+        case CMD_FILL:
+        case CMD_RESIZE:
+            need = PERM_WRITE;
+            break;
+            
+        case CMD_COPY: {
+            // Источник нужно уметь читать
+            shm_copy_t copy;
+            if (data != NULL && header->size == sizeof(copy)) {
+                memcpy(&copy, data, sizeof(copy));
+                // Источника здесь нет: как и обработчик, отдаем перенос данных клиенту
+                int result = conn_may(conn, (int32_t)ntohl(copy.src_shmid), PERM_READ);
+                if (result != SHM_SUCCESS) {
+                    return (result == SHM_ENOENT) ? SHM_EXDEV : result;
+                }
+            }
+            need = PERM_WRITE;
+            break;
+        }
+            
+        // Команды узлов кластера
+        case CMD_SET_CLUSTER_MAP:
+        case CMD_MIGRATE_IN:
+        case CMD_MIGRATE_OUT:
+        case CMD_REPLICA_UPDATE:
+            return SHM_EACCES;
+            
+        default:
+            return SHM_SUCCESS;
+    }
+    return conn_may(conn, header->shmid, need);
+}
+
+// Выполнение команды. Данные ответа (если есть) возвращаются через reply
+static int execute_request(client_conn_t *conn, shm_header_t *header, void *data,
+                           void **reply, size_t *reply_size, uint32_t *encoding) {
+    int result;
+    DSHM_TRACE_BEGIN(DSHM_TRACE_EXECUTE, header->command, header->shmid);
+    switch (header->command) {
+        case CMD_CREATE_SEGMENT:
+            result = handle_create_segment(header, data, conn, reply, reply_size);
+            break;
+            
+        case CMD_ATTACH_SEGMENT:
+            result = handle_attach_segment(header);
+            break;
+            
+        case CMD_DETACH_SEGMENT:
+            result = handle_detach_segment(header);
+            break;
+            
+        case CMD_REMOVE_SEGMENT:
+            result = handle_remove_segment(header, conn);
+            break;
+            
+        case CMD_READ_DATA:
+            // Для чтения данных нужно выделить буфер
+            *reply = dshm_pool_alloc(conn->pool, header->size);
+            if (*reply != NULL) {
+                int zero_range = 0;
+                result = handle_read_data(conn, header, *reply, &zero_range);
+                *reply_size = header->size;
+                if (result == SHM_SUCCESS && zero_range) {
+                    // Диапазон ни разу не записывался - вместо данных отправляем признак
+                    dshm_pool_free(conn->pool, *reply);
+                    *reply = NULL;
+                    *reply_size = 0;
+                    *encoding = DSHM_ENC_ZERO;
+                }
+            } else {
+                result = SHM_ENOMEM;
+            }
+            break;
+            
+        case CMD_PUNCH_HOLE:
+            result = handle_punch_hole(header);
+            break;
+            
+        case CMD_FILL:
+            result = handle_fill(header);
+            break;
+            
+        case CMD_COPY:
+            result = handle_copy(header, data);
+            break;
+            
+        case CMD_RESIZE:
+            result = handle_resize(header, conn, data, reply, reply_size);
+            break;
+            
+        case CMD_SNAPSHOT:
+            result = handle_snapshot(header, conn, reply, reply_size);
+            break;
+            
+        case CMD_GET_CHANGES:
+            result = handle_get_changes(header, data, reply, reply_size);
+            break;
+            
+        case CMD_CHECKSUM:
+            result = handle_checksum(header, reply, reply_size);
+            break;
+            
+        case CMD_SUBSCRIBE:
+            result = handle_subscribe(header, conn);
+            break;
+            
+        case CMD_WRITE_DATA:
+            result = handle_write_data(header, data);
+            break;
+            
+        case CMD_SHMCTL:
+            result = handle_shmctl(header, data, conn, reply, reply_size);
+            break;
+            
+        case CMD_CLUSTER_MAP:
+            result = handle_cluster_map(reply, reply_size);
+            break;
+            
+        case CMD_SET_CLUSTER_MAP:
+            result = handle_set_cluster_map(header, data);
+            break;
+            
+        case CMD_MIGRATE_IN:
+            result = handle_migrate_in(conn, header, data);
+            break;
+            
+        case CMD_MIGRATE_OUT:
+            result = handle_migrate_out(header, reply, reply_size);
+            break;
+            
+        case CMD_REPLICA_UPDATE:
+            result = handle_replica_update(header, data);
+            break;
+            
+        case CMD_HELLO:
+            // Возвращаем возможности, поддерживаемые обеими сторонами
+            result = handle_hello(header, conn, reply, reply_size);
+            break;
+            
+        case CMD_AUTH:
+            result = handle_auth(header, data, conn, reply, reply_size);
+            break;
+            
+        default:
+            result = SHM_EINVAL;
+            break;
+    }
+    DSHM_TRACE_END(DSHM_TRACE_EXECUTE, header->command, header->shmid);
+    return result;
+}
+
+static void futex_wait(uint32_t *word, uint32_t value, int timeout_ms) {
+    struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000L };
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, timeout_ms > 0 ? &timeout : NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Выполняется ли команда владельцем сегмента. Ожидание журнала изменений,
+// подписки, команды кластера и миграции остаются в потоке соединения.
+static int worker_command(uint32_t command) {
+    switch (command) {
+        case CMD_CREATE_SEGMENT:
+        case CMD_ATTACH_SEGMENT:
+        case CMD_DETACH_SEGMENT:
+        case CMD_REMOVE_SEGMENT:
+        case CMD_READ_DATA:
+        case CMD_WRITE_DATA:
+        case CMD_PUNCH_HOLE:
+        case CMD_FILL:
+        case CMD_COPY:
+        case CMD_RESIZE:
+        case CMD_SHMCTL:
+        case CMD_SNAPSHOT:
+        case CMD_CHECKSUM:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Выполнение команд из всех непустых очередей. Возвращает число выполненных
+static int worker_poll(worker_t *w) {
+    int done = 0;
+    for (int word = 0; word < (MAX_CLIENTS + 63) / 64; word++) {
+        uint64_t bits = __atomic_exchange_n(&w->pending[word], 0, __ATOMIC_ACQUIRE);
+        while (bits != 0) {
+            int slot = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            worker_request_t *req;
+            while ((req = dshm_spsc_pop(&w->queues[slot])) != NULL) {
+                req->result = execute_request(req->conn, &req->header, req->data,
+                                              &req->reply, &req->reply_size, &req->encoding);
+                if (__atomic_exchange_n(&req->state, REQ_DONE, __ATOMIC_RELEASE) != REQ_PENDING) {
+                    futex_wake(&req->state);
+                }
+                done++;
+            }
+        }
+    }
+    return done;
+}
+
+// Цикл обработчика: опрос очередей, при простое - сон до новой команды
+static void* worker_thread(void *arg) {
+    worker_t *w = arg;
+    int idle = 0;
+    current_worker = (int)(w - workers);
+
+    while (running) {
+        uint32_t wake = __atomic_load_n(&w->wake, __ATOMIC_SEQ_CST);
+        if (worker_poll(w) > 0) {
+            idle = 0;
+            continue;
+        }
+        if (++idle < worker_spin) {
+            continue;
+        }
+        // Флаг сна выставляется до повторной проверки очередей, поэтому
+        // команда, поставленная после нее, изменит счетчик и разбудит поток
+        __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (worker_poll(w) == 0) {
+            futex_wait(&w->wake, wake, WORKER_IDLE_MS);
+        }
+        __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+        idle = 0;
+    }
+    return NULL;
+}
+
+// Обработчик команды. Сегмент создает владелец его будущего shmid: для ключа -
+// владелец первого shmid корзины ключа, для IPC_PRIVATE - обработчики по кругу
+// (generate_shmid выбирает shmid, принадлежащий выполняющему обработчику).
+static int command_worker(const shm_header_t *header) {
+    if (header->command == CMD_CREATE_SEGMENT) {
+        if (header->shmid == IPC_PRIVATE) {
+            return (int)(__atomic_fetch_add(&private_worker, 1, __ATOMIC_RELAXED) % (uint32_t)worker_count);
+        }
+        return segment_owner(dshm_cluster_bucket_id((uint32_t)header->shmid, 0));
+    }
+    return segment_owner(header->shmid);
+}
+
+// Передача команды владельцу сегмента и ожидание результата. Если обработчик
+// не ответил за WORKER_TIMEOUT_MS, возвращает SHM_ERROR и помечает команду
+// брошенной: соединение после ответа закрывается (см. handle_client).
+static int worker_submit(client_conn_t *conn, shm_header_t *header, void *data,
+                         void **reply, size_t *reply_size, uint32_t *encoding) {
+    worker_request_t *req = conn->request;
+    *req = (worker_request_t){
+        .conn = conn, .header = *header, .data = data,
+        .reply = NULL, .reply_size = 0, .encoding = *encoding,
+        .result = SHM_ERROR, .state = REQ_PENDING
+    };
+    worker_t *w = &workers[command_worker(header)];
+    int slot = conn->worker_slot;
+
+    // Соединение ждет каждую команду, поэтому очередь не переполняется
+    while (dshm_spsc_push(&w->queues[slot], req) == -1) {
+        sched_yield();
+    }
+    __atomic_fetch_or(&w->pending[slot / 64], 1ull << (slot % 64), __ATOMIC_RELEASE);
+    __atomic_fetch_add(&w->wake, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)) {
+        futex_wake(&w->wake);
+    }
+
+    for (int spin = 0; spin < worker_spin; spin++) {
+        if (__atomic_load_n(&req->state, __ATOMIC_ACQUIRE) == REQ_DONE) {
+            break;
+        }
+    }
+    uint32_t expected = REQ_PENDING;
+    if (__atomic_compare_exchange_n(&req->state, &expected, REQ_SLEEPING, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        uint64_t deadline = now_ms() + WORKER_TIMEOUT_MS;
+        while (__atomic_load_n(&req->state, __ATOMIC_ACQUIRE) != REQ_DONE) {
+            uint64_t now = now_ms();
+            expected = REQ_SLEEPING;
+            if (now >= deadline &&
+                __atomic_compare_exchange_n(&req->state, &expected, REQ_ABANDONED, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                fprintf(stderr, "Обработчик %d не выполнил команду %u за %d мс\n",
+                        (int)(w - workers), header->command, WORKER_TIMEOUT_MS);
+                return SHM_ERROR;
+            }
+            futex_wait(&req->state, REQ_SLEEPING, (now < deadline) ? (int)(deadline - now) : 1);
+        }
+    }
+
+    *header = req->header;
+    *reply = req->reply;
+    *reply_size = req->reply_size;
+    *encoding = req->encoding;
+    return req->result;
+}
+
+// Брошена ли последняя команда соединения (ее выполнение еще не дождались)
+static int request_abandoned(const client_conn_t *conn) {
+    return conn->request != NULL && __atomic_load_n(&conn->request->state, __ATOMIC_ACQUIRE) == REQ_ABANDONED;
+}
+
+// Очередь соединения у обработчиков (-1 - все заняты, команды выполняются на месте)
+static int worker_slot_acquire(void) {
+    int slot = -1;
+    pthread_mutex_lock(&worker_slots_mutex);
+    for (int i = 0; i < MAX_CLIENTS && slot == -1; i++) {
+        if (!worker_slot_used[i]) {
+            worker_slot_used[i] = 1;
+            slot = i;
+        }
+    }
+    pthread_mutex_unlock(&worker_slots_mutex);
+    return slot;
+}
+
+static void worker_slot_release(int slot) {
+    pthread_mutex_lock(&worker_slots_mutex);
+    worker_slot_used[slot] = 0;
+    pthread_mutex_unlock(&worker_slots_mutex);
+}
+
+// Запуск обработчиков, закрепленных за ядрами по кругу
+static int start_workers(int count) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    if (count == 0) {
+        count = (int)cpus;
+    }
+    if (posix_memalign((void**)&workers, DSHM_CACHE_LINE, count * sizeof(worker_t)) != 0) {
+        return -1;
+    }
+    memset(workers, 0, count * sizeof(worker_t));
+    worker_spin = (cpus > 1) ? WORKER_SPIN : 0;
+
+    for (int i = 0; i < count; i++) {
+        worker_t *w = &workers[i];
+        for (int q = 0; q < MAX_CLIENTS; q++) {
+            dshm_spsc_init(&w->queues[q]);
+        }
+        w->cpu = (int)(i % cpus);
+        if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+            return -1;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(w->thread, sizeof(set), &set);
+        pthread_detach(w->thread);
+        worker_count++;
+    }
+    return 0;
+}
+
+// Обработка одного запроса клиента
+// Возвращает -1, если соединение нужно закрыть
+static int process_request(client_conn_t *conn) {
+    shm_header_t header;
+    ssize_t bytes_received;
+    
+    // Читаем заголовок запроса
+    bytes_received = conn_recv(conn, &header, sizeof(header), 1);
+    if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0; // Истек таймаут ожидания - клиент просто простаивает
+    }
+    if (bytes_received != sizeof(header)) {
+        return -1; // Ошибка или соединение закрыто
+    }
+    
+    // Запрос учитывается до проверки остановки: остановка дожидается учтенных запросов
+    __atomic_add_fetch(&requests_in_flight, 1, __ATOMIC_SEQ_CST);
+    int refused = __atomic_load_n(&draining, __ATOMIC_SEQ_CST);
+    
+    // Возможности, действовавшие при отправке запроса (CMD_HELLO меняет их только для следующих)
+    uint32_t caps = conn->caps;
+    uint32_t crc = dshm_crc32c(0, &header, sizeof(header));
+    
+    // Преобразуем поля заголовка из сетевого порядка байт
+    header.command = ntohl(header.command);
+    header.size = ntohl(header.size);
+    header.shmid = ntohl(header.shmid);
+    header.flags = ntohl(header.flags);
+    header.offset = ntohl(header.offset);
+    header.encoding = ntohl(header.encoding);
+    DSHM_TRACE_BEGIN(DSHM_TRACE_REQUEST, header.command, header.shmid);
+    
+    void *data = NULL;
+    void *reply = NULL;        // Данные ответа (если есть)
+    size_t reply_size = 0;
+    shm_response_t response = {0};
+    int result = SHM_SUCCESS;
+    int corrupted = 0;         // Поток запросов нарушен, после ответа соединение закрывается
+    
+    // Буфер запроса (или ответа на чтение) выделяется только в пределах лимитов.
+    // Малые буферы не учитываются: их сумма ограничена числом соединений, а
+    // частые малые чтения не должны дважды проходить через admission_mutex.
+    int payload = (header.size > 0 && has_payload(header.command));
+    size_t reserved = (payload || header.command == CMD_READ_DATA) ? header.size : 0;
+    if (reserved <= OPTIMISTIC_READ_MAX) {
+        reserved = 0;
+    }
+    
+    // До подтверждения ключа выполняются только CMD_HELLO и CMD_AUTH с данными не
+    // больше shm_auth_t и без сжатия: под данные неподтвержденного соединения
+    // не выделяется память и ничего не распаковывается
+    int guest_refused = (auth_key_count > 0 && !conn->authenticated &&
+                         ((header.command != CMD_HELLO && header.command != CMD_AUTH) ||
+                          (payload && (header.size > sizeof(shm_auth_t) || header.encoding != DSHM_ENC_NONE))));
+    if (guest_refused) {
+        reserved = 0;
+        result = SHM_EACCES;
+    } else if (limit_buffers_conn > 0 && reserved > limit_buffers_conn) {
+        reserved = 0;
+        result = SHM_ENOMEM;
+    } else {
+        admission_acquire(reserved);
+        // Выделяем память для данных, если они есть
+        if (payload) {
+            data = dshm_pool_alloc(conn->pool, header.size);
+            if (data == NULL) {
+                result = SHM_ENOMEM;
+            }
+        }
+    }
+    
+    if (guest_refused && payload) {
+        // Данные не читаются: после ответа соединение закрывается
+        corrupted = 1;
+        goto done;
+    }
+    
+    // Читаем данные (данные отклоненного запроса пропускаем) и контрольную сумму
+    DSHM_TRACE_BEGIN(DSHM_TRACE_RECV, header.command, header.shmid);
+    if (payload && data == NULL) {
+        bytes_received = discard_payload(conn, header.size, &crc) == 0 ? (ssize_t)header.size : -1;
+    } else if (payload) {
+        bytes_received = conn_recv(conn, data, header.size, 0);
+        crc = dshm_crc32c(crc, data, header.size);
+    }
+    int checked = (!payload || bytes_received == (ssize_t)header.size) ? check_trailer(conn, caps, crc) : -1;
+    DSHM_TRACE_END(DSHM_TRACE_RECV, header.command, header.shmid);
+    if (checked == -1) {
+        dshm_pool_free(conn->pool, data);
+        admission_release(reserved);
+        __atomic_sub_fetch(&requests_in_flight, 1, __ATOMIC_SEQ_CST);
+        DSHM_TRACE_END(DSHM_TRACE_REQUEST, header.command, header.shmid);
+        return -1; // Ошибка или соединение закрыто
+    }
+    if (checked == 0) {
+        // Заголовку нельзя верить, а значит, и границам следующих сообщений
+        result = SHM_EBADMSG;
+        corrupted = 1;
+        goto done;
+    }
+    if (result != SHM_SUCCESS) {
+        goto done;
+    }
+    // Сервер останавливается: запрос не выполняется, клиент повторит его через новое соединение
+    if (refused) {
+        result = SHM_ESHUTDOWN;
+        goto done;
+    }
+    
+    if (payload) {
+        // Распаковываем сжатые данные
+        if (header.encoding == DSHM_ENC_COMPRESSED) {
+            // Исходный размер задан отправителем - проверяем его до выделения памяти
+            uint32_t raw_len = 0;
+            if (header.size < sizeof(raw_len)) {
+                result = SHM_EINVAL;
+                goto done;
+            }
+            memcpy(&raw_len, data, sizeof(raw_len));
+            raw_len = ntohl(raw_len);
+            if ((limit_buffers_conn > 0 && raw_len > limit_buffers_conn) || !admission_try(raw_len)) {
+                result = SHM_ENOMEM;
+                goto done;
+            }
+            reserved += raw_len;
+            
+            void *raw = dshm_pool_alloc(conn->pool, raw_len);
+            if (raw == NULL) {
+                result = SHM_ENOMEM;
+                goto done;
+            }
+            DSHM_TRACE_BEGIN(DSHM_TRACE_DECODE, header.command, header.shmid);
+            int decoded = dshm_decompress((char*)data + sizeof(raw_len), header.size - sizeof(raw_len),
+                                          raw, raw_len);
+            DSHM_TRACE_END(DSHM_TRACE_DECODE, header.command, header.shmid);
+            dshm_pool_free(conn->pool, data);
+            data = raw;
+            if (decoded == -1) {
+                result = SHM_EINVAL;
+                goto done;
+            }
+            header.size = raw_len;
+        } else if (header.encoding != DSHM_ENC_NONE) {
+            result = SHM_EINVAL;
+            goto done;
+        }
+    }
+    
+    // Без ключей команды узлов кластера принимаются только от узлов и с этой машины
+    if (auth_key_count == 0 && node_command(header.command) && !conn_node_peer(conn)) {
+        result = SHM_EACCES;
+        goto done;
+    }
+    
+    // Запрос к сегменту другого узла кластера перенаправляем клиенту
+    result = route_request(&header);
+    if (result != SHM_SUCCESS) {
+        goto done;
+    }
+    
+    // Права проверяются до передачи обработчику; суперпользователь (и любое
+    // соединение сервера без ключа) их не проверяет
+    if (conn->uid != 0) {
+        result = check_access(conn, &header, data);
+        if (result != SHM_SUCCESS) {
+            goto done;
+        }
+    }
+    
+    // Команды над сегментами выполняет обработчик, которому принадлежит сегмент
+    if (worker_count > 0 && conn->worker_slot >= 0 && worker_command(header.command)) {
+        DSHM_TRACE_BEGIN(DSHM_TRACE_QUEUE, header.command, header.shmid);
+        result = worker_submit(conn, &header, data, &reply, &reply_size, &response.encoding);
+        DSHM_TRACE_END(DSHM_TRACE_QUEUE, header.command, header.shmid);
+        if (request_abandoned(conn)) {
+            // Обработчик еще пользуется данными запроса и пулом соединения: они
+            // освобождаются при закрытии соединения, клиент получает разрыв
+            conn->request->reserved = reserved;
+            __atomic_sub_fetch(&requests_in_flight, 1, __ATOMIC_SEQ_CST);
+            DSHM_TRACE_END(DSHM_TRACE_REQUEST, header.command, header.shmid);
+            return -1;
+        }
+    } else {
+        result = execute_request(conn, &header, data, &reply, &reply_size, &response.encoding);
+    }
+    
+done:
+    // При ошибке данные ответа не передаются
+    if (result < 0) {
+        reply_size = 0;
+        response.encoding = DSHM_ENC_NONE;
+    }
+    
+    // Сжимаем объемные данные ответа, если клиент это поддерживает
+    if (reply_size >= DSHM_COMPRESS_THRESHOLD && (conn->caps & DSHM_CAP_COMPRESS)) {
+        DSHM_TRACE_BEGIN(DSHM_TRACE_ENCODE, header.command, header.shmid);
+        size_t cap = sizeof(uint32_t) + reply_size;
+        void *encoded = dshm_pool_alloc(conn->pool, cap);
+        size_t encoded_size = (encoded != NULL) ? dshm_encode_payload_into(reply, reply_size, encoded, cap) : 0;
+        if (encoded_size > 0) {
+            dshm_pool_free(conn->pool, reply);
+            reply = encoded;
+            reply_size = encoded_size;
+            response.encoding = DSHM_ENC_COMPRESSED;
+        } else {
+            dshm_pool_free(conn->pool, encoded);
+        }
+        DSHM_TRACE_END(DSHM_TRACE_ENCODE, header.command, header.shmid);
+    }
+    
+    response.result = result;
+    response.error_code = (result < 0) ? -result : 0;
+    response.data_size = reply_size;
+    
+    // Преобразуем поля ответа в сетевой порядок байт
+    shm_response_t net_response = {
+        .result = htonl(response.result),
+        .error_code = htonl(response.error_code),
+        .data_size = htonl(response.data_size),
+        .encoding = htonl(response.encoding)
+    };
+    
+    // Отправляем ответ клиенту, за ним - данные ответа
+    DSHM_TRACE_BEGIN(DSHM_TRACE_SEND, header.command, header.shmid);
+    int status = conn_send_reply(conn, &net_response, reply, response.data_size, (caps & DSHM_CAP_CRC) != 0);
+    DSHM_TRACE_END(DSHM_TRACE_SEND, header.command, header.shmid);
+    
+    // Возвращаем буфер запроса в пул
+    dshm_pool_free(conn->pool, data);
+    admission_release(reserved);
+    
+    // Во время остановки ответ уходит до того, как запрос перестает учитываться
+    if (__atomic_load_n(&draining, __ATOMIC_SEQ_CST)) {
+        conn_flush(conn);
+    }
+    __atomic_sub_fetch(&requests_in_flight, 1, __ATOMIC_SEQ_CST);
+    DSHM_TRACE_END(DSHM_TRACE_REQUEST, header.command, header.shmid);
+    
+    // Соединение подписчика дальше только получает рассылку изменений
+    if (conn->subscription != NULL) {
+        if (status == 0) {
+            serve_subscription(conn);
+        }
+        push_unsubscribe(conn->subscription);
+        conn->subscription = NULL;
+        return -1;
+    }
+    return corrupted ? -1 : status;
+}
+
+// Учет открытых соединений: при остановке сервер закрывает их сам
+static void register_conn(client_conn_t *conn) {
+    pthread_mutex_lock(&conns_mutex);
+    conn->prev = NULL;
+    conn->next = conn_list;
+    if (conn_list != NULL) {
+        conn_list->prev = conn;
+    }
+    conn_list = conn;
+    pthread_mutex_unlock(&conns_mutex);
+}
+
+static void unregister_conn(client_conn_t *conn) {
+    pthread_mutex_lock(&conns_mutex);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        conn_list = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&conns_mutex);
+}
+
+// Функция обработки клиента (для потока)
+static void* handle_client(void *arg) {
+    int client_socket = (int)(intptr_t)arg;
+    
+    // Устанавливаем таймаут для сокета
+    struct timeval timeout;
+    timeout.tv_sec = 30; // 30 секунд
+    timeout.tv_usec = 0;
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    dshm_socket_setup(client_socket);
+    
+    // Обрабатываем запросы от клиента, пока он не отключится
+    // Буферы запросов берутся из пула потока, а не из общей кучи
+    dshm_pool_t pool;
+    dshm_pool_init(&pool);
+    dshm_reader_t reader;
+    dshm_reader_init(&reader, client_socket);
+    grant_t grants[GRANT_SLOTS];
+    memset(grants, 0, sizeof(grants));
+    worker_request_t request;
+    memset(&request, 0, sizeof(request));
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(client_socket, (struct sockaddr*)&peer, &peer_len) == -1) {
+        peer.sin_addr.s_addr = 0;
+    }
+    client_conn_t conn = { .socket = client_socket, .caps = 0, .uring = NULL, .reader = &reader,
+                           .peer_addr = peer.sin_addr.s_addr, .account = NULL, .pool = &pool,
+                           .worker_slot = (worker_count > 0) ? worker_slot_acquire() : -1,
+                           .node_peer = -1, .uid = 0, .gid = 0, .grants = grants, .request = &request };
+    uring_conn_t uring;
+    if (use_uring && uring_conn_init(&uring, client_socket, &pool) == 0) {
+        conn.uring = &uring;
+    }
+    register_conn(&conn);
+    while (running) {
+        if (process_request(&conn) == -1) {
+            break;
+        }
+    }
+    
+    // Брошенную команду обработчик еще выполняет: пул, очередь и стек соединения
+    // нужны ему до конца
+    if (request_abandoned(&conn)) {
+        shutdown(client_socket, SHUT_RDWR);
+        while (__atomic_load_n(&request.state, __ATOMIC_ACQUIRE) != REQ_DONE) {
+            futex_wait(&request.state, REQ_ABANDONED, WORKER_IDLE_MS);
+        }
+        dshm_pool_free(&pool, request.reply);
+        dshm_pool_free(&pool, request.data);
+        admission_release(request.reserved);
+    }
+    if (conn.uring != NULL) {
+        uring_conn_exit(conn.uring);
+    }
+    if (conn.worker_slot >= 0) {
+        worker_slot_release(conn.worker_slot);
+    }
+    dshm_pool_destroy(&pool);
+    if (conn.incoming != NULL) {
+        DSHM_TRACE_LOCK(&segments_mutex);
+        drop_incoming(&conn);
+        pthread_mutex_unlock(&segments_mutex);
+    }
+    release_conn_account(&conn);
+    unregister_conn(&conn);
+    close(client_socket);
+    return NULL;
+}
+
+// Запуск потока обработки нового клиента
+static void start_client(int client_socket) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    if (getpeername(client_socket, (struct sockaddr*)&client_addr, &client_len) == 0) {
+        printf("Подключен клиент: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    }
+    
+    // Создаем поток для обработки клиента (сокет передается в самом аргументе)
+    pthread_t client_thread;
+    if (pthread_create(&client_thread, NULL, handle_client, (void*)(intptr_t)client_socket) != 0) {
+        perror("Ошибка создания потока для клиента");
+        close(client_socket);
+        return;
+    }
+    
+    // Отсоединяем поток, чтобы он автоматически завершался
+    pthread_detach(client_thread);
+}
+
+// Пробуждение цикла приема подключений (безопасно в обработчике сигнала)
+static void wake_accept_loop(void) {
+    ssize_t written = write(stop_pipe[1], "", 1);
+    (void)written; // Канал полон - пробуждение и так ожидает
+}
+
+// Остановка выполнения запросов: новые получают SHM_ESHUTDOWN, ожидание журнала
+// и рассылка изменений прерываются. Дожидается запросов в обработке и миграции.
+// Возвращает 0 или -1, если они не завершились за DRAIN_TIMEOUT_MS.
+static int drain_requests(void) {
+    __atomic_store_n(&draining, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&change_mutex);
+    pthread_cond_broadcast(&change_cond);
+    pthread_mutex_unlock(&change_mutex);
+    pthread_mutex_lock(&push_mutex);
+    for (push_sub_t *sub = push_subs; sub != NULL; sub = sub->next) {
+        pthread_cond_signal(&sub->cond);
+    }
+    pthread_mutex_unlock(&push_mutex);
+    
+    for (int waited = 0; waited < DRAIN_TIMEOUT_MS; waited += 10) {
+        pthread_mutex_lock(&cluster_mutex);
+        int busy = migration_running || __atomic_load_n(&requests_in_flight, __ATOMIC_SEQ_CST) > 0 ||
+                   __atomic_load_n(&reclaim_running, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&cluster_mutex);
+        if (!busy) {
+            return 0;
+        }
+        struct timespec pause = { 0, 10 * 1000000L };
+        nanosleep(&pause, NULL);
+    }
+    fprintf(stderr, "Запросы не завершились за %d мс\n", DRAIN_TIMEOUT_MS);
+    return -1;
+}
+
+// Возобновление работы после неудавшейся передачи состояния
+static void resume_requests(void) {
+    __atomic_store_n(&draining, 0, __ATOMIC_SEQ_CST);
+}
+
+// Закрытие соединений клиентов. Клиент обнаружит закрытие при следующем запросе
+// и подключится заново - к преемнику, если он принял слушающий сокет.
+static void disconnect_clients(void) {
+    pthread_mutex_lock(&conns_mutex);
+    for (client_conn_t *conn = conn_list; conn != NULL; conn = conn->next) {
+        shutdown(conn->socket, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conns_mutex);
+}
+
+// Ожидание выхода потоков соединений. Возвращает 0, если все завершились
+static int wait_connections(int timeout_ms) {
+    for (int waited = 0; waited <= timeout_ms; waited += 10) {
+        pthread_mutex_lock(&conns_mutex);
+        int left = (conn_list != NULL);
+        pthread_mutex_unlock(&conns_mutex);
+        if (!left) {
+            return 0;
+        }
+        struct timespec pause = { 0, 10 * 1000000L };
+        nanosleep(&pause, NULL);
+    }
+    return -1;
+}
+
+// Передача состояния новому процессу сервера через управляющий сокет (-H).
+// Формат - внутренний для одной версии сервера, поля в порядке байт машины.
+#define HANDOFF_MAGIC 0x44534833u       // "DSH3"
+#define HANDOFF_TIMEOUT_S 30
+
+typedef struct {
+    uint32_t magic;
+    uint32_t segments;      // Число следующих описаний сегментов
+    uint32_t private_seq;
+    uint32_t snapshot_seq;
+    uint32_t map_len;       // Длина следующей карты кластера (0 - одиночный режим)
+} handoff_hello_t;          // Передается вместе со слушающим сокетом
+
+// Описание сегмента; за ним следуют битовая карта записанных страниц, карта
+// скопированных страниц снимка (если cow_source) и содержимое (если нет файла)
+typedef struct {
+    int32_t shmid;
+    int32_t key;
+    uint64_t size;
+    int32_t shmflg;
+    int32_t snapshot;
+    int32_t cow_source;     // Сегмент, страницы которого снимок еще разделяет (0 - нет)
+    int32_t replica;
+    uint32_t replica_epoch;
+    int32_t replica_copying;
+    uint64_t replica_copied;
+    int32_t ref_count;
+    uint32_t attached;
+    uint32_t has_fd;        // Вместе с описанием передан файл памяти сегмента
+    uint32_t uid;           // shm_perm сегмента
+    uint32_t gid;
+    uint32_t cuid;
+    uint32_t cgid;
+    uint64_t data_len;
+} handoff_segment_t;
+
+// Отправка сообщения вместе с дескриптором (fd < 0 - без него)
+static int handoff_send_msg(int sock, const void *buf, size_t len, int fd) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { (void*)buf, len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    if (sent < 0) {
+        return -1;
+    }
+    struct iovec rest = { (char*)buf + sent, len - (size_t)sent };
+    return dshm_write_full(sock, &rest, 1);
+}
+
+// Прием ровно len байт; *fd - пришедший с ними дескриптор (-1 - не было).
+// При fd == NULL пришедший дескриптор закрывается.
+static int handoff_recv_msg(int sock, void *buf, size_t len, int *fd) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    int received_fd = -1;
+    size_t done = 0;
+    while (done < len) {
+        struct iovec iov = { (char*)buf + done, len - done };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                              .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+        ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int passed;
+                memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+                if (received_fd == -1) {
+                    received_fd = passed;
+                } else {
+                    close(passed);
+                }
+            }
+        }
+        done += (size_t)got;
+    }
     
-    segment->attached_clients++;
-    segment->ref_count++;
-    
-    pthread_mutex_unlock(&segments_mutex);
-    return SHM_SUCCESS;
+    if (done < len || fd == NULL) {
+        if (received_fd != -1) {
+            close(received_fd);
+        }
+        received_fd = -1;
+    }
+    if (fd != NULL) {
+        *fd = received_fd;
+    }
+    return (done == len) ? 0 : -1;
 }
 
-// Обработка команды отсоединения от сегмента
-static int handle_detach_segment(shm_header_t *header) {
-    pthread_mutex_lock(&segments_mutex);
+// Передача преемнику слушающего сокета, карты кластера и всех сегментов: память
+// отдельных сегментов - их файлами memfd, малых сегментов - содержимым.
+// Вызывается после drain_requests(). Возвращает 0, если преемник подтвердил прием.
+static int handoff_send(int sock) {
+    struct timeval timeout = { HANDOFF_TIMEOUT_S, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
     
-    shm_segment_t *segment = find_segment(header->shmid);
-    if (segment == NULL) {
-        pthread_mutex_unlock(&segments_mutex);
-        return SHM_ENOENT;
-    }
+    static char map[DSHM_CLUSTER_MAP_MAX];
+    pthread_mutex_lock(&cluster_mutex);
+    int map_len = (cluster.node_count > 0) ? dshm_cluster_encode(&cluster, map, sizeof(map)) : 0;
+    handoff_hello_t hello = {
+        .magic = HANDOFF_MAGIC,
+        .private_seq = private_seq,
+        .snapshot_seq = snapshot_seq,
+        .map_len = (map_len > 0) ? (uint32_t)map_len : 0
+    };
+    pthread_mutex_unlock(&cluster_mutex);
     
-    if (segment->attached_clients > 0) {
-        segment->attached_clients--;
-        segment->ref_count--;
+    DSHM_TRACE_LOCK(&segments_mutex);
+    for (int i = 0; i < segments_high; i++) {
+        hello.segments += (segments[i].addr != NULL && !segments[i].retired && segments[i].migrating != MIGRATING_IN);
     }
-    
-    // Если сегмент помечен для удаления и больше нет клиентов, удаляем его
-    if ((segment->shmflg & IPC_RMID) && segment->attached_clients == 0) {
-        if (segment->addr != NULL) {
-            munmap(segment->addr, segment->size);
+    int status = handoff_send_msg(sock, &hello, sizeof(hello), server_socket);
+    if (status == 0 && hello.map_len > 0) {
+        struct iovec iov = { map, hello.map_len };
+        status = dshm_write_full(sock, &iov, 1);
+    }
+    for (int i = 0; i < segments_high && status == 0; i++) {
+        shm_segment_t *segment = &segments[i];
+        // Сегмент, принятый не целиком, остается у отправителя: тот повторит перенос
+        if (segment->addr == NULL || segment->retired || segment->migrating == MIGRATING_IN) {
+            continue;
+        }
+        int fd = segment->pooled ? -1 : segment->memfd;
+        handoff_segment_t record = {
+            .shmid = segment->shmid,
+            .key = segment->key,
+            .size = segment->size,
+            .shmflg = segment->shmflg,
+            .snapshot = segment->snapshot,
+            .cow_source = (segment->cow_source != NULL) ? segment->cow_source->shmid : 0,
+            .replica = segment->replica,
+            .replica_epoch = segment->replica_epoch,
+            .replica_copying = segment->replica_copying,
+            .replica_copied = segment->replica_copied,
+            .ref_count = __atomic_load_n(&segment->ref_count, __ATOMIC_RELAXED),
+            .attached = segment_attached(segment),
+            .has_fd = (fd != -1),
+            .uid = segment->uid,
+            .gid = segment->gid,
+            .cuid = segment->cuid,
+            .cgid = segment->cgid,
+            .data_len = (fd != -1) ? 0 : segment->size
+        };
+        size_t bitmap = page_bitmap_size(segment->size);
+        struct iovec iov[3] = {
+            { segment->touched, bitmap },
+            { segment->cow_copied, (segment->cow_source != NULL) ? bitmap : 0 },
+            { segment->addr, record.data_len },
+        };
+        status = handoff_send_msg(sock, &record, sizeof(record), fd);
+        if (status == 0) {
+            status = dshm_write_full(sock, iov, 3);
         }
-        memset(segment, 0, sizeof(shm_segment_t));
-        segment_count--;
     }
-    
     pthread_mutex_unlock(&segments_mutex);
-    return SHM_SUCCESS;
-}
-
-// Обработка команды удаления сегмента
-static int handle_remove_segment(shm_header_t *header) {
-    return remove_segment(header->shmid);
+    
+    uint32_t ack = 0;
+    if (status == 0 && (handoff_recv_msg(sock, &ack, sizeof(ack), NULL) == -1 || ack != HANDOFF_MAGIC)) {
+        status = -1;
+    }
+    return status;
 }
 
-// Обработка команды shmctl
-static int handle_shmctl(shm_header_t *header, void *data) {
-    pthread_mutex_lock(&segments_mutex);
+// Прием состояния от прежнего процесса сервера (см. handoff_send)
+static int handoff_receive(int sock) {
+    struct timeval timeout = { HANDOFF_TIMEOUT_S, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
     
-    shm_segment_t *segment = find_segment(header->shmid);
-    if (segment == NULL) {
-        pthread_mutex_unlock(&segments_mutex);
-        return SHM_ENOENT;
+    handoff_hello_t hello;
+    int listen_fd = -1;
+    static char map[DSHM_CLUSTER_MAP_MAX];
+    if (handoff_recv_msg(sock, &hello, sizeof(hello), &listen_fd) == -1 || hello.magic != HANDOFF_MAGIC ||
+        listen_fd == -1 || hello.map_len >= sizeof(map) ||
+        handoff_recv_msg(sock, map, hello.map_len, NULL) == -1) {
+        fprintf(stderr, "Неверные данные от прежнего процесса сервера\n");
+        if (listen_fd != -1) {
+            close(listen_fd);
+        }
+        return -1;
     }
     
-    // Обработка различных команд shmctl
-    switch (header->flags) {
-        case IPC_RMID:
-            // Помечаем сегмент для удаления
-            segment->shmflg |= IPC_RMID;
-            if (segment->attached_clients == 0) {
-                // Если нет присоединенных клиентов, удаляем сразу
-                if (segment->addr != NULL) {
-                    munmap(segment->addr, segment->size);
-                }
-                memset(segment, 0, sizeof(shm_segment_t));
-                segment_count--;
-            }
+    // Карта могла смениться после запуска прежнего процесса
+    if (hello.map_len > 0) {
+        if (dshm_cluster_decode(&cluster, map, hello.map_len) == -1 || (cluster_self = find_self(&cluster)) == -1) {
+            fprintf(stderr, "Этот узел отсутствует в карте кластера прежнего процесса\n");
+            close(listen_fd);
+            return -1;
+        }
+    }
+    private_seq = hello.private_seq;
+    snapshot_seq = hello.snapshot_seq;
+    
+    // Исходные сегменты снимков по номерам описателей
+    int *cow_ids = calloc((size_t)max_segments, sizeof(int));
+    if (cow_ids == NULL) {
+        perror("Не удалось принять сегменты от прежнего процесса сервера");
+        close(listen_fd);
+        return -1;
+    }
+    int status = 0;
+    DSHM_TRACE_LOCK(&segments_mutex);
+    for (uint32_t n = 0; n < hello.segments && status == 0; n++) {
+        handoff_segment_t record;
+        int fd = -1;
+        status = -1;
+        if (handoff_recv_msg(sock, &record, sizeof(record), &fd) == -1 || record.has_fd != (fd != -1) ||
+            (record.data_len != 0 && record.data_len != record.size)) {
             break;
-            
-        case IPC_STAT:
-            // Возвращаем статус сегмента
-            // Для простоты возвращаем базовую информацию
-            if (data != NULL) {
-                struct shmid_ds *buf = (struct shmid_ds*)data;
-                buf->shm_segsz = segment->size;
-                buf->shm_nattch = segment->attached_clients;
-                buf->shm_perm.mode = segment->shmflg;
-            }
+        }
+        shm_segment_t *segment = create_segment_from(record.shmid, (size_t)record.size, record.shmflg, fd);
+        if (segment == NULL) {
             break;
-            
-        case IPC_SET:
-            // Устанавливаем параметры сегмента
-            if (data != NULL) {
-                struct shmid_ds *buf = (struct shmid_ds*)data;
-                segment->shmflg = buf->shm_perm.mode;
-            }
+        }
+        index_segment(segment);
+        size_t bitmap = page_bitmap_size(segment->size);
+        if (record.cow_source != 0 && (segment->cow_copied = calloc(bitmap, 1)) == NULL) {
             break;
-            
-        default:
-            pthread_mutex_unlock(&segments_mutex);
-            return SHM_EINVAL;
+        }
+        
+        if (record.data_len > 0) {
+            protect_segment(segment, PROT_READ | PROT_WRITE);
+        }
+        if (handoff_recv_msg(sock, segment->touched, bitmap, NULL) == -1 ||
+            (record.cow_source != 0 && handoff_recv_msg(sock, segment->cow_copied, bitmap, NULL) == -1) ||
+            handoff_recv_msg(sock, segment->addr, record.data_len, NULL) == -1) {
+            break;
+        }
+        if (record.data_len > 0 && (segment->shmflg & SHM_RDONLY)) {
+            protect_segment(segment, PROT_READ);
+        }
+        
+        segment->key = record.key;
+        segment->snapshot = record.snapshot;
+        segment->replica = record.replica;
+        segment->replica_epoch = record.replica_epoch;
+        segment->replica_copying = record.replica_copying;
+        segment->replica_copied = record.replica_copied;
+        segment->uid = record.uid;
+        segment->gid = record.gid;
+        segment->cuid = record.cuid;
+        segment->cgid = record.cgid;
+        __atomic_store_n(&segment->ref_count, record.ref_count, __ATOMIC_RELAXED);
+        __atomic_fetch_or(&segment->attach_state, (uint64_t)(record.attached & ATTACH_COUNT), __ATOMIC_RELEASE);
+        cow_ids[segment - segments] = record.cow_source;
+        status = 0;
     }
     
+    // Снимки снова разделяют страницы со своими исходными сегментами
+    for (int i = 0; i < segments_high && status == 0; i++) {
+        shm_segment_t *segment = &segments[i];
+        if (segment->addr == NULL) {
+            continue;
+        }
+        if (cow_ids[i] != 0) {
+            shm_segment_t *source = find_segment(cow_ids[i]);
+            if (source == NULL) {
+                status = -1;
+                break;
+            }
+            cow_link(segment, source);
+            protect_segment(segment, PROT_READ | PROT_WRITE);
+        }
+        if (!segment->replica && !(segment->shmflg & SEGMENT_REMOVED)) {
+            index_key(segment);
+        }
+    }
     pthread_mutex_unlock(&segments_mutex);
-    return SHM_SUCCESS;
+    free(cow_ids);
+    
+    uint32_t ack = HANDOFF_MAGIC;
+    struct iovec iov = { &ack, sizeof(ack) };
+    if (status == -1 || dshm_write_full(sock, &iov, 1) == -1) {
+        fprintf(stderr, "Не удалось принять сегменты от прежнего процесса сервера\n");
+        close(listen_fd);
+        return -1;
+    }
+    server_socket = listen_fd;
+    return (int)hello.segments;
 }
 
-// Обработка одного запроса клиента
-static void process_request(int client_socket) {
-    shm_header_t header;
-    ssize_t bytes_received;
-    
-    // Читаем заголовок запроса
-    bytes_received = recv(client_socket, &header, sizeof(header), 0);
-    if (bytes_received <= 0) {
-        return; // Ошибка или соединение закрыто
+// Подключение к управляющему сокету прежнего процесса сервера (-1 - его нет)
+static int handoff_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock != -1 && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        sock = -1;
     }
-    
-    // Преобразуем поля заголовка из сетевого порядка байт
-    header.command = ntohl(header.command);
-    header.size = ntohl(header.size);
-    header.shmid = ntohl(header.shmid);
-    header.flags = ntohl(header.flags);
-    header.offset = ntohl(header.offset);
-    
-    void *data = NULL;
-    shm_response_t response = {0};
-    int result = SHM_SUCCESS;
-    
-    // Выделяем память для данных, если они есть
-    if (header.size > 0) {
-        data = malloc(header.size);
-        if (data == NULL) {
-            response.result = SHM_ENOMEM;
-            goto send_response;
+    return sock;
+}
+
+// Ожидание преемника на управляющем сокете. Состояние передается только
+// процессу того же пользователя.
+static void *handoff_thread(void *arg __attribute__((unused))) {
+    while (running) {
+        int sock = accept4(handoff_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 || cred.uid != geteuid()) {
+            close(sock);
+            continue;
         }
         
-        // Читаем данные
-        bytes_received = recv(client_socket, data, header.size, 0);
-        if (bytes_received <= 0) {
-            free(data);
-            return; // Ошибка или соединение закрыто
+        pthread_mutex_lock(&conns_mutex);
+        if (handoff_conn == -1) {
+            handoff_conn = sock;
+            sock = -1;
+        }
+        pthread_mutex_unlock(&conns_mutex);
+        if (sock != -1) {
+            close(sock); // Передача уже идет
+        } else {
+            wake_accept_loop();
         }
     }
+    return NULL;
+}
+
+// Создание управляющего сокета, на котором этот процесс ждет преемника
+static int handoff_listen(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path); // Сокет прежнего процесса или оставшийся после аварийного завершения
     
-    // Обрабатываем команду
-    switch (header.command) {
-        case CMD_CREATE_SEGMENT:
-            result = handle_create_segment(&header, data);
-            break;
-            
-        case CMD_ATTACH_SEGMENT:
-            result = handle_attach_segment(&header);
-            break;
-            
-        case CMD_DETACH_SEGMENT:
-            result = handle_detach_segment(&header);
-            break;
-            
-        case CMD_REMOVE_SEGMENT:
-            result = handle_remove_segment(&header);
+    handoff_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoff_socket == -1 || bind(handoff_socket, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        chmod(path, 0600) == -1 || listen(handoff_socket, 1) == -1) {
+        return -1;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handoff_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Подключившийся преемник (-1 - нет)
+static int take_handoff_conn(void) {
+    pthread_mutex_lock(&conns_mutex);
+    int sock = handoff_conn;
+    handoff_conn = -1;
+    pthread_mutex_unlock(&conns_mutex);
+    return sock;
+}
+
+// Прием подключений через многократный accept io_uring.
+// Возвращает -1, если ядро не поддерживает такой режим
+static int accept_loop_uring(void) {
+    dshm_uring_t ring;
+    if (dshm_uring_init(&ring, URING_ENTRIES) == -1) {
+        return -1;
+    }
+    
+    // Запись в stop_pipe завершает цикл
+    struct io_uring_sqe *stop_sqe = dshm_uring_get_sqe(&ring);
+    dshm_uring_prep_poll(stop_sqe, stop_pipe[0], POLLIN);
+    stop_sqe->user_data = URING_UD_STOP;
+    
+    int armed = 0;
+    int accepted = 0;
+    int stop = 0;
+    while (running && !stop) {
+        if (!armed) {
+            struct io_uring_sqe *sqe = dshm_uring_get_sqe(&ring);
+            dshm_uring_prep_accept_multishot(sqe, server_socket);
+            armed = 1;
+        }
+        if (dshm_uring_submit(&ring, 1) == -1 && errno != EINTR) {
+            perror("Ошибка io_uring_enter");
             break;
-            
-        case CMD_READ_DATA:
-            {
-                // Для чтения данных нужно выделить буфер
-                void *read_buffer = malloc(header.size);
-                if (read_buffer != NULL) {
-                    result = handle_read_data(&header, read_buffer, header.size);
-                    if (result == SHM_SUCCESS) {
-                        // Отправляем данные клиенту
-                        if (send(client_socket, read_buffer, header.size, 0) != (ssize_t)header.size) {
-                            result = SHM_ERROR; // Ошибка отправки
-                        }
-                    }
-                    free(read_buffer);
-                } else {
-                    result = SHM_ENOMEM;
-                }
+        }
+        
+        // Все подключения, принятые ядром с прошлого вызова
+        struct io_uring_cqe *cqe;
+        while ((cqe = dshm_uring_peek(&ring)) != NULL) {
+            int res = cqe->res;
+            if (cqe->user_data == URING_UD_STOP) {
+                dshm_uring_seen(&ring);
+                stop = 1;
+                continue;
             }
-            break;
-            
-        case CMD_WRITE_DATA:
-            result = handle_write_data(&header, data);
-            break;
-            
-        case CMD_SHMCTL:
-            result = handle_shmctl(&header, data);
-            break;
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                armed = 0;
+            }
+            dshm_uring_seen(&ring);
             
-        default:
-            result = SHM_EINVAL;
-            break;
+            if (res >= 0) {
+                accepted = 1;
+                start_client(res);
+            } else if (res == -EINVAL && !accepted) {
+                dshm_uring_exit(&ring);
+                return -1; // Многократный accept не поддерживается
+            } else if (running && res != -EINTR && res != -ECONNABORTED) {
+                fprintf(stderr, "Ошибка при принятии подключения: %s\n", strerror(-res));
+            }
+        }
     }
     
-    response.result = result;
-    response.error_code = (result < 0) ? -result : 0;
-    response.data_size = (header.command == CMD_READ_DATA) ? header.size : 0;
-    
-send_response:
-    // Преобразуем поля ответа в сетевой порядок байт
-    shm_response_t net_response = {
-        .result = htonl(response.result),
-        .error_code = htonl(response.error_code),
-        .data_size = htonl(response.data_size)
+    dshm_uring_exit(&ring);
+    return 0;
+}
+
+// Прием подключений блокирующим accept (до записи в stop_pipe)
+static void accept_loop(void) {
+    struct pollfd fds[2] = {
+        { .fd = server_socket, .events = POLLIN },
+        { .fd = stop_pipe[0], .events = POLLIN },
     };
-    
-    // Отправляем ответ клиенту
-    if (send(client_socket, &net_response, sizeof(net_response), 0) != sizeof(net_response)) {
-        // Ошибка отправки ответа
+    while (running) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno != EINTR) {
+                perror("Ошибка poll");
+            }
+            continue;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        int client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Ошибка при принятии подключения");
+            }
+            continue;
+        }
+        start_client(client_socket);
     }
-    
-    // Освобождаем память
-    if (data != NULL) {
-        free(data);
+}
+
+// Обработчик SIGINT, SIGTERM и SIGUSR1. Только отмечает запрос остановки (или
+// записи трассировки) и будит цикл приема подключений: остальное делает основной поток.
+static void signal_handler(int sig) {
+    int saved_errno = errno;
+    if (sig == SIGUSR1) {
+        trace_requested = 1;
+    } else {
+        stop_requested = 1;
     }
+    wake_accept_loop();
+    errno = saved_errno;
 }
 
-// Функция обработки клиента (для потока)
-static void* handle_client(void *arg) {
-    int client_socket = *(int*)arg;
-    free(arg); // Освобождаем выделенную память
-    
-    // Устанавливаем таймаут для сокета
-    struct timeval timeout;
-    timeout.tv_sec = 30; // 30 секунд
-    timeout.tv_usec = 0;
-    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-    
-    // Обрабатываем запросы от клиента
-    while (running) {
-        process_request(client_socket);
+// Запись событий трассировки всех потоков в файл -T
+static void dump_trace(void) {
+    int count = dshm_trace_dump(trace_path);
+    if (count == -1) {
+        fprintf(stderr, "Не удалось записать трассировку в %s: %s\n", trace_path, strerror(errno));
+    } else {
+        printf("Трассировка (%d событий) записана в %s\n", count, trace_path);
     }
-    
-    close(client_socket);
-    return NULL;
 }
 
-// Обработчик сигнала для корректного завершения
-static void signal_handler(int sig __attribute__((unused))) {
-    running = 0;
-    if (server_socket != -1) {
-        close(server_socket);
+// Разбор размера с необязательным суффиксом K, M или G
+static int parse_size(const char *text, size_t *size) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text) {
+        return -1;
     }
-    printf("\nСервер остановлен.\n");
+    switch (*end) {
+        case 'G': case 'g': value <<= 10; /* fallthrough */
+        case 'M': case 'm': value <<= 10; /* fallthrough */
+        case 'K': case 'k': value <<= 10; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *size = (size_t)value;
+    return 0;
 }
 
 // Основная функция сервера
 int main(int argc, char *argv[]) {
     int port = 8080; // Порт по умолчанию
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    struct sockaddr_in server_addr;
     
-    // Обработка аргументов командной строки
-    if (argc > 1) {
-        port = atoi(argv[1]);
+    const char *cluster_nodes = NULL;
+    const char *self_name = NULL;
+    int opt_char;
+    
+    // Обработка аргументов командной строки:
+    // distributed_shm_server [-u] [-w обработчики] [-c узел1:порт1,узел2:порт2,...] [-i узел:порт] [-r копии]
+    //                        [-Q квота] [-q квота_соединения] [-B буферы] [-b буфер_запроса]
+    //                        [-H управляющий_сокет] [-T файл_трассировки] [-k файл_ключа] [порт]
+    int worker_threads = -1;
+    int replicas = 0;
+    while ((opt_char = getopt(argc, argv, "c:i:r:uw:Q:q:B:b:H:T:k:S:")) != -1) {
+        size_t *limit = NULL;
+        switch (opt_char) {
+            case 'Q':
+                limit = &quota_segments_global;
+                break;
+            case 'q':
+                limit = &quota_segments_conn;
+                break;
+            case 'B':
+                limit = &limit_buffers_global;
+                break;
+            case 'b':
+                limit = &limit_buffers_conn;
+                break;
+            case 'c':
+                cluster_nodes = optarg;
+                break;
+            case 'i':
+                self_name = optarg;
+                break;
+            case 'r':
+                replicas = atoi(optarg);
+                if (replicas < 0 || replicas >= DSHM_MAX_NODES) {
+                    fprintf(stderr, "Неверное число копий: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'H':
+                handoff_path = optarg;
+                if (strlen(optarg) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+                    fprintf(stderr, "Слишком длинный путь управляющего сокета: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'T':
+                trace_path = optarg;
+#ifndef DSHM_TRACE
+                fprintf(stderr, "Сервер собран без трассировки (make trace), -T не действует\n");
+#endif
+                break;
+            case 'k':
+                free(auth_keys);
+                auth_keys = calloc(DSHM_AUTH_KEYS_MAX, sizeof(dshm_auth_entry_t));
+                auth_key_count = (auth_keys != NULL) ? dshm_auth_load_keys(optarg, auth_keys, DSHM_AUTH_KEYS_MAX) : -1;
+                if (auth_key_count == -1) {
+                    if (errno == EINVAL) {
+                        fprintf(stderr, "Неверный файл ключей %s: строки \"node ключ\" и \"uid:gid ключ\" "
+                                "(uid не 0) или один ключ, ключи от %d до %d байт\n",
+                                optarg, DSHM_AUTH_KEY_MIN, DSHM_AUTH_KEY_MAX);
+                    } else {
+                        perror(optarg);
+                    }
+                    return 1;
+                }
+                node_key = NULL;
+                for (int i = 0; i < auth_key_count && node_key == NULL; i++) {
+                    if (auth_keys[i].kind != DSHM_KEY_USER) {
+                        node_key = &auth_keys[i];
+                    }
+                }
+                break;
+            case 'S':
+                max_segments = atoi(optarg);
+                if (max_segments <= 0 || max_segments > SEGMENTS_LIMIT) {
+                    fprintf(stderr, "Неверное число сегментов: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                worker_threads = atoi(optarg);
+                if (worker_threads < 0 || worker_threads > 1024) {
+                    fprintf(stderr, "Неверное число обработчиков: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Использование: %s [-u] [-w обработчики] [-c узлы_кластера] [-i этот_узел] [-r копии] "
+                        "[-Q квота] [-q квота_соединения] [-B буферы] [-b буфер_запроса] [-H управляющий_сокет] "
+                        "[-T файл_трассировки] [-k файл_ключа] [-S сегменты] [порт]\n",
+                        argv[0]);
+                return 1;
+        }
+        if (limit != NULL && parse_size(optarg, limit) == -1) {
+            fprintf(stderr, "Неверный размер: %s\n", optarg);
+            return 1;
+        }
+    }
+    // Клиенты передают данные блоками до MAX_BUFFER_SIZE байт
+    if (limit_buffers_conn > 0 && limit_buffers_conn < MAX_BUFFER_SIZE + sizeof(uint32_t)) {
+        fprintf(stderr, "Буфер запроса не может быть меньше %zu байт\n", MAX_BUFFER_SIZE + sizeof(uint32_t));
+        return 1;
+    }
+    if (optind < argc) {
+        port = atoi(argv[optind]);
         if (port <= 0 || port > 65535) {
             fprintf(stderr, "Неверный номер порта. Используйте значение от 1 до 65535.\n");
             return 1;
         }
     }
     
-    // Регистрируем обработчик сигнала для корректного завершения
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    // Адрес этого узла в карте кластера (по умолчанию - первый узел с нашим портом)
+    self_port = port;
+    if (self_name != NULL) {
+        const char *colon = strrchr(self_name, ':');
+        if (colon == NULL || (size_t)(colon - self_name) >= sizeof(self_host)) {
+            fprintf(stderr, "Неверный адрес узла: %s\n", self_name);
+            return 1;
+        }
+        memcpy(self_host, self_name, colon - self_name);
+        self_host[colon - self_name] = '\0';
+        self_port = atoi(colon + 1);
+    }
+    if (cluster_nodes != NULL) {
+        if (dshm_cluster_parse(&cluster, cluster_nodes, 1) == -1 || cluster.node_count == 0) {
+            fprintf(stderr, "Неверная карта кластера: %s\n", cluster_nodes);
+            return 1;
+        }
+        cluster_self = find_self(&cluster);
+        if (cluster_self == -1) {
+            fprintf(stderr, "Этот узел отсутствует в карте кластера\n");
+            return 1;
+        }
+        cluster.replicas = replicas;
+    }
     
-    // Создаем TCP сокет
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        perror("Не удалось создать сокет");
-        return 1;
+    dshm_arenas_init(&segment_arenas, relocate_segment, wait_for_readers);
+    if (worker_threads >= 0) {
+        if (start_workers(worker_threads) == -1) {
+            perror("Ошибка запуска обработчиков");
+            return 1;
+        }
+        printf("Обработчиков сегментов: %d\n", worker_count);
     }
     
-    // Устанавливаем опцию для повторного использования адреса
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-        perror("Не удалось установить опцию сокета SO_REUSEADDR");
-        close(server_socket);
+    // Таблицы сегментов
+    if (init_segment_table() == -1) {
+        perror("Не удалось зарезервировать таблицу сегментов");
         return 1;
     }
     
-    // Настраиваем адрес сервера
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    // Каждый отдельный сегмент держит открытым свой файл memfd
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
     
-    // Привязываем сокет к адресу
-    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        perror("Не удалось привязать сокет к адресу");
-        close(server_socket);
+    // Сигналы завершения только будят цикл приема подключений
+    if (pipe2(stop_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("Не удалось создать канал остановки");
         return 1;
     }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    if (trace_path != NULL) {
+        sigaction(SIGUSR1, &action, NULL);
+    }
+    
+    // Прежний процесс сервера, если он работает, передает слушающий сокет и сегменты
+    int inherited = -1;
+    if (handoff_path != NULL) {
+        int sock = handoff_connect(handoff_path);
+        if (sock != -1) {
+            inherited = handoff_receive(sock);
+            close(sock);
+            if (inherited == -1) {
+                return 1;
+            }
+        }
+    }
+    
+    if (inherited == -1) {
+        // Создаем TCP сокет
+        server_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_socket == -1) {
+            perror("Не удалось создать сокет");
+            return 1;
+        }
+    
+        // Устанавливаем опцию для повторного использования адреса
+        int opt = 1;
+        if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+            perror("Не удалось установить опцию сокета SO_REUSEADDR");
+            close(server_socket);
+            return 1;
+        }
+    
+        // Настраиваем адрес сервера
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
+    
+        // Привязываем сокет к адресу
+        if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+            perror("Не удалось привязать сокет к адресу");
+            close(server_socket);
+            return 1;
+        }
+    
+        // Начинаем прослушивание
+        if (listen(server_socket, MAX_CLIENTS) == -1) {
+            perror("Ошибка при начале прослушивания");
+            close(server_socket);
+            return 1;
+        }
     
-    // Начинаем прослушивание
-    if (listen(server_socket, MAX_CLIENTS) == -1) {
-        perror("Ошибка при начале прослушивания");
-        close(server_socket);
+    }
+    if (handoff_path != NULL && handoff_listen(handoff_path) == -1) {
+        perror("Не удалось создать управляющий сокет");
         return 1;
     }
     
     printf("Сервер распределенной памяти запущен на порту %d\n", port);
+    if (inherited >= 0) {
+        printf("Принято от прежнего процесса сервера сегментов: %d\n", inherited);
+    }
+    if (cluster.node_count > 0) {
+        printf("Узел %d из %d в кластере (%s:%d)\n", cluster_self + 1, cluster.node_count,
+               cluster.nodes[cluster_self].host, cluster.nodes[cluster_self].port);
+    }
+    if (use_uring && !uring_available()) {
+        printf("io_uring недоступен, используется стандартный ввод-вывод\n");
+        use_uring = 0;
+    }
+    if (use_uring) {
+        printf("Сетевой ввод-вывод через io_uring\n");
+    }
     printf("Ожидание подключений...\n");
     
-    // Инициализация массива сегментов
-    memset(segments, 0, sizeof(segments));
+    // Журнал нового запуска не продолжает нумерацию прежнего
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    change_log_id = (uint32_t)(now.tv_sec ^ now.tv_usec ^ ((uint32_t)getpid() << 16)) | 1;
     
-    // Цикл обработки подключений
-    while (running) {
-        // Принимаем новое подключение
-        int *client_socket = malloc(sizeof(int));
-        if (client_socket == NULL) {
-            fprintf(stderr, "Ошибка выделения памяти для сокета клиента\n");
-            continue;
+    if (cluster.replicas > 0) {
+        pthread_mutex_lock(&cluster_mutex);
+        start_replication();
+        pthread_mutex_unlock(&cluster_mutex);
+        printf("Копий сегментов для чтения: %d\n", cluster.replicas);
+    }
+    
+    // Цикл обработки подключений. Его прерывают сигнал остановки и подключение
+    // преемника к управляющему сокету; неудавшаяся передача возобновляет работу.
+    int uring_accept = use_uring;
+    for (;;) {
+        if (uring_accept && accept_loop_uring() == -1) {
+            printf("Многократный accept io_uring недоступен, используется accept\n");
+            uring_accept = 0;
         }
-        
-        *client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        if (*client_socket == -1) {
-            if (running) { // Если сервер еще работает, выводим ошибку
-                perror("Ошибка при принятии подключения");
-            }
-            free(client_socket);
-            continue;
+        if (!uring_accept) {
+            accept_loop();
         }
-        
-        printf("Подключен клиент: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-        
-        // Создаем поток для обработки клиента
-        pthread_t client_thread;
-        if (pthread_create(&client_thread, NULL, handle_client, client_socket) != 0) {
-            perror("Ошибка создания потока для клиента");
-            close(*client_socket);
-            free(client_socket);
-            continue;
+        char wakeups[64];
+        while (read(stop_pipe[0], wakeups, sizeof(wakeups)) > 0) {
+        }
+        if (trace_requested) {
+            trace_requested = 0;
+            dump_trace();
         }
         
-        // Отсоединяем поток, чтобы он автоматически завершался
-        pthread_detach(client_thread);
+        int successor = take_handoff_conn();
+        if (successor != -1) {
+            printf("Передача состояния новому процессу сервера...\n");
+            int handed_off = (drain_requests() == 0 && handoff_send(successor) == 0);
+            close(successor);
+            if (handed_off) {
+                // Сегменты и слушающий сокет теперь принадлежат преемнику: память
+                // не освобождается, соединения клиентов переходят к нему
+                disconnect_clients();
+                running = 0;
+                printf("Состояние передано, сервер завершен.\n");
+                return 0;
+            }
+            fprintf(stderr, "Не удалось передать состояние, сервер продолжает работу\n");
+            resume_requests();
+        } else if (stop_requested) {
+            break;
+        }
     }
+    printf("\nСервер остановлен.\n");
     
-    // Закрываем серверный сокет
+    // Запросы в обработке завершаются, затем соединения закрываются
+    int drained = (drain_requests() == 0);
+    if (trace_path != NULL) {
+        dump_trace();
+    }
+    disconnect_clients();
+    running = 0;
     close(server_socket);
+    if (handoff_socket != -1) {
+        shutdown(handoff_socket, SHUT_RDWR);
+        close(handoff_socket);
+        unlink(handoff_path);
+    }
     
-    // Освобождаем все сегменты памяти
-    pthread_mutex_lock(&segments_mutex);
-    for (int i = 0; i < MAX_SEGMENTS; i++) {
-        if (segments[i].addr != NULL) {
-            munmap(segments[i].addr, segments[i].size);
+    // Освобождаем все сегменты памяти, если их больше никто не использует
+    if (drained && wait_connections(1000) == 0) {
+        DSHM_TRACE_LOCK(&segments_mutex);
+        for (int i = 0; i < segments_high; i++) {
+            if (segments[i].addr != NULL && !segments[i].retired) {
+                destroy_segment(&segments[i]);
+            }
         }
+        pthread_mutex_unlock(&segments_mutex);
     }
-    pthread_mutex_unlock(&segments_mutex);
     
     printf("Сервер завершен.\n");
     return 0;
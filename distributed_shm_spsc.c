@@ -0,0 +1,28 @@
+#include <string.h>
+
+#include "distributed_shm_spsc.h"
+
+void dshm_spsc_init(dshm_spsc_t *queue) {
+    memset(queue, 0, sizeof(*queue));
+}
+
+int dshm_spsc_push(dshm_spsc_t *queue, void *item) {
+    unsigned tail = queue->tail;
+    if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == DSHM_SPSC_SIZE) {
+        return -1;
+    }
+    queue->items[tail & (DSHM_SPSC_SIZE - 1)] = item;
+    // Элемент становится виден потребителю вместе с новым хвостом
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *dshm_spsc_pop(dshm_spsc_t *queue) {
+    unsigned head = queue->head;
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    void *item = queue->items[head & (DSHM_SPSC_SIZE - 1)];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
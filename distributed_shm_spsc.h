@@ -0,0 +1,31 @@
+#ifndef DISTRIBUTED_SHM_SPSC_H
+#define DISTRIBUTED_SHM_SPSC_H
+
+#include <stddef.h>
+
+// Емкость очереди (степень двойки)
+#define DSHM_SPSC_SIZE 8
+#ifndef DSHM_CACHE_LINE
+#define DSHM_CACHE_LINE 64
+#endif
+
+// Очередь указателей без блокировок для одного производителя и одного потребителя.
+// Индексы производителя и потребителя лежат в разных строках кэша, чтобы запись
+// одной стороны не вытесняла строку другой.
+typedef struct {
+    unsigned head;                                  // Пишет только потребитель
+    char pad_head[DSHM_CACHE_LINE - sizeof(unsigned)];
+    unsigned tail;                                  // Пишет только производитель
+    char pad_tail[DSHM_CACHE_LINE - sizeof(unsigned)];
+    void *items[DSHM_SPSC_SIZE];
+} dshm_spsc_t;
+
+void dshm_spsc_init(dshm_spsc_t *queue);
+
+// Добавление в очередь (сторона производителя). Возвращает -1, если очередь полна
+int dshm_spsc_push(dshm_spsc_t *queue, void *item);
+
+// Извлечение из очереди (сторона потребителя). Возвращает NULL, если очередь пуста
+void *dshm_spsc_pop(dshm_spsc_t *queue);
+
+#endif // DISTRIBUTED_SHM_SPSC_H
@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "distributed_shm_stream.h"
+
+#if defined(__x86_64__)
+#define DSHM_STREAM_HW 1
+#include <emmintrin.h>
+#endif
+
+#ifdef DSHM_STREAM_HW
+
+// Байт до границы 16 байт (выравнивание, которого требует movntdq)
+static size_t unaligned_head(const void *dst, size_t len) {
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    return (head < len) ? head : len;
+}
+
+void dshm_stream_copy(void *dst, const void *src, size_t len) {
+    char *d = dst;
+    const char *s = src;
+    size_t head = unaligned_head(d, len);
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    // По строке кэша за шаг: строка пишется целиком и не читается из памяти
+    while (len >= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)s);
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+        _mm_stream_si128((__m128i*)d, a);
+        _mm_stream_si128((__m128i*)(d + 16), b);
+        _mm_stream_si128((__m128i*)(d + 32), c);
+        _mm_stream_si128((__m128i*)(d + 48), e);
+        d += 64;
+        s += 64;
+        len -= 64;
+    }
+    memcpy(d, s, len);
+}
+
+void dshm_stream_fill(void *dst, int value, size_t len) {
+    char *d = dst;
+    size_t head = unaligned_head(d, len);
+    memset(d, value, head);
+    d += head;
+    len -= head;
+
+    __m128i v = _mm_set1_epi8((char)value);
+    while (len >= 64) {
+        _mm_stream_si128((__m128i*)d, v);
+        _mm_stream_si128((__m128i*)(d + 16), v);
+        _mm_stream_si128((__m128i*)(d + 32), v);
+        _mm_stream_si128((__m128i*)(d + 48), v);
+        d += 64;
+        len -= 64;
+    }
+    memset(d, value, len);
+}
+
+void dshm_stream_fence(void) {
+    _mm_sfence();
+}
+
+#else
+
+void dshm_stream_copy(void *dst, const void *src, size_t len) {
+    memcpy(dst, src, len);
+}
+
+void dshm_stream_fill(void *dst, int value, size_t len) {
+    memset(dst, value, len);
+}
+
+void dshm_stream_fence(void) {
+}
+
+#endif // DSHM_STREAM_HW
@@ -0,0 +1,24 @@
+#ifndef DISTRIBUTED_SHM_STREAM_H
+#define DISTRIBUTED_SHM_STREAM_H
+
+#include <stddef.h>
+
+// Копирование и заполнение памяти записью в обход кэша (non-temporal stores).
+// Данные больших диапазонов, которые не будут сразу прочитаны, не вытесняют
+// из кэша рабочие данные других запросов. На архитектурах без таких
+// инструкций функции сводятся к memcpy и memset.
+
+// Диапазоны от этого размера выгоднее писать в обход кэша
+#define DSHM_STREAM_MIN (1024 * 1024)
+
+// Копирование неперекрывающихся областей
+void dshm_stream_copy(void *dst, const void *src, size_t len);
+
+// Заполнение области байтом value
+void dshm_stream_fill(void *dst, int value, size_t len);
+
+// Завершение записей в обход кэша: после вызова они видны другим потокам
+// раньше любых последующих записей
+void dshm_stream_fence(void);
+
+#endif // DISTRIBUTED_SHM_STREAM_H
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "distributed_shm_trace.h"
+
+static const char *const stage_names[DSHM_TRACE_STAGES] = {
+    [DSHM_TRACE_REQUEST] = "request",
+    [DSHM_TRACE_RECV] = "recv",
+    [DSHM_TRACE_DECODE] = "decode",
+    [DSHM_TRACE_QUEUE] = "queue",
+    [DSHM_TRACE_EXECUTE] = "execute",
+    [DSHM_TRACE_LOCK] = "lock",
+    [DSHM_TRACE_COPY] = "copy",
+    [DSHM_TRACE_ENCODE] = "encode",
+    [DSHM_TRACE_SEND] = "send",
+    [DSHM_TRACE_CLIENT_REQUEST] = "client_request",
+    [DSHM_TRACE_CLIENT_SEND] = "client_send",
+    [DSHM_TRACE_CLIENT_WAIT] = "client_wait",
+};
+
+const char *dshm_trace_stage_name(unsigned stage) {
+    return (stage < DSHM_TRACE_STAGES) ? stage_names[stage] : NULL;
+}
+
+#ifdef DSHM_TRACE
+
+#define TRACE_RING_EVENTS 16384     // Событий в кольце потока (степень двойки)
+
+// Кольцо событий. Пишет только поток-владелец; после его выхода кольцо
+// переходит к новому потоку, а старые события остаются до перезаписи.
+typedef struct trace_ring {
+    struct trace_ring *next;    // Список всех колец (только пополняется)
+    int owned;                  // Кольцо принадлежит живому потоку
+    uint64_t head;              // Число записанных событий
+    dshm_trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+static trace_ring_t *rings = NULL;
+static __thread trace_ring_t *thread_ring = NULL;
+static __thread uint32_t thread_tid = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static void release_ring(void *ring) {
+    __atomic_store_n(&((trace_ring_t*)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+// Кольцо текущего потока: освобожденное другим потоком или новое
+static trace_ring_t *acquire_ring(void) {
+    pthread_once(&ring_once, ring_key_init);
+    trace_ring_t *ring;
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(trace_ring_t));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(ring_key, ring);
+    thread_tid = (uint32_t)syscall(SYS_gettid);
+    thread_ring = ring;
+    return ring;
+}
+
+void dshm_trace_record(unsigned stage, unsigned phase, uint32_t command, int32_t shmid) {
+    trace_ring_t *ring = thread_ring;
+    if (ring == NULL && (ring = acquire_ring()) == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t head = ring->head;
+    dshm_trace_event_t *event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+    event->time_ns = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+    event->tid = thread_tid;
+    event->stage = (uint16_t)stage;
+    event->phase = (uint8_t)phase;
+    event->reserved = 0;
+    event->command = command;
+    event->shmid = shmid;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Захват блокировки; ожидание, если она занята, становится этапом DSHM_TRACE_LOCK
+int dshm_trace_mutex_lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return 0;
+    }
+    dshm_trace_record(DSHM_TRACE_LOCK, 'B', 0, 0);
+    int rc = pthread_mutex_lock(mutex);
+    dshm_trace_record(DSHM_TRACE_LOCK, 'E', 0, 0);
+    return rc;
+}
+
+// Запись событий кольца, которые владелец не перезаписал во время копирования
+static int dump_ring(trace_ring_t *ring, dshm_trace_event_t *copy, FILE *f) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+    for (uint64_t i = first; i < head; i++) {
+        copy[i - first] = ring->events[i & (TRACE_RING_EVENTS - 1)];
+    }
+    // Владелец мог успеть записать новые события поверх самых старых
+    // (и, возможно, пишет следующее прямо сейчас)
+    uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t valid = (now >= TRACE_RING_EVENTS) ? now - TRACE_RING_EVENTS + 1 : 0;
+    uint64_t skip = (valid > first) ? valid - first : 0;
+    if (skip >= head - first) {
+        return 0;
+    }
+    size_t count = (size_t)(head - first - skip);
+    return (fwrite(copy + skip, sizeof(dshm_trace_event_t), count, f) == count) ? (int)count : -1;
+}
+
+int dshm_trace_dump(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    dshm_trace_file_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DSHM_TRACE_MAGIC, sizeof(header.magic));
+    header.pid = (uint32_t)getpid();
+    header.event_size = sizeof(dshm_trace_event_t);
+    FILE *comm = fopen("/proc/self/comm", "r");
+    if (comm != NULL) {
+        if (fgets(header.name, sizeof(header.name), comm) != NULL) {
+            header.name[strcspn(header.name, "\n")] = '\0';
+        }
+        fclose(comm);
+    }
+
+    dshm_trace_event_t *copy = malloc(TRACE_RING_EVENTS * sizeof(dshm_trace_event_t));
+    int total = (copy != NULL && fwrite(&header, sizeof(header), 1, f) == 1) ? 0 : -1;
+    for (trace_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL && total >= 0;
+         ring = ring->next) {
+        int count = dump_ring(ring, copy, f);
+        total = (count >= 0) ? total + count : -1;
+    }
+    free(copy);
+    if (fclose(f) != 0) {
+        total = -1;
+    }
+    return total;
+}
+
+#else
+
+int dshm_trace_dump(const char *path __attribute__((unused))) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif // DSHM_TRACE
@@ -0,0 +1,86 @@
+#ifndef DISTRIBUTED_SHM_TRACE_H
+#define DISTRIBUTED_SHM_TRACE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Трассировка этапов обработки запросов. Включается при сборке: -DDSHM_TRACE
+// (цель make trace) пишет события в кольцевой буфер своего потока без
+// блокировок, -DDSHM_TRACE_USDT делает каждое событие статической точкой USDT
+// (провайдер dshm, точки begin и end) для perf и bpftrace. Без этих флагов
+// макросы ниже ничего не делают. Буферы сбрасываются в файл по требованию
+// (dshm_trace_dump), dshm_trace2json переводит файлы в формат Chrome trace / Perfetto.
+
+// Этапы (имена - dshm_trace_stage_name)
+enum {
+    DSHM_TRACE_REQUEST = 1,     // Запрос на сервере: от заголовка до отправки ответа
+    DSHM_TRACE_RECV,            // Прием данных запроса и контрольной суммы
+    DSHM_TRACE_DECODE,          // Распаковка данных запроса
+    DSHM_TRACE_QUEUE,           // Передача команды обработчику сегмента и ожидание результата
+    DSHM_TRACE_EXECUTE,         // Выполнение команды
+    DSHM_TRACE_LOCK,            // Ожидание занятой блокировки сегментов
+    DSHM_TRACE_COPY,            // Копирование данных в сегмент или из него
+    DSHM_TRACE_ENCODE,          // Сжатие данных ответа
+    DSHM_TRACE_SEND,            // Отправка ответа
+    DSHM_TRACE_CLIENT_REQUEST,  // Запрос клиента целиком, с повторами и перенаправлениями
+    DSHM_TRACE_CLIENT_SEND,     // Отправка запроса узлу
+    DSHM_TRACE_CLIENT_WAIT,     // Ожидание и прием ответа узла
+    DSHM_TRACE_STAGES
+};
+
+// Событие файла трассировки (порядок байт машины)
+typedef struct {
+    uint64_t time_ns;       // CLOCK_MONOTONIC: общее время процессов одной машины
+    uint32_t tid;
+    uint16_t stage;
+    uint8_t phase;          // 'B' - начало этапа, 'E' - его конец
+    uint8_t reserved;
+    uint32_t command;       // Команда запроса (0 - неизвестна)
+    int32_t shmid;
+} dshm_trace_event_t;
+
+// Заголовок файла трассировки, за ним - события до конца файла.
+// События одного потока идут в порядке записи.
+#define DSHM_TRACE_MAGIC "DSHMTRC1"
+typedef struct {
+    char magic[8];
+    uint32_t pid;
+    uint32_t event_size;    // sizeof(dshm_trace_event_t)
+    char name[16];          // Имя процесса
+} dshm_trace_file_t;
+
+// Имя этапа или NULL
+const char *dshm_trace_stage_name(unsigned stage);
+
+// Запись событий всех потоков процесса в файл. Возвращает число записанных
+// событий или -1 (errno; ENOSYS - сборка без -DDSHM_TRACE)
+int dshm_trace_dump(const char *path);
+
+#ifdef DSHM_TRACE
+void dshm_trace_record(unsigned stage, unsigned phase, uint32_t command, int32_t shmid);
+int dshm_trace_mutex_lock(pthread_mutex_t *mutex);
+#define DSHM_TRACE_RECORD(stage, phase, command, shmid) dshm_trace_record((stage), (phase), (command), (shmid))
+#define DSHM_TRACE_LOCK(mutex) dshm_trace_mutex_lock(mutex)
+#else
+#define DSHM_TRACE_RECORD(stage, phase, command, shmid) ((void)0)
+#define DSHM_TRACE_LOCK(mutex) pthread_mutex_lock(mutex)
+#endif
+
+#ifdef DSHM_TRACE_USDT
+#include <sys/sdt.h>
+#define DSHM_TRACE_PROBE(point, stage, command, shmid) DTRACE_PROBE3(dshm, point, (stage), (command), (shmid))
+#else
+#define DSHM_TRACE_PROBE(point, stage, command, shmid) ((void)0)
+#endif
+
+// Начало и конец этапа
+#define DSHM_TRACE_BEGIN(stage, command, shmid) do { \
+        DSHM_TRACE_PROBE(begin, stage, command, shmid); \
+        DSHM_TRACE_RECORD(stage, 'B', command, shmid); \
+    } while (0)
+#define DSHM_TRACE_END(stage, command, shmid) do { \
+        DSHM_TRACE_PROBE(end, stage, command, shmid); \
+        DSHM_TRACE_RECORD(stage, 'E', command, shmid); \
+    } while (0)
+
+#endif // DISTRIBUTED_SHM_TRACE_H
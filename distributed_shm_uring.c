@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "distributed_shm_uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, _NSIG / 8);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int dshm_uring_init(dshm_uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = -1;
+
+    int fd = sys_io_uring_setup(entries, &params);
+    if (fd == -1) {
+        return -1;
+    }
+    ring->fd = fd;
+
+    // Нужны общее отображение SQ/CQ и ожидание без лишних копий
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        close(fd);
+        ring->fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // SQ и CQ отображаются одним участком (IORING_FEAT_SINGLE_MMAP)
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        dshm_uring_exit(ring);
+        return -1;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        dshm_uring_exit(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    char *cq = ring->sq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+void dshm_uring_exit(dshm_uring_t *ring) {
+    if (ring->buf_ring != NULL) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = DSHM_URING_BGID;
+        sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(ring->buf_ring, ring->buf_ring_size);
+        ring->buf_ring = NULL;
+    }
+    free(ring->buf_base);
+    ring->buf_base = NULL;
+
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        ring->sq_ring = NULL;
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+int dshm_uring_setup_buffers(dshm_uring_t *ring, unsigned count, size_t size) {
+    // Число буферов в кольце должно быть степенью двойки
+    if (count == 0 || (count & (count - 1)) != 0 || count > 32768) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    ring->buf_base = malloc(count * size);
+    if (ring->buf_base == NULL) {
+        munmap(mem, ring->buf_ring_size);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = count;
+    reg.bgid = DSHM_URING_BGID;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        int saved = errno;
+        munmap(mem, ring->buf_ring_size);
+        free(ring->buf_base);
+        ring->buf_base = NULL;
+        errno = saved;
+        return -1;
+    }
+
+    ring->buf_ring = mem;
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_tail = 0;
+    for (unsigned bid = 0; bid < count; bid++) {
+        dshm_uring_recycle(ring, bid);
+    }
+    return 0;
+}
+
+void *dshm_uring_buffer(dshm_uring_t *ring, unsigned bid) {
+    return ring->buf_base + (size_t)bid * ring->buf_size;
+}
+
+void dshm_uring_recycle(dshm_uring_t *ring, unsigned bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)dshm_uring_buffer(ring, bid);
+    buf->len = (uint32_t)ring->buf_size;
+    buf->bid = (uint16_t)bid;
+    ring->buf_tail++;
+    // Ядро читает хвост кольца без блокировок
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *dshm_uring_get_sqe(dshm_uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head > ring->sq_mask) {
+        return NULL;
+    }
+    unsigned index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+unsigned dshm_uring_pending(const dshm_uring_t *ring) {
+    return ring->sqe_tail - *ring->sq_tail;
+}
+
+int dshm_uring_submit(dshm_uring_t *ring, unsigned wait_nr) {
+    unsigned to_submit = dshm_uring_pending(ring);
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    // При EINTR записи не отправлены, вызов можно повторить
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    return sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags);
+}
+
+struct io_uring_cqe *dshm_uring_peek(dshm_uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void dshm_uring_seen(dshm_uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void dshm_uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void dshm_uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+}
+
+void dshm_uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = DSHM_URING_BGID;
+}
+
+void dshm_uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, int flags) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = (uint32_t)flags;
+}
@@ -0,0 +1,78 @@
+#ifndef DISTRIBUTED_SHM_URING_H
+#define DISTRIBUTED_SHM_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// Минимальная обертка над io_uring на системных вызовах (без liburing).
+// Кольцо используется одним потоком, синхронизация между потоками не нужна.
+typedef struct {
+    int fd;
+
+    // Очереди отправки (SQ) и завершений (CQ) в общем отображении
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sqe_tail;          // Заполненные, но еще не отправленные в ядро записи
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Кольцо зарегистрированных буферов приема (IORING_REGISTER_PBUF_RING)
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    unsigned buf_count;
+    size_t buf_size;
+    unsigned char *buf_base;
+    uint16_t buf_tail;
+} dshm_uring_t;
+
+// Идентификатор группы буферов приема
+#define DSHM_URING_BGID 0
+
+// Создание кольца на entries записей. Возвращает 0 или -1 (errno)
+int dshm_uring_init(dshm_uring_t *ring, unsigned entries);
+
+// Освобождение кольца и буферов
+void dshm_uring_exit(dshm_uring_t *ring);
+
+// Регистрация count буферов приема по size байт для многократного recv
+int dshm_uring_setup_buffers(dshm_uring_t *ring, unsigned count, size_t size);
+
+// Адрес буфера приема по номеру из CQE
+void *dshm_uring_buffer(dshm_uring_t *ring, unsigned bid);
+
+// Возврат буфера приема ядру после обработки данных
+void dshm_uring_recycle(dshm_uring_t *ring, unsigned bid);
+
+// Следующая свободная запись SQ (обнуленная) или NULL, если очередь заполнена
+struct io_uring_sqe *dshm_uring_get_sqe(dshm_uring_t *ring);
+
+// Число заполненных, но не отправленных записей
+unsigned dshm_uring_pending(const dshm_uring_t *ring);
+
+// Отправка накопленных записей одним вызовом и ожидание wait_nr завершений.
+// Возвращает число отправленных записей или -1 (errno)
+int dshm_uring_submit(dshm_uring_t *ring, unsigned wait_nr);
+
+// Очередное завершение без системного вызова или NULL
+struct io_uring_cqe *dshm_uring_peek(dshm_uring_t *ring);
+
+// Пометка завершения, полученного dshm_uring_peek, как обработанного
+void dshm_uring_seen(dshm_uring_t *ring);
+
+// Подготовка операций
+void dshm_uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd);
+void dshm_uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd);
+void dshm_uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events);
+void dshm_uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, int flags);
+
+#endif // DISTRIBUTED_SHM_URING_H
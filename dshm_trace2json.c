@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "distributed_shm.h"
+#include "distributed_shm_trace.h"
+
+// Перевод файлов трассировки (dshm_trace_dump) в формат Chrome trace, который
+// открывают chrome://tracing и ui.perfetto.dev:
+//   dshm_trace2json server.trace client.trace > trace.json
+// Файлы сервера и клиентов одной машины совмещаются по общему времени.
+
+#define DEPTH_SLOTS 4096        // Потоков одного файла (открытая адресация)
+
+static const char *const command_names[] = {
+    [CMD_CREATE_SEGMENT] = "CREATE_SEGMENT",
+    [CMD_ATTACH_SEGMENT] = "ATTACH_SEGMENT",
+    [CMD_DETACH_SEGMENT] = "DETACH_SEGMENT",
+    [CMD_REMOVE_SEGMENT] = "REMOVE_SEGMENT",
+    [CMD_READ_DATA] = "READ_DATA",
+    [CMD_WRITE_DATA] = "WRITE_DATA",
+    [CMD_GET_STATUS] = "GET_STATUS",
+    [CMD_SHMCTL] = "SHMCTL",
+    [CMD_CLUSTER_MAP] = "CLUSTER_MAP",
+    [CMD_SET_CLUSTER_MAP] = "SET_CLUSTER_MAP",
+    [CMD_MIGRATE_IN] = "MIGRATE_IN",
+    [CMD_MIGRATE_OUT] = "MIGRATE_OUT",
+    [CMD_HELLO] = "HELLO",
+    [CMD_PUNCH_HOLE] = "PUNCH_HOLE",
+    [CMD_SNAPSHOT] = "SNAPSHOT",
+    [CMD_GET_CHANGES] = "GET_CHANGES",
+    [CMD_CHECKSUM] = "CHECKSUM",
+    [CMD_REPLICA_UPDATE] = "REPLICA_UPDATE",
+    [CMD_SUBSCRIBE] = "SUBSCRIBE",
+    [CMD_FILL] = "FILL",
+    [CMD_COPY] = "COPY",
+    [CMD_RESIZE] = "RESIZE",
+    [CMD_AUTH] = "AUTH",
+};
+
+// Глубина вложенности этапов потока: кольцо могло сохранить конец этапа без
+// его начала, такие концы пропускаются
+typedef struct {
+    uint32_t tid;
+    int depth;
+} depth_slot_t;
+
+static int *thread_depth(depth_slot_t *slots, uint32_t tid) {
+    for (uint32_t i = tid % DEPTH_SLOTS, n = 0; n < DEPTH_SLOTS; i = (i + 1) % DEPTH_SLOTS, n++) {
+        if (slots[i].tid == tid || slots[i].tid == 0) {
+            slots[i].tid = tid;
+            return &slots[i].depth;
+        }
+    }
+    return NULL;
+}
+
+// Вывод событий одного файла. Возвращает -1, если файл не прочитан
+static int convert_file(const char *path, int *first) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    dshm_trace_file_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, DSHM_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.event_size != sizeof(dshm_trace_event_t)) {
+        fprintf(stderr, "%s: не файл трассировки\n", path);
+        fclose(f);
+        return -1;
+    }
+    header.name[sizeof(header.name) - 1] = '\0';
+    printf("%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"%s\"}}",
+           *first ? "" : ",", header.pid, header.name);
+    *first = 0;
+
+    depth_slot_t *slots = calloc(DEPTH_SLOTS, sizeof(depth_slot_t));
+    if (slots == NULL) {
+        fclose(f);
+        return -1;
+    }
+    dshm_trace_event_t event;
+    while (fread(&event, sizeof(event), 1, f) == 1) {
+        const char *stage = dshm_trace_stage_name(event.stage);
+        int *depth = thread_depth(slots, event.tid);
+        if (stage == NULL || depth == NULL || (event.phase != 'B' && event.phase != 'E')) {
+            continue;
+        }
+        if (event.phase == 'E' && *depth == 0) {
+            continue;
+        }
+        *depth += (event.phase == 'B') ? 1 : -1;
+
+        printf(",\n{\"name\":\"%s\",\"cat\":\"dshm\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%u,\"tid\":%u",
+               stage, event.phase, (unsigned long long)(event.time_ns / 1000), (unsigned)(event.time_ns % 1000),
+               header.pid, event.tid);
+        if (event.phase == 'B' && event.command != 0) {
+            const char *command = (event.command < sizeof(command_names) / sizeof(command_names[0]))
+                                  ? command_names[event.command] : NULL;
+            if (command != NULL) {
+                printf(",\"args\":{\"command\":\"%s\",\"shmid\":%d}}", command, event.shmid);
+            } else {
+                printf(",\"args\":{\"command\":%u,\"shmid\":%d}}", event.command, event.shmid);
+            }
+        } else {
+            printf("}");
+        }
+    }
+    free(slots);
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Использование: %s файл_трассировки... > trace.json\n", argv[0]);
+        return 1;
+    }
+    int first = 1;
+    int status = 0;
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (int i = 1; i < argc; i++) {
+        if (convert_file(argv[i], &first) == -1) {
+            status = 1;
+        }
+    }
+    printf("\n]}\n");
+    return status;
+}
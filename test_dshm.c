@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +12,7 @@
 
 // Include our distributed SHM client
 #include "distributed_shm_client.h"
+#include "distributed_shm_crc.h"
 
 int main() {
     printf("Тестирование распределенной разделяемой памяти\n");
@@ -78,6 +81,215 @@ int main() {
 
     printf("Отсоединились от сегмента разделяемой памяти\n");
 
+    // Attach again: the data written before detaching must come back from the server
+    shm_ptr = (char*)shmat(shmid, NULL, 0);
+    if (shm_ptr == (char*)-1) {
+        perror("shmat");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    if (strcmp(shm_ptr, test_data) != 0) {
+        printf("ERROR: данные после повторного присоединения не совпадают: %s\n", shm_ptr);
+        distributed_shm_cleanup();
+        return 1;
+    }
+    printf("Данные сохранились на сервере: %s\n", shm_ptr);
+
+    // Subscribe to the change log, write a range and expect a record with its data
+    dshm_subscription_t *sub = distributed_shm_subscribe(shmid, 0, DSHM_CHANGES_DATA);
+    if (sub == NULL) {
+        perror("distributed_shm_subscribe");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    memcpy(shm_ptr + 1024, "delta", 5);
+    if (distributed_shm_sync(shm_ptr + 1024, 5) == -1) {
+        perror("distributed_shm_sync");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    const dshm_change_t *changes = NULL;
+    int lost = 0;
+    int nchanges = distributed_shm_next_changes(sub, 1000, &changes, &lost);
+    if (nchanges != 1 || lost || changes[0].offset != 1024 || changes[0].len != 5 ||
+        changes[0].data == NULL || memcmp(changes[0].data, "delta", 5) != 0) {
+        printf("ERROR: журнал изменений вернул неожиданный результат (%d записей)\n", nchanges);
+        distributed_shm_cleanup();
+        return 1;
+    }
+    printf("Журнал изменений: запись %llu, смещение %zu, %zu байт\n",
+           (unsigned long long)changes[0].seq, changes[0].offset, changes[0].len);
+    distributed_shm_unsubscribe(sub);
+
+    // Push subscription to a range: only writes overlapping it are delivered
+    sub = distributed_shm_subscribe_range(shmid, 2048, 64, DSHM_CHANGES_DATA);
+    if (sub == NULL) {
+        perror("distributed_shm_subscribe_range");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    memcpy(shm_ptr + 3000, "skip", 4);
+    memcpy(shm_ptr + 2050, "push", 4);
+    if (distributed_shm_sync(shm_ptr + 3000, 4) == -1 || distributed_shm_sync(shm_ptr + 2050, 4) == -1) {
+        perror("distributed_shm_sync");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    nchanges = distributed_shm_next_changes(sub, 1000, &changes, &lost);
+    if (nchanges != 1 || lost || changes[0].offset != 2050 || changes[0].len != 4 ||
+        changes[0].data == NULL || memcmp(changes[0].data, "push", 4) != 0) {
+        printf("ERROR: рассылка изменений вернула неожиданный результат (%d записей)\n", nchanges);
+        distributed_shm_cleanup();
+        return 1;
+    }
+    printf("Рассылка изменений: смещение %zu, %zu байт\n", changes[0].offset, changes[0].len);
+    distributed_shm_unsubscribe(sub);
+
+    // Take a snapshot, then overwrite the source: the snapshot keeps the old contents
+    int snap_id = distributed_shm_snapshot(shmid);
+    if (snap_id == -1) {
+        perror("distributed_shm_snapshot");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    strcpy(shm_ptr, "changed after snapshot");
+    if (distributed_shm_sync(shm_ptr, 4096) == -1) {
+        perror("distributed_shm_sync");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    char *snap_ptr = (char*)shmat(snap_id, NULL, SHM_RDONLY);
+    if (snap_ptr == (char*)-1) {
+        perror("shmat snapshot");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    if (strcmp(snap_ptr, test_data) != 0) {
+        printf("ERROR: снимок изменился вместе с исходным сегментом: %s\n", snap_ptr);
+        distributed_shm_cleanup();
+        return 1;
+    }
+    printf("Снимок %d сохранил данные: %s\n", snap_id, snap_ptr);
+    if (shmdt(snap_ptr) == -1 || shmctl(snap_id, IPC_RMID, NULL) == -1) {
+        perror("shmdt/shmctl snapshot");
+        distributed_shm_cleanup();
+        return 1;
+    }
+
+    // The server's digest of a synced range matches the one computed locally
+    uint32_t digest = 0;
+    if (distributed_shm_checksum(shmid, 0, 4096, &digest) == -1 ||
+        digest != dshm_range_digest(shm_ptr, 0, 4096) ||
+        distributed_shm_checksum(shmid, 100, 3000, &digest) == -1 ||
+        digest != dshm_range_digest(shm_ptr, 100, 3000)) {
+        printf("ERROR: контрольная сумма диапазона не совпадает с локальной\n");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    printf("Контрольная сумма сегмента: 0x%08x\n", digest);
+
+    // Server-side fill, overlapping move within the segment and copy from its start
+    memset(shm_ptr + 3500, 0, 100);
+    if (distributed_shm_sync(shm_ptr + 3500, 100) == -1 ||
+        distributed_shm_fill(shmid, 3500, 'x', 10) == -1 ||
+        distributed_shm_copy(shmid, 3505, shmid, 3500, 10) == -1 ||
+        distributed_shm_copy(shmid, 3600, shmid, 0, 7) == -1 ||
+        distributed_shm_refresh(shm_ptr + 3500, 200) == -1) {
+        perror("distributed_shm_fill/copy");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    if (memcmp(shm_ptr + 3500, "xxxxxxxxxxxxxxx", 15) != 0 || shm_ptr[3515] != 0 ||
+        memcmp(shm_ptr + 3600, "changed", 7) != 0) {
+        printf("ERROR: заполнение или копирование на сервере дало неверные данные\n");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    printf("Заполнение и копирование диапазонов на сервере\n");
+
+    // Syncing changes around a range filled on the server must not write it back from the shadow
+    shm_ptr[3000] = 'a';
+    shm_ptr[3100] = 'b';
+    if (distributed_shm_fill(shmid, 3040, 'f', 20) == -1 || distributed_shm_sync(shm_ptr, 4096) == -1 ||
+        distributed_shm_refresh(shm_ptr + 3000, 101) == -1) {
+        perror("distributed_shm_fill/sync");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    if (shm_ptr[3000] != 'a' || shm_ptr[3100] != 'b' || memcmp(shm_ptr + 3040, "ffffffffffffffffffff", 20) != 0) {
+        printf("ERROR: синхронизация затерла данные, заполненные на сервере\n");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    printf("Синхронизация отправила только измененные байты\n");
+
+    // Grow the segment, write past the old end, then shrink it back
+    char *grown = distributed_shm_resize(shm_ptr, 3 * 4096);
+    struct shmid_ds grown_stat;
+    if (grown == (void*)-1) {
+        perror("distributed_shm_resize");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    shm_ptr = grown;
+    strcpy(shm_ptr + 2 * 4096 + 100, "grown");
+    if (distributed_shm_sync(shm_ptr + 2 * 4096, 4096) == -1 ||
+        shmctl(shmid, IPC_STAT, &grown_stat) == -1 || grown_stat.shm_segsz != 3 * 4096) {
+        perror("distributed_shm_sync/shmctl after resize");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    memset(shm_ptr + 2 * 4096, 0, 4096);
+    if (distributed_shm_refresh(shm_ptr + 2 * 4096, 4096) == -1 ||
+        strcmp(shm_ptr + 2 * 4096 + 100, "grown") != 0) {
+        printf("ERROR: данные за прежним концом сегмента не сохранились\n");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    shm_ptr = distributed_shm_resize(shm_ptr, 4096);
+    if (shm_ptr == (void*)-1 || distributed_shm_refresh(shm_ptr, 4096) == -1 ||
+        memcmp(shm_ptr + 3600, "changed", 7) != 0) {
+        printf("ERROR: уменьшение сегмента повредило данные\n");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    printf("Размер сегмента изменен: %d -> %d -> %d байт\n", 4096, 3 * 4096, 4096);
+
+    // Sequential refreshes of a writable attachment must not read ahead over unsynced writes
+    int seq_id = shmget(IPC_PRIVATE, 16 * 4096, IPC_CREAT | 0666);
+    char *seq_ptr = (seq_id == -1) ? (char*)-1 : (char*)shmat(seq_id, NULL, 0);
+    if (seq_ptr == (char*)-1) {
+        perror("shmget/shmat sequential");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    strcpy(seq_ptr + 6 * 4096, "unsynced");
+    for (int page = 0; page < 4; page++) {
+        if (distributed_shm_refresh(seq_ptr + page * 4096, 4096) == -1) {
+            perror("distributed_shm_refresh");
+            distributed_shm_cleanup();
+            return 1;
+        }
+    }
+    usleep(100 * 1000);
+    if (strcmp(seq_ptr + 6 * 4096, "unsynced") != 0) {
+        printf("ERROR: упреждающее чтение затерло несинхронизированные данные\n");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    if (shmdt(seq_ptr) == -1 || shmctl(seq_id, IPC_RMID, NULL) == -1) {
+        perror("shmdt/shmctl sequential");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    printf("Последовательное чтение сохранило несинхронизированные данные\n");
+
+    if (shmdt(shm_ptr) == -1) {
+        perror("shmdt");
+        distributed_shm_cleanup();
+        return 1;
+    }
+
     // Remove the shared memory segment
     if (shmctl(shmid, IPC_RMID, NULL) == -1) {
         perror("shmctl IPC_RMID");
@@ -0,0 +1,137 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Include our distributed SHM client
+#include "distributed_shm_client.h"
+
+#define TEST_SEGMENTS 32
+#define TEST_KEY_BASE 0x4000
+#define TEST_REPLICA_KEY_BASE 0x4100
+#define TEST_REPLICA_SIZE 65536
+
+// Ожидается кластер из двух узлов и один свободный узел:
+//   ./distributed_shm_server -c localhost:8080,localhost:8081 8080
+//   ./distributed_shm_server -c localhost:8080,localhost:8081 8081
+//   ./distributed_shm_server 8082
+// С ключом -r 1 у узлов кластера тест 3 читает сегменты с их копий.
+int main() {
+    printf("Тестирование распределения сегментов по узлам кластера\n");
+
+    if (distributed_shm_init_cluster("localhost:8080,localhost:8081") != 0) {
+        perror("distributed_shm_init_cluster failed");
+        return 1;
+    }
+
+    printf("Клиент инициализирован\n");
+
+    int shmids[TEST_SEGMENTS];
+    void *ptrs[TEST_SEGMENTS];
+
+    // Test 1: Create and attach segments spread across the nodes
+    printf("\n--- Тест 1: Создание сегментов на двух узлах ---\n");
+    for (int i = 0; i < TEST_SEGMENTS; i++) {
+        shmids[i] = shmget(TEST_KEY_BASE + i, 4096, IPC_CREAT | 0666);
+        if (shmids[i] == -1) {
+            perror("shmget failed");
+            distributed_shm_cleanup();
+            return 1;
+        }
+        ptrs[i] = shmat(shmids[i], NULL, 0);
+        if (ptrs[i] == (void*)-1) {
+            perror("shmat failed");
+            distributed_shm_cleanup();
+            return 1;
+        }
+    }
+    printf("OK: создано и присоединено %d сегментов\n", TEST_SEGMENTS);
+
+    // Test 2: Scale out to three nodes, segments must stay reachable
+    printf("\n--- Тест 2: Добавление третьего узла ---\n");
+    if (distributed_shm_set_cluster("localhost:8080,localhost:8081,localhost:8082") != 0) {
+        perror("distributed_shm_set_cluster failed");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    sleep(1);
+
+    for (int i = 0; i < TEST_SEGMENTS; i++) {
+        struct shmid_ds buf;
+        if (shmctl(shmids[i], IPC_STAT, &buf) == -1) {
+            printf("ERROR: сегмент %d недоступен после изменения карты\n", shmids[i]);
+            perror("shmctl IPC_STAT");
+            distributed_shm_cleanup();
+            return 1;
+        }
+    }
+    printf("OK: все сегменты доступны после миграции\n");
+
+    // Test 3: Read-only attachments see the data written through the owner
+    printf("\n--- Тест 3: Чтение сегментов, присоединенных только для чтения ---\n");
+    distributed_shm_set_replica_reads(1000);
+    for (int i = 0; i < TEST_SEGMENTS; i++) {
+        int shmid = shmget(TEST_REPLICA_KEY_BASE + i, TEST_REPLICA_SIZE, IPC_CREAT | 0666);
+        char *p = (shmid == -1) ? (void*)-1 : shmat(shmid, NULL, 0);
+        if (p == (void*)-1) {
+            perror("shmget/shmat failed");
+            distributed_shm_cleanup();
+            return 1;
+        }
+        memset(p, 'a' + i % 26, TEST_REPLICA_SIZE);
+        shmdt(p);
+    }
+    usleep(300000);
+    for (int i = 0; i < TEST_SEGMENTS; i++) {
+        int shmid = shmget(TEST_REPLICA_KEY_BASE + i, 0, 0);
+        char *p = (shmid == -1) ? (void*)-1 : shmat(shmid, NULL, SHM_RDONLY);
+        if (p == (void*)-1) {
+            perror("shmget/shmat (SHM_RDONLY) failed");
+            distributed_shm_cleanup();
+            return 1;
+        }
+        for (int j = 0; j < TEST_REPLICA_SIZE; j++) {
+            if (p[j] != 'a' + i % 26) {
+                printf("ERROR: сегмент %d, байт %d: прочитано %d\n", shmid, j, p[j]);
+                distributed_shm_cleanup();
+                return 1;
+            }
+        }
+        shmdt(p);
+        shmctl(shmid, IPC_RMID, NULL);
+    }
+    printf("OK: данные прочитаны\n");
+
+    // Test 4: Scale back in, the third node hands its segments over
+    printf("\n--- Тест 4: Вывод третьего узла из кластера ---\n");
+    if (distributed_shm_set_cluster("localhost:8080,localhost:8081") != 0) {
+        perror("distributed_shm_set_cluster failed");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    sleep(1);
+
+    for (int i = 0; i < TEST_SEGMENTS; i++) {
+        if (shmdt(ptrs[i]) == -1) {
+            perror("shmdt failed");
+            distributed_shm_cleanup();
+            return 1;
+        }
+        if (shmctl(shmids[i], IPC_RMID, NULL) == -1) {
+            perror("shmctl IPC_RMID failed");
+            distributed_shm_cleanup();
+            return 1;
+        }
+    }
+    printf("OK: все сегменты отсоединены и удалены\n");
+
+    distributed_shm_cleanup();
+    printf("\nВсе тесты завершены успешно!\n");
+    return 0;
+}
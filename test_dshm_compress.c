@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "distributed_shm_compress.h"
+
+#define TEST_SIZE (256 * 1024)
+
+// Сжатие и распаковка блока с проверкой совпадения
+static int roundtrip(const char *name, const unsigned char *src, size_t len) {
+    size_t cap = len + len / 2 + 64;
+    unsigned char *packed = malloc(cap);
+    unsigned char *unpacked = malloc(len);
+    if (packed == NULL || unpacked == NULL) {
+        free(packed);
+        free(unpacked);
+        printf("ERROR: %s: нехватка памяти\n", name);
+        return 1;
+    }
+
+    size_t packed_len = dshm_compress(src, len, packed, cap);
+    int failed = (packed_len == 0 ||
+                  dshm_decompress(packed, packed_len, unpacked, len) != 0 ||
+                  memcmp(src, unpacked, len) != 0);
+
+    if (failed) {
+        printf("ERROR: %s: данные после распаковки не совпадают\n", name);
+    } else {
+        printf("OK: %s: %zu -> %zu байт\n", name, len, packed_len);
+    }
+
+    free(packed);
+    free(unpacked);
+    return failed;
+}
+
+int main() {
+    printf("Тестирование сжатия полезной нагрузки\n");
+
+    unsigned char *buf = malloc(TEST_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    int failures = 0;
+
+    // Test 1: Zero pages
+    memset(buf, 0, TEST_SIZE);
+    failures += roundtrip("нулевые страницы", buf, TEST_SIZE);
+
+    // Test 2: Table-like rows with repeated values and sparse zeros
+    for (size_t i = 0; i < TEST_SIZE / 16; i++) {
+        uint32_t row[4] = { (uint32_t)i, (uint32_t)(i % 7), 0, 42 };
+        memcpy(buf + i * 16, row, sizeof(row));
+    }
+    failures += roundtrip("табличные данные", buf, TEST_SIZE);
+
+    // Test 3: Incompressible data must still round-trip
+    srand(12345);
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        buf[i] = (unsigned char)rand();
+    }
+    failures += roundtrip("случайные данные", buf, TEST_SIZE);
+
+    // Test 4: Small and odd-sized inputs
+    failures += roundtrip("один байт", buf, 1);
+    memset(buf, 'a', 13);
+    failures += roundtrip("короткая серия", buf, 13);
+
+    // Test 5: Payload encoding skips data that does not shrink
+    size_t encoded_len = 0;
+    void *encoded = dshm_encode_payload(buf, TEST_SIZE, &encoded_len);
+    if (encoded != NULL) {
+        printf("ERROR: несжимаемые данные были закодированы\n");
+        free(encoded);
+        failures++;
+    } else {
+        printf("OK: несжимаемые данные передаются как есть\n");
+    }
+
+    // Test 6: Corrupted stream is rejected
+    memset(buf, 0, TEST_SIZE);
+    encoded = dshm_encode_payload(buf, TEST_SIZE, &encoded_len);
+    if (encoded == NULL) {
+        printf("ERROR: нулевые данные не были закодированы\n");
+        failures++;
+    } else {
+        size_t decoded_len = 0;
+        ((unsigned char*)encoded)[encoded_len - 1] ^= 0x7f;
+        void *decoded = dshm_decode_payload(encoded, encoded_len, &decoded_len);
+        if (decoded != NULL) {
+            printf("ERROR: поврежденные данные были приняты\n");
+            free(decoded);
+            failures++;
+        } else {
+            printf("OK: поврежденные данные отклонены\n");
+        }
+        free(encoded);
+    }
+
+    free(buf);
+    if (failures > 0) {
+        printf("\nОшибок: %d\n", failures);
+        return 1;
+    }
+    printf("\nВсе тесты завершены успешно!\n");
+    return 0;
+}
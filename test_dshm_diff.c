@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "distributed_shm_diff.h"
+
+#define TEST_SIZE (64 * 1024 + 37)
+#define MAX_RUNS 64
+
+static const char *impl_names[] = { "scalar", "sse2", "avx2" };
+
+// Эталон: побайтовый поиск отрезков с теми же правилами объединения
+static int reference_runs(const unsigned char *a, const unsigned char *b, size_t len, size_t gap,
+                          dshm_run_t *runs, int max_runs) {
+    int count = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (a[i] == b[i]) {
+            continue;
+        }
+        if (count > 0 && (i - (runs[count - 1].offset + runs[count - 1].len) <= gap || count == max_runs)) {
+            runs[count - 1].len = i + 1 - runs[count - 1].offset;
+        } else {
+            runs[count].offset = i;
+            runs[count].len = 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Сравнение результата текущей реализации с эталоном
+static int check_runs(const char *name, const unsigned char *a, const unsigned char *b,
+                      size_t len, size_t gap, int max_runs) {
+    dshm_run_t expected[MAX_RUNS];
+    dshm_run_t actual[MAX_RUNS];
+    int expected_count = reference_runs(a, b, len, gap, expected, max_runs);
+    int actual_count = dshm_diff_runs(a, b, len, gap, actual, max_runs);
+
+    if (actual_count != expected_count ||
+        memcmp(actual, expected, expected_count * sizeof(dshm_run_t)) != 0) {
+        printf("ERROR: %s (%s): получено %d отрезков, ожидалось %d\n",
+               name, dshm_diff_impl(), actual_count, expected_count);
+        return 1;
+    }
+    printf("OK: %s (%s): %d отрезков\n", name, dshm_diff_impl(), actual_count);
+    return 0;
+}
+
+int main() {
+    printf("Тестирование поиска изменений\n");
+
+    unsigned char *old = malloc(TEST_SIZE);
+    unsigned char *cur = malloc(TEST_SIZE);
+    if (old == NULL || cur == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    int failures = 0;
+
+    srand(12345);
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        old[i] = (unsigned char)rand();
+    }
+
+    for (size_t n = 0; n < sizeof(impl_names) / sizeof(impl_names[0]); n++) {
+        if (dshm_diff_select(impl_names[n]) == -1) {
+            printf("SKIP: %s не поддерживается процессором\n", impl_names[n]);
+            continue;
+        }
+
+        // Test 1: Identical blocks
+        memcpy(cur, old, TEST_SIZE);
+        failures += check_runs("без изменений", cur, old, TEST_SIZE, 0, MAX_RUNS);
+
+        // Test 2: Sparse single bytes, including block edges and the unaligned tail
+        size_t sparse[] = { 0, 63, 64, 127, 4095, 4096, 30000, TEST_SIZE - 1 };
+        for (size_t i = 0; i < sizeof(sparse) / sizeof(sparse[0]); i++) {
+            cur[sparse[i]] ^= 0x5a;
+        }
+        failures += check_runs("одиночные байты", cur, old, TEST_SIZE, 0, MAX_RUNS);
+        failures += check_runs("объединение близких", cur, old, TEST_SIZE, 64, MAX_RUNS);
+
+        // Test 3: Long run crossing several blocks
+        memset(cur + 1000, 0xee, 5000);
+        failures += check_runs("длинный отрезок", cur, old, TEST_SIZE, 0, MAX_RUNS);
+
+        // Test 4: More runs than fit, the last one absorbs the rest
+        for (size_t i = 10000; i < 20000; i += 100) {
+            cur[i] ^= 0xff;
+        }
+        failures += check_runs("переполнение списка", cur, old, TEST_SIZE, 0, 8);
+
+        // Test 5: Random changes
+        memcpy(cur, old, TEST_SIZE);
+        for (int i = 0; i < 500; i++) {
+            cur[rand() % TEST_SIZE] ^= (unsigned char)(1 + rand() % 255);
+        }
+        failures += check_runs("случайные изменения", cur, old, TEST_SIZE, 16, MAX_RUNS);
+
+        // Test 6: Zero detection
+        memset(cur, 0, TEST_SIZE);
+        int zero_ok = dshm_is_zero(cur, TEST_SIZE);
+        cur[TEST_SIZE - 1] = 1;
+        zero_ok = zero_ok && !dshm_is_zero(cur, TEST_SIZE) && dshm_is_zero(cur, TEST_SIZE - 1);
+        cur[100] = 1;
+        zero_ok = zero_ok && !dshm_is_zero(cur, 4096) && dshm_is_zero(cur, 100);
+        if (!zero_ok) {
+            printf("ERROR: поиск нулевых блоков (%s)\n", dshm_diff_impl());
+            failures++;
+        } else {
+            printf("OK: поиск нулевых блоков (%s)\n", dshm_diff_impl());
+        }
+    }
+
+    free(old);
+    free(cur);
+    if (failures > 0) {
+        printf("\nОшибок: %d\n", failures);
+        return 1;
+    }
+    printf("\nВсе тесты завершены успешно!\n");
+    return 0;
+}
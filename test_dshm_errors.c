@@ -1,15 +1,53 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <unistd.h>
 #include <errno.h>
 
 // Include our distributed SHM client
 #include "distributed_shm_client.h"
 
+// Servers with limits run next to the main one on their own ports
+#define QUOTA_CONN_PORT 8093
+#define QUOTA_GLOBAL_PORT 8094
+
+// Start ./distributed_shm_server with one limit option on a port and connect the
+// client to it. Returns the server pid, -1 on failure.
+static pid_t start_limited_server(int port, const char *opt, const char *value, const char *opt2, const char *value2) {
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("./distributed_shm_server", "distributed_shm_server", opt, value, opt2, value2,
+              port_arg, (char*)NULL);
+        _exit(127);
+    }
+    if (pid == -1) {
+        return -1;
+    }
+    usleep(300 * 1000);
+    distributed_shm_cleanup();
+    if (distributed_shm_init("localhost", port) != 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return pid;
+}
+
+static void stop_limited_server(pid_t pid) {
+    distributed_shm_cleanup();
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
 int main() {
     printf("Тестирование обработки ошибок распределенной разделяемой памяти\n");
 
@@ -99,6 +137,164 @@ int main() {
         printf("ERROR: shmat не вернула -1 для удаленного сегмента\n");
     }
 
+    // Test 6: Key lookup with IPC_CREAT / IPC_EXCL semantics
+    printf("\n--- Тест 6: Поиск сегмента по ключу ---\n");
+    int failures = 0;
+    int keyed = shmget(key, 1024, IPC_CREAT | IPC_EXCL | 0666);
+    if (keyed == -1) {
+        perror("shmget IPC_EXCL failed");
+        distributed_shm_cleanup();
+        return 1;
+    }
+    if (shmget(key, 1024, IPC_CREAT | IPC_EXCL | 0666) == -1 && errno == EEXIST) {
+        printf("OK: повторный IPC_EXCL вернул EEXIST\n");
+    } else {
+        printf("ERROR: повторный IPC_EXCL не вернул EEXIST\n");
+        failures++;
+    }
+    if (shmget(key, 0, 0) == keyed && shmget(key, 512, IPC_CREAT | 0666) == keyed) {
+        printf("OK: поиск по ключу вернул существующий сегмент %d\n", keyed);
+    } else {
+        printf("ERROR: поиск по ключу не нашел сегмент %d\n", keyed);
+        failures++;
+    }
+    if (shmget(key, 4096, 0) == -1 && errno == EINVAL) {
+        printf("OK: запрос размера больше существующего вернул EINVAL\n");
+    } else {
+        printf("ERROR: запрос размера больше существующего не вернул EINVAL\n");
+        failures++;
+    }
+    if (shmget(key + 1, 1024, 0) == -1 && errno == ENOENT) {
+        printf("OK: поиск несуществующего ключа без IPC_CREAT вернул ENOENT\n");
+    } else {
+        printf("ERROR: поиск несуществующего ключа без IPC_CREAT не вернул ENOENT\n");
+        failures++;
+    }
+    int private1 = shmget(IPC_PRIVATE, 1024, 0666);
+    int private2 = shmget(IPC_PRIVATE, 1024, 0666);
+    if (private1 != -1 && private2 != -1 && private1 != private2) {
+        printf("OK: сегменты IPC_PRIVATE получили разные ID: %d, %d\n", private1, private2);
+    } else {
+        printf("ERROR: сегменты IPC_PRIVATE не созданы или совпадают\n");
+        failures++;
+    }
+    shmctl(private1, IPC_RMID, NULL);
+    shmctl(private2, IPC_RMID, NULL);
+
+    // Test 7: IPC_SET changes only the permission bits; keys must be long enough
+    printf("\n--- Тест 7: Права доступа сегмента ---\n");
+    struct shmid_ds perm;
+    if (shmctl(keyed, IPC_STAT, &perm) == 0) {
+        perm.shm_perm.mode = SHM_RDONLY | 0640;
+    }
+    if (shmctl(keyed, IPC_SET, &perm) == 0 && shmctl(keyed, IPC_STAT, &perm) == 0 &&
+        (perm.shm_perm.mode & 0777) == 0640 && !(perm.shm_perm.mode & SHM_RDONLY)) {
+        printf("OK: IPC_SET изменил только права: %o\n", perm.shm_perm.mode & 0777);
+    } else {
+        printf("ERROR: IPC_SET изменил флаги сегмента помимо прав\n");
+        failures++;
+    }
+    if (distributed_shm_set_key("short", 5) == -1 && errno == EINVAL) {
+        printf("OK: короткий общий ключ отклонен\n");
+    } else {
+        printf("ERROR: короткий общий ключ принят\n");
+        failures++;
+    }
+
+    // Test 8: a range whose end wraps around 32 bits is rejected, not clipped
+    printf("\n--- Тест 8: Диапазон с переполнением смещения ---\n");
+    uint32_t digest;
+    if (distributed_shm_checksum(keyed, 0xFFFFFF00u, 0x200, &digest) == -1 && errno == EINVAL) {
+        printf("OK: контрольная сумма диапазона за концом сегмента вернула EINVAL\n");
+    } else {
+        printf("ERROR: контрольная сумма диапазона с переполнением не отклонена\n");
+        failures++;
+    }
+    shmctl(keyed, IPC_RMID, NULL);
+
+    // Test 9: segment memory quotas reject creation and growth past the limit
+    printf("\n--- Тест 9: Квоты памяти сегментов (-q, -Q) и общий лимит буферов (-B) ---\n");
+    pid_t limited = start_limited_server(QUOTA_CONN_PORT, "-q", "512K", "-B", "64K");
+    if (limited == -1) {
+        printf("ERROR: не удалось запустить сервер с квотой -q\n");
+        failures++;
+    } else {
+        int small = shmget(IPC_PRIVATE, 256 << 10, IPC_CREAT | 0666);
+        errno = 0;
+        int over = shmget(IPC_PRIVATE, 512 << 10, IPC_CREAT | 0666);
+        if (small != -1 && over == -1 && errno == ENOMEM) {
+            printf("OK: сегмент сверх квоты владельца отклонен с ENOMEM\n");
+        } else {
+            printf("ERROR: квота владельца не соблюдена (%d, %d)\n", small, over);
+            failures++;
+        }
+        char *small_ptr = (small == -1) ? (char*)-1 : shmat(small, NULL, 0);
+        char *grown = (small_ptr == (char*)-1) ? (char*)-1 : distributed_shm_resize(small_ptr, 1 << 20);
+        if (grown == (char*)-1 && errno == ENOMEM &&
+            (grown = distributed_shm_resize(small_ptr, 384 << 10)) != (char*)-1) {
+            printf("OK: рост сверх квоты отклонен, в пределах квоты - выполнен\n");
+            // A request above the -B total is admitted once no other one is in flight
+            memset(grown, 'q', 384 << 10);
+            if (distributed_shm_sync(grown, 384 << 10) == 0) {
+                printf("OK: запись больше общего лимита буферов допущена без других запросов\n");
+            } else {
+                perror("distributed_shm_sync");
+                failures++;
+            }
+            shmdt(grown);
+        } else {
+            printf("ERROR: рост сегмента не учел квоту владельца\n");
+            failures++;
+        }
+        shmctl(small, IPC_RMID, NULL);
+        stop_limited_server(limited);
+    }
+    limited = start_limited_server(QUOTA_GLOBAL_PORT, "-Q", "512K", "-b", "65540");
+    if (limited == -1) {
+        printf("ERROR: не удалось запустить сервер с квотой -Q\n");
+        failures++;
+    } else {
+        int first = shmget(IPC_PRIVATE, 384 << 10, IPC_CREAT | 0666);
+        errno = 0;
+        int second = shmget(IPC_PRIVATE, 256 << 10, IPC_CREAT | 0666);
+        if (first != -1 && second == -1 && errno == ENOMEM) {
+            printf("OK: сегмент сверх общей квоты отклонен с ENOMEM\n");
+        } else {
+            printf("ERROR: общая квота не соблюдена (%d, %d)\n", first, second);
+            failures++;
+        }
+
+        // Test 10: a request larger than -b is refused without reading it into memory
+        printf("\n--- Тест 10: Лимит буфера одного запроса (-b) ---\n");
+        static char big[128 << 10];
+        int result = send_request_to_server(CMD_WRITE_DATA, first, 0, 0, big, sizeof(big), NULL, NULL);
+        char *first_ptr = (first == -1) ? (char*)-1 : shmat(first, NULL, 0);
+        if (result < 0 && errno == ENOMEM && first_ptr != (char*)-1) {
+            printf("OK: запрос больше -b отклонен с ENOMEM, соединение работает\n");
+        } else {
+            printf("ERROR: запрос больше -b не отклонен (%d)\n", result);
+            failures++;
+        }
+        // Ordinary transfers are split into blocks below the limit
+        if (first_ptr != (char*)-1) {
+            memset(first_ptr, 'b', 384 << 10);
+            if (distributed_shm_sync(first_ptr, 384 << 10) == 0) {
+                printf("OK: запись блоками в пределах -b выполнена\n");
+            } else {
+                perror("distributed_shm_sync");
+                failures++;
+            }
+            shmdt(first_ptr);
+        }
+        shmctl(first, IPC_RMID, NULL);
+        stop_limited_server(limited);
+    }
+
+    if (failures > 0) {
+        distributed_shm_cleanup();
+        return 1;
+    }
+
     distributed_shm_cleanup();
     printf("\nВсе тесты завершены успешно!\n");
     return 0;
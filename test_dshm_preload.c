@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+// Обычная программа System V: собирается без библиотеки клиента и
+// запускается с LD_PRELOAD=./libdistributed_shm_preload.so и
+// DSHM_KEYS=0x5000-0x50ff (предполагается, что сервер запущен)
+
+#define CLUSTER_KEY 0x5042
+#define LOCAL_KEY 0x6042
+#define TEST_SIZE 8192
+
+// Есть ли ключ среди сегментов ядра
+static int kernel_has_key(key_t key) {
+    FILE *f = fopen("/proc/sysvipc/shm", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[512];
+    int found = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        long k;
+        if (sscanf(line, "%ld", &k) == 1 && (key_t)k == key) {
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// Процесс, запущенный заново, получает shmid извне и не вызывает shmget
+static int check_attach(int shmid) {
+    char *view = shmat(shmid, NULL, SHM_RDONLY);
+    if (view == (void*)-1) {
+        return 2;
+    }
+    for (int i = 0; i < TEST_SIZE; i++) {
+        if (view[i] != (char)(i * 7)) {
+            return 3;
+        }
+    }
+    return shmdt(view) == 0 ? 0 : 4;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "attach") == 0) {
+        return check_attach(atoi(argv[2]));
+    }
+    int failures = 0;
+
+    printf("Тестирование перехвата System V через LD_PRELOAD\n");
+
+    printf("\n--- Тест 1: Ключ из DSHM_KEYS обслуживает кластер ---\n");
+    int shmid = shmget(CLUSTER_KEY, TEST_SIZE, IPC_CREAT | 0666);
+    if (shmid == -1) {
+        perror("shmget");
+        return 1;
+    }
+    if (kernel_has_key(CLUSTER_KEY) != 0) {
+        printf("ERROR: ключ 0x%x оказался сегментом ядра\n", CLUSTER_KEY);
+        failures++;
+    } else {
+        printf("OK: ключ 0x%x не создал сегмент ядра\n", CLUSTER_KEY);
+    }
+    char *data = shmat(shmid, NULL, 0);
+    if (data == (void*)-1) {
+        perror("shmat");
+        return 1;
+    }
+    for (int i = 0; i < TEST_SIZE; i++) {
+        data[i] = (char)(i * 7);
+    }
+
+    printf("\n--- Тест 2: Повторное присоединение того же сегмента ---\n");
+    // Второе присоединение разделяет отображение и не затирает несинхронизированные записи
+    char *again = shmat(shmid, NULL, 0);
+    struct shmid_ds ds;
+    if (again != data || data[TEST_SIZE - 1] != (char)((TEST_SIZE - 1) * 7)) {
+        printf("ERROR: повторный shmat вернул %p вместо %p или затер данные\n", (void*)again, (void*)data);
+        failures++;
+    } else if (shmctl(shmid, IPC_STAT, &ds) == -1 || ds.shm_nattch != 2) {
+        printf("ERROR: сервер учел не два присоединения\n");
+        failures++;
+    } else {
+        printf("OK: оба shmat вернули одно отображение, данные сохранены\n");
+    }
+    // Каждый shmdt снимает одно присоединение на сервере
+    if (shmdt(data) == -1 || shmdt(data) == -1) {
+        perror("shmdt");
+        failures++;
+    } else if (shmctl(shmid, IPC_STAT, &ds) == -1 || ds.shm_nattch != 0) {
+        printf("ERROR: после двух shmdt на сервере осталось присоединений: %lu\n", (unsigned long)ds.shm_nattch);
+        failures++;
+    } else {
+        printf("OK: два shmdt сняли оба присоединения\n");
+    }
+
+    printf("\n--- Тест 3: Другой процесс присоединяет shmid ---\n");
+    pid_t pid = fork();
+    if (pid == 0) {
+        char arg[16];
+        snprintf(arg, sizeof(arg), "%d", shmid);
+        execl("/proc/self/exe", argv[0], "attach", arg, (char*)NULL);
+        _exit(5);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("ERROR: дочерний процесс завершился с кодом %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        failures++;
+    } else {
+        printf("OK: дочерний процесс прочитал данные сегмента\n");
+    }
+
+    printf("\n--- Тест 4: Остальные ключи остаются сегментами System V ---\n");
+    int local_id = shmget(LOCAL_KEY, TEST_SIZE, IPC_CREAT | 0666);
+    if (local_id == -1) {
+        perror("shmget (local)");
+        failures++;
+    } else {
+        if (kernel_has_key(LOCAL_KEY) != 1) {
+            printf("ERROR: ключ 0x%x не стал сегментом ядра\n", LOCAL_KEY);
+            failures++;
+        } else {
+            printf("OK: ключ 0x%x - сегмент ядра\n", LOCAL_KEY);
+        }
+        char *local = shmat(local_id, NULL, 0);
+        if (local == (void*)-1) {
+            perror("shmat (local)");
+            failures++;
+        } else {
+            strcpy(local, "local");
+            shmdt(local);
+        }
+        shmctl(local_id, IPC_RMID, NULL);
+    }
+
+    printf("\n--- Тест 5: IPC_STAT и IPC_RMID сегмента кластера ---\n");
+    if (shmctl(shmid, IPC_STAT, &ds) == -1 || ds.shm_segsz != TEST_SIZE) {
+        printf("ERROR: IPC_STAT вернул неверный размер\n");
+        failures++;
+    }
+    if (shmctl(shmid, IPC_RMID, NULL) == -1) {
+        perror("shmctl IPC_RMID");
+        failures++;
+    }
+    if (shmget(CLUSTER_KEY, TEST_SIZE, 0) != -1) {
+        printf("ERROR: ключ 0x%x все еще существует\n", CLUSTER_KEY);
+        failures++;
+    } else {
+        printf("OK: сегмент кластера удален\n");
+    }
+
+    printf("\n%s\n", failures == 0 ? "Все тесты завершены успешно!" : "Тесты LD_PRELOAD завершились с ошибками");
+    return failures == 0 ? 0 : 1;
+}